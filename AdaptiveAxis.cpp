@@ -7,36 +7,38 @@
 
 #include <AdaptiveAxis.h>
 
+static ConfigHandle<int> cfg_microstep_slew("microstep_slew");
+static ConfigHandle<double> cfg_current_slew("current_slew");
+static ConfigHandle<int> cfg_microstep_track("microstep_track");
+static ConfigHandle<double> cfg_current_track("current_track");
+static ConfigHandle<int> cfg_microstep_correction("microstep_correction");
+static ConfigHandle<double> cfg_current_correction("current_correction");
+static ConfigHandle<double> cfg_current_idle("current_idle");
+
 void AdaptiveAxis::slew_mode()
 {
 	this->stepper->poweron();
-	this->stepper->setMicroStep(
-			TelescopeConfiguration::getInt("microstep_slew"));
-	this->stepper->setCurrent(
-			TelescopeConfiguration::getDouble("current_slew"));
+	this->stepper->setMicroStep(cfg_microstep_slew.get());
+	this->stepper->setCurrent(cfg_current_slew.get());
 }
 
 void AdaptiveAxis::track_mode()
 {
 	this->stepper->poweron();
-	this->stepper->setMicroStep(
-			TelescopeConfiguration::getInt("microstep_track"));
-	this->stepper->setCurrent(
-			TelescopeConfiguration::getDouble("current_track"));
+	this->stepper->setMicroStep(cfg_microstep_track.get());
+	this->stepper->setCurrent(cfg_current_track.get());
 }
 
 void AdaptiveAxis::correction_mode()
 {
 	this->stepper->poweron();
-	this->stepper->setMicroStep(
-			TelescopeConfiguration::getInt("microstep_correction"));
-	this->stepper->setCurrent(
-			TelescopeConfiguration::getDouble("current_correction"));
+	this->stepper->setMicroStep(cfg_microstep_correction.get());
+	this->stepper->setCurrent(cfg_current_correction.get());
 }
 
 void AdaptiveAxis::idle_mode()
 {
-	double idle_current = TelescopeConfiguration::getDouble("current_idle");
+	double idle_current = cfg_current_idle.get();
 	if (idle_current != 0)
 		this->stepper->setCurrent(idle_current);
 	else
@@ -8,7 +8,7 @@
 #include "LCDConsole.h"
 #include <math.h>
 #include <ctype.h>
-#include "MCULoadMeasurement.h"
+#include "SystemProfiler.h"
 
 bool LCDConsole::inited = false;
 Mutex LCDConsole::mutex;
@@ -18,6 +18,10 @@ int LCDConsole::x0 = 0, LCDConsole::y0 = 0, LCDConsole::width = lcd.GetXSize(),
 int LCDConsole::textheight = 0, LCDConsole::textwidth = 0,
 		LCDConsole::buffersize = 0;
 int *LCDConsole::buffer, *LCDConsole::head, *LCDConsole::tail;
+int *LCDConsole::shown;
+uint8_t *LCDConsole::dirty;
+int LCDConsole::scrolled = 0;
+BlockingSPSCRing<int, LCDCONSOLE_RING_SIZE> LCDConsole::ring;
 Semaphore LCDConsole::sem_update(0, 1);
 Thread LCDConsole::thread(osPriorityLow, OS_STACK_SIZE, NULL, "LCD Console");
 
@@ -27,10 +31,16 @@ LCDConsole lcd_handle_err("lcd_stderr", LCD_COLOR_YELLOW);
 
 #define BG_COLOR LCD_COLOR_BLACK
 
+/// LTDC layer the console is drawn on
+#ifndef LCDCONSOLE_LTDC_LAYER
+#define LCDCONSOLE_LTDC_LAYER LTDC_Layer1
+#endif
+
+/**
+ * Spin instead of sleeping, so that the cycle counter of the profiler keeps counting in the idle thread
+ */
 void idle_hook()
 {
-	core_util_critical_section_enter();
-	MCULoadMeasurement::getInstance().setMCUActive(false);
 //	sleep_manager_lock_deep_sleep();
 //	sleep();
 //	__WFI();
@@ -38,8 +48,6 @@ void idle_hook()
 	int i = 1000;
 	while (i--)
 		;
-	MCULoadMeasurement::getInstance().setMCUActive(true);
-	core_util_critical_section_exit();
 }
 
 void LCDConsole::init(int x0, int y0, int width, int height)
@@ -62,18 +70,22 @@ void LCDConsole::init(int x0, int y0, int width, int height)
 	// Init buffer
 	buffer = new int[buffersize](); // Will be init to zero
 	head = tail = buffer;
+	shown = new int[buffersize];
+	dirty = new uint8_t[textheight];
+	memset(shown, 0xFF, buffersize * sizeof(int)); // Nothing drawn yet
+	memset(dirty, 1, textheight);
 
 	// Start task thread
 	thread.start(task_thread);
 
 	// Register idle hook
 	Thread::attach_idle_hook(idle_hook);
-	MCULoadMeasurement::getInstance().reset();
+	SystemProfiler::update();
 }
 
 void LCDConsole::task_thread()
 {
-	int *buffer0 = new int[buffersize](); // Local buffer
+	int chunk[64];
 	char sbuf[64];
 	// Main loop
 	while (true)
@@ -83,13 +95,13 @@ void LCDConsole::task_thread()
 		if (s == 0)
 		{
 			// Timeout, update CPU usage
+			SystemProfiler::update();
 			lcd.SetBackColor(LCD_COLOR_BLUE);
 			lcd.SetTextColor(LCD_COLOR_WHITE);
 			int len = sprintf(sbuf, "Load: %4.1f%% ",
-					MCULoadMeasurement::getInstance().getCPUUsage() * 100);
+					SystemProfiler::getCPUUsage() * 100);
 			lcd.DisplayStringAt(0, lcd.GetYSize() - BSP_LCD_GetFont()->Height,
 					(unsigned char*) sbuf, LEFT_MODE);
-			MCULoadMeasurement::getInstance().reset();
 
 			time_t t = time(NULL);
 			struct tm ts;
@@ -105,49 +117,110 @@ void LCDConsole::task_thread()
 			continue;
 		}
 
-		mutex.lock(); // Lock the buffer. If any thread is still printing stuff to the buffer, this will wait for it to finish
-		memcpy(buffer0, buffer, buffersize * sizeof(*buffer)); // Copy buffer to a private one to work in
-		mutex.unlock(); // Unlock the buffer. If any thread is waiting for the mutex, it can now run (and potentially generating another update signal).
+		// Take everything written so far into the buffer. Writers can keep adding to the ring meanwhile
+		unsigned int n;
+		while ((n = ring.pop_n(chunk, sizeof(chunk) / sizeof(chunk[0]))) > 0)
+		{
+			for (unsigned int i = 0; i < n; i++)
+				put_char(chunk[i]);
+		}
+		render();
+	}
+}
 
-		int *head0 = buffer0 + (head - buffer);
-		// clear area;
-//		lcd.SetTextColor(BG_COLOR);
-//		lcd.FillRect(x0, y0, width, height);
+/**
+ * Draw the cells that changed since the last update. Scrolling is done by moving the frame buffer,
+ * so that only the new lines at the bottom are drawn.
+ */
+void LCDConsole::render()
+{
+	int fw = BSP_LCD_GetFont()->Width, fh = BSP_LCD_GetFont()->Height;
+	int headrow = (head - buffer) / textwidth;
 
-		int line = 0, col = 0;
-		int x = x0, y = y0;
-		lcd.SetBackColor(BG_COLOR);
-		for (int *p = head0, i = 0; i < buffersize; i++)
+	if (scrolled > 0)
+	{
+		if (scrolled < textheight && scroll_up(scrolled))
 		{
-			// Set color from the buffer
-			lcd.SetTextColor((uint32_t(0xFF000000 | (*p >> 8))));
-
-			// Content to draw
-			unsigned char c = (*p) & 0xFF;
+			// The screen now shows the old lines moved up
+			int keep = (textheight - scrolled) * textwidth;
+			memmove(shown, shown + scrolled * textwidth, keep * sizeof(int));
+			memset(shown + keep, 0xFF, scrolled * textwidth * sizeof(int));
+			for (int r = textheight - scrolled; r < textheight; r++)
+				dirty[(headrow + r) % textheight] = 1;
+		}
+		else
+		{
+			// Redraw everything
+			memset(shown, 0xFF, buffersize * sizeof(int));
+			memset(dirty, 1, textheight);
+		}
+		scrolled = 0;
+	}
 
-			// Display the char if displayable, otherwise put white space
-			if (isprint(c))
-				lcd.DisplayChar(x, y, c);
-			else
-				lcd.DisplayChar(x, y, ' ');
-
-			x += BSP_LCD_GetFont()->Width;
-			col++;
-			if (col == textwidth)
+	int color = -1;
+	lcd.SetBackColor(BG_COLOR);
+	for (int r = 0; r < textheight; r++)
+	{
+		int br = (headrow + r) % textheight;
+		if (!dirty[br])
+			continue;
+		dirty[br] = 0;
+		int *p = buffer + br * textwidth;
+		int *s = shown + r * textwidth;
+		for (int c = 0; c < textwidth; c++)
+		{
+			if (p[c] == s[c])
+				continue;
+			s[c] = p[c];
+			if ((p[c] >> 8) != color)
 			{
-				// Next line
-				line++;
-				y += BSP_LCD_GetFont()->Height;
-				col = 0;
-				x = 0;
+				// Set color from the buffer
+				color = p[c] >> 8;
+				lcd.SetTextColor((uint32_t(0xFF000000 | color)));
 			}
-			p++;
-			if (p - buffer0 == buffersize)
-				p = buffer0; // wrap around the buffer
+			// Display the char if displayable, otherwise put white space
+			unsigned char ch = p[c] & 0xFF;
+			lcd.DisplayChar(x0 + c * fw, y0 + r * fh, isprint(ch) ? ch : ' ');
 		}
 	}
 }
 
+/**
+ * Move the text area of the frame buffer up by a number of lines with the DMA2D
+ * @return false if the frame buffer format is not supported
+ */
+bool LCDConsole::scroll_up(int lines)
+{
+	static const uint8_t pixel_size[] =
+	{ 4, 3, 2, 2, 2 }; // ARGB8888, RGB888, RGB565, ARGB1555, ARGB4444
+	uint32_t mode = LCDCONSOLE_LTDC_LAYER->PFCR & 0x7;
+	if (mode >= sizeof(pixel_size))
+		return false; // L8, AL44 and AL88 cannot be written by the DMA2D
+	uint32_t bpp = pixel_size[mode];
+	uint32_t pitch = (LCDCONSOLE_LTDC_LAYER->CFBLR >> 16) & 0x1FFF; // Bytes per line
+	int fh = BSP_LCD_GetFont()->Height;
+	uint32_t w = textwidth * BSP_LCD_GetFont()->Width;
+	uint32_t h = (textheight - lines) * fh;
+	uint32_t dst = LCDCONSOLE_LTDC_LAYER->CFBAR + y0 * pitch + x0 * bpp;
+	uint32_t src = dst + lines * fh * pitch;
+
+	// Memory to memory. The copy goes from top to bottom, so the overlap is safe when moving up
+	while (DMA2D->CR & DMA2D_CR_START)
+		;
+	DMA2D->CR = 0;
+	DMA2D->FGPFCCR = mode;
+	DMA2D->OPFCCR = mode;
+	DMA2D->FGMAR = src;
+	DMA2D->OMAR = dst;
+	DMA2D->FGOR = pitch / bpp - w;
+	DMA2D->OOR = pitch / bpp - w;
+	DMA2D->NLR = (w << 16) | h;
+	DMA2D->CR |= DMA2D_CR_START;
+	while (DMA2D->CR & DMA2D_CR_START)
+		Thread::yield(); // Let other threads of the same priority run
+	return true;
+}
+
 LCDConsole::LCDConsole(const char * name, uint32_t color) :
 		FileLike(name)
 {
@@ -162,76 +235,94 @@ ssize_t LCDConsole::read(void* buffer, size_t size)
 
 ssize_t LCDConsole::write(const void* str, size_t size)
 {
+	const char *pb = (const char*) str;
+	int chunk[32];
 	mutex.lock();
-	char *pb = (char*) str;
-	for (char *p = pb; p < pb + size; p++)
+	while (size > 0)
 	{
-		char c = (int) (*p);
-		bool scroll = false;
-		if (isprint(c))
-		{
-			*(tail++) = (color << 8) | c; // Put the current char and color into the buffer
-			if (tail >= buffer + buffersize)
-				tail -= buffersize;
-			if (tail == head)
-				scroll = true;
-		}
-		else if (c == '\b')
-		{
-			// Backspace, tail pointer go back by one
-			if (tail != head) // If the buffer is empty, do nothing
-			{
-				tail--;
-				if (tail < buffer)
-					tail += buffersize;
-			}
+		size_t n = (size > 32) ? 32 : size;
+		for (size_t i = 0; i < n; i++)
+			chunk[i] = (color << 8) | (unsigned char) pb[i]; // Put the current char and color into the ring
+		// The ring can only be drained by the task thread after it is signalled, so signal it before waiting for space
+		if (ring.space() < n)
+			sem_update.release();
+		ring.put_n(chunk, n); // Waits only if the task thread is behind by a full ring
+		pb += n;
+		size -= n;
+	}
+	mutex.unlock();
+	sem_update.release(); // Signal the task to update the graphics
 
-		}
-		else if (c == '\r')
-		{
-			// Roll back to start of line
-			int currpos = (tail - head + buffersize) % buffersize; // current position in buffer
-			int linestart = currpos - currpos % textwidth; // Position of the start of the line
-			tail = head + linestart;
-			if (tail >= buffer + buffersize)
-				tail -= buffersize;
-		}
-		else if (c == '\n')
+	return pb - (const char*) str;
+}
+
+/**
+ * Put a character into the screen buffer. Only called by the task thread
+ */
+void LCDConsole::put_char(int v)
+{
+	char c = v & 0xFF;
+	bool scroll = false;
+	if (isprint(c))
+	{
+		dirty[(tail - buffer) / textwidth] = 1;
+		*(tail++) = v; // Put the char and color into the buffer
+		if (tail >= buffer + buffersize)
+			tail -= buffersize;
+		if (tail == head)
+			scroll = true;
+	}
+	else if (c == '\b')
+	{
+		// Backspace, tail pointer go back by one
+		if (tail != head) // If the buffer is empty, do nothing
 		{
-			// Newline
-			int currpos = (tail - head + buffersize) % buffersize; // current position in buffer
-			int nextlinestart = currpos - currpos % textwidth + textwidth; // Position of a new line start
-			tail = head + nextlinestart;
-			if (tail >= buffer + buffersize)
-				tail -= buffersize;
-			if (nextlinestart >= buffersize) // Scroll if the tail will overrun the head
-				scroll = true;
+			tail--;
+			if (tail < buffer)
+				tail += buffersize;
 		}
 
-		// wrap
+	}
+	else if (c == '\r')
+	{
+		// Roll back to start of line
+		int currpos = (tail - head + buffersize) % buffersize; // current position in buffer
+		int linestart = currpos - currpos % textwidth; // Position of the start of the line
+		tail = head + linestart;
+		if (tail >= buffer + buffersize)
+			tail -= buffersize;
+	}
+	else if (c == '\n')
+	{
+		// Newline
+		int currpos = (tail - head + buffersize) % buffersize; // current position in buffer
+		int nextlinestart = currpos - currpos % textwidth + textwidth; // Position of a new line start
+		tail = head + nextlinestart;
+		if (tail >= buffer + buffersize)
+			tail -= buffersize;
+		if (nextlinestart >= buffersize) // Scroll if the tail will overrun the head
+			scroll = true;
+	}
 
-		if (scroll)
+	if (scroll)
+	{
+		// Scroll a line
+		head += textwidth; // Increase head by one line
+		if (head >= buffer + buffersize)
 		{
-			// Scroll a line
-			head += textwidth; // Increase head by one line
-			if (head >= buffer + buffersize)
-			{
-				head -= buffersize; // wrap
-			}
-			for (int *p = tail; p != head;)
+			head -= buffersize; // wrap
+		}
+		scrolled++;
+		for (int *p = tail; p != head;)
+		{
+			dirty[(p - buffer) / textwidth] = 1;
+			*(p++) = 0; // Set everything between tail and head to null
+			if (p >= buffer + buffersize)
 			{
-				*(p++) = 0; // Set everything between tail and head to null
-				if (p >= buffer + buffersize)
-				{
-					p -= buffersize;
-				}
+				p -= buffersize;
 			}
 		}
 	}
-	sem_update.release(); // Signal the task to update the graphics
-
-	mutex.unlock();
-	return size;
 }
 
 off_t LCDConsole::seek(off_t offset, int whence)
@@ -10,14 +10,22 @@
 
 #include "mbed.h"
 #include "LCD_DISCO_F429ZI.h"
+#include "SPSCRing.h"
+
+/// Number of characters that can be waiting to be drawn
+#define LCDCONSOLE_RING_SIZE 1024
 
 class LCDConsole: public FileLike
 {
 protected:
 
 	static int* buffer; // The first 3 byets of each int contain its color, and last byte contain the content
-	static int *head, *tail;
-	static Mutex mutex;
+	static int *head, *tail; // Only used by the task thread
+	static int *shown; // Cells currently on the screen, in screen order. -1 if the cell must be redrawn
+	static uint8_t *dirty; // Lines of buffer changed since the last update
+	static int scrolled; // Lines scrolled since the last update
+	static BlockingSPSCRing<int, LCDCONSOLE_RING_SIZE> ring; // Characters written, in the same format as the buffer
+	static Mutex mutex; // Serializes the writers, which are the producers of the ring
 	static LCD_DISCO_F429ZI lcd;
 	static Thread thread;
 	static bool inited;
@@ -28,6 +36,9 @@ protected:
 	uint32_t color;
 
 	static void task_thread();
+	static void put_char(int c);
+	static void render();
+	static bool scroll_up(int lines);
 public:
 
 	static void init(int x0, int y0, int width, int height);
@@ -4,7 +4,6 @@
 #include "SDBlockDevice.h"
 #include "FATFileSystem.h"
 #include "EquatorialMount.h"
-#include "MCULoadMeasurement.h"
 
 Thread blinker_thread(osPriorityNormal, 1024, NULL, "Blinker");
 DigitalOut led1(LED1);
@@ -175,6 +175,13 @@ void AMIS30543StepperDriver::setMicroStep(int microstep)
 		return;
 	}
 
+	// Keep the step count if the resolution changes while stepping
+	if (status == STEPPING)
+	{
+		stepCount += ((double) step.getCount()) * inc
+				* (1.0 / this->microstep - 1.0 / microstep);
+	}
+
 	// Update the microstep variable only if the value is valid
 	this->microstep = microstep;
 }
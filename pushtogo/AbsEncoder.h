@@ -11,23 +11,40 @@
 #define TELESCOPE_ABSENCODER_H_
 
 #include <stdint.h>
+
 /**
-* Interface of a generic Absolute Encoder
+* Interface of an absolute encoder of any resolution, for code that handles all encoders alike
 */
-template<uint32_t maxCount>
-class AbsEncoder
+class GenericAbsEncoder
 {
 public:
-	AbsEncoder(){
+	GenericAbsEncoder(){
 	}
-	virtual ~AbsEncoder(){
+	virtual ~GenericAbsEncoder(){
 	}
 
+	/** @return position in counts, from 0 to getMaxCount() - 1 */
 	virtual uint32_t readPos() = 0;
 	virtual void zero()
 	{
 	}
 
+	/** @return number of counts per revolution */
+	virtual uint32_t getMaxCount() const = 0;
+};
+
+/**
+* Interface of a generic Absolute Encoder
+*/
+template<uint32_t maxCount>
+class AbsEncoder: public GenericAbsEncoder
+{
+public:
+	AbsEncoder(){
+	}
+	virtual ~AbsEncoder(){
+	}
+
 	uint32_t getMaxCount() const
 	{
 		return maxCount;
@@ -0,0 +1,229 @@
+/*
+ * AlignmentSolver.cpp
+ */
+
+#include "AlignmentSolver.h"
+#include <math.h>
+#include <string.h>
+#include "mbed.h"
+
+#define AS_DEBUG 0
+
+#define AS_MAX_ITERATION 50
+
+static const double tol = 1e-10;
+static const double delta = 1e-7; /// Step for the finite-difference Jacobian
+static const double lambda_init = 1e-3;
+static const double lambda_max = 1e10;
+static const double pivot_min = 1e-9; /// Smallest pivot of the Cholesky factor, relative to the diagonal of J'J
+
+AlignmentSolver::AlignmentSolver(AlignmentProblem &problem, int nparam) :
+		problem(problem), np(nparam), residue(0), iterations(0)
+{
+	if (np < 1 || np > AS_MAX_PARAM)
+		error("AlignmentSolver: %d parameters not supported", np);
+}
+
+double AlignmentSolver::cost(const double p[])
+{
+	problem.prepare(0, p);
+	double s = 0;
+	for (int i = 0; i < problem.size(); i++)
+	{
+		double r[2];
+		problem.residual(0, i, r);
+		s += r[0] * r[0] + r[1] * r[1];
+	}
+	return s;
+}
+
+/**
+ * Fill J'J and J'f at p
+ * @return sum of squared residuals at p
+ */
+double AlignmentSolver::linearize(const double p[])
+{
+	double q[AS_MAX_PARAM];
+	problem.prepare(0, p);
+	for (int j = 0; j < np; j++)
+	{
+		memcpy(q, p, np * sizeof(double));
+		q[j] += delta;
+		problem.prepare(j + 1, q);
+	}
+
+	memset(jtj, 0, sizeof(jtj));
+	memset(jtf, 0, sizeof(jtf));
+	double s = 0;
+	for (int i = 0; i < problem.size(); i++)
+	{
+		double f[2], jac[2][AS_MAX_PARAM];
+		problem.residual(0, i, f);
+		for (int j = 0; j < np; j++)
+		{
+			double r[2];
+			problem.residual(j + 1, i, r);
+			jac[0][j] = (r[0] - f[0]) / delta;
+			jac[1][j] = (r[1] - f[1]) / delta;
+		}
+		// Accumulate the two rows of this measurement
+		for (int j = 0; j < np; j++)
+		{
+			for (int k = 0; k <= j; k++)
+				jtj[j][k] += jac[0][j] * jac[0][k] + jac[1][j] * jac[1][k];
+			jtf[j] += jac[0][j] * f[0] + jac[1][j] * f[1];
+		}
+		s += f[0] * f[0] + f[1] * f[1];
+	}
+	// Only the lower triangle is used
+	return s;
+}
+
+/**
+ * Cholesky factorization of J'J + lambda * diag(J'J)
+ * @return false if the matrix is not positive definite, or too close to singular to tell the parameters apart
+ */
+bool AlignmentSolver::factor(double lambda)
+{
+	for (int j = 0; j < np; j++)
+	{
+		for (int k = 0; k <= j; k++)
+		{
+			double s = jtj[j][k];
+			if (k == j)
+				s += lambda * (jtj[j][j] > tol ? jtj[j][j] : tol);
+			for (int m = 0; m < k; m++)
+				s -= chol[j][m] * chol[k][m];
+			if (k == j)
+			{
+				if (!(s > pivot_min * jtj[j][j]))
+					return false;
+				chol[j][j] = sqrt(s);
+			}
+			else
+			{
+				chol[j][k] = s / chol[k][k];
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * Solve L L' x = b with the factor
+ */
+void AlignmentSolver::substitute(const double b[], double x[])
+{
+	// Forward substitution L y = b
+	for (int j = 0; j < np; j++)
+	{
+		double s = b[j];
+		for (int m = 0; m < j; m++)
+			s -= chol[j][m] * x[m];
+		x[j] = s / chol[j][j];
+	}
+	// Back substitution L' x = y
+	for (int j = np - 1; j >= 0; j--)
+	{
+		double s = x[j];
+		for (int m = j + 1; m < np; m++)
+			s -= chol[m][j] * x[m];
+		x[j] = s / chol[j][j];
+	}
+}
+
+/**
+ * Solve (J'J + lambda * diag(J'J)) dp = -J'f
+ * @return false if the matrix is not positive definite
+ */
+bool AlignmentSolver::solveDamped(double lambda, double dp[])
+{
+	if (!factor(lambda))
+		return false;
+	double b[AS_MAX_PARAM];
+	for (int j = 0; j < np; j++)
+		b[j] = -jtf[j];
+	substitute(b, dp);
+	return true;
+}
+
+bool AlignmentSolver::covariance(const double p[], double *cov, int stride)
+{
+	linearize(p);
+	if (!factor(0))
+		return false;
+	double e[AS_MAX_PARAM];
+	for (int k = 0; k < np; k++)
+	{
+		double x[AS_MAX_PARAM];
+		memset(e, 0, sizeof(e));
+		e[k] = 1;
+		substitute(e, x);
+		for (int j = 0; j < np; j++)
+			cov[j * stride + k] = x[j];
+	}
+	return true;
+}
+
+bool AlignmentSolver::solve(double p[])
+{
+	double lambda = lambda_init;
+	double dp[AS_MAX_PARAM], q[AS_MAX_PARAM];
+	bool converged = false;
+	double c = linearize(p);
+
+	for (iterations = 0; iterations < AS_MAX_ITERATION && !converged;
+			iterations++)
+	{
+		if (!(c == c))
+			break; // NaN
+		if (!solveDamped(lambda, dp))
+		{
+			lambda *= 10;
+			if (lambda > lambda_max)
+				break;
+			continue;
+		}
+
+		double step = 0;
+		for (int j = 0; j < np; j++)
+		{
+			q[j] = p[j] + dp[j];
+			step += dp[j] * dp[j];
+		}
+		double cq = cost(q);
+		if (cq < c)
+		{
+			// Accept the step and move towards Gauss-Newton
+			memcpy(p, q, np * sizeof(double));
+			converged = (sqrt(step) < tol || c - cq < tol * c);
+			lambda = (lambda > 1e-12) ? lambda * 0.1 : lambda;
+			c = converged ? cq : linearize(p);
+		}
+		else
+		{
+			// Reject the step and move towards gradient descent
+			converged = (sqrt(step) < tol);
+			lambda *= 10;
+			if (lambda > lambda_max)
+			{
+				// No step decreases the residue any more, we are at the minimum
+				converged = true;
+			}
+		}
+		debug_if(AS_DEBUG, "Iteration %d, cost=%e, lambda=%e\n", iterations,
+				c, lambda);
+	}
+
+	if (converged && !factor(0))
+	{
+		// The residuals don't depend on some combination of the parameters, e.g. all the stars in the same place.
+		// The damping found a minimum, but not the only one
+		converged = false;
+	}
+
+	residue = sqrt(cost(p));
+	debug_if(AS_DEBUG, "%s after %d iterations, r=%e\n",
+			converged ? "Converged" : "Diverged", iterations, residue);
+	return converged;
+}
@@ -0,0 +1,96 @@
+/*
+ * AlignmentSolver.h
+ *
+ * Damped least-squares (Levenberg-Marquardt) solver for alignment and pointing models.
+ *
+ * The solver does not store the Jacobian. Each measurement contributes its two rows to the normal
+ * equations J'J and J'f as soon as it is evaluated, so the memory used does not depend on the
+ * number of measurements. All the workspace is in the solver object, which is meant to live on the
+ * caller's stack, so several solvers can run at the same time.
+ */
+
+#ifndef PUSHTOGO_ALIGNMENTSOLVER_H_
+#define PUSHTOGO_ALIGNMENTSOLVER_H_
+
+/// Max number of parameters of a problem
+#define AS_MAX_PARAM 10
+
+/**
+ * Least-squares problem: measurements with two residuals each, as functions of the parameters.
+ * The solver evaluates the residuals at up to nparam + 1 parameter sets at the same time (for the
+ * finite-difference Jacobian), so the problem keeps one prepared state per slot.
+ */
+class AlignmentProblem
+{
+public:
+	virtual ~AlignmentProblem()
+	{
+	}
+
+	/** @return number of measurements */
+	virtual int size() const = 0;
+
+	/**
+	 * Prepare a slot for evaluating residuals at parameters p
+	 * @param slot 0 to AS_MAX_PARAM
+	 */
+	virtual void prepare(int slot, const double p[]) = 0;
+
+	/**
+	 * Residuals of measurement i, model minus measured, with the parameters prepared in slot
+	 */
+	virtual void residual(int slot, int i, double r[2]) = 0;
+};
+
+class AlignmentSolver
+{
+public:
+	/**
+	 * @param problem Problem to solve
+	 * @param nparam Number of parameters, at most AS_MAX_PARAM
+	 */
+	AlignmentSolver(AlignmentProblem &problem, int nparam);
+
+	/**
+	 * Minimize the sum of squared residuals
+	 * @param p Initial parameters. Updated with the solution
+	 * @return true if converged, false if the iteration failed or ran out, or the parameters are not determined by
+	 * the measurements (J'J singular at the solution)
+	 */
+	bool solve(double p[]);
+
+	/** @return Root of the sum of squared residuals at the solution */
+	double getResidue() const
+	{
+		return residue;
+	}
+
+	int getIterations() const
+	{
+		return iterations;
+	}
+
+	/**
+	 * Compute the covariance of the parameters, (J'J)^-1, at p. Used to continue the fit incrementally.
+	 * @param cov Output matrix, element (j, k) at cov[j * stride + k]
+	 * @return false if J'J is singular, or close to it
+	 */
+	bool covariance(const double p[], double *cov, int stride);
+
+private:
+	AlignmentProblem &problem;
+	int np;
+	double jtj[AS_MAX_PARAM][AS_MAX_PARAM]; /// J'J
+	double jtf[AS_MAX_PARAM]; /// J'f
+	double chol[AS_MAX_PARAM][AS_MAX_PARAM]; /// Cholesky factor of the damped J'J
+	double residue;
+	int iterations;
+
+	double cost(const double p[]);
+	double linearize(const double p[]);
+	bool factor(double lambda);
+	void substitute(const double b[], double x[]);
+	bool solveDamped(double lambda, double dp[]);
+};
+
+#endif /* PUSHTOGO_ALIGNMENTSOLVER_H_ */
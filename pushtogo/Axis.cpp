@@ -6,23 +6,44 @@
  */
 
 #include <Axis.h>
+#include "EncoderObserver.h"
+#include "PeriodicErrorCorrection.h"
+#include "SystemProfiler.h"
 
 #define AXIS_DEBUG 1
 
-static inline double min(double x, double y)
-{
-	return (x < y) ? x : y;
-}
+/*Configs read during motion*/
+static ConfigHandle<double> cfg_acceleration("acceleration");
+static ConfigHandle<int> cfg_acceleration_step_time("acceleration_step_time");
+static ConfigHandle<double> cfg_max_speed("max_speed");
+static ConfigHandle<int> cfg_jerk_time("jerk_time");
+static ConfigHandle<double> cfg_min_slew_angle("min_slew_angle");
+static ConfigHandle<double> cfg_correction_speed_sidereal(
+		"correction_speed_sidereal");
+static ConfigHandle<double> cfg_correction_tolerance("correction_tolerance");
+static ConfigHandle<int> cfg_min_correction_time("min_correction_time");
+static ConfigHandle<double> cfg_max_correction_angle("max_correction_angle");
+static ConfigHandle<int> cfg_max_guide_time("max_guide_time");
+static ConfigHandle<double> cfg_encoder_sample_rate("encoder_sample_rate");
+static ConfigHandle<double> cfg_backlash_speed_sidereal(
+		"backlash_speed_sidereal");
+
 Axis::Axis(double stepsPerDeg, StepperMotor *stepper, const char *name) :
-		stepsPerDeg(stepsPerDeg), stepper(stepper), axisName(name), currentSpeed(
-				0), currentDirection(AXIS_ROTATE_POSITIVE), slewSpeed(
+		stepsPerDeg(stepsPerDeg), degPerStep(1.0 / stepsPerDeg), stepper(
+				stepper), axisName(name), currentSpeed(0), currentDirection(
+				AXIS_ROTATE_POSITIVE), slewSpeed(
 				TelescopeConfiguration::getDouble("default_slew_speed")), trackSpeed(
 				TelescopeConfiguration::getDouble(
 						"default_track_speed_sidereal") * sidereal_speed), guideSpeed(
 				TelescopeConfiguration::getDouble(
 						"default_guide_speed_sidereal") * sidereal_speed), status(
 				AXIS_STOPPED), slewState(AXIS_NOT_SLEWING), slew_finish_sem(0,
-				1), slew_finish_state(FINISH_COMPLETE)
+				1), slew_finish_state(FINISH_COMPLETE), trackDirection(
+				AXIS_ROTATE_STOP), trackOffset(0), trackRate(0), trackFreq(0), trackError(
+				0), trackTime(0), trackSteps(0), trackBias(0), observer(NULL), pec(NULL), motorOffset(0), guideSchedCount(0), guideRemaining(
+				0), guideRate(0), backlash(0), approachDir(AXIS_ROTATE_STOP), lashSide(
+				AXIS_ROTATE_POSITIVE), takeupSeq(0), traceId(
+				MotionTrace::addSource(name))
 {
 	if (stepsPerDeg <= 0)
 		error("Axis: steps per degree must be > 0");
@@ -58,6 +79,71 @@ Axis::~Axis()
 	delete taskName;
 }
 
+void Axis::setAngleDeg(double angle)
+{
+	double count = angle * stepsPerDeg;
+	motorOffset += stepper->getStepCount() - count;
+	stepper->setStepCount(count);
+	EncoderObserver *obs = observer;
+	if (obs)
+		obs->reset(); // The encoder is referenced to the new step count
+}
+
+/**
+ * Wait until the encoder has sampled the axis at rest, so that getAngleDeg() is up to date
+ */
+void Axis::waitEncoder()
+{
+	if (observer)
+		Thread::wait((uint32_t) ceil(2000.0 / cfg_encoder_sample_rate.get()));
+}
+
+/**
+ * Take up the backlash before the motor starts in a direction. If the gear was last driven the other way,
+ * the motor first turns through the backlash at the takeup speed, starting without acceleration. The axis
+ * does not move meanwhile, so these steps are taken out of the step count.
+ * At power-up the gear is taken as driven in the positive direction.
+ * The stepper must be stopped. An emergency stop ends the takeup and is left set for the caller.
+ * @param dir Direction the motor is about to start in
+ */
+void Axis::takeup(axisrotdir_t dir)
+{
+	if (dir == AXIS_ROTATE_STOP)
+		return;
+	if (dir == lashSide || backlash <= 0)
+	{
+		lashSide = dir;
+		return;
+	}
+	double count0 = stepper->getStepCount();
+	double speed = setStepFrequency(
+			cfg_backlash_speed_sidereal.get() * sidereal_speed * stepsPerDeg)
+			* degPerStep;
+	int time_ms = (int) (backlash / speed * 1000 + 0.5);
+	takeupSeq++;
+	startStepper((dir == AXIS_ROTATE_POSITIVE) ? STEP_FORWARD : STEP_BACKWARD);
+	osThreadFlagsWait(AXIS_EMERGE_STOP_SIGNAL, osFlagsWaitAny | osFlagsNoClear,
+			time_ms);
+	stopStepper();
+	double steps = stepper->getStepCount() - count0;
+	stepper->setStepCount(count0); // The axis is still where it was
+	motorOffset += steps;
+	takeupSeq++;
+	lashSide = dir;
+	MotionTrace::record(TRACE_TAKEUP, traceId, dir, 0, steps);
+	debug_if(AXIS_DEBUG, "%s: backlash taken up, %f steps\n", axisName,
+			steps);
+}
+
+double Axis::getAngleDeg()
+{
+	double angle = stepper->getStepCount() / stepsPerDeg;
+	EncoderObserver *obs = observer;
+	if (obs)
+		angle += obs->getBias();
+	return remainder(angle, 360);
+}
+
 void Axis::task()
 {
 
@@ -68,7 +154,9 @@ void Axis::task()
 		msg_t *message;
 		enum msg_t::sig_t signal;
 		float value;
-		axisrotdir_t dir;
+		double speed;
+		axisrotdir_t dir, trackDir;
+		uint32_t time;
 		bool wc;
 
 		// Wait for next message
@@ -81,6 +169,9 @@ void Axis::task()
 			value = message->value;
 			dir = message->dir;
 			wc = message->withCorrection;
+			trackDir = message->trackDir;
+			time = message->time;
+			speed = message->speed;
 			task_pool.free(message);
 		}
 		else
@@ -89,7 +180,8 @@ void Axis::task()
 			debug("%s: Error fetching the task queue.\n", axisName);
 			continue;
 		}
-		debug_if(AXIS_DEBUG, "%s: MSG %d %f %d 0x%8x\n", axisName, signal,
+		MotionTrace::record(TRACE_MESSAGE, traceId, signal, value);
+		debug_if(AXIS_DEBUG, "%s: MSG %d %f %d\n", axisName, signal,
 				value, dir);
 
 		/*Check the type of the signal, and start corresponding operations*/
@@ -98,16 +190,33 @@ void Axis::task()
 		case msg_t::SIGNAL_SLEW_TO:
 			if (status == AXIS_STOPPED)
 			{
-				slew(dir, value, false, wc);
+				slew(dir, value, false, wc, AXIS_ROTATE_STOP, 0, speed);
 			}
 			else
 			{
 				debug("%s: being slewed while not in STOPPED mode.\n",
 						axisName);
 			}
-			debug_if(0, "%s: SIG SLEW 0x%08x\n", axisName, Thread::gettid());
+			debug_if(0, "%s: SIG SLEW %p\n", axisName, Thread::gettid());
 			slew_finish_sem.release(); /*Send a signal so that the caller is free to run*/
 			break;
+		case msg_t::SIGNAL_SLEW_TRACK:
+			if (status == AXIS_STOPPED)
+			{
+				slew(dir, value, false, false, trackDir, time, speed);
+			}
+			else
+			{
+				debug("%s: being slewed while not in STOPPED mode.\n",
+						axisName);
+			}
+			slew_finish_sem.release();
+			if (status == AXIS_TRACKING)
+			{
+				// Handed over, the stepper is already running at the tracking speed
+				track(trackDir, true);
+			}
+			break;
 		case msg_t::SIGNAL_SLEW_INDEFINITE:
 			if (status == AXIS_STOPPED || status == AXIS_INERTIAL)
 			{
@@ -122,7 +231,23 @@ void Axis::task()
 		case msg_t::SIGNAL_TRACK:
 			if (status == AXIS_STOPPED)
 			{
-				track(dir);
+				double owed = 0;
+				if (wc && dir != AXIS_ROTATE_STOP)
+				{
+					// Steps to the target, which moved at the tracking speed since the message was sent.
+					// No more than the tracking in that time
+					double missed = trackSpeed
+							* (uint32_t) (osKernelGetTickCount() - time) * 0.001;
+					double dest = value
+							+ ((dir == AXIS_ROTATE_POSITIVE) ? missed : -missed);
+					owed = remainder(dest - getAngleDeg(), 360.0);
+					if (owed > missed)
+						owed = missed;
+					else if (owed < -missed)
+						owed = -missed;
+					owed *= stepsPerDeg;
+				}
+				track(dir, false, owed);
 			}
 			else
 			{
@@ -136,8 +261,61 @@ void Axis::task()
 	}
 }
 
+double Axis::getSlewTime(double angle, double speed)
+{
+	angle = fabs(angle);
+	double minSlewAngle = cfg_min_slew_angle.get();
+	double correctionSpeed = cfg_correction_speed_sidereal.get()
+			* sidereal_speed;
+	if (angle <= minSlewAngle)
+	{
+		// Done by correction alone
+		return angle / correctionSpeed;
+	}
+	// The slew stops short by half the min slew angle, which is done by correction
+	angle -= 0.5 * minSlewAngle;
+	double t = 0.5 * minSlewAngle / correctionSpeed;
+	double acceleration = cfg_acceleration.get();
+	double v = (speed > 0 && speed < slewSpeed) ? speed : slewSpeed;
+	double maxSpeed = cfg_max_speed.get();
+	if (v > maxSpeed)
+		v = maxSpeed;
+	if (angle < v * v / acceleration)
+	{
+		v = sqrt(angle * acceleration); // The speed is never reached
+	}
+	// Trapezoidal profile. Jerk limiting makes each ramp longer by half the jerk time
+	return t + v / acceleration + angle / v + cfg_jerk_time.get() * 0.001;
+}
+
+double Axis::getSlewSpeedFor(double angle, double time)
+{
+	angle = fabs(angle);
+	double minSlewAngle = cfg_min_slew_angle.get();
+	double acceleration = cfg_acceleration.get();
+	double maxSpeed = cfg_max_speed.get();
+	double v = (slewSpeed < maxSpeed) ? slewSpeed : maxSpeed;
+	if (angle <= minSlewAngle)
+	{
+		return v; // Done by correction alone
+	}
+	angle -= 0.5 * minSlewAngle;
+	time -= 0.5 * minSlewAngle
+			/ (cfg_correction_speed_sidereal.get() * sidereal_speed)
+			+ cfg_jerk_time.get() * 0.001;
+	// Solve v / acceleration + angle / v = time, the lower root is the slower slew
+	double disc = acceleration * acceleration * time * time
+			- 4 * acceleration * angle;
+	if (disc < 0)
+	{
+		return v; // Can't be done in that time, go as fast as possible
+	}
+	double s = 0.5 * (acceleration * time - sqrt(disc));
+	return (s < v) ? s : v;
+}
+
 void Axis::slew(axisrotdir_t dir, double dest, bool indefinite,
-bool useCorrection)
+bool useCorrection, axisrotdir_t trackDir, uint32_t destTime, double speed)
 {
 	if (!indefinite && (isnan(dest) || isinf(dest)))
 	{
@@ -150,16 +328,43 @@ bool useCorrection)
 		return;
 	}
 
+	/* Get the speed table for the current configuration. All configurations used during the slew are read here*/
+	const MotionProfile *profile = MotionProfile::acquire(
+			cfg_acceleration.get(), cfg_acceleration_step_time.get(),
+			cfg_max_speed.get(), cfg_jerk_time.get());
+	if (!profile)
+	{
+		debug("%s: failed to create motion profile.\n", axisName);
+		return;
+	}
+	const int stepTime_ms = profile->getStepTime();
+	const double stepTime = stepTime_ms * 0.001;
+
 	slew_mode(); // Switch to slew mode
 	Thread::signal_clr(
 	AXIS_STOP_SIGNAL | AXIS_EMERGE_STOP_SIGNAL | AXIS_SPEEDCHANGE_SIGNAL); // Clear flags
 	bool isInertial = (status == AXIS_INERTIAL);
-	status = AXIS_SLEWING;
-	slewState = AXIS_NOT_SLEWING;
+	setStatus(AXIS_SLEWING);
+	setSlewState(AXIS_NOT_SLEWING);
 	slew_finish_state = FINISH_COMPLETE;
 	currentDirection = dir;
 	stepdir_t sd = (dir == AXIS_ROTATE_POSITIVE) ? STEP_FORWARD : STEP_BACKWARD;
 
+	/* A target to be tracked moves at the tracking speed. vt is its speed in the slew direction*/
+	const bool handover = !indefinite && trackDir != AXIS_ROTATE_STOP;
+	const double dest0 = dest;
+	uint32_t startTime = osKernelGetTickCount();
+	double vt = 0;
+	if (handover)
+	{
+		double v = (trackDir == AXIS_ROTATE_POSITIVE) ? trackSpeed : -trackSpeed;
+		dest += v * (uint32_t) (startTime - destTime) * 0.001; // Where the target is now
+		vt = (dir == AXIS_ROTATE_POSITIVE) ? v : -v;
+		useCorrection = false; // Done by approach()
+	}
+	// Speed at the end of the deceleration. A slew in the tracking direction ends at the tracking speed
+	double finalSpeed = (vt > 0) ? vt : 0;
+
 	/* Calculate the angle to rotate*/
 	bool skip_slew = false;
 	double angleDeg = getAngleDeg();
@@ -174,53 +379,41 @@ bool useCorrection)
 			dest, delta);
 
 	double startSpeed = 0;
-	double endSpeed = slewSpeed, waitTime;
-	unsigned int ramp_steps;
-	double acceleration = TelescopeConfiguration::getDouble("acceleration");
+	double endSpeed = (speed > 0 && speed < slewSpeed) ? speed : slewSpeed;
+	double waitTime;
 
 	if (!indefinite)
 	{
-		// Ensure that delta is more than the minimum slewing angle, calculate the correct endSpeed and waitTime
-		if (delta > TelescopeConfiguration::getDouble("min_slew_angle"))
+		// Ensure that delta is more than the minimum slewing angle, calculate the correct endSpeed
+		double minSlewAngle = cfg_min_slew_angle.get();
+		if (delta > minSlewAngle)
 		{
-			/*The motion angle is decreased to ensure the correction step is in the same direction*/
-			delta = delta
-					- 0.5 * TelescopeConfiguration::getDouble("min_slew_angle");
-
-			double angleRotatedDuringAcceleration;
-
-			/* The actual endSpeed we get might be different than this due to the finite time resolution of the stepper driver
-			 * Here we set the dummy frequency and obtain the actual frequency it will be set to, so that the slewing time will be more accurate
-			 */
-
-			// Calculate the desired endSpeed. If delta is small, then endSpeed will correspondingly be reduced
-			endSpeed = min(sqrt(delta * acceleration),
-					stepper->setFrequency(stepsPerDeg * endSpeed)
-							/ stepsPerDeg);
-			ramp_steps = (unsigned int) (endSpeed
-					/ (TelescopeConfiguration::getInt("acceleration_step_time")
-							/ 1000.0) / acceleration);
-			if (ramp_steps < 1)
-				ramp_steps = 1;
-
-			angleRotatedDuringAcceleration = 0;
-			/*Simulate the slewing process to get an accurate estimate of the actual angle that will be slewed*/
-			for (unsigned int i = 1; i <= ramp_steps; i++)
+			/*The motion angle is decreased to ensure the correction step is in the same direction.
+			 * If the final approach must be from the other side because of the backlash, the slew goes past
+			 * the target instead, and the correction comes back*/
+			if (!handover)
+				delta += (useCorrection && backlash > 0
+						&& approachDir != AXIS_ROTATE_STOP && dir != approachDir) ?
+						0.5 * minSlewAngle : -0.5 * minSlewAngle;
+
+			// If delta is small, then endSpeed will correspondingly be reduced to the highest speed in the table we can reach
+			int peak = profile->findPeak(delta);
+			if (handover)
 			{
-				double speed = stepper->setFrequency(
-						stepsPerDeg * endSpeed / ramp_steps * i) / stepsPerDeg;
-				angleRotatedDuringAcceleration += speed
-						* (TelescopeConfiguration::getInt(
-								"acceleration_step_time") / 1000.0)
-						* (i == ramp_steps ? 1 : 2); // Count both acceleration and deceleration
+				// The target moves during the ramps
+				peak = profile->findPeak(
+						delta + vt * (2 * peak + 2) * stepTime);
+			}
+			if (peak < 0)
+				peak = 0;
+			if (peak < profile->indexOf(MotionProfile::toFixed(endSpeed)))
+			{
+				endSpeed = MotionProfile::toDouble(
+						profile->getSpeedFixed(peak));
 			}
 
-			waitTime = (delta - angleRotatedDuringAcceleration) / endSpeed;
-			if (waitTime < 0.0)
-				waitTime = 0.0; // With the above calculations, waitTime should no longer be zero. But if it happens to be so, let the correction do the job
-
-			debug_if(AXIS_DEBUG, "%s: endspeed = %f deg/s, time=%f, acc=%f\n",
-					axisName, endSpeed, waitTime, acceleration);
+			debug_if(AXIS_DEBUG, "%s: endspeed = %f deg/s, peak=%d/%d\n",
+					axisName, endSpeed, peak, profile->getSteps());
 		}
 		else
 		{
@@ -244,32 +437,34 @@ bool useCorrection)
 	{
 		int wait_ms;
 		uint32_t flags;
+		double rampAngle = 0; // Angle rotated during acceleration
 		/*Acceleration*/
-		slewState = AXIS_SLEW_ACCELERATING;
-		ramp_steps = (unsigned int) ((endSpeed - startSpeed)
-				/ (TelescopeConfiguration::getInt("acceleration_step_time")
-						/ 1000.0) / acceleration);
-
-		if (ramp_steps < 1)
-			ramp_steps = 1;
+		setSlewState(AXIS_SLEW_ACCELERATING);
+		if (!isInertial)
+			takeup(dir); // In inertial mode the motor is still running
+		ramp.reset(profile, startSpeed);
+		ramp.setTarget(endSpeed);
 
-		debug_if(AXIS_DEBUG, "%s: accelerate in %d steps\n", axisName,
-				ramp_steps); // TODO: DEBUG
+		debug_if(AXIS_DEBUG, "%s: accelerate from %f to %f\n", axisName,
+				startSpeed, ramp.getTarget()); // TODO: DEBUG
 
-		for (unsigned int i = 1; i <= ramp_steps; i++)
+		bool started = false;
+		do
 		{
-			currentSpeed = stepper->setFrequency(
-					stepsPerDeg
-							* ((endSpeed - startSpeed) / ramp_steps * i
-									+ startSpeed)) / stepsPerDeg; // Set and update currentSpeed with actual speed
+			currentSpeed = setStepFrequency(stepsPerDeg * ramp.step())
+					* degPerStep; // Set and update currentSpeed with actual speed
+			rampAngle += currentSpeed * stepTime;
 
-			if (i == 1)
-				stepper->start(sd);
+			if (!started)
+			{
+				startStepper(sd);
+				started = true;
+			}
 
 			/*Monitor whether there is a stop/emerge stop signal*/
 			uint32_t flags = osThreadFlagsWait(
 			AXIS_STOP_SIGNAL | AXIS_EMERGE_STOP_SIGNAL, osFlagsWaitAny,
-					TelescopeConfiguration::getInt("acceleration_step_time"));
+					stepTime_ms);
 
 			if (flags == osFlagsErrorTimeout)
 			{
@@ -291,10 +486,41 @@ bool useCorrection)
 					goto stop;
 				}
 			}
+		} while (!ramp.done());
+
+		if (!indefinite)
+		{
+			/* The deceleration goes through the same speeds as the acceleration, except the last one.
+			 * Using the actual speeds we got, the slewing time will be accurate*/
+			double decelAngle = rampAngle - currentSpeed * stepTime;
+			double decelTime = 0;
+			double togo = delta - rampAngle;
+			if (handover)
+			{
+				// The deceleration ends at the final speed, simulate it on a copy of the ramp
+				MotionRamp decel = ramp;
+				decel.setTarget(finalSpeed);
+				decelAngle = 0;
+				double speed;
+				while ((speed = decel.step()) > 0)
+				{
+					decelAngle += speed * stepTime;
+					decelTime += stepTime;
+					if (finalSpeed > 0 && decel.done())
+						break;
+				}
+				// The target keeps moving until it is intercepted at the end of the deceleration
+				togo += vt
+						* ((uint32_t) (osKernelGetTickCount() - startTime)
+								* 0.001 + decelTime);
+			}
+			waitTime = (togo - decelAngle) / (currentSpeed - vt);
+			if (waitTime < 0.0)
+				waitTime = 0.0; // With the above calculations, waitTime should no longer be zero. But if it happens to be so, let the correction do the job
 		}
 
 		/*Keep slewing and wait*/
-		slewState = AXIS_SLEW_CONSTANT_SPEED;
+		setSlewState(AXIS_SLEW_CONSTANT_SPEED);
 		debug_if(AXIS_DEBUG, "%s: wait for %f\n", axisName, waitTime); // TODO
 		wait_ms = (isinf(waitTime)) ? osWaitForever : (int) (waitTime * 1000);
 
@@ -306,6 +532,8 @@ bool useCorrection)
 					AXIS_STOP_SIGNAL | AXIS_EMERGE_STOP_SIGNAL
 							| (indefinite ? AXIS_SPEEDCHANGE_SIGNAL : 0),
 					osFlagsWaitAny, wait_ms); /*Wait the remaining time*/
+			MotionTrace::record(TRACE_WAKEUP, traceId,
+					(flags & osFlagsError) ? 0 : (flags >> 16));
 			if (flags != osFlagsErrorTimeout)
 			{
 				if (flags & AXIS_EMERGE_STOP_SIGNAL)
@@ -323,35 +551,20 @@ bool useCorrection)
 				else if (flags & AXIS_SPEEDCHANGE_SIGNAL)
 				{
 					// Change speed, therefore also changing waittime. Only applies to indefinite slew
-					double newSpeed = slewSpeed;
-					startSpeed = currentSpeed;
-					endSpeed = newSpeed;
-
-					ramp_steps = (unsigned int) (fabs(endSpeed - startSpeed)
-							/ (TelescopeConfiguration::getInt(
-									"acceleration_step_time") / 1000.0)
-							/ acceleration);
+					ramp.setTarget(slewSpeed);
 
-					if (ramp_steps < 1)
-						ramp_steps = 1;
+					debug_if(AXIS_DEBUG, "%s: accelerate to %f\n", axisName,
+							ramp.getTarget()); // TODO: DEBUG
 
-					debug_if(AXIS_DEBUG, "%s: accelerate in %d steps\n",
-							axisName, ramp_steps); // TODO: DEBUG
-
-					for (unsigned int i = 1; i <= ramp_steps; i++)
+					do
 					{
-						currentSpeed = stepper->setFrequency(
-								stepsPerDeg
-										* ((endSpeed - startSpeed) / ramp_steps
-												* i + startSpeed))
-								/ stepsPerDeg; // Set and update currentSpeed with actual speed
+						currentSpeed = setStepFrequency(
+								stepsPerDeg * ramp.step()) * degPerStep; // Set and update currentSpeed with actual speed
 
 						/*Monitor whether there is a stop/emerge stop signal*/
 						uint32_t flags = osThreadFlagsWait(
 						AXIS_STOP_SIGNAL | AXIS_EMERGE_STOP_SIGNAL,
-						osFlagsWaitAny,
-								TelescopeConfiguration::getInt(
-										"acceleration_step_time"));
+						osFlagsWaitAny, stepTime_ms);
 
 						if (flags == osFlagsErrorTimeout)
 						{
@@ -373,7 +586,7 @@ bool useCorrection)
 								goto stop;
 							}
 						}
-					}
+					} while (!ramp.done());
 				}
 			}
 			if (!indefinite)
@@ -385,27 +598,25 @@ bool useCorrection)
 
 		stop:
 		/*Now deceleration*/
-		slewState = AXIS_SLEW_DECELERATING;
-		endSpeed = currentSpeed;
-		ramp_steps = (unsigned int) (currentSpeed
-				/ (TelescopeConfiguration::getInt("acceleration_step_time")
-						/ 1000.0) / acceleration);
-
-		if (ramp_steps < 1)
-			ramp_steps = 1;
+		setSlewState(AXIS_SLEW_DECELERATING);
+		if (slew_finish_state != FINISH_COMPLETE)
+			finalSpeed = 0;
+		ramp.setTarget(finalSpeed);
 
-		debug_if(AXIS_DEBUG, "%s: decelerate in %d steps from %f\n", axisName,
-				ramp_steps, endSpeed); // TODO: DEBUG
+		debug_if(AXIS_DEBUG, "%s: decelerate from %f\n", axisName,
+				currentSpeed); // TODO: DEBUG
 
-		for (unsigned int i = ramp_steps - 1; i >= 1; i--)
+		while (true)
 		{
-			currentSpeed = stepper->setFrequency(
-					stepsPerDeg * endSpeed / ramp_steps * i) / stepsPerDeg; // set and update accurate speed
+			double speed = ramp.step();
+			if (speed <= 0)
+				break;
+			currentSpeed = setStepFrequency(stepsPerDeg * speed)
+					* degPerStep; // set and update accurate speed
 			// Wait. Now we only handle EMERGENCY STOP signal, since stop has been handled already
 			flags = osThreadFlagsWait(
 			AXIS_EMERGE_STOP_SIGNAL | AXIS_STOP_KEEPSPEED_SIGNAL,
-			osFlagsWaitAny,
-					TelescopeConfiguration::getInt("acceleration_step_time"));
+			osFlagsWaitAny, stepTime_ms);
 
 			if (flags != osFlagsErrorTimeout)
 			{
@@ -419,33 +630,53 @@ bool useCorrection)
 				else if (flags & AXIS_STOP_KEEPSPEED_SIGNAL)
 				{
 					// Keep current speed
-					status = AXIS_INERTIAL;
-					slewState = AXIS_NOT_SLEWING;
+					setStatus(AXIS_INERTIAL);
+					setSlewState(AXIS_NOT_SLEWING);
+					MotionProfile::release(profile);
 					return;
 				}
 			}
+			if (finalSpeed > 0 && ramp.done())
+			{
+				// Keep running at the tracking speed
+				break;
+			}
 		}
 
 		emerge_stop:
 		/*Fully pull-over*/
-		slewState = AXIS_NOT_SLEWING;
-		stepper->stop();
-		currentSpeed = 0;
+		setSlewState(AXIS_NOT_SLEWING);
+		if (finalSpeed == 0 || slew_finish_state != FINISH_COMPLETE)
+		{
+			stopStepper();
+			currentSpeed = 0;
+		}
+	}
+
+	MotionProfile::release(profile);
+
+	if (handover && slew_finish_state == FINISH_COMPLETE)
+	{
+		approach(dest0, destTime, trackDir);
+		return;
 	}
 
 	if (useCorrection)
 	{
 		// Switch mode
 		correction_mode();
-		double correctionSpeed = TelescopeConfiguration::getDouble(
-				"correction_speed_sidereal") * sidereal_speed;
+		double correctionSpeed = cfg_correction_speed_sidereal.get()
+				* sidereal_speed;
+		double correctionTolerance = cfg_correction_tolerance.get();
+		int minCorrectionTime = cfg_min_correction_time.get();
 		/*Use correction to goto the final angle with high resolution*/
+		waitEncoder();
 		angleDeg = getAngleDeg();
 		debug_if(AXIS_DEBUG, "%s: correct from %f to %f deg\n", axisName,
 				angleDeg, dest); // TODO: DEBUG
 
 		double diff = remainder(angleDeg - dest, 360.0);
-		if (diff > TelescopeConfiguration::getDouble("max_correction_angle"))
+		if (diff > cfg_max_correction_angle.get())
 		{
 			debug(
 					"%s: correction too large: %f. Check hardware configuration.\n",
@@ -454,39 +685,63 @@ bool useCorrection)
 			idle_mode();
 			currentSpeed = 0;
 			slew_finish_state = FINISH_EMERG_STOPPED;
-			status = AXIS_STOPPED;
+			setStatus(AXIS_STOPPED);
 			return;
 		}
 
-		int nTry = 3; // Try 3 corrections at most
-		while (--nTry
-				&& fabsf(diff)
-						> TelescopeConfiguration::getDouble(
-								"correction_tolerance"))
+		// Correct until within tolerance. With an encoder the angle is the real one, so this also
+		// makes up for the steps lost during the slew. Give up if a correction does not get closer
+		// A correction against the approach direction goes past the target by half the min slew angle, and
+		// the next one comes back. It is done at most twice, so that the loop ends
+		double lastDiff = INFINITY;
+		bool failed = false;
+		int overshoots = 0;
+		while (fabs(diff) > correctionTolerance)
 		{
+			if (fabs(diff) >= fabs(lastDiff))
+			{
+				failed = true;
+				break;
+			}
+			lastDiff = diff;
+
 			/*Determine correction direction and time*/
 			sd = (diff > 0.0) ? STEP_BACKWARD : STEP_FORWARD;
+			axisrotdir_t cd =
+					(sd == STEP_FORWARD) ?
+							AXIS_ROTATE_POSITIVE : AXIS_ROTATE_NEGATIVE;
+			double angle = fabs(diff);
+			if (backlash > 0 && approachDir != AXIS_ROTATE_STOP
+					&& cd != approachDir && overshoots < 2)
+			{
+				angle += 0.5 * cfg_min_slew_angle.get();
+				overshoots++;
+				lastDiff = INFINITY; // Farther from the target on purpose
+			}
 
 			/*Perform correction*/
-			currentSpeed = stepper->setFrequency(stepsPerDeg * correctionSpeed)
-					/ stepsPerDeg; // Set and update actual speed
+			takeup(cd);
+			currentSpeed = setStepFrequency(stepsPerDeg * correctionSpeed)
+					* degPerStep; // Set and update actual speed
+			currentDirection = cd;
 
-			int correctionTime_ms = (int) (fabs(diff) / currentSpeed * 1000); // Use the accurate speed for calculating time
+			int correctionTime_ms = (int) (angle / currentSpeed * 1000); // Use the accurate speed for calculating time
 
 			debug_if(AXIS_DEBUG,
 					"%s: correction: from %f to %f deg. time=%d ms\n", axisName,
 					angleDeg, dest, correctionTime_ms); //TODO: DEBUG
-			if (correctionTime_ms
-					< TelescopeConfiguration::getInt("min_correction_time"))
+			if (correctionTime_ms < minCorrectionTime)
 			{
 				break;
 			}
+			MotionTrace::record(TRACE_CORRECTION, traceId, 0, -diff,
+					correctionTime_ms);
 
 			/*Start, wait, stop*/
-			stepper->start(sd);
+			startStepper(sd);
 			uint32_t flags = osThreadFlagsWait(AXIS_EMERGE_STOP_SIGNAL,
 			osFlagsWaitAny, correctionTime_ms);
-			stepper->stop();
+			stopStepper();
 			if (flags != osFlagsErrorTimeout)
 			{
 				// Emergency stop!
@@ -494,11 +749,12 @@ bool useCorrection)
 				goto emerge_stop2;
 			}
 
+			waitEncoder();
 			angleDeg = getAngleDeg();
 			diff = remainder(angleDeg - dest, 360.0);
 		}
 
-		if (!nTry)
+		if (failed)
 		{
 			debug("%s: correction failed. Check hardware configuration.\n",
 					axisName);
@@ -510,43 +766,165 @@ bool useCorrection)
 	emerge_stop2:
 // Set status to stopped
 	currentSpeed = 0;
-	status = AXIS_STOPPED;
+	setStatus(AXIS_STOPPED);
 	idle_mode();
 }
 
-void Axis::track(axisrotdir_t dir)
+void Axis::approach(double dest, uint32_t destTime, axisrotdir_t trackDir)
 {
+	/* The stepper is either stopped, or running at the tracking speed in the tracking direction*/
 	track_mode();
-	if (trackSpeed != 0 && dir != AXIS_ROTATE_STOP)
+	const double v = (trackDir == AXIS_ROTATE_POSITIVE) ? trackSpeed : -trackSpeed; // Speed of the target
+	const stepdir_t trackSd =
+			(trackDir == AXIS_ROTATE_POSITIVE) ? STEP_FORWARD : STEP_BACKWARD;
+	bool running = currentSpeed > 0;
+	stepdir_t sd = trackSd;
+	if (running)
 	{
-		stepdir_t sd =
-				(dir == AXIS_ROTATE_POSITIVE) ? STEP_FORWARD : STEP_BACKWARD;
-		currentSpeed = stepper->setFrequency(trackSpeed * stepsPerDeg)
-				/ stepsPerDeg;
-		currentDirection = dir;
-		stepper->start(sd);
+		// The microstep setting may have changed
+		currentSpeed = setStepFrequency(trackSpeed * stepsPerDeg)
+				* degPerStep;
 	}
-	else
+
+	double correctionSpeed = cfg_correction_speed_sidereal.get()
+			* sidereal_speed;
+	double correctionTolerance = cfg_correction_tolerance.get();
+	int minCorrectionTime = cfg_min_correction_time.get();
+
+	/*Correct at the correction speed relative to the target*/
+	for (int nTry = 0; nTry < 3; nTry++)
+	{
+		double target = dest
+				+ v * (uint32_t) (osKernelGetTickCount() - destTime) * 0.001;
+		double diff = remainder(getAngleDeg() - target, 360.0);
+		if (fabs(diff) <= correctionTolerance)
+		{
+			break;
+		}
+		double speed = v + ((diff > 0) ? -correctionSpeed : correctionSpeed);
+		stepdir_t d = (speed > 0) ? STEP_FORWARD : STEP_BACKWARD;
+		if (running && d != sd)
+		{
+			stopStepper();
+			running = false;
+		}
+		if (!running)
+			takeup((d == STEP_FORWARD) ?
+					AXIS_ROTATE_POSITIVE : AXIS_ROTATE_NEGATIVE);
+		currentSpeed = setStepFrequency(fabs(speed) * stepsPerDeg)
+				* degPerStep; // Set and update actual speed
+		currentDirection =
+				(d == STEP_FORWARD) ? AXIS_ROTATE_POSITIVE : AXIS_ROTATE_NEGATIVE;
+		double relSpeed = fabs(
+				((d == STEP_FORWARD) ? currentSpeed : -currentSpeed) - v);
+		int correctionTime_ms = (int) (fabs(diff) / relSpeed * 1000);
+
+		debug_if(AXIS_DEBUG, "%s: approach: %f deg to go. time=%d ms\n",
+				axisName, -diff, correctionTime_ms);
+		if (correctionTime_ms < minCorrectionTime)
+		{
+			break;
+		}
+		MotionTrace::record(TRACE_CORRECTION, traceId, 0, -diff,
+				correctionTime_ms);
+
+		if (!running)
+		{
+			startStepper(d);
+			running = true;
+		}
+		sd = d;
+		uint32_t flags = osThreadFlagsWait(
+		AXIS_STOP_SIGNAL | AXIS_EMERGE_STOP_SIGNAL, osFlagsWaitAny,
+				correctionTime_ms);
+		if (flags != osFlagsErrorTimeout)
+		{
+			slew_finish_state =
+					(flags & AXIS_EMERGE_STOP_SIGNAL) ?
+							FINISH_EMERG_STOPPED : FINISH_STOPPED;
+			stopStepper();
+			currentSpeed = 0;
+			setStatus(AXIS_STOPPED);
+			idle_mode();
+			return;
+		}
+	}
+
+	/*Now at the target, keep moving with it*/
+	if (running && sd != trackSd)
+	{
+		stopStepper();
+		running = false;
+	}
+	if (!running && trackSpeed > 0)
+		takeup(trackDir);
+	currentSpeed = setStepFrequency(trackSpeed * stepsPerDeg)
+			* degPerStep;
+	currentDirection = trackDir;
+	if (!running && trackSpeed > 0)
+	{
+		startStepper(trackSd);
+	}
+	debug_if(AXIS_DEBUG, "%s: tracking at %f deg\n", axisName, getAngleDeg());
+	setStatus(AXIS_TRACKING);
+}
+
+/**
+ * Track until stopped
+ * @param handover The stepper is already running at the tracking speed
+ * @param owed Steps to pay back at the correction speed, positive in the AXIS_ROTATE_POSITIVE direction
+ */
+void Axis::track(axisrotdir_t dir, bool handover, double owed)
+{
+	track_mode();
+	if (trackSpeed == 0 || dir == AXIS_ROTATE_STOP)
 	{
 		// For DEC axis
 		dir = AXIS_ROTATE_STOP;
 		trackSpeed = 0;
-		currentSpeed = 0;
-		currentDirection = AXIS_ROTATE_POSITIVE;
+		if (currentSpeed == 0)
+			currentDirection = AXIS_ROTATE_POSITIVE;
 	}
-	status = AXIS_TRACKING;
+	trackDirection = dir;
+	trackError = owed;
+	trackTime = 0;
+	trackSteps = 0;
+	guideRemaining = 0;
+	guideRate = 0;
+	guideSchedCount = 0;
+	ditherTrack(false);
+	setStatus(AXIS_TRACKING);
+	// After a handover, a stop may have been requested since the slew finished
 	Thread::signal_clr(
-	AXIS_STOP_SIGNAL | AXIS_EMERGE_STOP_SIGNAL | AXIS_GUIDE_SIGNAL);
+			handover ?
+					AXIS_GUIDE_SIGNAL | AXIS_SPEEDCHANGE_SIGNAL :
+					(AXIS_STOP_SIGNAL | AXIS_EMERGE_STOP_SIGNAL
+							| AXIS_GUIDE_SIGNAL | AXIS_SPEEDCHANGE_SIGNAL));
 	// Empty the guide queue
-	while (!guide_queue.empty())
-		guide_queue.get();
+	guide_queue.clear();
 
 	while (true)
 	{
-		// Now we wait for SOMETHING to happen - either STOP, EMERGE_STOP or GUIDE
+		// Now we wait for SOMETHING to happen - either STOP, EMERGE_STOP, GUIDE or a new rate offset,
+		// or the next change of the guide timeline.
+		// The step rate is corrected periodically so that its mean matches the tracking rate
+		uint32_t timeout = nextGuideEvent();
+		if ((trackRate + guideRate != 0 || observer)
+				&& timeout > AXIS_TRACK_DITHER_MS)
+			timeout = AXIS_TRACK_DITHER_MS;
+		uint32_t waitStart = us_ticker_read();
 		uint32_t flags = osThreadFlagsWait(
-		AXIS_GUIDE_SIGNAL | AXIS_STOP_SIGNAL | AXIS_EMERGE_STOP_SIGNAL,
-		osFlagsWaitAny, osWaitForever);
+		AXIS_GUIDE_SIGNAL | AXIS_STOP_SIGNAL | AXIS_EMERGE_STOP_SIGNAL
+				| AXIS_SPEEDCHANGE_SIGNAL, osFlagsWaitAny, timeout);
+		MotionTrace::record(TRACE_WAKEUP, traceId,
+				(flags & osFlagsError) ? 0 : (flags >> 16));
+		if (flags == osFlagsErrorTimeout && timeout != osWaitForever)
+		{
+			// How late the thread runs after the timeout
+			int32_t late = (int32_t) (us_ticker_read() - waitStart)
+					- (int32_t) (timeout * 1000);
+			SystemProfiler::wakeupLatency.add(late > 0 ? late : 0);
+		}
 		if ((flags & osFlagsError) == 0) // has flag
 		{
 			if (flags & (AXIS_STOP_SIGNAL | AXIS_EMERGE_STOP_SIGNAL))
@@ -554,120 +932,213 @@ void Axis::track(axisrotdir_t dir)
 				// We stop tracking
 				break;
 			}
-			else if (flags & AXIS_GUIDE_SIGNAL)
+			if (flags & AXIS_GUIDE_SIGNAL)
 			{
-				bool stopped = false;
-				// Guide. Process all commands in the queue
-				while (true)
-				{
-					osEvent evt = guide_queue.get(0); // try to get a message
-					if (evt.status == osEventMessage)
-					{
-						int guideTime_ms = (int) evt.value.p;
-						if (guideTime_ms == 0)
-							continue; // Nothing to guide
-						// Determine guide direction
-						axisrotdir_t guide_dir =
-								(guideTime_ms > 0) ?
-										AXIS_ROTATE_POSITIVE :
-										AXIS_ROTATE_NEGATIVE;
-
-						double newSpeed =
-								(guide_dir == currentDirection) ?
-										trackSpeed + guideSpeed :
-										trackSpeed - guideSpeed; /*Determine speed in the original direction (currentDirection)*/
-
-						// Clamp to maximum guide time
-						guideTime_ms = abs(guideTime_ms);
-						if (guideTime_ms
-								> TelescopeConfiguration::getInt(
-										"max_guide_time"))
-						{
-							debug("Axis: Guiding time too long: %d ms\n",
-									abs(guideTime_ms));
-							guideTime_ms = TelescopeConfiguration::getInt(
-									"max_guide_time");
-						}
-
-						bool dirswitch = false;
-						if (newSpeed > 0)
-						{
-							currentSpeed = stepper->setFrequency(
-									newSpeed * stepsPerDeg) / stepsPerDeg; //set and update accurate speed
-							if (trackSpeed == 0)
-							{
-								// For DEC, we also need to start the motor
-								stepper->start(STEP_FORWARD); // Reverse direction
-							}
-						}
-						else if (newSpeed < 0)
-						{
-							//
-							stepper->stop();
-							currentSpeed = stepper->setFrequency(
-									-newSpeed * stepsPerDeg) / stepsPerDeg; //set and update accurate speed
-							stepper->start(
-									(currentDirection == AXIS_ROTATE_POSITIVE) ?
-											STEP_BACKWARD : STEP_FORWARD); // Reverse direction
-							dirswitch = true;
-						}
-						else
-						{
-							// newSpeed == 0, just stop the motor
-							currentSpeed = 0;
-							stepper->stop();
-							dirswitch = true; // Make sure to recover the original speed
-						}
-
-						uint32_t flags = osThreadFlagsWait(
-						AXIS_STOP_SIGNAL | AXIS_EMERGE_STOP_SIGNAL,
-						osFlagsWaitAny, guideTime_ms);
-						if (flags != osFlagsErrorTimeout)
-						{
-							//break and stop;
-							stopped = true;
-							break;
-						}
-						if (dirswitch || trackSpeed == 0)
-						{
-							stepper->stop();
-							// Restart the motor in original direction
-							if (trackSpeed != 0)
-							{
-								stepper->start(
-										(currentDirection
-												== AXIS_ROTATE_POSITIVE) ?
-												STEP_FORWARD : STEP_BACKWARD); // Reverse direction
-							}
-						}
-						// Restore to normal speed
-						if (trackSpeed != 0)
-							currentSpeed = stepper->setFrequency(
-									trackSpeed * stepsPerDeg) / stepsPerDeg;
-						else
-							currentSpeed = 0;
-
-						// End guiding
-					}
-					else
-					{
-						// No more message to get. Break out
-						break;
-					}
-				}
-				if (stopped)
-				{
-					//Complete break out
-					break;
-				}
+				pullGuide();
 			}
 		}
+		// Timed out, new guide pulses or new rate offset
+		ditherTrack(true);
 	}
 
 // Stop
 	currentSpeed = 0;
-	stepper->stop();
-	status = AXIS_STOPPED;
+	stopStepper();
+	trackOffset = 0;
+	trackRate = 0;
+	setStatus(AXIS_STOPPED);
 	idle_mode();
 }
 
+/**
+ * Run the stepper at a signed rate, reversing or stopping it as needed
+ * @param rate Rate in deg/s, positive in the AXIS_ROTATE_POSITIVE direction
+ * @return actual rate
+ */
+double Axis::setRate(double rate)
+{
+	axisrotdir_t dir =
+			(rate >= 0) ? AXIS_ROTATE_POSITIVE : AXIS_ROTATE_NEGATIVE;
+	bool running = currentSpeed != 0;
+	if (rate == 0)
+	{
+		if (running)
+			stopStepper();
+		currentSpeed = 0;
+		return 0;
+	}
+	if (running && dir != currentDirection)
+	{
+		stopStepper();
+		running = false;
+	}
+	if (!running)
+		takeup(dir);
+	currentSpeed = setStepFrequency(fabs(rate) * stepsPerDeg)
+			* degPerStep;
+	currentDirection = dir;
+	if (!running)
+		startStepper(
+				(dir == AXIS_ROTATE_POSITIVE) ? STEP_FORWARD : STEP_BACKWARD);
+	return (dir == AXIS_ROTATE_POSITIVE) ? currentSpeed : -currentSpeed;
+}
+
+/**
+ * Set the tracking step frequency so that the mean rate matches the tracking rate.
+ * The stepper can only produce a set of discrete frequencies, which are off by up to a few ppm from
+ * the tracking speed. The difference is integrated over time as a step error, and the next frequency is
+ * chosen to pay it back within AXIS_TRACK_DITHER_MS. The frequencies then alternate around the requested
+ * rate, and the error stays within a fraction of a step instead of growing with time.
+ * The tracking rate is the tracking speed in the tracking direction plus the rate offset, so a new offset
+ * only changes the frequency, and reverses the motor only if the rate changes sign.
+ * The guide timeline is advanced here too: while guide time remains, the guide speed is added to the rate.
+ * @param account true to account for the time spent at the previous frequency
+ */
+void Axis::ditherTrack(bool account)
+{
+	double requested = (trackRate + guideRate) * stepsPerDeg;
+	EncoderObserver *obs = observer;
+	double bias = obs ? obs->getBias() : 0;
+	PeriodicErrorCorrection *p =
+			(trackDirection != AXIS_ROTATE_STOP) ? pec : NULL;
+	if (account)
+	{
+		double dt = tim.read_high_resolution_us() * 1e-6;
+		trackTime += dt;
+		trackSteps += (trackFreq - guideRate * stepsPerDeg) * dt;
+		trackError += (requested - trackFreq) * dt;
+		// Steps lost since the last update, as seen by the encoder
+		trackError -= (bias - trackBias) * stepsPerDeg;
+		// Serve the guide time
+		double guided = guideRemaining;
+		if (guideRate > 0)
+			guideRemaining = (guideRemaining > dt) ? guideRemaining - dt : 0;
+		else if (guideRate < 0)
+			guideRemaining = (guideRemaining < -dt) ? guideRemaining + dt : 0;
+		// Corrections of this period, for the PEC recording
+		if (p)
+			p->update(getMotorPosition(), dt,
+					(guided - guideRemaining) * guideSpeed, trackBias - bias);
+	}
+	tim.reset();
+	trackBias = bias;
+
+	// Start the scheduled guide pulses that are due
+	uint32_t now = osKernelGetTickCount();
+	for (int i = 0; i < guideSchedCount;)
+	{
+		if ((int32_t) (guideSched[i].start - now) <= 0)
+		{
+			addGuide(guideSched[i].ms);
+			guideSched[i] = guideSched[--guideSchedCount];
+		}
+		else
+			i++;
+	}
+	if (fabs(guideRemaining) < 0.5e-3)
+		guideRemaining = 0; // Less than the resolution of the timeline
+	guideRate = (guideRemaining > 0) ? guideSpeed :
+				(guideRemaining < 0) ? -guideSpeed : 0;
+
+	trackRate = ((trackDirection == AXIS_ROTATE_STOP) ? 0 :
+					(trackDirection == AXIS_ROTATE_POSITIVE) ?
+							trackSpeed : -trackSpeed) + trackOffset
+			+ (p ? p->getRate(getMotorPosition()) : 0);
+	double rate = trackRate + guideRate;
+	if (rate == 0 && fabs(trackError) < 0.5)
+	{
+		// Nothing to follow, e.g. DEC without rate offset or guiding
+		trackError = 0;
+		trackFreq = setRate(0);
+		return;
+	}
+	// Pay back the error, no faster than the correction speed
+	double payback = trackError * degPerStep * (1000.0 / AXIS_TRACK_DITHER_MS);
+	double maxPayback = cfg_correction_speed_sidereal.get() * sidereal_speed;
+	if (payback > maxPayback)
+		payback = maxPayback;
+	else if (payback < -maxPayback)
+		payback = -maxPayback;
+	uint32_t seq = takeupSeq;
+	trackFreq = setRate(rate + payback) * stepsPerDeg;
+	if (takeupSeq != seq)
+	{
+		// The axis stood still during the takeup. The target kept moving, and the guide time is served from now on
+		trackError += trackRate * stepsPerDeg * tim.read_high_resolution_us()
+				* 1e-6;
+		tim.reset();
+	}
+}
+
+/**
+ * Move the guide pulses from the queue to the schedule. ditherTrack() starts them when they are due,
+ * after accounting for the guide time served so far.
+ */
+void Axis::pullGuide()
+{
+	guidepulse_t pulse;
+	while (guide_queue.pop(pulse))
+	{
+		if (pulse.ms == 0)
+			continue; // Nothing to guide
+		if (guideSchedCount < AXIS_GUIDE_SCHED_SIZE)
+		{
+			guideSched[guideSchedCount++] = pulse;
+			continue;
+		}
+		// No room left, merge with the pulse that starts closest in time
+		int nearest = 0;
+		uint32_t dmin = UINT32_MAX;
+		for (int i = 0; i < guideSchedCount; i++)
+		{
+			int32_t d = (int32_t) (guideSched[i].start - pulse.start);
+			uint32_t ad = (d < 0) ? -(uint32_t) d : (uint32_t) d;
+			if (ad < dmin)
+			{
+				dmin = ad;
+				nearest = i;
+			}
+		}
+		guideSched[nearest].ms += pulse.ms;
+	}
+}
+
+/**
+ * Merge a guide pulse into the guide time still to be served. Pulses in opposite directions cancel out,
+ * and pulses in the same direction extend the running one, so the guide rate never changes by more than
+ * the guide speed.
+ * @param ms Signed duration, positive in the AXIS_ROTATE_POSITIVE direction
+ */
+void Axis::addGuide(int ms)
+{
+	// Clamp to maximum guide time
+	double maxGuideTime = cfg_max_guide_time.get() * 0.001;
+	guideRemaining += ms * 0.001;
+	if (fabs(guideRemaining) > maxGuideTime)
+	{
+		debug("%s: Guiding time too long: %d ms\n", axisName,
+				(int) (fabs(guideRemaining) * 1000));
+		guideRemaining = (guideRemaining > 0) ? maxGuideTime : -maxGuideTime;
+	}
+}
+
+/**
+ * @return time in ms until the guide rate changes, osWaitForever if nothing is scheduled
+ */
+uint32_t Axis::nextGuideEvent()
+{
+	uint32_t next = osWaitForever;
+	if (guideRate != 0)
+		next = (uint32_t) ceil(fabs(guideRemaining) * 1000);
+	uint32_t now = osKernelGetTickCount();
+	for (int i = 0; i < guideSchedCount; i++)
+	{
+		int32_t d = (int32_t) (guideSched[i].start - now);
+		if (d < 0)
+			d = 0;
+		if ((uint32_t) d < next)
+			next = d;
+	}
+	return next;
+}
+
@@ -9,12 +9,17 @@
 #define PUSHTOGO_AXIS_H_
 
 class Axis;
+class EncoderObserver;
+class PeriodicErrorCorrection;
 
 #include "StepperMotor.h"
 #include <math.h>
 #include "mbed.h"
 #include "CelestialMath.h"
 #include "TelescopeConfiguration.h"
+#include "MotionProfile.h"
+#include "SPSCRing.h"
+#include "MotionTrace.h"
 
 //#define AXIS_SLEW_SIGNAL				0x00010000
 #define AXIS_GUIDE_SIGNAL				0x00020000
@@ -23,6 +28,11 @@ class Axis;
 #define AXIS_STOP_KEEPSPEED_SIGNAL		0x00100000
 #define AXIS_SPEEDCHANGE_SIGNAL			0x00200000
 
+/// Interval in ms between corrections of the tracking step rate, see Axis::ditherTrack()
+#define AXIS_TRACK_DITHER_MS			100
+/// Number of guide pulses that can be scheduled to start later
+#define AXIS_GUIDE_SCHED_SIZE			8
+
 /**
  * status of the Axis object
  */
@@ -78,10 +88,11 @@ public:
 	 * Perform a goto to a specified angle (in Radian) in the specified direction with slewing rate
 	 * @param dir Rotation direction
 	 * @param angleDeg Angle to rotate
+	 * @param speed Max speed of this slew in deg/s, 0 to use the slew speed
 	 * @return osStatus
 	 */
 	osStatus startSlewTo(axisrotdir_t dir, double angle, bool withCorrection =
-	true)
+	true, double speed = 0)
 	{
 		msg_t *message = task_pool.alloc();
 		if (!message)
@@ -92,9 +103,50 @@ public:
 		message->value = angle;
 		message->dir = dir;
 		message->withCorrection = withCorrection;
+		message->speed = speed;
+		osStatus s;
+
+		debug_if(0, "%s: CLR SLEW %p\n", axisName, Thread::gettid());
+		slew_finish_sem.wait(0); // Make sure the semaphore is cleared. THIS MUST BE DONE BEFORE THE MESSAGE IS ENQUEUED
+
+		if ((s = task_queue.put(message)) != osOK)
+		{
+			task_pool.free(message);
+			return s;
+		}
+
+		return osOK;
+	}
+
+	/**
+	 * Slew to a target moving at the tracking speed, and start tracking when it is reached.
+	 * The slew intercepts the target where it will be at the end of the slew. If it goes in the tracking direction,
+	 * it decelerates to the tracking speed instead of stopping, so the axis goes from slewing to tracking without a stop.
+	 * The remaining error is corrected while moving with the target.
+	 * @param dir Slew direction
+	 * @param angle Position of the target at the time of the call
+	 * @param trackDir Tracking direction
+	 * @param speed Max speed of this slew in deg/s, 0 to use the slew speed
+	 * @return osStatus
+	 * @note waitForSlew() returns when tracking has started
+	 */
+	osStatus startSlewToTrack(axisrotdir_t dir, double angle,
+			axisrotdir_t trackDir, double speed = 0)
+	{
+		msg_t *message = task_pool.alloc();
+		if (!message)
+		{
+			return osErrorNoMemory;
+		}
+		message->signal = msg_t::SIGNAL_SLEW_TRACK;
+		message->value = angle;
+		message->dir = dir;
+		message->withCorrection = false;
+		message->trackDir = trackDir;
+		message->time = osKernelGetTickCount();
+		message->speed = speed;
 		osStatus s;
 
-		debug_if(0, "%s: CLR SLEW 0x%08x\n", axisName, Thread::gettid());
 		slew_finish_sem.wait(0); // Make sure the semaphore is cleared. THIS MUST BE DONE BEFORE THE MESSAGE IS ENQUEUED
 
 		if ((s = task_queue.put(message)) != osOK)
@@ -106,12 +158,28 @@ public:
 		return osOK;
 	}
 
+	/**
+	 * Estimate the time a slew takes with the current acceleration
+	 * @param angle Angle to rotate in deg
+	 * @param speed Max speed of the slew in deg/s, 0 to use the slew speed
+	 * @return time in seconds
+	 */
+	double getSlewTime(double angle, double speed = 0);
+
+	/**
+	 * Find the max speed that makes a slew take the specified time, for coordinating slews
+	 * @param angle Angle to rotate in deg
+	 * @param time Time of the slew in seconds
+	 * @return speed in deg/s, the slew speed if the slew can't be done in that time
+	 */
+	double getSlewSpeedFor(double angle, double time);
+
 	/**
 	 * Wait for a slew to finish. Must be called after and only once after a call to startSlewTo, from the same thread
 	 */
 	finishstate_t waitForSlew()
 	{
-		debug_if(0, "%s: WAIT SLEW 0x%08x\n", axisName, Thread::gettid());
+		debug_if(0, "%s: WAIT SLEW %p\n", axisName, Thread::gettid());
 		if (slew_finish_sem.wait() <= 0)
 		{
 			return FINISH_ERROR;
@@ -175,6 +243,7 @@ public:
 		}
 		message->signal = msg_t::SIGNAL_TRACK;
 		message->dir = dir;
+		message->withCorrection = false;
 		osStatus s;
 		if ((s = task_queue.put(message)) != osOK)
 		{
@@ -186,21 +255,69 @@ public:
 	}
 
 	/**
-	 * Perform a goto to a specified angle (in Radian) in the specified direction with slewing rate
-	 * It will perform an acceleration, a GoTo, and a deceleration before returning
+	 * Start tracking a target, until stop() is called. The distance to the target is paid back at the correction
+	 * speed while tracking. It is meant to make up for the tracking missed while the axis was doing something
+	 * else, so it is limited to the tracking since the given time
+	 * @param dir Tracking direction
+	 * @param angle Position of the target at the kernel tick time
+	 * @param time Kernel tick
+	 * @return osStatus
+	 */
+	osStatus startTracking(axisrotdir_t dir, double angle, uint32_t time)
+	{
+		msg_t *message = task_pool.alloc();
+		if (!message)
+		{
+			return osErrorNoMemory;
+		}
+		message->signal = msg_t::SIGNAL_TRACK;
+		message->dir = dir;
+		message->withCorrection = true;
+		message->value = angle;
+		message->time = time;
+		osStatus s;
+		if ((s = task_queue.put(message)) != osOK)
+		{
+			task_pool.free(message);
+			return s;
+		}
+
+		return osOK;
+	}
+
+	/**
+	 * Guide at the guide speed relative to the tracking rate, starting now
 	 * @param dir Rotation direction
 	 * @param time_ms guiding time in milliseconds
 	 * @return osStatus
 	 */
 	osStatus guide(axisrotdir_t dir, int time_ms)
 	{
-		if (dir == AXIS_ROTATE_NEGATIVE)
-			time_ms = -time_ms;
+		return guide(dir, time_ms, osKernelGetTickCount());
+	}
+
+	/**
+	 * Guide at the guide speed relative to the tracking rate.
+	 * Pulses are merged into one timeline: pulses in opposite directions cancel out, and a pulse in the
+	 * direction of the one being served extends it. A pulse that is late is served in full.
+	 * @param dir Rotation direction
+	 * @param time_ms guiding time in milliseconds
+	 * @param start Kernel tick at which the pulse starts
+	 * @return osStatus
+	 */
+	osStatus guide(axisrotdir_t dir, int time_ms, uint32_t start)
+	{
+		guidepulse_t pulse;
+		pulse.start = start;
+		pulse.ms = (dir == AXIS_ROTATE_NEGATIVE) ? -time_ms : time_ms;
+		MotionTrace::record(TRACE_GUIDE, traceId, dir, time_ms);
 		// Put the guide pulse into the queue
-		osStatus s;
-		if ((s = guide_queue.put((void*) (time_ms))) != osOK)
+		guide_mutex.lock();
+		bool ok = guide_queue.push(pulse);
+		guide_mutex.unlock();
+		if (!ok)
 		{
-			return s;
+			return osErrorResource;
 		}
 		task_thread->signal_set(AXIS_GUIDE_SIGNAL); // Signal the task thread to read the queue
 		return osOK;
@@ -254,19 +371,101 @@ public:
 	/** @param new angle
 	 * @note Must be called only when the axis is stopped
 	 */
-	void setAngleDeg(double angle)
-	{
-		stepper->setStepCount(angle * stepsPerDeg);
-	}
+	void setAngleDeg(double angle);
+
+	/** @return new angle, corrected by the encoder if there is one
+	 * @note Can be called anywhere
+	 */
+	double getAngleDeg();
 
-	/** @return new angle
+	/** @return angle from the step count alone
 	 * @note Can be called anywhere
 	 */
-	double getAngleDeg()
+	double getStepAngleDeg()
 	{
 		return remainder(stepper->getStepCount() / stepsPerDeg, 360);
 	}
 
+	/** Attach the position observer of an encoder. Called by EncoderObserver
+	 */
+	void setObserver(EncoderObserver *observer)
+	{
+		this->observer = observer;
+	}
+
+	EncoderObserver *getObserver() const
+	{
+		return observer;
+	}
+
+	/** Attach periodic error correction. Called by PeriodicErrorCorrection
+	 */
+	void setPEC(PeriodicErrorCorrection *pec)
+	{
+		this->pec = pec;
+	}
+
+	PeriodicErrorCorrection *getPEC() const
+	{
+		return pec;
+	}
+
+	/** @return position of the motor in full steps, counted from power-up. Unlike the step count,
+	 * it is not changed when the angle is set, and it includes the backlash takeups
+	 */
+	double getMotorPosition()
+	{
+		return stepper->getStepCount() + motorOffset;
+	}
+
+	double getStepsPerDeg() const
+	{
+		return stepsPerDeg;
+	}
+
+	const char *getAxisName() const
+	{
+		return axisName;
+	}
+
+	/** Set the backlash model of the gear
+	 * @param backlash Angle in deg the motor turns through without moving the axis when it reverses
+	 * @param approachDir Direction of the final approach of a slew, AXIS_ROTATE_STOP for either
+	 * @note Must be called only when the axis is stopped
+	 */
+	void setBacklash(double backlash, axisrotdir_t approachDir =
+			AXIS_ROTATE_STOP)
+	{
+		if (backlash >= 0)
+			this->backlash = backlash;
+		this->approachDir = approachDir;
+	}
+
+	double getBacklash() const
+	{
+		return backlash;
+	}
+
+	axisrotdir_t getApproachDirection() const
+	{
+		return approachDir;
+	}
+
+	/** @return number of backlash takeups so far
+	 */
+	uint32_t getTakeupCount() const
+	{
+		return takeupSeq / 2;
+	}
+
+	/** @return odd while the backlash is being taken up. Changes when a takeup starts or finishes,
+	 * so that the encoder samples taken meanwhile can be dropped
+	 */
+	uint32_t getTakeupSeq() const
+	{
+		return takeupSeq;
+	}
+
 	axisstatus_t getStatus()
 	{
 		return status;
@@ -326,6 +525,37 @@ public:
 		return currentSpeed;
 	}
 
+	/** @return mean step rate actually emitted since tracking started, in sidereal rate. Guide pulses are not counted
+	 */
+	double getTrackingRateSidereal() const
+	{
+		if (trackTime <= 0)
+			return fabs(trackRate) / sidereal_speed;
+		return fabs(trackSteps) / trackTime * degPerStep / sidereal_speed;
+	}
+
+	/** Set a rate offset added to the tracking speed, to follow a target whose apparent motion is not sidereal.
+	 * Takes effect immediately if the axis is tracking, without stopping the motor. Reset to 0 when tracking stops.
+	 * @param offset Offset in deg/s, positive in the AXIS_ROTATE_POSITIVE direction
+	 */
+	void setTrackOffset(double offset)
+	{
+		trackOffset = offset;
+		task_thread->signal_set(AXIS_SPEEDCHANGE_SIGNAL);
+	}
+
+	double getTrackOffset() const
+	{
+		return trackOffset;
+	}
+
+	/** @return angle in deg by which the steps emitted while tracking lag behind the requested rate. Stays within a fraction of a step
+	 */
+	double getTrackingDrift() const
+	{
+		return trackError * degPerStep;
+	}
+
 	axisslewstate_t getSlewState() const
 	{
 		return slewState;
@@ -342,14 +572,24 @@ protected:
 	{
 		enum sig_t
 		{
-			SIGNAL_SLEW_TO = 0, SIGNAL_SLEW_INDEFINITE, SIGNAL_TRACK
+			SIGNAL_SLEW_TO = 0, SIGNAL_SLEW_INDEFINITE, SIGNAL_TRACK, SIGNAL_SLEW_TRACK
 		} signal;
 		double value;
 		axisrotdir_t dir;bool withCorrection;
+		double speed; /// Max speed of the slew, 0 for slewSpeed
+		axisrotdir_t trackDir; /// Tracking direction for SIGNAL_SLEW_TRACK
+		uint32_t time; /// Kernel tick when value was valid, for SIGNAL_SLEW_TRACK and SIGNAL_TRACK with correction
 	} msg_t;
 
+	typedef struct
+	{
+		uint32_t start; /// Kernel tick at which the pulse starts
+		int ms; /// Duration, negative in the AXIS_ROTATE_NEGATIVE direction
+	} guidepulse_t;
+
 	/*Configurations*/
 	double stepsPerDeg; ///steps per degree
+	double degPerStep; ///degrees per step, to avoid divisions
 	StepperMotor *stepper; ///Pointer to stepper motor
 	const char *axisName;
 	char *taskName;
@@ -364,18 +604,78 @@ protected:
 	volatile axisslewstate_t slewState;
 	Thread *task_thread; ///Thread for executing all lower-level tasks
 	Queue<msg_t, 16> task_queue; ///Queue of messages
-	Queue<void, 16> guide_queue; ///Guide pulse queue
+	SPSCRing<guidepulse_t, 16> guide_queue; ///Guide pulse queue, consumed by the task thread
+	Mutex guide_mutex; ///Serializes the threads putting guide pulses
 	MemoryPool<msg_t, 16> task_pool; ///MemoryPool for allocating messages
 	Semaphore slew_finish_sem;
 	volatile finishstate_t slew_finish_state;
 	Timer tim;
+	MotionRamp ramp; ///Speed ramp generator used by slew
+	axisrotdir_t trackDirection; /// Direction of the tracking speed, AXIS_ROTATE_STOP if the axis only follows the offset
+	volatile double trackOffset; /// Rate offset in deg/s added to the tracking speed
+	double trackRate; /// Signed tracking rate in deg/s followed by ditherTrack()
+	double trackFreq; /// Signed step frequency currently set by ditherTrack()
+	double trackError; /// Steps owed to the requested tracking rate, carried over to the next period
+	double trackTime; /// Time in s spent tracking at trackFreq
+	double trackSteps; /// Steps emitted while tracking at trackFreq
+	double trackBias; /// Encoder bias already accounted in trackError
+	EncoderObserver *volatile observer; /// Encoder position observer, NULL if the axis has no encoder
+	PeriodicErrorCorrection *volatile pec; /// Periodic error correction, NULL if not used
+	double motorOffset; /// Motor position - step count
+	guidepulse_t guideSched[AXIS_GUIDE_SCHED_SIZE]; /// Guide pulses that start later
+	int guideSchedCount;
+	double guideRemaining; /// Guide time in s still to be served, negative in the AXIS_ROTATE_NEGATIVE direction
+	double guideRate; /// Guide rate in deg/s added to the tracking rate
+	double backlash; /// Backlash of the gear in deg
+	axisrotdir_t approachDir; /// Direction of the final approach of a slew, AXIS_ROTATE_STOP for either
+	axisrotdir_t lashSide; /// Direction the gear was last driven in
+	volatile uint32_t takeupSeq; /// Incremented when a takeup starts and when it finishes
+	uint8_t traceId; /// Source id in the motion trace
 
 	void task();
 
 	/*Low-level functions for internal use*/
 	void slew(axisrotdir_t dir, double dest, bool indefinite,
-	bool useCorrection);
-	void track(axisrotdir_t dir);
+	bool useCorrection, axisrotdir_t trackDir = AXIS_ROTATE_STOP,
+			uint32_t destTime = 0, double speed = 0);
+	void approach(double dest, uint32_t destTime, axisrotdir_t trackDir);
+	void track(axisrotdir_t dir, bool handover = false, double owed = 0);
+	void ditherTrack(bool account);
+	double setRate(double rate);
+	void pullGuide();
+	void addGuide(int ms);
+	uint32_t nextGuideEvent();
+	void waitEncoder();
+	void takeup(axisrotdir_t dir);
+
+	/*Stepper and state changes, recorded in the motion trace*/
+	double setStepFrequency(double freq)
+	{
+		double f = stepper->setFrequency(freq);
+		MotionTrace::record(TRACE_FREQUENCY, traceId, 0, freq, f);
+		return f;
+	}
+	void startStepper(stepdir_t dir)
+	{
+		stepper->start(dir);
+		MotionTrace::record(TRACE_START, traceId,
+				(dir == STEP_FORWARD) ? 1 : 2, 0, stepper->getStepCount());
+	}
+	void stopStepper()
+	{
+		stepper->stop();
+		MotionTrace::record(TRACE_STOP, traceId, 0, 0, stepper->getStepCount());
+	}
+	void setSlewState(axisslewstate_t state)
+	{
+		slewState = state;
+		MotionTrace::record(TRACE_SLEW_STATE, traceId, state);
+	}
+	void setStatus(axisstatus_t status)
+	{
+		this->status = status;
+		MotionTrace::record(TRACE_STATUS, traceId, status);
+	}
 
 	/*These functions can be overriden to provide mode selection before each type of operation is performed, such as microstepping and current setting*/
 	virtual void slew_mode()
@@ -0,0 +1,253 @@
+/*
+ * BinaryProtocol.cpp
+ */
+
+#include "BinaryProtocol.h"
+#include <string.h>
+
+uint16_t bp_crc16(const uint8_t *data, size_t len, uint16_t crc)
+{
+	while (len--)
+	{
+		crc ^= (uint16_t) (*data++) << 8;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (uint16_t) ((crc << 1) ^ 0x1021) : (uint16_t) (crc << 1);
+	}
+	return crc;
+}
+
+FrameWriter::FrameWriter(uint8_t *buf, size_t size, uint16_t id, uint8_t type) :
+		buf(buf), size(size > BP_MAX_FRAME ? BP_MAX_FRAME : size), pos(
+		BP_HEADER_SIZE + BP_BODY_HEADER_SIZE), overflow(false)
+{
+	buf[0] = BP_SYNC0;
+	buf[1] = BP_SYNC1;
+	buf[4] = (uint8_t) id;
+	buf[5] = (uint8_t) (id >> 8);
+	buf[6] = type;
+}
+
+FrameWriter &FrameWriter::putU8(uint8_t v)
+{
+	return putBytes(&v, 1);
+}
+
+FrameWriter &FrameWriter::putU16(uint16_t v)
+{
+	uint8_t b[2] =
+	{ (uint8_t) v, (uint8_t) (v >> 8) };
+	return putBytes(b, 2);
+}
+
+FrameWriter &FrameWriter::putU32(uint32_t v)
+{
+	uint8_t b[4] =
+	{ (uint8_t) v, (uint8_t) (v >> 8), (uint8_t) (v >> 16), (uint8_t) (v >> 24) };
+	return putBytes(b, 4);
+}
+
+FrameWriter &FrameWriter::putF64(double v)
+{
+	uint64_t u;
+	memcpy(&u, &v, sizeof(u));
+	putU32((uint32_t) u);
+	return putU32((uint32_t) (u >> 32));
+}
+
+FrameWriter &FrameWriter::putBytes(const void *data, size_t len)
+{
+	if (len > payloadSpace())
+	{
+		overflow = true;
+		return *this;
+	}
+	memcpy(buf + pos, data, len);
+	pos += len;
+	return *this;
+}
+
+FrameWriter &FrameWriter::putState(const bp_state &s)
+{
+	putU32(s.time);
+	putF64(s.ra).putF64(s.dec);
+	putF64(s.ra_delta).putF64(s.dec_delta);
+	putF64(s.ra_speed).putF64(s.dec_speed);
+	putU8(s.side).putU8(s.status);
+	return putU8(s.ra_slew).putU8(s.dec_slew);
+}
+
+void FrameWriter::setI32(size_t p, int32_t v)
+{
+	p += BP_HEADER_SIZE + BP_BODY_HEADER_SIZE;
+	if (p + 4 > pos)
+		return;
+	buf[p] = (uint8_t) v;
+	buf[p + 1] = (uint8_t) (v >> 8);
+	buf[p + 2] = (uint8_t) (v >> 16);
+	buf[p + 3] = (uint8_t) (v >> 24);
+}
+
+size_t FrameWriter::finish()
+{
+	if (overflow)
+		return 0;
+	size_t length = pos - BP_HEADER_SIZE;
+	buf[2] = (uint8_t) length;
+	buf[3] = (uint8_t) (length >> 8);
+	uint16_t crc = bp_crc16(buf + 2, pos - 2);
+	buf[pos] = (uint8_t) crc;
+	buf[pos + 1] = (uint8_t) (crc >> 8);
+	return pos + BP_TRAILER_SIZE;
+}
+
+bool FrameReader::getU8(uint8_t &v)
+{
+	if (!take(1))
+		return false;
+	v = data[pos++];
+	return true;
+}
+
+bool FrameReader::getU16(uint16_t &v)
+{
+	if (!take(2))
+		return false;
+	v = (uint16_t) (data[pos] | (data[pos + 1] << 8));
+	pos += 2;
+	return true;
+}
+
+bool FrameReader::getU32(uint32_t &v)
+{
+	if (!take(4))
+		return false;
+	v = (uint32_t) data[pos] | ((uint32_t) data[pos + 1] << 8)
+			| ((uint32_t) data[pos + 2] << 16) | ((uint32_t) data[pos + 3] << 24);
+	pos += 4;
+	return true;
+}
+
+bool FrameReader::getI32(int32_t &v)
+{
+	uint32_t u;
+	if (!getU32(u))
+		return false;
+	v = (int32_t) u;
+	return true;
+}
+
+bool FrameReader::getF64(double &v)
+{
+	uint32_t lo, hi;
+	if (!take(8))
+		return false;
+	getU32(lo);
+	getU32(hi);
+	uint64_t u = ((uint64_t) hi << 32) | lo;
+	memcpy(&v, &u, sizeof(v));
+	return true;
+}
+
+bool FrameReader::getState(bp_state &s)
+{
+	getU32(s.time);
+	getF64(s.ra);
+	getF64(s.dec);
+	getF64(s.ra_delta);
+	getF64(s.dec_delta);
+	getF64(s.ra_speed);
+	getF64(s.dec_speed);
+	getU8(s.side);
+	getU8(s.status);
+	getU8(s.ra_slew);
+	getU8(s.dec_slew);
+	return ok();
+}
+
+FrameDecoder::result_t FrameDecoder::feed(uint8_t b)
+{
+	switch (state)
+	{
+	case 0:
+		if (b == BP_SYNC0)
+			state = 1;
+		break;
+	case 1:
+		// A repeated first sync byte may still start a frame
+		state = (b == BP_SYNC1) ? 2 : ((b == BP_SYNC0) ? 1 : 0);
+		break;
+	case 2:
+		lenbytes[0] = b;
+		state = 3;
+		break;
+	case 3:
+		lenbytes[1] = b;
+		length = lenbytes[0] | (lenbytes[1] << 8);
+		if (length < BP_BODY_HEADER_SIZE || length > BP_MAX_BODY)
+		{
+			err = BP_ERR_LENGTH;
+			reset();
+			return DECODE_ERROR;
+		}
+		count = 0;
+		state = 4;
+		break;
+	case 4:
+		body[count++] = b;
+		if (count == length)
+			state = 5;
+		break;
+	case 5:
+		crc = b;
+		state = 6;
+		break;
+	case 6:
+	{
+		crc |= (uint16_t) b << 8;
+		uint16_t c = bp_crc16(lenbytes, 2);
+		c = bp_crc16(body, length, c);
+		size_t len = length;
+		reset();
+		length = len; // Keep the frame available until the next byte is fed
+		if (c != crc)
+		{
+			err = BP_ERR_CRC;
+			return DECODE_ERROR;
+		}
+		return DECODE_FRAME;
+	}
+	}
+	return DECODE_MORE;
+}
+
+FrameDecoder::result_t FrameDecoder::feed(const uint8_t *data, size_t len,
+		size_t &consumed)
+{
+	for (consumed = 0; consumed < len;)
+	{
+		result_t r = feed(data[consumed++]);
+		if (r != DECODE_MORE)
+			return r;
+	}
+	return DECODE_MORE;
+}
+
+size_t FrameDecoder::need() const
+{
+	switch (state)
+	{
+	case 0:
+	case 1:
+		return 1; // The sync bytes must be read one at a time
+	case 2:
+		return 2;
+	case 3:
+		return 1;
+	case 4:
+		return length - count + BP_TRAILER_SIZE;
+	case 5:
+		return 2;
+	default:
+		return 1;
+	}
+}
@@ -0,0 +1,299 @@
+/*
+ * BinaryProtocol.h
+ *
+ * Framed binary protocol of the mount server. This file has no dependency on mbed, so the same
+ * codec is used by the firmware and by host-side tools.
+ *
+ * Frame layout, all integers little-endian:
+ *
+ *   A5 5A | length (u16) | id (u16) | type (u8) | payload (length - 3 bytes) | crc (u16)
+ *
+ * length counts id, type and payload. The CRC is CRC-16/CCITT-FALSE over the length field and
+ * the body (id, type, payload). Angles and speeds are IEEE-754 doubles.
+ *
+ * Every request carries an id chosen by the client. The reply carries the same id and the type of
+ * the request with BP_REPLY set. Replies to commands that move the mount are sent when the motion
+ * finishes, so they can arrive after the replies to later requests.
+ */
+
+#ifndef PUSHTOGO_BINARYPROTOCOL_H_
+#define PUSHTOGO_BINARYPROTOCOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BP_SYNC0 0xA5
+#define BP_SYNC1 0x5A
+
+/// Size of sync and length fields
+#define BP_HEADER_SIZE 4
+/// Size of id and type fields
+#define BP_BODY_HEADER_SIZE 3
+/// Size of CRC
+#define BP_TRAILER_SIZE 2
+/// Max size of the body (id, type and payload)
+#define BP_MAX_BODY 256
+#define BP_MAX_PAYLOAD (BP_MAX_BODY - BP_BODY_HEADER_SIZE)
+#define BP_MAX_FRAME (BP_HEADER_SIZE + BP_MAX_BODY + BP_TRAILER_SIZE)
+
+/**
+ * Frame types
+ */
+typedef enum
+{
+	/// Text command line, payload is the line as typed in the text protocol. Output lines of the command are sent as BP_MSG_TEXT
+	BP_OP_COMMAND = 0x01,
+	/// Read the mount state. Reply: bp_state
+	BP_OP_READ = 0x02,
+	/// Go to. Payload: u8 coordinate system (BP_COORD_*), f64 ra or ra_delta, f64 dec or dec_delta
+	BP_OP_GOTO = 0x03,
+	/// Stop. Payload: u8 0 to stop all motion, 1 to stop tracking only
+	BP_OP_STOP = 0x04,
+	/// Emergency stop
+	BP_OP_ESTOP = 0x05,
+	/// Start tracking
+	BP_OP_TRACK = 0x06,
+	/// Start or stop nudging. Payload: u8 nudgedir_t
+	BP_OP_NUDGE = 0x07,
+	/// Guide. Payload: u8 guidedir_t, u16 milliseconds, optional u16 delay in ms before the pulse starts
+	BP_OP_GUIDE = 0x08,
+	/// Subscribe to telemetry. Payload: f64 rate in Hz, 0 to unsubscribe. Frames are sent as BP_MSG_TELEMETRY
+	BP_OP_SUBSCRIBE = 0x09,
+
+	/// Output text of a BP_OP_COMMAND request
+	BP_MSG_TEXT = 0x40,
+	/// Telemetry frame, id is the low 16 bits of the sequence number. Payload: u32 sequence number, bp_state
+	BP_MSG_TELEMETRY = 0x41,
+	/// Frame that could not be decoded. Payload: u8 bp_error_t
+	BP_MSG_ERROR = 0x42,
+
+	/// Set in the type of the reply to a request. Payload: i32 status, followed by the data of the request
+	BP_REPLY = 0x80
+} bp_type_t;
+
+typedef enum
+{
+	BP_COORD_EQ = 0, BP_COORD_MOUNT = 1
+} bp_coord_t;
+
+typedef enum
+{
+	BP_ERR_CRC = 1, /// CRC mismatch
+	BP_ERR_LENGTH = 2 /// Length field out of range
+} bp_error_t;
+
+/**
+ * Mount state as carried in BP_OP_READ replies and telemetry frames. Encoded field by field in
+ * declaration order: u32 time, f64 ra, f64 dec, f64 ra_delta, f64 dec_delta, f64 ra_speed,
+ * f64 dec_speed, u8 side, u8 status, u8 ra_slew, u8 dec_slew
+ */
+struct bp_state
+{
+	uint32_t time;
+	double ra;
+	double dec;
+	double ra_delta;
+	double dec_delta;
+	double ra_speed;
+	double dec_speed;
+	uint8_t side;
+	uint8_t status;
+	uint8_t ra_slew;
+	uint8_t dec_slew;
+};
+
+/**
+ * CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF)
+ */
+uint16_t bp_crc16(const uint8_t *data, size_t len, uint16_t crc = 0xFFFF);
+
+/**
+ * Builds a frame in a caller-supplied buffer. The put functions are chained, and an overflow is
+ * reported once by finish()
+ */
+class FrameWriter
+{
+public:
+	/**
+	 * @param buf Buffer of at least BP_HEADER_SIZE + BP_BODY_HEADER_SIZE + BP_TRAILER_SIZE bytes
+	 * @param size Size of the buffer, clamped to BP_MAX_FRAME
+	 */
+	FrameWriter(uint8_t *buf, size_t size, uint16_t id, uint8_t type);
+
+	FrameWriter &putU8(uint8_t v);
+	FrameWriter &putU16(uint16_t v);
+	FrameWriter &putU32(uint32_t v);
+	FrameWriter &putI32(int32_t v)
+	{
+		return putU32((uint32_t) v);
+	}
+	FrameWriter &putF64(double v);
+	FrameWriter &putBytes(const void *data, size_t len);
+	FrameWriter &putState(const bp_state &s);
+
+	/** Overwrite a 32-bit field written earlier, at payload offset pos */
+	void setI32(size_t pos, int32_t v);
+
+	/** @return number of payload bytes written so far */
+	size_t payloadSize() const
+	{
+		return pos - BP_HEADER_SIZE - BP_BODY_HEADER_SIZE;
+	}
+
+	/** @return number of payload bytes that can still be written */
+	size_t payloadSpace() const
+	{
+		return (pos + BP_TRAILER_SIZE <= size) ? size - pos - BP_TRAILER_SIZE : 0;
+	}
+
+	/**
+	 * Fill in length and CRC
+	 * @return total size of the frame, or 0 if the payload did not fit
+	 */
+	size_t finish();
+
+private:
+	uint8_t *buf;
+	size_t size;
+	size_t pos;
+	bool overflow;
+};
+
+/**
+ * Reads fields from a payload. A read past the end fails and leaves the reader in error state
+ */
+class FrameReader
+{
+public:
+	FrameReader(const uint8_t *data, size_t len) :
+			data(data), len(len), pos(0), error(false)
+	{
+	}
+
+	bool getU8(uint8_t &v);
+	bool getU16(uint16_t &v);
+	bool getU32(uint32_t &v);
+	bool getI32(int32_t &v);
+	bool getF64(double &v);
+	bool getState(bp_state &s);
+
+	/** @return number of bytes not read yet */
+	size_t remaining() const
+	{
+		return len - pos;
+	}
+
+	/** @return pointer to the bytes not read yet */
+	const uint8_t *current() const
+	{
+		return data + pos;
+	}
+
+	/** @return true if no read has failed */
+	bool ok() const
+	{
+		return !error;
+	}
+
+private:
+	const uint8_t *data;
+	size_t len;
+	size_t pos;
+	bool error;
+
+	bool take(size_t n)
+	{
+		if (error || len - pos < n)
+		{
+			error = true;
+			return false;
+		}
+		return true;
+	}
+};
+
+/**
+ * Incremental frame decoder. Bytes can be fed in chunks of any size. Garbage between frames is
+ * skipped by searching for the sync bytes.
+ */
+class FrameDecoder
+{
+public:
+	typedef enum
+	{
+		DECODE_MORE = 0, /// Frame not complete
+		DECODE_FRAME, /// A frame is available in id(), type(), payload()
+		DECODE_ERROR /// A frame was dropped, see error()
+	} result_t;
+
+	FrameDecoder()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		state = 0;
+		count = 0;
+		length = 0;
+	}
+
+	/** @return true if the decoder is waiting for the start of a frame */
+	bool idle() const
+	{
+		return state == 0;
+	}
+
+	/**
+	 * Feed one byte
+	 */
+	result_t feed(uint8_t b);
+
+	/**
+	 * Feed a chunk. Stops after the first byte that completes or drops a frame
+	 * @param consumed number of bytes used
+	 */
+	result_t feed(const uint8_t *data, size_t len, size_t &consumed);
+
+	/**
+	 * @return number of bytes that can be read without reading past the end of the current frame.
+	 * Used by blocking readers that must not consume data after the frame.
+	 */
+	size_t need() const;
+
+	uint16_t id() const
+	{
+		return (uint16_t) (body[0] | (body[1] << 8));
+	}
+
+	uint8_t type() const
+	{
+		return body[2];
+	}
+
+	const uint8_t *payload() const
+	{
+		return body + BP_BODY_HEADER_SIZE;
+	}
+
+	size_t payloadSize() const
+	{
+		return length - BP_BODY_HEADER_SIZE;
+	}
+
+	bp_error_t error() const
+	{
+		return err;
+	}
+
+private:
+	int state; /// 0, 1: sync, 2, 3: length, 4: body, 5, 6: crc
+	size_t count;
+	size_t length;
+	uint16_t crc;
+	bp_error_t err;
+	uint8_t lenbytes[2];
+	uint8_t body[BP_MAX_BODY];
+};
+
+#endif /* PUSHTOGO_BINARYPROTOCOL_H_ */
@@ -6,6 +6,7 @@
  */
 
 #include "CelestialMath.h"
+#include "AlignmentSolver.h"
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -507,372 +508,13 @@ void CelestialMath::alignTwoStars(const LocalEquatorialCoordinates star_ref[],
 	debug_if(CM_DEBUG, "Final delta: %.2e\n", residue);
 }
 
-static double jac[20][5]; // can maximally hold 10 stars
-static double jacjac[5][5]; // J'J
-static double invj[5][5];
-
-static void get_corrected_stars(const int N, LocalEquatorialCoordinates stars[],
-		const LocalEquatorialCoordinates star_ref[],
-		const LocationCoordinates& loc, const AzimuthalCoordinates& pa,
-		const LocalEquatorialCoordinates& offset, double cone)
-{
-	static Transformation t;
-	CelestialMath::getMisalignedPolarAxisTransformation(t, pa, loc);
-	for (int i = 0; i < N; i++)
-	{
-		stars[i] = CelestialMath::applyConeError(
-				CelestialMath::applyMisalignment(t, star_ref[i]), cone)
-				+ offset;
-	}
-}
-
-static void fill_jacobian(const int N, const int j,
-		LocalEquatorialCoordinates stars0[],
-		LocalEquatorialCoordinates stars1[], const double &dd)
-{
-	for (int i = 0; i < N; i++)
-	{
-		jac[i * 2][j] = (stars1[i].dec - stars0[i].dec) / dd;
-		jac[i * 2 + 1][j] = (stars1[i].ha - stars0[i].ha) / dd;
-	}
-}
-
-static double det33(int a1, int a2, int a3, int b1, int b2, int b3)
-{
-	return jacjac[a1][b1] * jacjac[a2][b2] * jacjac[a3][b3]
-			+ jacjac[a1][b2] * jacjac[a2][b3] * jacjac[a3][b1]
-			+ jacjac[a1][b3] * jacjac[a2][b1] * jacjac[a3][b2]
-			- jacjac[a1][b1] * jacjac[a2][b3] * jacjac[a3][b2]
-			- jacjac[a1][b2] * jacjac[a2][b1] * jacjac[a3][b3]
-			- jacjac[a1][b3] * jacjac[a2][b2] * jacjac[a3][b1];
-}
-
-static double det44(int a1, int a2, int a3, int a4, int b1, int b2, int b3,
-		int b4)
-{
-	return jacjac[a1][b1] * det33(a2, a3, a4, b2, b3, b4)
-			- jacjac[a1][b2] * det33(a2, a3, a4, b1, b3, b4)
-			+ jacjac[a1][b3] * det33(a2, a3, a4, b1, b2, b4)
-			- jacjac[a1][b4] * det33(a2, a3, a4, b1, b2, b3);
-}
-
-static void invert()
-{
-	invj[0][0] = det44(1, 2, 3, 4, 1, 2, 3, 4);
-	invj[1][0] = -det44(1, 2, 3, 4, 0, 2, 3, 4);
-	invj[2][0] = det44(1, 2, 3, 4, 0, 1, 3, 4);
-	invj[3][0] = -det44(1, 2, 3, 4, 0, 1, 2, 4);
-	invj[4][0] = det44(1, 2, 3, 4, 0, 1, 2, 3);
-
-	double det55 = invj[0][0] * jacjac[0][0] + invj[1][0] * jacjac[0][1]
-			+ invj[2][0] * jacjac[0][2] + invj[3][0] * jacjac[0][3]
-			+ invj[4][0] * jacjac[0][4];
-	double idet55 = 1.0 / det55;
-
-	invj[0][0] *= idet55;
-	invj[1][0] *= idet55;
-	invj[2][0] *= idet55;
-	invj[3][0] *= idet55;
-	invj[4][0] *= idet55;
-
-	invj[0][1] = -det44(0, 2, 3, 4, 1, 2, 3, 4) * idet55;
-	invj[1][1] = det44(0, 2, 3, 4, 0, 2, 3, 4) * idet55;
-	invj[2][1] = -det44(0, 2, 3, 4, 0, 1, 3, 4) * idet55;
-	invj[3][1] = det44(0, 2, 3, 4, 0, 1, 2, 4) * idet55;
-	invj[4][1] = -det44(0, 2, 3, 4, 0, 1, 2, 3) * idet55;
-
-	invj[0][2] = det44(0, 1, 3, 4, 1, 2, 3, 4) * idet55;
-	invj[1][2] = -det44(0, 1, 3, 4, 0, 2, 3, 4) * idet55;
-	invj[2][2] = det44(0, 1, 3, 4, 0, 1, 3, 4) * idet55;
-	invj[3][2] = -det44(0, 1, 3, 4, 0, 1, 2, 4) * idet55;
-	invj[4][2] = det44(0, 1, 3, 4, 0, 1, 2, 3) * idet55;
-
-	invj[0][3] = -det44(0, 1, 2, 4, 1, 2, 3, 4) * idet55;
-	invj[1][3] = det44(0, 1, 2, 4, 0, 2, 3, 4) * idet55;
-	invj[2][3] = -det44(0, 1, 2, 4, 0, 1, 3, 4) * idet55;
-	invj[3][3] = det44(0, 1, 2, 4, 0, 1, 2, 4) * idet55;
-	invj[4][3] = -det44(0, 1, 2, 4, 0, 1, 2, 3) * idet55;
-
-	invj[0][4] = det44(0, 1, 2, 3, 1, 2, 3, 4) * idet55;
-	invj[1][4] = -det44(0, 1, 2, 3, 0, 2, 3, 4) * idet55;
-	invj[2][4] = det44(0, 1, 2, 3, 0, 1, 3, 4) * idet55;
-	invj[3][4] = -det44(0, 1, 2, 3, 0, 1, 2, 4) * idet55;
-	invj[4][4] = det44(0, 1, 2, 3, 0, 1, 2, 3) * idet55;
-}
-
 static inline double sqr(double x)
 {
 	return x * x;
 }
 
-void CelestialMath::alignNStars(const int N,
-		const LocalEquatorialCoordinates star_ref[],
-		const LocalEquatorialCoordinates star_meas[],
-		const LocationCoordinates& loc, AzimuthalCoordinates& pa,
-		LocalEquatorialCoordinates& offset, double& cone)
-{
-	if (N == 2)
-	{
-		alignTwoStars(star_ref, star_meas, loc, pa, offset);
-		cone = 0;
-		return;
-	}
-	if (N <= 1)
-	{
-		return;
-	}
-
-// Assuming the cone error is not huge, we should be fairly close to the local minimum
-	int i = 0;
-	double residue = 1e10;
-	LocalEquatorialCoordinates stars0[N], stars1[N];
-	double dp[5];
-	double f[20];
-
-	while (i++ < MAX_ITERATION_OPTIMIZATION && residue > tol)
-	{
-		// Calulate Jacobian
-		get_corrected_stars(N, stars0, star_ref, loc, pa, offset, cone);
-		/*Vary pa.alt*/
-		get_corrected_stars(N, stars1, star_ref, loc,
-				AzimuthalCoordinates(pa.alt + delta, pa.azi), offset, cone);
-		fill_jacobian(N, 0, stars0, stars1, delta);
-		/*Vary pa.azi*/
-		get_corrected_stars(N, stars1, star_ref, loc,
-				AzimuthalCoordinates(pa.alt, pa.azi + delta), offset, cone);
-		fill_jacobian(N, 1, stars0, stars1, delta);
-		/*Vary offset.dec*/
-		get_corrected_stars(N, stars1, star_ref, loc, pa,
-				LocalEquatorialCoordinates(offset.dec + delta, offset.ha),
-				cone);
-		fill_jacobian(N, 2, stars0, stars1, delta);
-		/*Vary offset.ha*/
-		get_corrected_stars(N, stars1, star_ref, loc, pa,
-				LocalEquatorialCoordinates(offset.dec, offset.ha + delta),
-				cone);
-		fill_jacobian(N, 3, stars0, stars1, delta);
-		/*Vary cone*/
-		get_corrected_stars(N, stars1, star_ref, loc, pa, offset, cone + delta);
-		fill_jacobian(N, 4, stars0, stars1, delta);
-
-		// The Jacobian is now filled. It is 2*N rows and 5 columns
-		// Gauss-Newton method: x_n - x_(n-1) = - (J'J)^-1J' * f_(n-1)
-		// 1. Matrix multiplication
-		int p, q, r;
-
-		for (p = 0; p < 5; p++)
-		{
-			for (q = 0; q < 5; q++)
-			{
-				double s = 0;
-				for (r = 0; r < 2 * N; r++)
-					s += jac[r][p] * jac[r][q];
-				jacjac[p][q] = s;
-			}
-		}
-
-		// 2. Matrix inversion
-		invert();
-
-		// 3. Calculate f_(n-1)
-		double newresidue = 0;
-		for (p = 0; p < N; p++)
-		{
-			f[2 * p] = stars0[p].dec - star_meas[p].dec;
-			f[2 * p + 1] = stars0[p].ha - star_meas[p].ha;
-			newresidue += sqr(f[2 * p]) + sqr(f[2 * p + 1]);
-		}
-		newresidue = sqrt(newresidue);
-		// 4. Matrix multiplication
-		for (p = 0; p < 5; p++)
-		{
-			double s = 0;
-			for (q = 0; q < 5; q++)
-			{
-				for (r = 0; r < 2 * N; r++)
-				{
-					s += invj[p][q] * jac[r][q] * f[r];
-				}
-			}
-			dp[p] = -s;
-		}
-		// 5. Apply the correction
-		pa.alt += dp[0];
-		pa.azi += dp[1];
-		offset.dec += dp[2];
-		offset.ha += dp[3];
-		cone += dp[4];
-
-		if (newresidue >= residue - tol)
-		{
-			debug_if(CM_DEBUG, "Converged.\n");
-			break;
-		}
-		else
-		{
-			residue = newresidue;
-		}
-		debug_if(CM_DEBUG, "Iteration %i, %f\t%f\t%f\t%f\t%f\tr=%f\n", i,
-				pa.alt, pa.azi, offset.dec, offset.ha, cone, residue);
-	}
-
-	debug_if(CM_DEBUG, "Final result: %f\t%f\t%f\t%f\t%f\tr=%f\n", pa.alt,
-			pa.azi, offset.dec, offset.ha, cone, residue);
-}
-
-static void get_corrected_stars(const int N, MountCoordinates stars[],
-		const LocalEquatorialCoordinates star_ref[],
-		const MountCoordinates star_meas[], const LocationCoordinates& loc,
-		const AzimuthalCoordinates& pa, const IndexOffset& offset, double cone)
-{
-	static Transformation t;
-	CelestialMath::getMisalignedPolarAxisTransformation(t, pa, loc);
-	for (int i = 0; i < N; i++)
-	{
-		// Misalign, apply cone error, and transform to mount coordinates using the same pier side as in the measured stars
-		stars[i] = CelestialMath::localEquatorialToMount(
-				CelestialMath::applyConeError(
-						CelestialMath::applyMisalignment(t, star_ref[i]), cone),
-				star_meas[i].side) + offset;
-	}
-}
-
-static void fill_jacobian(const int N, const int j, MountCoordinates stars0[],
-		MountCoordinates stars1[], const double &dd)
-{
-	for (int i = 0; i < N; i++)
-	{
-		jac[i * 2][j] = (stars1[i].dec_delta - stars0[i].dec_delta) / dd;
-		jac[i * 2 + 1][j] = (stars1[i].ra_delta - stars0[i].ra_delta) / dd;
-	}
-}
-
-void CelestialMath::alignNStars(const int N,
-		const LocalEquatorialCoordinates star_ref[],
-		const MountCoordinates star_meas[], const LocationCoordinates& loc,
-		AzimuthalCoordinates& pa, IndexOffset& offset, double& cone,
-		bool &diverge)
-{
-	if (N == 2)
-	{
-		alignTwoStars(star_ref, star_meas, loc, pa, offset, diverge);
-		cone = 0;
-		return;
-	}
-	if (N <= 1)
-	{
-		return;
-	}
-
-// Assuming the cone error is not huge, we should be fairly close to the local minimum
-	int i = 0;
-	double residue = 1e10;
-	MountCoordinates stars0[N], stars1[N];
-	double dp[5];
-	double f[20];
-
-	diverge = true;
-
-	while (i++ < MAX_ITERATION_OPTIMIZATION && residue > tol)
-	{
-		// Calulate Jacobian
-		get_corrected_stars(N, stars0, star_ref, star_meas, loc, pa, offset,
-				cone);
-		/*Vary pa.alt*/
-		get_corrected_stars(N, stars1, star_ref, star_meas, loc,
-				AzimuthalCoordinates(pa.alt + delta, pa.azi), offset, cone);
-		fill_jacobian(N, 0, stars0, stars1, delta);
-		/*Vary pa.azi*/
-		get_corrected_stars(N, stars1, star_ref, star_meas, loc,
-				AzimuthalCoordinates(pa.alt, pa.azi + delta), offset, cone);
-		fill_jacobian(N, 1, stars0, stars1, delta);
-		/*Vary offset.dec*/
-		get_corrected_stars(N, stars1, star_ref, star_meas, loc, pa,
-				IndexOffset(offset.dec_off + delta, offset.ra_off), cone);
-		fill_jacobian(N, 2, stars0, stars1, delta);
-		/*Vary offset.ha*/
-		get_corrected_stars(N, stars1, star_ref, star_meas, loc, pa,
-				IndexOffset(offset.dec_off, offset.ra_off + delta), cone);
-		fill_jacobian(N, 3, stars0, stars1, delta);
-		/*Vary cone*/
-		get_corrected_stars(N, stars1, star_ref, star_meas, loc, pa, offset,
-				cone + delta);
-		fill_jacobian(N, 4, stars0, stars1, delta);
-
-		// The Jacobian is now filled. It is 2*N rows and 5 columns
-		// Gauss-Newton method: x_n - x_(n-1) = - (J'J)^-1J' * f_(n-1)
-		// 1. Matrix multiplication
-		int p, q, r;
-
-		for (p = 0; p < 5; p++)
-		{
-			for (q = 0; q < 5; q++)
-			{
-				double s = 0;
-				for (r = 0; r < 2 * N; r++)
-					s += jac[r][p] * jac[r][q];
-				jacjac[p][q] = s;
-			}
-		}
-
-		// 2. Matrix inversion
-		invert();
-
-		// 3. Calculate f_(n-1)
-		double newresidue = 0;
-		for (p = 0; p < N; p++)
-		{
-			f[2 * p] = stars0[p].dec_delta - star_meas[p].dec_delta;
-			f[2 * p + 1] = stars0[p].ra_delta - star_meas[p].ra_delta;
-			newresidue += sqr(f[2 * p]) + sqr(f[2 * p + 1]);
-		}
-		newresidue = sqrt(newresidue);
-		// 4. Matrix multiplication
-		for (p = 0; p < 5; p++)
-		{
-			double s = 0;
-			for (q = 0; q < 5; q++)
-			{
-				for (r = 0; r < 2 * N; r++)
-				{
-					s += invj[p][q] * jac[r][q] * f[r];
-				}
-			}
-			dp[p] = -s;
-		}
-		// 5. Apply the correction
-		pa.alt += dp[0];
-		pa.azi += dp[1];
-		offset.dec_off += dp[2];
-		offset.ra_off += dp[3];
-		cone += dp[4];
-
-		if (newresidue >= residue - tol)
-		{
-			debug_if(CM_DEBUG, "Converged.\n");
-			diverge = false;
-			break;
-		}
-		else
-		{
-			residue = newresidue;
-		}
-		debug_if(CM_DEBUG, "Iteration %i, %f\t%f\t%f\t%f\t%f\tr=%f\n", i,
-				pa.alt, pa.azi, offset.dec_off, offset.ra_off, cone, residue);
-	}
-
-	if (diverge)
-	{
-		debug_if(CM_DEBUG, "Diverged.\n");
-	}
-
-	debug_if(CM_DEBUG, "Final result: %f\t%f\t%f\t%f\t%f\tr=%f\n", pa.alt,
-			pa.azi, offset.dec_off, offset.ra_off, cone, residue);
-
-}
-
 EqCalibration CelestialMath::align(const int N, const AlignmentStar stars[],
-		const LocationCoordinates &loc, bool &diverge)
+		const LocationCoordinates &loc, bool &diverge, int terms)
 {
 	EqCalibration calib;
 	calib.pa.alt = loc.lat;
@@ -884,22 +526,30 @@ EqCalibration CelestialMath::align(const int N, const AlignmentStar stars[],
 	}
 	else
 	{
-		LocalEquatorialCoordinates star_ref[N];
-		MountCoordinates star_meas[N];
-		for (int i = 0; i < N; i++)
+		// Start from the two-star solution of the first two stars
+		LocalEquatorialCoordinates star_ref[2] =
+		{ stars[0].star_ref_local(loc), stars[1].star_ref_local(loc) };
+		MountCoordinates star_meas[2] =
+		{ stars[0].star_meas, stars[1].star_meas };
+		alignTwoStars(star_ref, star_meas, loc, calib.pa, calib.offset,
+				diverge);
+		if (N > 2)
 		{
-			star_ref[i] = stars[i].star_ref_local(loc);
-			star_meas[i] = stars[i].star_meas;
-		}
-		if (N == 2)
-		{
-			alignTwoStars(star_ref, star_meas, loc, calib.pa, calib.offset,
-					diverge);
-		}
-		else
-		{
-			alignNStars(N, star_ref, star_meas, loc, calib.pa, calib.offset,
-					calib.cone, diverge);
+			if (diverge)
+			{
+				calib.pa = AzimuthalCoordinates(loc.lat, 0);
+				calib.offset = IndexOffset(0, 0);
+			}
+			// Fit the basic model first, then the optional terms from there if there are enough stars
+			alignNStars(N, stars, loc, calib, 0, diverge);
+			if (!diverge && terms && N >= PM_MIN_STARS_TERMS)
+			{
+				EqCalibration full = calib;
+				alignNStars(N, stars, loc, full, terms, diverge);
+				if (!diverge)
+					calib = full;
+				diverge = false;
+			}
 		}
 	}
 	calib.error = CelestialMath::alignmentError(N, stars, calib, loc);
@@ -1010,25 +660,740 @@ double CelestialMath::kingRate(EquatorialCoordinates eq,
 	return 6.0 / kingMpD;
 }
 
+double CelestialMath::refraction(double alt)
+{
+	if (alt < -1)
+		alt = -1; // Below the horizon, the value only has to be continuous
+	// In arcmin. The constant makes it 0 at the zenith
+	double r = 1.02 / tan((alt + 10.3 / (alt + 5.11)) * DEGREE) + 0.0019279;
+	return (r > 0) ? r / 60.0 : 0;
+}
+
+EquatorialCoordinates CelestialMath::applyRefraction(
+		const EquatorialCoordinates &eq, time_t time,
+		const LocationCoordinates &loc)
+{
+	LocalEquatorialCoordinates leq = equatorialToLocalEquatorial(eq, time, loc);
+	AzimuthalCoordinates ac = localEquatorialToAzimuthal(leq, loc);
+	ac.alt += refraction(ac.alt);
+	if (ac.alt > 90)
+		ac.alt = 90;
+	return localEquatorialToEquatorial(azimuthalToLocalEquatorial(ac, loc),
+			time, loc);
+}
+
+/*Math functions in the precision of the mount model*/
+static inline double m_sin(double x)
+{
+	return sin(x);
+}
+static inline float m_sin(float x)
+{
+	return sinf(x);
+}
+static inline double m_cos(double x)
+{
+	return cos(x);
+}
+static inline float m_cos(float x)
+{
+	return cosf(x);
+}
+static inline double m_tan(double x)
+{
+	return tan(x);
+}
+static inline float m_tan(float x)
+{
+	return tanf(x);
+}
+static inline double m_asin(double x)
+{
+	return asin((x > 1) ? 1 : ((x < -1) ? -1 : x));
+}
+static inline float m_asin(float x)
+{
+	return asinf((x > 1.0f) ? 1.0f : ((x < -1.0f) ? -1.0f : x));
+}
+static inline double m_sqrt(double x)
+{
+	return sqrt(x);
+}
+static inline float m_sqrt(float x)
+{
+	return sqrtf(x);
+}
+static inline double m_atan2(double y, double x)
+{
+	return atan2(y, x);
+}
+static inline float m_atan2(float y, float x)
+{
+	return atan2f(y, x);
+}
+static inline double m_remainder(double x, double y)
+{
+	return remainder(x, y);
+}
+static inline float m_remainder(float x, float y)
+{
+	return remainderf(x, y);
+}
+
+/**
+ * Corrections of the optional pointing model terms at (ha, dec), see pmterm_t
+ * @param west Pier side is west
+ */
+template<typename T>
+static inline void model_terms(const MountModel::Coefficients<T> &c, T ha,
+		T dec, bool west, T &dha, T &ddec)
+{
+	const T D = (T) DEGREE;
+	T sh = m_sin(ha * D), ch = m_cos(ha * D);
+	T sd = m_sin(dec * D), cd = m_cos(dec * D);
+	if (cd < (T) 1e-3)
+		cd = (T) 1e-3; // The terms diverge at the pole
+	T td = sd / cd;
+	dha = (west ? -c.np : c.np) * td + c.tf * c.cos_lat * sh / cd
+			- c.daf * (c.cos_lat * ch + c.sin_lat * td);
+	ddec = c.tf * (c.cos_lat * ch * sd - c.sin_lat * cd) + c.fo * ch;
+}
+
+/**
+ * Local equatorial to mount coordinates, see MountModel::localToMount
+ * @param force_side Use side_in even if it is PIER_SIDE_EAST, which has the same value as PIER_SIDE_AUTO
+ */
+template<typename T>
+static inline void model_forward(const MountModel::Coefficients<T> &c, T ha,
+		T dec, pierside_t side_in, T &ra_delta, T &dec_delta,
+		pierside_t &side_out, bool force_side = false)
+{
+	const T D = (T) DEGREE, R = (T) RADIAN;
+	T c1 = m_cos(dec * D), s1 = m_sin(dec * D);
+	T c2 = m_cos(ha * D), s2 = m_sin(ha * D);
+	T x = c1 * c2, y = -c1 * s2, z = s1;
+	// Misalignment (same as applyMisalignment)
+	T X = x * c.m[0][0] + y * c.m[1][0] + z * c.m[2][0];
+	T Y = x * c.m[0][1] + y * c.m[1][1] + z * c.m[2][1];
+	T Z = x * c.m[0][2] + y * c.m[1][2] + z * c.m[2][2];
+	// Cone error (same as applyConeError)
+	dec = m_asin(Z) * R;
+	ha = m_atan2(-Y, X) * R;
+	if (c.tan_cone != 0)
+	{
+		dec = m_asin(Z / c.cos_cone) * R;
+		ha -= m_asin(Z / m_sqrt(X * X + Y * Y) * c.tan_cone) * R; // tan(dec) without trig
+	}
+	// To mount coordinates and offset (same as localEquatorialToMount)
+	bool west = side_in == PIER_SIDE_WEST
+			|| (!force_side && side_in == PIER_SIDE_AUTO
+					&& (ha = m_remainder(ha, (T) 360)) > 0);
+	if (c.terms)
+	{
+		T dha, ddec;
+		model_terms(c, ha, dec, west, dha, ddec);
+		ha += dha;
+		dec += ddec;
+	}
+	if (west)
+	{
+		side_out = PIER_SIDE_WEST;
+		dec_delta = m_remainder((T) 90 - dec + c.dec_off, (T) 360);
+		ra_delta = m_remainder(ha - (T) 90 + c.ra_off, (T) 360);
+	}
+	else
+	{
+		side_out = PIER_SIDE_EAST;
+		dec_delta = m_remainder(dec - (T) 90 + c.dec_off, (T) 360);
+		ra_delta = m_remainder(ha + (T) 90 + c.ra_off, (T) 360);
+	}
+}
+
+/**
+ * Mount to local equatorial coordinates, see MountModel::mountToLocal
+ */
+template<typename T>
+static inline void model_inverse(const MountModel::Coefficients<T> &c,
+		T ra_delta, T dec_delta, pierside_t side, T &ha, T &dec)
+{
+	const T D = (T) DEGREE, R = (T) RADIAN;
+	// Offset and mount coordinates (same as mountToLocalEquatorial)
+	dec_delta = m_remainder(dec_delta - c.dec_off, (T) 360);
+	ra_delta = m_remainder(ra_delta - c.ra_off, (T) 360);
+	bool west = side == PIER_SIDE_WEST
+			|| (side == PIER_SIDE_AUTO && dec_delta > 0);
+	if (west)
+	{
+		ha = ra_delta + (T) 90;
+		dec = (T) 90 - dec_delta;
+	}
+	else
+	{
+		ha = ra_delta - (T) 90;
+		dec = (T) 90 + dec_delta;
+	}
+	if (c.terms)
+	{
+		// The corrections are small, a fixed-point iteration converges quickly
+		T ha0 = ha, dec0 = dec;
+		for (int i = 0; i < 3; i++)
+		{
+			T dha, ddec;
+			model_terms(c, ha, dec, west, dha, ddec);
+			ha = ha0 - dha;
+			dec = dec0 - ddec;
+		}
+	}
+	// Cone error (same as deapplyConeError)
+	if (c.tan_cone != 0)
+	{
+		T lmd = m_asin(m_sin(dec * D) * c.cos_cone) * R;
+		if (lmd < (T) 90 - (T) eps && lmd > (T) -90 + (T) eps)
+		{
+			ha += m_asin(c.tan_cone * m_tan(lmd * D)) * R;
+			dec = lmd;
+		}
+	}
+	// Misalignment, with the transposed rotation (same as deapplyMisalignment)
+	T c1 = m_cos(dec * D), s1 = m_sin(dec * D);
+	T c2 = m_cos(ha * D), s2 = m_sin(ha * D);
+	T x = c1 * c2, y = -c1 * s2, z = s1;
+	T X = c.m[0][0] * x + c.m[0][1] * y + c.m[0][2] * z;
+	T Y = c.m[1][0] * x + c.m[1][1] * y + c.m[1][2] * z;
+	T Z = c.m[2][0] * x + c.m[2][1] * y + c.m[2][2] * z;
+	dec = m_asin(Z) * R;
+	ha = m_atan2(-Y, X) * R;
+}
+
+template<typename T>
+static void model_coefficients(MountModel::Coefficients<T> &c,
+		const Transformation &t, const EqCalibration &calib,
+		const LocationCoordinates &loc)
+{
+	c.m[0][0] = (T) t.a11;
+	c.m[0][1] = (T) t.a12;
+	c.m[0][2] = (T) t.a13;
+	c.m[1][0] = (T) t.a21;
+	c.m[1][1] = (T) t.a22;
+	c.m[1][2] = (T) t.a23;
+	c.m[2][0] = (T) t.a31;
+	c.m[2][1] = (T) t.a32;
+	c.m[2][2] = (T) t.a33;
+	c.cos_cone = (T) cos(calib.cone * DEGREE);
+	c.tan_cone = (T) tan(calib.cone * DEGREE);
+	c.dec_off = (T) calib.offset.dec_off;
+	c.ra_off = (T) calib.offset.ra_off;
+	c.np = (T) calib.np;
+	c.tf = (T) calib.tf;
+	c.daf = (T) calib.daf;
+	c.fo = (T) calib.fo;
+	c.sin_lat = (T) sin(loc.lat * DEGREE);
+	c.cos_lat = (T) cos(loc.lat * DEGREE);
+	c.terms = calib.terms() != 0;
+}
+
+template<typename T>
+static void model_to_mount(const MountModel::Coefficients<T> &c, int n,
+		const T ra[], const T dec[], T ra_delta[], T dec_delta[],
+		pierside_t side[], double lst, pierside_t side_in)
+{
+	for (int i = 0; i < n; i++)
+	{
+		pierside_t s;
+		model_forward(c, m_remainder((T) lst - ra[i], (T) 360), dec[i],
+				side_in, ra_delta[i], dec_delta[i], s);
+		if (side)
+			side[i] = s;
+	}
+}
+
+template<typename T>
+static void model_to_equatorial(const MountModel::Coefficients<T> &c, int n,
+		const T ra_delta[], const T dec_delta[], const pierside_t side[],
+		T ra[], T dec[], double lst)
+{
+	for (int i = 0; i < n; i++)
+	{
+		T ha;
+		model_inverse(c, ra_delta[i], dec_delta[i],
+				side ? side[i] : PIER_SIDE_AUTO, ha, dec[i]);
+		ra[i] = m_remainder((T) lst - ha, (T) 360);
+	}
+}
+
+MountModel::MountModel()
+{
+	update(EqCalibration(), LocationCoordinates());
+}
+
+MountModel::MountModel(const EqCalibration &calib,
+		const LocationCoordinates &loc)
+{
+	update(calib, loc);
+}
+
+void MountModel::update(const EqCalibration &calib,
+		const LocationCoordinates &loc)
+{
+	this->calib = calib;
+	this->loc = loc;
+	Transformation t;
+	CelestialMath::getMisalignedPolarAxisTransformation(t, calib.pa, loc);
+	model_coefficients(cd, t, calib, loc);
+	model_coefficients(cf, t, calib, loc);
+}
+
+MountCoordinates MountModel::localToMount(const LocalEquatorialCoordinates &leq,
+		pierside_t side) const
+{
+	MountCoordinates mc;
+	model_forward(cd, leq.ha, leq.dec, side, mc.ra_delta, mc.dec_delta,
+			mc.side);
+	return mc;
+}
+
+LocalEquatorialCoordinates MountModel::mountToLocal(
+		const MountCoordinates &mc) const
+{
+	LocalEquatorialCoordinates leq;
+	model_inverse(cd, mc.ra_delta, mc.dec_delta, mc.side, leq.ha, leq.dec);
+	return leq;
+}
+
+MountCoordinates MountModel::toMount(const EquatorialCoordinates &eq,
+		time_t timestamp, pierside_t side) const
+{
+	return localToMount(
+			CelestialMath::equatorialToLocalEquatorial(eq, timestamp, loc),
+			side);
+}
+
+EquatorialCoordinates MountModel::toEquatorial(const MountCoordinates &mc,
+		time_t timestamp) const
+{
+	return CelestialMath::localEquatorialToEquatorial(mountToLocal(mc),
+			timestamp, loc);
+}
+
+void MountModel::toMount(int n, const EquatorialCoordinates eq[],
+		MountCoordinates out[], time_t timestamp, pierside_t side) const
+{
+	double lst = CelestialMath::getLocalSiderealTime(timestamp, loc);
+	for (int i = 0; i < n; i++)
+	{
+		double ha = remainder(lst - eq[i].ra, 360.0), dec = eq[i].dec;
+		model_forward(cd, ha, dec, side, out[i].ra_delta, out[i].dec_delta,
+				out[i].side);
+	}
+}
+
+void MountModel::toEquatorial(int n, const MountCoordinates mc[],
+		EquatorialCoordinates out[], time_t timestamp) const
+{
+	double lst = CelestialMath::getLocalSiderealTime(timestamp, loc);
+	for (int i = 0; i < n; i++)
+	{
+		double ha, dec;
+		model_inverse(cd, mc[i].ra_delta, mc[i].dec_delta, mc[i].side, ha,
+				dec);
+		out[i].dec = dec;
+		out[i].ra = remainder(lst - ha, 360.0);
+	}
+}
+
+void MountModel::toMount(int n, const double ra[], const double dec[],
+		double ra_delta[], double dec_delta[], pierside_t side[],
+		time_t timestamp, pierside_t side_in) const
+{
+	model_to_mount(cd, n, ra, dec, ra_delta, dec_delta, side,
+			CelestialMath::getLocalSiderealTime(timestamp, loc), side_in);
+}
+
+void MountModel::toMount(int n, const float ra[], const float dec[],
+		float ra_delta[], float dec_delta[], pierside_t side[],
+		time_t timestamp, pierside_t side_in) const
+{
+	model_to_mount(cf, n, ra, dec, ra_delta, dec_delta, side,
+			CelestialMath::getLocalSiderealTime(timestamp, loc), side_in);
+}
+
+void MountModel::toEquatorial(int n, const double ra_delta[],
+		const double dec_delta[], const pierside_t side[], double ra[],
+		double dec[], time_t timestamp) const
+{
+	model_to_equatorial(cd, n, ra_delta, dec_delta, side, ra, dec,
+			CelestialMath::getLocalSiderealTime(timestamp, loc));
+}
+
+void MountModel::toEquatorial(int n, const float ra_delta[],
+		const float dec_delta[], const pierside_t side[], float ra[],
+		float dec[], time_t timestamp) const
+{
+	model_to_equatorial(cf, n, ra_delta, dec_delta, side, ra, dec,
+			CelestialMath::getLocalSiderealTime(timestamp, loc));
+}
+
+/**
+ * N-star alignment in local equatorial coordinates.
+ * Parameters: pa.alt, pa.azi, offset.dec, offset.ha, cone
+ */
+class LocalAlignmentProblem: public AlignmentProblem
+{
+public:
+	LocalAlignmentProblem(int N, const LocalEquatorialCoordinates star_ref[],
+			const LocalEquatorialCoordinates star_meas[],
+			const LocationCoordinates &loc) :
+			N(N), star_ref(star_ref), star_meas(star_meas), loc(loc)
+	{
+	}
+
+	virtual int size() const
+	{
+		return N;
+	}
+
+	virtual void prepare(int slot, const double p[])
+	{
+		CelestialMath::getMisalignedPolarAxisTransformation(t[slot],
+				AzimuthalCoordinates(p[0], p[1]), loc);
+		offset[slot] = LocalEquatorialCoordinates(p[2], p[3]);
+		cone[slot] = p[4];
+	}
+
+	virtual void residual(int slot, int i, double r[2])
+	{
+		LocalEquatorialCoordinates star = (CelestialMath::applyConeError(
+				CelestialMath::applyMisalignment(t[slot], star_ref[i]),
+				cone[slot]) + offset[slot]) - star_meas[i];
+		r[0] = star.dec;
+		r[1] = star.ha * cos(star_meas[i].dec * DEGREE);
+	}
+
+private:
+	int N;
+	const LocalEquatorialCoordinates *star_ref;
+	const LocalEquatorialCoordinates *star_meas;
+	const LocationCoordinates &loc;
+	Transformation t[AS_MAX_PARAM + 1];
+	LocalEquatorialCoordinates offset[AS_MAX_PARAM + 1];
+	double cone[AS_MAX_PARAM + 1];
+};
+
+/**
+ * Parameter vector of the pointing model: pa.alt, pa.azi, offset.dec_off, offset.ra_off, cone,
+ * followed by the optional terms in the mask, in the order of pmterm_t
+ * @return number of parameters
+ */
+static int calib_to_params(const EqCalibration &calib, int terms, double p[])
+{
+	int n = 0;
+	p[n++] = calib.pa.alt;
+	p[n++] = calib.pa.azi;
+	p[n++] = calib.offset.dec_off;
+	p[n++] = calib.offset.ra_off;
+	p[n++] = calib.cone;
+	if (terms & PM_TERM_NP)
+		p[n++] = calib.np;
+	if (terms & PM_TERM_TF)
+		p[n++] = calib.tf;
+	if (terms & PM_TERM_DAF)
+		p[n++] = calib.daf;
+	if (terms & PM_TERM_FO)
+		p[n++] = calib.fo;
+	return n;
+}
+
+static void params_to_calib(const double p[], int terms, EqCalibration &calib)
+{
+	int n = 0;
+	calib.pa.alt = p[n++];
+	calib.pa.azi = p[n++];
+	calib.offset.dec_off = p[n++];
+	calib.offset.ra_off = p[n++];
+	calib.cone = p[n++];
+	calib.np = (terms & PM_TERM_NP) ? p[n++] : 0;
+	calib.tf = (terms & PM_TERM_TF) ? p[n++] : 0;
+	calib.daf = (terms & PM_TERM_DAF) ? p[n++] : 0;
+	calib.fo = (terms & PM_TERM_FO) ? p[n++] : 0;
+}
+
+/**
+ * N-star alignment in mount coordinates, using the same pier side as the measured stars.
+ * The reference stars are given either in local equatorial coordinates, or as AlignmentStars
+ * converted on the fly so no array of N elements has to be built.
+ * Parameters: see calib_to_params
+ */
+class MountAlignmentProblem: public AlignmentProblem
+{
+public:
+	MountAlignmentProblem(int N, const LocalEquatorialCoordinates star_ref[],
+			const MountCoordinates star_meas[], const LocationCoordinates &loc) :
+			N(N), star_ref(star_ref), star_meas(star_meas), stars(NULL), loc(
+					loc), terms(0), cached(-1)
+	{
+	}
+
+	MountAlignmentProblem(int N, const AlignmentStar stars[],
+			const LocationCoordinates &loc, int terms) :
+			N(N), star_ref(NULL), star_meas(NULL), stars(stars), loc(loc), terms(
+					terms), cached(-1)
+	{
+	}
+
+	virtual int size() const
+	{
+		return N;
+	}
+
+	virtual void prepare(int slot, const double p[])
+	{
+		EqCalibration calib;
+		params_to_calib(p, terms, calib);
+		Transformation t;
+		CelestialMath::getMisalignedPolarAxisTransformation(t, calib.pa, loc);
+		model_coefficients(c[slot], t, calib, loc);
+		// Keep evaluating the terms when they cross 0
+		c[slot].terms = (terms != 0);
+	}
+
+	virtual void residual(int slot, int i, double r[2])
+	{
+		error(slot, i, r);
+		// The RA error is scaled to an angle on the sky, so stars close to the pole don't dominate
+		r[1] *= cosdec;
+	}
+
+	/**
+	 * Unscaled difference between model and measurement
+	 */
+	void error(int slot, int i, double r[2])
+	{
+		if (i != cached)
+		{
+			// The same star is evaluated in all slots in a row
+			ref = stars ? stars[i].star_ref_local(loc) : star_ref[i];
+			meas = stars ? stars[i].star_meas : star_meas[i];
+			cosdec = cos(ref.dec * DEGREE);
+			cached = i;
+		}
+		// Measured positions don't tell PIER_SIDE_EAST from PIER_SIDE_AUTO, use the side they were measured on, as mountToLocalEquatorial does
+		pierside_t side =
+				(meas.side == PIER_SIDE_WEST
+						|| meas.dec_delta - c[slot].dec_off > 0) ?
+						PIER_SIDE_WEST : PIER_SIDE_EAST;
+		MountCoordinates mc;
+		model_forward(c[slot], ref.ha, ref.dec, side, mc.ra_delta,
+				mc.dec_delta, mc.side, true);
+		r[0] = remainder(mc.dec_delta - meas.dec_delta, 360.0);
+		r[1] = remainder(mc.ra_delta - meas.ra_delta, 360.0);
+	}
+
+private:
+	int N;
+	const LocalEquatorialCoordinates *star_ref;
+	const MountCoordinates *star_meas;
+	const AlignmentStar *stars;
+	const LocationCoordinates &loc;
+	int terms;
+	MountModel::Coefficients<double> c[AS_MAX_PARAM + 1];
+	int cached;
+	LocalEquatorialCoordinates ref;
+	MountCoordinates meas;
+	double cosdec;
+};
+
+void CelestialMath::alignNStars(const int N,
+		const LocalEquatorialCoordinates star_ref[],
+		const LocalEquatorialCoordinates star_meas[],
+		const LocationCoordinates& loc, AzimuthalCoordinates& pa,
+		LocalEquatorialCoordinates& offset, double& cone)
+{
+	if (N == 2)
+	{
+		alignTwoStars(star_ref, star_meas, loc, pa, offset);
+		cone = 0;
+		return;
+	}
+	if (N <= 1)
+	{
+		return;
+	}
+
+	LocalAlignmentProblem problem(N, star_ref, star_meas, loc);
+	AlignmentSolver solver(problem, 5);
+	double p[5] =
+	{ pa.alt, pa.azi, offset.dec, offset.ha, cone };
+	solver.solve(p);
+	pa = AzimuthalCoordinates(p[0], p[1]);
+	offset = LocalEquatorialCoordinates(p[2], p[3]);
+	cone = p[4];
+
+	debug_if(CM_DEBUG, "Final result: %f\t%f\t%f\t%f\t%f\tr=%f\n", pa.alt,
+			pa.azi, offset.dec, offset.ha, cone, solver.getResidue());
+}
+
+/**
+ * Run the solver on a mount alignment problem and update the calibration
+ * @param cov If not NULL, receives the covariance of the parameters at the solution
+ * @return number of parameters
+ */
+static int solve_mount_alignment(MountAlignmentProblem &problem,
+		EqCalibration &calib, int terms, bool &diverge, double *cov = NULL,
+		int stride = 0)
+{
+	double p[PM_MAX_PARAM];
+	int np = calib_to_params(calib, terms, p);
+	AlignmentSolver solver(problem, np);
+	diverge = !solver.solve(p);
+	if (!diverge)
+	{
+		params_to_calib(p, terms, calib);
+		if (cov && !solver.covariance(p, cov, stride))
+			diverge = true;
+	}
+	debug_if(CM_DEBUG, "%s: %f\t%f\t%f\t%f\t%f\tr=%f\n",
+			diverge ? "Diverged" : "Converged", p[0], p[1], p[2], p[3], p[4],
+			solver.getResidue());
+	return np;
+}
+
+void CelestialMath::alignNStars(const int N,
+		const LocalEquatorialCoordinates star_ref[],
+		const MountCoordinates star_meas[], const LocationCoordinates& loc,
+		AzimuthalCoordinates& pa, IndexOffset& offset, double& cone,
+		bool &diverge)
+{
+	if (N == 2)
+	{
+		alignTwoStars(star_ref, star_meas, loc, pa, offset, diverge);
+		cone = 0;
+		return;
+	}
+	if (N <= 1)
+	{
+		return;
+	}
+
+	MountAlignmentProblem problem(N, star_ref, star_meas, loc);
+	EqCalibration calib(offset, pa, cone, 0);
+	solve_mount_alignment(problem, calib, 0, diverge);
+	if (!diverge)
+	{
+		pa = calib.pa;
+		offset = calib.offset;
+		cone = calib.cone;
+	}
+}
+
+void CelestialMath::alignNStars(const int N, const AlignmentStar stars[],
+		const LocationCoordinates &loc, EqCalibration &calib, int terms,
+		bool &diverge)
+{
+	MountAlignmentProblem problem(N, stars, loc, terms);
+	solve_mount_alignment(problem, calib, terms, diverge);
+}
+
 double CelestialMath::alignmentError(const int N, const AlignmentStar stars[],
 		const EqCalibration &calib, const LocationCoordinates& loc)
 {
-	static Transformation t;
-	CelestialMath::getMisalignedPolarAxisTransformation(t, calib.pa, loc);
+	int terms = calib.terms();
+	MountAlignmentProblem problem(N, stars, loc, terms);
+	double p[PM_MAX_PARAM];
+	calib_to_params(calib, terms, p);
+	problem.prepare(0, p);
 	double r = 0;
 	for (int i = 0; i < N; i++)
 	{
-		// Misalign, apply cone error, and transform to mount coordinates using the same pier side as in the measured stars
-		MountCoordinates mc = CelestialMath::localEquatorialToMount(
-				CelestialMath::applyConeError(
-						CelestialMath::applyMisalignment(t,
-								CelestialMath::equatorialToLocalEquatorial(
-										stars[i].star_ref, stars[i].timestamp,
-										loc)), calib.cone),
-				stars[i].star_meas.side) + calib.offset;
-
-		r += sqr(mc.ra_delta - stars[i].star_meas.ra_delta)
-				+ sqr(mc.dec_delta - stars[i].star_meas.dec_delta);
+		double e[2];
+		problem.error(0, i, e);
+		r += sqr(e[0]) + sqr(e[1]);
 	}
 	return sqrt(r);
 }
+
+PointingModelFit::PointingModelFit() :
+		np(0), fit_terms(0)
+{
+}
+
+EqCalibration PointingModelFit::fit(int N, const AlignmentStar stars[],
+		const LocationCoordinates &loc, int terms, bool &diverge)
+{
+	np = 0;
+	EqCalibration calib = CelestialMath::align(N, stars, loc, diverge, terms);
+	if (diverge || N < 3)
+		return calib;
+	// Polish the solution once more to get the covariance for the incremental fit
+	if (N < PM_MIN_STARS_TERMS)
+		terms = 0;
+	MountAlignmentProblem problem(N, stars, loc, terms);
+	bool fail;
+	int n = solve_mount_alignment(problem, calib, terms, fail, &cov[0][0],
+			PM_MAX_PARAM);
+	if (!fail)
+	{
+		np = n;
+		fit_terms = terms;
+	}
+	calib.error = CelestialMath::alignmentError(N, stars, calib, loc);
+	return calib;
+}
+
+void PointingModelFit::add(const AlignmentStar &star,
+		const LocationCoordinates &loc, EqCalibration &calib)
+{
+	if (np == 0)
+		return;
+	// Linearize the model of the new star at the current solution
+	double p[PM_MAX_PARAM], q[PM_MAX_PARAM];
+	double f[2], h[2][PM_MAX_PARAM];
+	const double dd = 1e-7;
+	MountAlignmentProblem problem(1, &star, loc, fit_terms);
+	calib_to_params(calib, fit_terms, p);
+	problem.prepare(0, p);
+	problem.residual(0, 0, f);
+	for (int j = 0; j < np; j++)
+	{
+		double r[2];
+		memcpy(q, p, sizeof(q));
+		q[j] += dd;
+		problem.prepare(1, q);
+		problem.residual(1, 0, r);
+		h[0][j] = (r[0] - f[0]) / dd;
+		h[1][j] = (r[1] - f[1]) / dd;
+	}
+
+	// Recursive least squares: K = P H' (H P H' + I)^-1, p -= K f, P -= K H P
+	double ph[PM_MAX_PARAM][2]; // P H'
+	for (int j = 0; j < np; j++)
+	{
+		for (int m = 0; m < 2; m++)
+		{
+			double s = 0;
+			for (int k = 0; k < np; k++)
+				s += cov[j][k] * h[m][k];
+			ph[j][m] = s;
+		}
+	}
+	double s11 = 1, s12 = 0, s22 = 1; // H P H' + I, symmetric
+	for (int k = 0; k < np; k++)
+	{
+		s11 += h[0][k] * ph[k][0];
+		s12 += h[0][k] * ph[k][1];
+		s22 += h[1][k] * ph[k][1];
+	}
+	double det = s11 * s22 - s12 * s12;
+	double i11 = s22 / det, i12 = -s12 / det, i22 = s11 / det;
+	double gain[PM_MAX_PARAM][2];
+	for (int j = 0; j < np; j++)
+	{
+		gain[j][0] = ph[j][0] * i11 + ph[j][1] * i12;
+		gain[j][1] = ph[j][0] * i12 + ph[j][1] * i22;
+		p[j] -= gain[j][0] * f[0] + gain[j][1] * f[1];
+	}
+	for (int j = 0; j < np; j++)
+		for (int k = 0; k < np; k++)
+			cov[j][k] -= gain[j][0] * ph[k][0] + gain[j][1] * ph[k][1];
+
+	params_to_calib(p, fit_terms, calib);
+}
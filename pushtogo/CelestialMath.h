@@ -154,20 +154,50 @@ struct AlignmentStar
 			const LocationCoordinates &loc) const;
 };
 
+/**
+ * Optional terms of the pointing model, on top of index offset, polar axis misalignment and cone error.
+ * The terms are small corrections in degrees, applied to the local equatorial coordinates (H, dec) at latitude phi:
+ */
+typedef enum
+{
+	PM_TERM_NP = 1, /// Non-perpendicularity of the DEC and RA axes: dH = NP tan(dec), sign flips with the pier side
+	PM_TERM_TF = 2, /// Tube flexure: dH = TF cos(phi) sin(H) / cos(dec), ddec = TF (cos(phi) cos(H) sin(dec) - sin(phi) cos(dec))
+	PM_TERM_DAF = 4, /// DEC axis flexure: dH = -DAF (cos(phi) cos(H) + sin(phi) tan(dec))
+	PM_TERM_FO = 8, /// Fork/pier flexure: ddec = FO cos(H)
+	PM_TERMS_ALL = 15
+} pmterm_t;
+
+/// Number of optional terms
+#define PM_NUM_TERMS 4
+/// Max number of parameters of the pointing model: PA alt/azi, offsets, cone and the optional terms
+#define PM_MAX_PARAM (5 + PM_NUM_TERMS)
+
 struct EqCalibration
 {
 	IndexOffset offset;
 	AzimuthalCoordinates pa;
 	double cone;
+	double np; /// Non-perpendicularity, see PM_TERM_NP
+	double tf; /// Tube flexure, see PM_TERM_TF
+	double daf; /// DEC axis flexure, see PM_TERM_DAF
+	double fo; /// Fork/pier flexure, see PM_TERM_FO
 	double error;
 	EqCalibration() :
-			cone(0), error(0)
+			cone(0), np(0), tf(0), daf(0), fo(0), error(0)
 	{
 	}
 	EqCalibration(const IndexOffset &off, const AzimuthalCoordinates p,
 			double c, double e) :
-			offset(off), pa(p), cone(c), error(e)
+			offset(off), pa(p), cone(c), np(0), tf(0), daf(0), fo(0), error(e)
+	{
+	}
+	/**
+	 * @return Mask of the optional terms that are not 0
+	 */
+	int terms() const
 	{
+		return (np != 0 ? PM_TERM_NP : 0) | (tf != 0 ? PM_TERM_TF : 0)
+				| (daf != 0 ? PM_TERM_DAF : 0) | (fo != 0 ? PM_TERM_FO : 0);
 	}
 };
 /**
@@ -260,7 +290,8 @@ public:
 
 	/**
 	 * N-star alignment for finding PA misalignment, offset, and cone error
-	 * This function will first call alignTwoStars with the first two stars assuming no cone error, then run an optimization algorithm to minimize the residual error by tweaking all 5 parameters.
+	 * Starting from the given values, runs a damped least-squares optimization to minimize the residual error by tweaking all 5 parameters.
+	 * The functions are reentrant and use a fixed amount of stack whatever the number of stars.
 	 * @param N number of alignment stars
 	 * @param star_ref Reference stars
 	 * @param star_meas Measured stars
@@ -280,11 +311,16 @@ public:
 			AzimuthalCoordinates &pa, IndexOffset &offset, double &cone,
 			bool &diverge);
 
+	static void alignNStars(const int N, const AlignmentStar stars[],
+			const LocationCoordinates &loc, EqCalibration &calib, int terms,
+			bool &diverge);
+
 	/**
 	 * Adaptor for EqMount
+	 * @param terms Optional terms of the pointing model to fit (pmterm_t), used with at least PM_MIN_STARS_TERMS stars
 	 */
 	static EqCalibration align(const int N, const AlignmentStar stars[],
-			const LocationCoordinates &loc, bool &diverge);
+			const LocationCoordinates &loc, bool &diverge, int terms = 0);
 
 	static double alignmentError(const int N, const AlignmentStar stars[],
 			const EqCalibration &calib, const LocationCoordinates &loc);
@@ -304,6 +340,161 @@ public:
 	static double kingRate(EquatorialCoordinates eq, LocationCoordinates loc,
 			time_t time);
 
+	/**
+	 * Atmospheric refraction at standard pressure and temperature (Saemundsson)
+	 * @param alt True altitude in degrees
+	 * @return Refraction in degrees, to be added to the true altitude
+	 */
+	static double refraction(double alt);
+
+	/**
+	 * Apparent position of a star, raised by atmospheric refraction
+	 */
+	static EquatorialCoordinates applyRefraction(const EquatorialCoordinates &eq,
+			time_t time, const LocationCoordinates &loc);
+
+};
+
+/**
+ * Mount model for converting between equatorial and mount coordinates with a fixed calibration and location.
+ * The misalignment rotation and the cone error terms are computed once in update(), so a conversion is one
+ * rotation and the trig of the input and output angles. It gives the same results as chaining
+ * equatorialToLocalEquatorial, applyMisalignment, applyConeError and localEquatorialToMount.
+ * The batched functions convert arrays with the sidereal time computed once. The float versions use single
+ * precision math, which runs on the FPU of the Cortex-M4 and is good to a few arcseconds.
+ */
+class MountModel
+{
+public:
+	MountModel();
+	MountModel(const EqCalibration &calib, const LocationCoordinates &loc);
+
+	/**
+	 * Recompute the model. Must be called when the calibration or the location changes
+	 */
+	void update(const EqCalibration &calib, const LocationCoordinates &loc);
+
+	const EqCalibration &getCalibration() const
+	{
+		return calib;
+	}
+
+	const LocationCoordinates &getLocation() const
+	{
+		return loc;
+	}
+
+	/*Single conversions*/
+	MountCoordinates toMount(const EquatorialCoordinates &eq, time_t timestamp,
+			pierside_t side = PIER_SIDE_AUTO) const;
+	EquatorialCoordinates toEquatorial(const MountCoordinates &mc,
+			time_t timestamp) const;
+	MountCoordinates localToMount(const LocalEquatorialCoordinates &leq,
+			pierside_t side = PIER_SIDE_AUTO) const;
+	LocalEquatorialCoordinates mountToLocal(const MountCoordinates &mc) const;
+
+	/*Batched conversions*/
+	void toMount(int n, const EquatorialCoordinates eq[],
+			MountCoordinates out[], time_t timestamp, pierside_t side =
+					PIER_SIDE_AUTO) const;
+	void toEquatorial(int n, const MountCoordinates mc[],
+			EquatorialCoordinates out[], time_t timestamp) const;
+
+	/**
+	 * Batched conversions on separate arrays of angles, in degrees
+	 * @param side Pier side of each star, can be NULL. For toMount, it is the output pier side if side_in is PIER_SIDE_AUTO
+	 * @note The input arrays can be used as output arrays
+	 */
+	void toMount(int n, const double ra[], const double dec[],
+			double ra_delta[], double dec_delta[], pierside_t side[],
+			time_t timestamp, pierside_t side_in = PIER_SIDE_AUTO) const;
+	void toMount(int n, const float ra[], const float dec[], float ra_delta[],
+			float dec_delta[], pierside_t side[], time_t timestamp,
+			pierside_t side_in = PIER_SIDE_AUTO) const;
+	void toEquatorial(int n, const double ra_delta[], const double dec_delta[],
+			const pierside_t side[], double ra[], double dec[],
+			time_t timestamp) const;
+	void toEquatorial(int n, const float ra_delta[], const float dec_delta[],
+			const pierside_t side[], float ra[], float dec[],
+			time_t timestamp) const;
+
+	/**
+	 * Model coefficients in precision T
+	 */
+	template<typename T>
+	struct Coefficients
+	{
+		T m[3][3]; /// Misalignment rotation
+		T cos_cone, tan_cone;
+		T dec_off, ra_off;
+		T np, tf, daf, fo; /// Optional terms, in degrees
+		T sin_lat, cos_lat;
+		bool terms; /// Any optional term is used
+	};
+
+private:
+	EqCalibration calib;
+	LocationCoordinates loc;
+	Coefficients<double> cd;
+	Coefficients<float> cf;
+};
+
+/// Min number of stars to fit the optional terms of the pointing model
+#define PM_MIN_STARS_TERMS 6
+
+/**
+ * Incremental fit of the pointing model.
+ * After a full fit of all stars, a new star is added with a recursive least-squares step: the model is
+ * linearized at the current solution and the solution and its covariance are updated with the two
+ * residuals of the new star. This costs as much as one star in the full fit, instead of a full fit.
+ */
+class PointingModelFit
+{
+public:
+	PointingModelFit();
+
+	/**
+	 * Forget the current solution. The next fit must be a full fit
+	 */
+	void reset()
+	{
+		np = 0;
+	}
+
+	/**
+	 * @return true if add() can be used with these terms
+	 */
+	bool canAdd(int terms) const
+	{
+		return np > 0 && terms == fit_terms;
+	}
+
+	/**
+	 * Fit all stars
+	 * @param terms Optional terms to fit
+	 * @return The calibration. diverge is set if the fit failed, in which case the incremental fit is not available
+	 */
+	EqCalibration fit(int N, const AlignmentStar stars[],
+			const LocationCoordinates &loc, int terms, bool &diverge);
+
+	/**
+	 * Update calib with one more star. Only valid after a full fit with the same terms, see canAdd()
+	 */
+	void add(const AlignmentStar &star, const LocationCoordinates &loc,
+			EqCalibration &calib);
+
+	/**
+	 * @return Number of parameters fitted, 0 if no fit is available
+	 */
+	int getNumParam() const
+	{
+		return np;
+	}
+
+private:
+	int np;
+	int fit_terms;
+	double cov[PM_MAX_PARAM][PM_MAX_PARAM]; /// Covariance of the parameters, (J'J)^-1
 };
 
 #endif /* CELESTIALMATH_H_ */
@@ -0,0 +1,122 @@
+/*
+ * EncoderObserver.cpp
+ */
+
+#include "EncoderObserver.h"
+#include "Axis.h"
+#include "TelescopeConfiguration.h"
+
+static ConfigHandle<double> cfg_encoder_sample_rate("encoder_sample_rate");
+static ConfigHandle<double> cfg_encoder_slip_threshold(
+		"encoder_slip_threshold");
+
+EncoderObserver *EncoderObserver::head = NULL;
+Mutex EncoderObserver::list_mutex;
+Thread *EncoderObserver::thread = NULL;
+
+EncoderObserver::EncoderObserver(Axis &axis, GenericAbsEncoder &encoder,
+bool invert) :
+		axis(axis), encoder(encoder), invert(invert), resolution(
+				360.0 / encoder.getMaxCount()), zero(0), bias(0), var(0), referenced(
+				false), slips(0), next(NULL)
+{
+	list_mutex.lock();
+	next = head;
+	head = this;
+	if (thread == NULL)
+	{
+		thread = new Thread(osPriorityAboveNormal, OS_STACK_SIZE, NULL,
+				"Encoder sampler");
+		thread->start(callback(&EncoderObserver::sampler_task));
+	}
+	list_mutex.unlock();
+	axis.setObserver(this);
+}
+
+EncoderObserver::~EncoderObserver()
+{
+	axis.setObserver(NULL);
+	list_mutex.lock();
+	for (EncoderObserver **p = &head; *p; p = &(*p)->next)
+	{
+		if (*p == this)
+		{
+			*p = next;
+			break;
+		}
+	}
+	list_mutex.unlock();
+}
+
+void EncoderObserver::reset()
+{
+	core_util_critical_section_enter();
+	bias = 0;
+	referenced = false;
+	core_util_critical_section_exit();
+}
+
+void EncoderObserver::sample()
+{
+	// The step count does not follow the axis while the backlash is taken up, skip the sample
+	uint32_t seq = axis.getTakeupSeq();
+	if (seq & 1)
+		return;
+	// The axis can move while the encoder is read, take the step angle in the middle
+	double step0 = axis.getStepAngleDeg();
+	uint32_t count = encoder.readPos();
+	double motion = remainder(axis.getStepAngleDeg() - step0, 360.0);
+	if (axis.getTakeupSeq() != seq)
+		return;
+	double step = step0 + motion / 2;
+	double enc = (invert ? -1.0 : 1.0) * (double) count * resolution;
+
+	// Quantization of the encoder, and the motion during the read
+	double r = (resolution * resolution + motion * motion) / 12;
+
+	if (!referenced)
+	{
+		zero = remainder(enc - step, 360.0);
+		var = r;
+		referenced = true;
+		return;
+	}
+
+	var += EO_BIAS_NOISE / cfg_encoder_sample_rate.get();
+	double b = bias;
+	double y = remainder(enc - zero - step - b, 360.0); // Innovation
+	if (fabs(y) > cfg_encoder_slip_threshold.get())
+	{
+		// Lost steps or backlash, the encoder is right
+		b += y;
+		var = r;
+		slips++;
+		debug("%s: slip of %f deg detected by the encoder\n",
+				axis.getAxisName(), y);
+	}
+	else
+	{
+		double k = var / (var + r);
+		b += k * y;
+		var *= 1 - k;
+	}
+
+	core_util_critical_section_enter();
+	if (referenced) // Not reset in the meantime
+		bias = b;
+	core_util_critical_section_exit();
+}
+
+void EncoderObserver::sampler_task()
+{
+	while (true)
+	{
+		Thread::wait((uint32_t) (1000 / cfg_encoder_sample_rate.get()));
+		list_mutex.lock();
+		for (EncoderObserver *p = head; p; p = p->next)
+		{
+			p->sample();
+		}
+		list_mutex.unlock();
+	}
+}
@@ -0,0 +1,95 @@
+/*
+ * EncoderObserver.h
+ *
+ * Closed-loop position estimate of an axis from its absolute encoder and its step count.
+ *
+ * The step count is precise but open-loop: lost steps and backlash make it drift from the real position.
+ * The encoder is absolute but coarse and noisy. The observer estimates the bias between the two,
+ * i.e. encoder angle - step angle, with a scalar Kalman filter updated at a fixed rate. The encoder
+ * is referenced to the step count when the axis angle is set, so the bias starts at 0.
+ * An innovation larger than encoder_slip_threshold is a slip and is taken as is.
+ * Axis::getAngleDeg() returns the step angle corrected by the bias, so slews, corrections and the mount
+ * position all see the real position, and tracking pays back the slips.
+ */
+
+#ifndef PUSHTOGO_ENCODEROBSERVER_H_
+#define PUSHTOGO_ENCODEROBSERVER_H_
+
+#include "mbed.h"
+#include "AbsEncoder.h"
+
+class Axis;
+
+/// Process noise of the bias in deg^2/s. Slow, because the slips are handled separately
+#define EO_BIAS_NOISE 1e-8
+
+class EncoderObserver
+{
+public:
+	/**
+	 * Attach an encoder to an axis, and start sampling it
+	 * @param axis Axis turning the encoder
+	 * @param encoder Absolute encoder, one revolution per turn of the axis
+	 * @param invert true if the encoder counts down when the axis turns in the positive direction
+	 */
+	EncoderObserver(Axis &axis, GenericAbsEncoder &encoder,
+	bool invert = false);
+	~EncoderObserver();
+
+	/**
+	 * Reference the encoder to the step count again at the next sample. Called when the axis angle is set
+	 */
+	void reset();
+
+	/** @return Estimated encoder angle - step angle, in deg. Can be called anywhere
+	 */
+	double getBias() const
+	{
+		core_util_critical_section_enter();
+		double b = bias;
+		core_util_critical_section_exit();
+		return b;
+	}
+
+	/** @return Standard deviation of the bias estimate, in deg
+	 */
+	double getUncertainty() const
+	{
+		return sqrt(var);
+	}
+
+	/** @return Number of slips detected since the encoder was attached
+	 */
+	uint32_t getSlipCount() const
+	{
+		return slips;
+	}
+
+	/**
+	 * Read the encoder and update the estimate. Called by the sampling thread
+	 */
+	void sample();
+
+protected:
+	Axis &axis;
+	GenericAbsEncoder &encoder;
+	bool invert;
+	double resolution; /// deg per count
+	double zero; /// Encoder angle at step angle 0
+	double bias; /// Estimated encoder angle - step angle in deg
+	double var; /// Variance of bias in deg^2
+	volatile bool referenced; /// false until the encoder is referenced to the step count
+	uint32_t slips;
+	EncoderObserver *next; /// Next observer sampled by the thread
+
+	static EncoderObserver *head;
+	static Mutex list_mutex;
+	static Thread *thread;
+	static void sampler_task();
+
+private:
+	EncoderObserver(const EncoderObserver &);
+	EncoderObserver &operator=(const EncoderObserver &);
+};
+
+#endif /* PUSHTOGO_ENCODEROBSERVER_H_ */
@@ -7,11 +7,57 @@
 
 #include "EqMountServer.h"
 #include "mbed_events.h"
+#include "SystemProfiler.h"
 #include <ctype.h>
 
 #define EMS_DEBUG 0
 
-extern ServerCommand commandlist[MAX_COMMAND];
+/// Size of the command hash table, must be a power of 2 and larger than MAX_COMMAND
+#define COMMAND_HASH_SIZE 256
+
+static ConfigHandle<int> cfg_max_guide_time("max_guide_time");
+
+/**
+ * Registered commands. The commands are kept in registration order (for the help menu), and
+ * indexed by an open-addressing hash table on their names, so that a lookup is one hash and
+ * usually one string comparison, however many commands are registered.
+ */
+class CommandTable
+{
+public:
+	CommandTable();
+
+	bool add(const ServerCommand &cmd);
+	const ServerCommand *find(const char *name) const;
+
+	int size() const
+	{
+		return count;
+	}
+
+	const ServerCommand &operator[](int i) const
+	{
+		return commands[i];
+	}
+
+private:
+	ServerCommand commands[MAX_COMMAND];
+	int count;
+	uint8_t index[COMMAND_HASH_SIZE]; /// Index+1 in commands, 0 for empty slot
+
+	static uint32_t hash(const char *name)
+	{
+		uint32_t h = 2166136261U; // FNV-1a
+		while (*name)
+		{
+			h ^= (uint8_t) *name++;
+			h *= 16777619U;
+		}
+		return h;
+	}
+};
+
+static CommandTable &command_table();
 
 void stprintf(FileHandle &f, const char *fmt, ...)
 {
@@ -24,181 +70,503 @@ void stprintf(FileHandle &f, const char *fmt, ...)
 	f.write(buf, len);
 }
 
+EqMountServer *EqMountServer::subscribers[EMS_MAX_SUBSCRIBERS];
+Mutex EqMountServer::subscriber_mutex;
+EqMountServer *volatile EqMountServer::telemetry_writing = NULL;
+Thread *EqMountServer::telemetry_thread = NULL;
+
 EqMountServer::EqMountServer(FileHandle &stream, bool echo) :
 		eq_mount(NULL), stream(stream), thread(osPriorityBelowNormal,
-		OS_STACK_SIZE, NULL, "EqMountServer"), echo(echo)
+		EMS_STACK_SIZE, NULL, "EqMountServer"), echo(echo), protocol(
+				EMS_PROTOCOL_TEXT), nextProtocol(EMS_PROTOCOL_TEXT), output(
+				*this), telemetryDivider(0), telemetryBinary(false), telemetrySeq(
+				0)
 {
+	memset(exec_ctx, 0, sizeof(exec_ctx));
 	thread.start(callback(this, &EqMountServer::task_thread));
 }
 
 EqMountServer::~EqMountServer()
 {
+	subscribe(0);
 	thread.terminate();
 }
 
-void EqMountServer::task_thread()
+osStatus EqMountServer::subscribe(double rate, bool binary)
 {
-	EventQueue queue(16 * EVENTS_EVENT_SIZE);
-	Thread evq_thd(osThreadGetPriority(Thread::gettid()), OS_STACK_SIZE, NULL,
-			"EqMountServer dispatcher");
-	evq_thd.start(callback(&queue, &EventQueue::dispatch_forever));
+	// Written so that NaN fails the check
+	if (!(rate >= 0 && rate <= 1000.0 / EMS_TELEMETRY_TICK_MS))
+		return osErrorParameter;
+
+	subscriber_mutex.lock();
+	int i, slot = -1;
+	for (i = 0; i < EMS_MAX_SUBSCRIBERS; i++)
+	{
+		if (subscribers[i] == this)
+			slot = i;
+	}
+	if (rate == 0)
+	{
+		if (slot >= 0)
+			subscribers[slot] = NULL;
+		telemetryDivider = 0;
+		// A frame being written to this server must be finished before the server can go away
+		while (telemetry_writing == this)
+		{
+			subscriber_mutex.unlock();
+			Thread::wait(EMS_TELEMETRY_TICK_MS);
+			subscriber_mutex.lock();
+		}
+		subscriber_mutex.unlock();
+		return osOK;
+	}
+	if (slot < 0)
+	{
+		for (i = 0; i < EMS_MAX_SUBSCRIBERS && subscribers[i]; i++)
+			;
+		if (i == EMS_MAX_SUBSCRIBERS)
+		{
+			subscriber_mutex.unlock();
+			return osErrorResource;
+		}
+		slot = i;
+	}
+	int divider = (int) (1000.0 / (rate * EMS_TELEMETRY_TICK_MS) + 0.5);
+	telemetryDivider = (divider < 1) ? 1 : divider;
+	telemetryBinary = binary;
+	subscribers[slot] = this;
+
+	if (telemetry_thread == NULL)
+	{
+		telemetry_thread = new Thread(osPriorityBelowNormal, OS_STACK_SIZE,
+		NULL, "EqMountServer telemetry");
+		telemetry_thread->start(callback(&EqMountServer::telemetry_task));
+	}
+	subscriber_mutex.unlock();
+	return osOK;
+}
 
+static void to_bp_state(const MountState &state, bp_state &bs)
+{
+	bs.time = (uint32_t) state.time;
+	bs.ra = state.eq.ra;
+	bs.dec = state.eq.dec;
+	bs.ra_delta = state.mount.ra_delta;
+	bs.dec_delta = state.mount.dec_delta;
+	bs.ra_speed = state.ra_speed;
+	bs.dec_speed = state.dec_speed;
+	bs.side = (uint8_t) state.mount.side;
+	bs.status = (uint8_t) state.status;
+	bs.ra_slew = (uint8_t) state.ra_slew;
+	bs.dec_slew = (uint8_t) state.dec_slew;
+}
+
+/**
+ * Telemetry producer. The state of each mount is read once per tick and formatted once,
+ * then written to all the streams that are due. The subscriber list is copied under the lock and the
+ * frames are written outside it, so a stream that blocks does not hold up the other subscribers or
+ * the subscriptions of other servers.
+ * Frame: pos <seq> <ra> <dec> <ra_delta> <dec_delta> <E|W> <ra_speed> <dec_speed> <status> <ra_slew> <dec_slew>
+ * Binary subscribers get the same state in a BP_MSG_TELEMETRY frame.
+ */
+void EqMountServer::telemetry_task()
+{
+	uint32_t tick = 0;
+	char frame[160];
+	bp_state bs;
+	uint8_t bframe[BP_MAX_FRAME];
 	while (true)
 	{
-		const int size = 256;
-		char *buffer = new char[size]; // text buffer
-		if (!buffer)
+		Thread::wait(EMS_TELEMETRY_TICK_MS);
+		tick++;
+
+		EqMountServer *due[EMS_MAX_SUBSCRIBERS];
+		int n = 0;
+		subscriber_mutex.lock();
+		for (int i = 0; i < EMS_MAX_SUBSCRIBERS; i++)
 		{
-			stprintf(stream, "Error: out of memory\r\n");
-			break;
+			EqMountServer *s = subscribers[i];
+			if (s && s->eq_mount && tick % s->telemetryDivider == 0)
+				due[n++] = s;
 		}
-		bool eof = false;
-		char x = 0;
-		int i = 0;
-		while (!eof && i < size - 2)
+		subscriber_mutex.unlock();
+
+		EquatorialMount *snapped = NULL;
+		bool formatted = false;
+		for (int k = 0; k < n; k++)
 		{
-			int s = stream.read(&x, 1);
-			if (s <= 0)
-			{ // End of file
-				eof = true;
-				break;
-			}
-			else if (x == '\r' || x == '\n')
-			{ // End of line
-				break;
+			EqMountServer *s = due[k];
+			// Skip servers that unsubscribed since the copy, otherwise keep them from going away
+			subscriber_mutex.lock();
+			bool subscribed = false;
+			for (int i = 0; i < EMS_MAX_SUBSCRIBERS; i++)
+			{
+				if (subscribers[i] == s)
+					subscribed = true;
 			}
-			else if (x == '\b' || x == '\x7F')
-			{ // Backspace
-				if (i > 0)
-				{
-					stprintf(stream, "\b \b"); // blank the current character properly
-					i--;
-				}
+			if (subscribed)
+				telemetry_writing = s;
+			subscriber_mutex.unlock();
+			if (!subscribed)
 				continue;
+
+			if (s->eq_mount != snapped)
+			{
+				MountState state;
+				s->eq_mount->getState(state);
+				snapped = s->eq_mount;
+				to_bp_state(state, bs);
+				formatted = false;
 			}
-			else if (isspace(x))
-			{ // Convert to white space
-				x = ' ';
-			}
-			else if (!isprint(x))
-			{ // Ignore everything else
+			if (s->telemetryBinary)
+			{
+				uint32_t seq = s->telemetrySeq++;
+				FrameWriter w(bframe, sizeof(bframe), (uint16_t) seq,
+						BP_MSG_TELEMETRY);
+				w.putU32(seq).putState(bs);
+				s->stream.write(bframe, w.finish());
+				telemetry_writing = NULL;
 				continue;
 			}
-			// Echo
-			if (echo)
+			if (!formatted)
 			{
-				stream.write(&x, 1);
+				// Text frame is only formatted if a text subscriber needs it
+				snprintf(frame, sizeof(frame),
+						"%.6f %.6f %.6f %.6f %c %.6f %.6f %d %d %d\r\n", bs.ra,
+						bs.dec, bs.ra_delta, bs.dec_delta,
+						(bs.side == PIER_SIDE_WEST) ? 'W' : 'E', bs.ra_speed,
+						bs.dec_speed, (int) bs.status, (int) bs.ra_slew,
+						(int) bs.dec_slew);
+				formatted = true;
 			}
-			buffer[i++] = (char) x;
+			stprintf(s->stream, "pos %lu %s", (unsigned long) s->telemetrySeq++,
+					frame);
+			telemetry_writing = NULL;
 		}
-		if (eof && i == 0)
-		{
-			delete[] buffer;
+	}
+}
+
+/**
+ * Read a command line
+ * @return length of the line, or -1 at end of file
+ */
+int EqMountServer::read_line(char *buffer)
+{
+	bool eof = false;
+	char x = 0;
+	int i = 0;
+	while (!eof && i < EMS_LINE_SIZE - 2)
+	{
+		int s = stream.read(&x, 1);
+		if (s <= 0)
+		{ // End of file
+			eof = true;
 			break;
 		}
+		else if (x == '\r' || x == '\n')
+		{ // End of line
+			break;
+		}
+		else if (x == '\b' || x == '\x7F')
+		{ // Backspace
+			if (i > 0)
+			{
+				stprintf(stream, "\b \b"); // blank the current character properly
+				i--;
+			}
+			continue;
+		}
+		else if (isspace(x))
+		{ // Convert to white space
+			x = ' ';
+		}
+		else if (!isprint(x))
+		{ // Ignore everything else
+			continue;
+		}
+		// Echo
 		if (echo)
 		{
-			// Echo new line character after command
-			stprintf(stream, "\r\n");
+			stream.write(&x, 1);
 		}
-		if (i == 0)
-		{ // Empty command
-			delete[] buffer;
-			continue;
+		buffer[i++] = (char) x;
+	}
+	if (eof && i == 0)
+	{
+		return -1;
+	}
+	if (echo)
+	{
+		// Echo new line character after command
+		stprintf(stream, "\r\n");
+	}
+	buffer[i] = '\0'; // insert null character
+	return i;
+}
+
+/**
+ * Read a binary frame into line. Never reads past the end of the frame, so that the server
+ * can switch back to text after any frame.
+ * @return 1 if a request was read, 0 if the frame was dropped, -1 at end of file
+ */
+int EqMountServer::read_frame(CommandLine *line)
+{
+	uint8_t buf[BP_MAX_FRAME];
+	while (true)
+	{
+		int s = stream.read(buf, decoder.need());
+		if (s <= 0)
+			return -1;
+		size_t used;
+		FrameDecoder::result_t r = FrameDecoder::DECODE_MORE;
+		for (int i = 0; i < s; i += used)
+		{
+			r = decoder.feed(buf + i, s - i, used);
+			if (r == FrameDecoder::DECODE_ERROR)
+			{
+				debug_if(EMS_DEBUG, "Error: binary frame dropped (%d).\n",
+						decoder.error());
+				FrameWriter w(buf, sizeof(buf), 0, BP_MSG_ERROR);
+				w.putU8(decoder.error());
+				stream.write(buf, w.finish());
+				return 0;
+			}
 		}
-		buffer[i] = '\0'; // insert null character
+		if (r == FrameDecoder::DECODE_FRAME)
+			break;
+	}
 
-		if (eq_mount == NULL)
+	line->reqid = decoder.id();
+	line->op = decoder.type();
+	line->length = decoder.payloadSize();
+	line->bcmd = NULL;
+	if (line->op == BP_OP_COMMAND)
+	{
+		// Text command in a frame
+		size_t len = line->length;
+		if (len > EMS_LINE_SIZE - 1)
+			len = EMS_LINE_SIZE - 1;
+		memcpy(line->buffer, decoder.payload(), len);
+		line->buffer[len] = '\0';
+		if (eq_mount == NULL || !parse_line(line))
 		{
-			stprintf(stream, "Error: EqMount not binded.\r\n");
-			delete[] buffer;
-			continue;
+			send_status(line, ERR_UNKNOWN_COMMAND);
+			return 0;
 		}
+		return 1;
+	}
 
-		char delim[] = " "; // Delimiter, can be any white character in the actual input
-		char *saveptr;
+	line->bcmd = findBinaryCommand(line->op);
+	if (line->bcmd == NULL || eq_mount == NULL)
+	{
+		debug_if(EMS_DEBUG, "Error: binary command 0x%02x not found.\n",
+				line->op);
+		send_status(line, ERR_UNKNOWN_COMMAND);
+		return 0;
+	}
+	memcpy(line->buffer, decoder.payload(), line->length);
+	return 1;
+}
+
+/**
+ * Split the line in buffer into command and arguments, and find the command
+ * @return false if the line is empty or the command is not found
+ */
+bool EqMountServer::parse_line(CommandLine *line)
+{
+	char delim[] = " "; // Delimiter, can be any white character in the actual input
+	char *saveptr;
+	char * command = strtok_r(line->buffer, delim, &saveptr); // Get the first token
 
-		char * command = strtok_r(buffer, delim, &saveptr); // Get the first token
+	if (command == NULL || strlen(command) == 0)
+	{ // Empty command
+		return false;
+	}
 
-		if (strlen(command) == 0)
-		{ // Empty command
-			delete[] buffer;
-			continue;
-		}
+	for (char *p = command; *p; ++p)
+		*p = tolower(*p); // Convert to lowercase
+
+	char **args = line->argv;
 
-		for (char *p = command; *p; ++p)
+	// Extract parameters
+	int i = 0;
+	do
+	{
+		args[i] = strtok_r(NULL, delim, &saveptr);
+		if (args[i] == NULL || ++i == EMS_MAX_ARGS)
+			break;
+	} while (true);
+
+	int argn = i;
+
+	debug_if(EMS_DEBUG, "command: |%s| ", command);
+	for (i = 0; i < argn; i++)
+	{
+		debug_if(EMS_DEBUG, "|%s| ", args[i]);
+		for (char *p = args[i]; *p; ++p)
 			*p = tolower(*p); // Convert to lowercase
+	}
+	debug_if(EMS_DEBUG, "\n");
 
-		char **args = new char*[16];
+	const ServerCommand *cmd = findCommand(command);
 
-		// Extract parameters
-		i = 0;
-		do
-		{
-			args[i] = strtok_r(NULL, delim, &saveptr);
-			if (args[i] == NULL || ++i == 16)
-				break;
-		} while (true);
+	if (cmd == NULL)
+	{
+		debug_if(EMS_DEBUG, "Error: command %s not found.\n", command);
+		return false;
+	}
 
-		int argn = i;
+	line->cmd = *cmd;
+	line->argn = argn;
+	return true;
+}
+
+/**
+ * Room a queued command takes in an EventQueue: the event itself, plus the callback of command_execute
+ * and its argument, which are stored with it
+ */
+#define EMS_EVENT_SIZE (EVENTS_EVENT_SIZE + sizeof(CommandLine *) \
+		+ sizeof(mbed::Callback<void(CommandLine *)>))
 
-		debug_if(EMS_DEBUG, "command: |%s| ", command);
-		for (i = 0; i < argn; i++)
+void EqMountServer::task_thread()
+{
+	EventQueue queue(EMS_LINE_POOL_SIZE * EMS_EVENT_SIZE);
+	Thread evq_thd(osThreadGetPriority(Thread::gettid()), OS_STACK_SIZE, NULL,
+			"EqMountServer dispatcher");
+	evq_thd.start(callback(&queue, &EventQueue::dispatch_forever));
+	EventQueue bg_queue(EMS_LINE_POOL_SIZE * EMS_EVENT_SIZE);
+	Thread bg_thd(osThreadGetPriority(Thread::gettid()), OS_STACK_SIZE, NULL,
+			"EqMountServer background");
+	bg_thd.start(callback(&bg_queue, &EventQueue::dispatch_forever));
+
+	exec_ctx[CMD_EXEC_INLINE].thread = Thread::gettid();
+	exec_ctx[CMD_EXEC_QUEUED].thread = evq_thd.get_id();
+	exec_ctx[CMD_EXEC_LONG].thread = bg_thd.get_id();
+
+	CommandLine spare; // Used when all lines in the pool are owned by the dispatchers
+	CommandLine *line = NULL;
+
+	while (true)
+	{
+		if (line == NULL || line == &spare)
 		{
-			debug_if(EMS_DEBUG, "|%s| ", args[i]);
-			for (char *p = args[i]; *p; ++p)
-				*p = tolower(*p); // Convert to lowercase
+			line = linePool.alloc();
+			if (line == NULL)
+				line = &spare; // Queued commands will be rejected until a line is returned
 		}
-		debug_if(EMS_DEBUG, "\n");
 
-		int cind = -1;
-
-		for (i = 0; i < MAX_COMMAND && commandlist[i].fptr != NULL; i++)
+		protocol = nextProtocol;
+		line->binary = (protocol == EMS_PROTOCOL_BINARY);
+		if (line->binary)
 		{
-			if (strcmp(commandlist[i].cmd, command) == 0)
-			{
-				cind = i;
+			int r = read_frame(line);
+			if (r < 0)
 				break;
+			else if (r == 0)
+				continue;
+		}
+		else
+		{
+			int len = read_line(line->buffer);
+			if (len < 0)
+				break;
+			else if (len == 0)
+				continue; // Empty command
+
+			if (eq_mount == NULL)
+			{
+				stprintf(stream, "Error: EqMount not binded.\r\n");
+				continue;
 			}
+			line->bcmd = NULL;
+			if (!parse_line(line))
+				continue;
 		}
 
-		if (cind == -1)
+		line->received = us_ticker_read();
+		command_exec_t exec = line->bcmd ? line->bcmd->exec : line->cmd.exec;
+
+		// Commands that can return immediately, directly run them. The line is reused afterwards
+		if (exec == CMD_EXEC_INLINE)
 		{
-			debug_if(EMS_DEBUG, "Error: command %s not found.\n", command);
-			delete[] buffer;
-			delete[] args;
+			execute(line, CMD_EXEC_INLINE);
 			continue;
 		}
 
-		// Commands that can return immediately, directly run them
-		if (cind < 8 || strcmp(command, "config") == 0)
+		if (line == &spare)
 		{
-			int ret = commandlist[cind].fptr(this, command, argn, args);
-			// Send the return status back
-			stprintf(stream, "%d %s\r\n", ret, command);
-			delete[] buffer;
-			delete[] args;
+			// All lines are waiting in the queues or executing
+			debug_if(EMS_DEBUG, "Error: %s rejected, server busy.\n",
+					line->cmd.cmd);
+			if (!line->binary)
+				stprintf(stream, "%s Error: server busy\r\n", line->cmd.cmd);
+			send_status(line, ERR_SERVER_BUSY);
 			continue;
 		}
 
 		// Queue the command
-		Callback<void(ServerCommand&, int, char**, char*)> cb = callback(this,
-				&EqMountServer::command_execute);
-		while (queue.call(cb, commandlist[cind], argn, args, buffer) == 0)
-		{ // Use the event dispatching thread to run this
-			debug("Event queue full. Wait...\r\n");
-			Thread::wait(100);
+		EventQueue &q = (exec == CMD_EXEC_LONG) ? bg_queue : queue;
+		if (q.call(callback(this, &EqMountServer::command_execute), line) == 0)
+		{
+			// Should not happen, the queues can hold all lines in the pool
+			debug_if(EMS_DEBUG, "Error: %s rejected, event queue full.\n",
+					line->cmd.cmd);
+			if (!line->binary)
+				stprintf(stream, "%s Error: server busy\r\n", line->cmd.cmd);
+			send_status(line, ERR_SERVER_BUSY);
+			continue;
 		}
 
-		// The buffer and argument list will be deleted when the command finishes execution in the event dispatch thread
+		// The line now belongs to the dispatcher, which will return it to the pool when the command finishes
+		line = NULL;
 	}
 	// If we reach here, it must be end of file
+	if (line != NULL && line != &spare)
+		linePool.free(line);
+}
+
+/**
+ * Send the return status of a request, in the protocol it was received in
+ */
+void EqMountServer::send_status(const CommandLine *line, int ret)
+{
+	if (line->binary)
+	{
+		uint8_t buf[BP_HEADER_SIZE + BP_BODY_HEADER_SIZE + 4 + BP_TRAILER_SIZE];
+		FrameWriter w(buf, sizeof(buf), line->reqid, line->op | BP_REPLY);
+		w.putI32(ret);
+		stream.write(buf, w.finish());
+	}
+	else
+	{
+		stprintf(stream, "%d %s\r\n", ret, line->cmd.cmd);
+	}
 }
 
-void EqMountServer::command_execute(ServerCommand &cmd, int argn, char *args[],
-		char *buffer)
+/**
+ * Run the command of a line and send the reply. Called from the thread of the execution class
+ */
+void EqMountServer::execute(CommandLine *line, command_exec_t cls)
 {
-	int ret = cmd.fptr(this, cmd.cmd, argn, args);
+	exec_ctx[cls].line = line;
+	if (line->bcmd)
+	{
+		// Binary command, the data of the reply follows the status
+		uint8_t buf[BP_MAX_FRAME];
+		FrameWriter w(buf, sizeof(buf), line->reqid, line->op | BP_REPLY);
+		w.putI32(0);
+		FrameReader args((const uint8_t *) line->buffer, line->length);
+		int ret = line->bcmd->fptr(this, args, w);
+		w.setI32(0, ret);
+		exec_ctx[cls].line = NULL;
+		stream.write(buf, w.finish());
+		SystemProfiler::commandLatency.add(us_ticker_read() - line->received);
+		return;
+	}
+
+	ServerCommand &cmd = line->cmd;
+	int ret = cmd.fptr(this, cmd.cmd, line->argn, line->argv);
+	exec_ctx[cls].line = NULL;
 
 	if (ret == ERR_WRONG_NUM_PARAM)
 	{
@@ -216,10 +584,44 @@ void EqMountServer::command_execute(ServerCommand &cmd, int argn, char *args[],
 	}
 
 	// Send the return status back
-	stprintf(stream, "%d %s\r\n", ret, cmd.cmd);
+	send_status(line, ret);
+	SystemProfiler::commandLatency.add(us_ticker_read() - line->received);
+}
 
-	delete[] buffer;
-	delete[] args;
+void EqMountServer::command_execute(CommandLine *line)
+{
+	execute(line,
+			(line->bcmd ? line->bcmd->exec : line->cmd.exec) == CMD_EXEC_LONG ?
+					CMD_EXEC_LONG : CMD_EXEC_QUEUED);
+	linePool.free(line);
+}
+
+ssize_t FramedStream::write(const void *buffer, size_t size)
+{
+	osThreadId tid = Thread::gettid();
+	const CommandLine *line = NULL;
+	for (int i = 0; i < 3; i++)
+	{
+		if (server.exec_ctx[i].thread == tid)
+			line = server.exec_ctx[i].line;
+	}
+	if (line == NULL || !line->binary)
+		return server.stream.write(buffer, size);
+
+	// Output of a binary request, split in text frames
+	const uint8_t *p = (const uint8_t *) buffer;
+	size_t left = size;
+	uint8_t buf[BP_MAX_FRAME];
+	while (left > 0)
+	{
+		size_t n = (left > BP_MAX_PAYLOAD) ? BP_MAX_PAYLOAD : left;
+		FrameWriter w(buf, sizeof(buf), line->reqid, BP_MSG_TEXT);
+		w.putBytes(p, n);
+		server.stream.write(buf, w.finish());
+		p += n;
+		left -= n;
+	}
+	return size;
 }
 
 static int eqmount_stop(EqMountServer *server, const char *cmd, int argn,
@@ -336,7 +738,15 @@ static int eqmount_speed(EqMountServer *server, const char *cmd, int argn,
 	{
 		// Print speed
 		double speed = 0;
-		if (strcmp(argv[0], "slew") == 0)
+		if (strcmp(argv[0], "rate") == 0)
+		{
+			// Achieved tracking rate and accumulated drift in arcsec
+			stprintf(server->getStream(), "%s %.9f %.3f\r\n", cmd,
+					server->getEqMount()->getTrackingRateSidereal(),
+					server->getEqMount()->getTrackingDrift() * 3600);
+			return 0;
+		}
+		else if (strcmp(argv[0], "slew") == 0)
 		{
 			speed = server->getEqMount()->getSlewSpeed();
 		}
@@ -402,7 +812,7 @@ static int eqmount_align(EqMountServer *server, const char *cmd, int argn,
 	if (argn == 0)
 	{
 		stprintf(server->getStream(),
-				"%s usage: align add [star]\nalign replace [n] [star]\nalign delete [n]\nalign show\nalign show [n]\n\nalign clear\n",
+				"%s usage: align add [star]\nalign replace [n] [star]\nalign delete [n]\nalign show\nalign show [n]\nalign terms [np|tf|daf|fo|all|none]...\nalign clear\n",
 				cmd);
 		return ERR_WRONG_NUM_PARAM;
 	}
@@ -531,6 +941,11 @@ static int eqmount_align(EqMountServer *server, const char *cmd, int argn,
 					server->getEqMount()->getCalibration().pa.azi);
 			stprintf(server->getStream(), "%s cone %.8f\n", cmd,
 					server->getEqMount()->getCalibration().cone);
+			stprintf(server->getStream(), "%s terms %.8f %.8f %.8f %.8f\n",
+					cmd, server->getEqMount()->getCalibration().np,
+					server->getEqMount()->getCalibration().tf,
+					server->getEqMount()->getCalibration().daf,
+					server->getEqMount()->getCalibration().fo);
 			stprintf(server->getStream(), "%s error %g\n", cmd,
 					server->getEqMount()->getCalibration().error);
 		}
@@ -568,6 +983,41 @@ static int eqmount_align(EqMountServer *server, const char *cmd, int argn,
 			return ERR_WRONG_NUM_PARAM;
 		}
 	}
+	else if (strcmp(argv[0], "terms") == 0)
+	{
+		static const char *names[PM_NUM_TERMS] =
+		{ "np", "tf", "daf", "fo" };
+		if (argn == 1)
+		{
+			// Show the terms that are fitted
+			int terms = server->getEqMount()->getPointingTerms();
+			stprintf(server->getStream(), "%s", cmd);
+			for (int j = 0; j < PM_NUM_TERMS; j++)
+			{
+				if (terms & (1 << j))
+					stprintf(server->getStream(), " %s", names[j]);
+			}
+			stprintf(server->getStream(), "\n");
+			return 0;
+		}
+		int terms = 0;
+		for (int i = 1; i < argn; i++)
+		{
+			int j;
+			for (j = 0; j < PM_NUM_TERMS; j++)
+			{
+				if (strcmp(argv[i], names[j]) == 0)
+					break;
+			}
+			if (j < PM_NUM_TERMS)
+				terms |= 1 << j;
+			else if (strcmp(argv[i], "all") == 0)
+				terms |= PM_TERMS_ALL;
+			else if (strcmp(argv[i], "none") != 0)
+				return ERR_PARAM_OUT_OF_RANGE;
+		}
+		return server->getEqMount()->setPointingTerms(terms);
+	}
 	else if (strcmp(argv[0], "clear") == 0)
 	{
 		if (argn != 1)
@@ -733,6 +1183,9 @@ static int eqmount_state(EqMountServer *server, const char *cmd, int argn,
 		case MOUNT_NUDGING_TRACKING:
 			s = "nudging_tracking";
 			break;
+		default:
+			s = "unknown";
+			break;
 		}
 		stprintf(server->getStream(), "%s %s\r\n", cmd, s);
 	}
@@ -748,12 +1201,11 @@ static int eqmount_help(EqMountServer *server, const char *cmd, int argn,
 		char *argv[])
 {
 	stprintf(server->getStream(), "%s Available commands: \r\n", cmd);
-	for (int i = 0; i < MAX_COMMAND; i++)
+	CommandTable &table = command_table();
+	for (int i = 0; i < table.size(); i++)
 	{
-		if (commandlist[i].fptr == NULL)
-			break;
-		stprintf(server->getStream(), "%s - %s : %s\r\n", cmd,
-				commandlist[i].cmd, commandlist[i].desc);
+		stprintf(server->getStream(), "%s - %s : %s\r\n", cmd, table[i].cmd,
+				table[i].desc);
 	}
 	return 0;
 }
@@ -762,10 +1214,10 @@ static int eqmount_guide(EqMountServer *server, const char *cmd, int argn,
 		char *argv[])
 {
 
-	if (argn != 2)
+	if (argn != 2 && argn != 3)
 	{
 		stprintf(server->getStream(),
-				"%s Usage: guide {north|west|south|east} milliseconds\r\n",
+				"%s Usage: guide {north|west|south|east} milliseconds [delay_ms]\r\n",
 				cmd);
 		return ERR_WRONG_NUM_PARAM;
 	}
@@ -773,26 +1225,34 @@ static int eqmount_guide(EqMountServer *server, const char *cmd, int argn,
 	char *tp;
 	int ms = strtod(argv[1], &tp);
 	if (tp == argv[1] || ms < 1
-			|| ms > TelescopeConfiguration::getInt("max_guide_time"))
+			|| ms > cfg_max_guide_time.get())
 	{
 		return ERR_PARAM_OUT_OF_RANGE;
 	}
+	double delay = 0;
+	if (argn == 3)
+	{
+		delay = strtod(argv[2], &tp);
+		// Same range as the binary protocol
+		if (tp == argv[2] || !(delay >= 0 && delay <= 65535))
+			return ERR_PARAM_OUT_OF_RANGE;
+	}
 
 	if (strcmp("north", argv[0]) == 0)
 	{
-		return server->getEqMount()->guide(GUIDE_NORTH, ms);
+		return server->getEqMount()->guide(GUIDE_NORTH, ms, (uint32_t) delay);
 	}
 	else if (strcmp("south", argv[0]) == 0)
 	{
-		return server->getEqMount()->guide(GUIDE_SOUTH, ms);
+		return server->getEqMount()->guide(GUIDE_SOUTH, ms, (uint32_t) delay);
 	}
 	else if (strcmp("west", argv[0]) == 0)
 	{
-		return server->getEqMount()->guide(GUIDE_WEST, ms);
+		return server->getEqMount()->guide(GUIDE_WEST, ms, (uint32_t) delay);
 	}
 	else if (strcmp("east", argv[0]) == 0)
 	{
-		return server->getEqMount()->guide(GUIDE_EAST, ms);
+		return server->getEqMount()->guide(GUIDE_EAST, ms, (uint32_t) delay);
 	}
 	else
 	{
@@ -859,6 +1319,48 @@ static int eqmount_time(EqMountServer *server, const char *cmd, int argn,
 	return 0;
 }
 
+static int eqmount_subscribe(EqMountServer *server, const char *cmd, int argn,
+		char *argv[])
+{
+	if (argn == 0)
+	{
+		stprintf(server->getStream(), "%s %.2f\r\n", cmd,
+				server->getTelemetryRate());
+		return 0;
+	}
+	else if (argn == 1)
+	{
+		double rate = 0;
+		if (strcmp(argv[0], "off") != 0)
+		{
+			char *tp;
+			rate = strtod(argv[0], &tp);
+			if (tp == argv[0] || *tp != '\0')
+				rate = -1; // Not a number, rejected by subscribe()
+		}
+		osStatus s = server->subscribe(rate,
+				server->getProtocol() == EMS_PROTOCOL_BINARY);
+		if (s == osErrorParameter)
+		{
+			stprintf(server->getStream(),
+					"%s usage: subscribe <rate in Hz, max %d>, or, subscribe off\r\n",
+					cmd, 1000 / EMS_TELEMETRY_TICK_MS);
+			return ERR_PARAM_OUT_OF_RANGE;
+		}
+		else if (s != osOK)
+		{
+			stprintf(server->getStream(), "%s Error: too many subscribers\r\n",
+					cmd);
+			return ERR_SERVER_BUSY;
+		}
+		return 0;
+	}
+	else
+	{
+		return ERR_WRONG_NUM_PARAM;
+	}
+}
+
 static int eqmount_settime(EqMountServer *server, const char *cmd, int argn,
 		char *argv[])
 {
@@ -905,42 +1407,240 @@ static int eqmount_settime(EqMountServer *server, const char *cmd, int argn,
 	return 0;
 }
 
-void EqMountServer::addCommand(const ServerCommand& cmd)
+static int eqmount_protocol(EqMountServer *server, const char *cmd, int argn,
+		char *argv[])
 {
-	int i = 0;
-	while (i < MAX_COMMAND && commandlist[i].fptr != NULL)
-		i++;
-	if (i >= MAX_COMMAND - 1)
+	if (argn == 0)
+	{
+		stprintf(server->getStream(), "%s %s\r\n", cmd,
+				(server->getProtocol() == EMS_PROTOCOL_BINARY) ?
+						"binary" : "text");
+	}
+	else if (argn == 1)
+	{
+		if (strcmp(argv[0], "text") == 0)
+			server->setProtocol(EMS_PROTOCOL_TEXT);
+		else if (strcmp(argv[0], "binary") == 0)
+			server->setProtocol(EMS_PROTOCOL_BINARY);
+		else
+			return ERR_PARAM_OUT_OF_RANGE;
+	}
+	else
+	{
+		return ERR_WRONG_NUM_PARAM;
+	}
+	return 0;
+}
+
+/* Commands of the binary protocol. Arguments are checked like their text counterparts */
+
+static int bp_read(EqMountServer *server, FrameReader &args, FrameWriter &reply)
+{
+	MountState state;
+	bp_state bs;
+	server->getEqMount()->getState(state);
+	to_bp_state(state, bs);
+	reply.putState(bs);
+	return 0;
+}
+
+static int bp_goto(EqMountServer *server, FrameReader &args, FrameWriter &reply)
+{
+	uint8_t coord;
+	double ra, dec;
+	args.getU8(coord);
+	args.getF64(ra);
+	args.getF64(dec);
+	if (!args.ok())
+		return ERR_WRONG_NUM_PARAM;
+	if (coord == BP_COORD_EQ)
+	{
+		if (!((ra <= 180.0) && (ra >= -180.0) && (dec <= 90.0) && (dec >= -90.0)))
+			return ERR_PARAM_OUT_OF_RANGE;
+		return server->getEqMount()->goTo(ra, dec);
+	}
+	else if (coord == BP_COORD_MOUNT)
+	{
+		if (!((ra <= 180.0) && (ra >= -180.0) && (dec <= 180.0)
+				&& (dec >= -180.0)))
+			return ERR_PARAM_OUT_OF_RANGE;
+		return server->getEqMount()->goToMount(MountCoordinates(dec, ra));
+	}
+	return ERR_PARAM_OUT_OF_RANGE;
+}
+
+static int bp_stop(EqMountServer *server, FrameReader &args, FrameWriter &reply)
+{
+	uint8_t what = 0;
+	if (args.remaining() > 0)
+		args.getU8(what);
+	if (what == 0)
+		server->getEqMount()->stopAsync();
+	else if (what == 1)
+		server->getEqMount()->stopTracking();
+	else
+		return ERR_PARAM_OUT_OF_RANGE;
+	return 0;
+}
+
+static int bp_estop(EqMountServer *server, FrameReader &args, FrameWriter &reply)
+{
+	server->getEqMount()->emergencyStop();
+	return 0;
+}
+
+static int bp_track(EqMountServer *server, FrameReader &args, FrameWriter &reply)
+{
+	return server->getEqMount()->startTracking();
+}
+
+static int bp_nudge(EqMountServer *server, FrameReader &args, FrameWriter &reply)
+{
+	uint8_t dir;
+	if (!args.getU8(dir))
+		return ERR_WRONG_NUM_PARAM;
+	if (dir & ~(NUDGE_EAST | NUDGE_WEST | NUDGE_NORTH | NUDGE_SOUTH))
+		return ERR_PARAM_OUT_OF_RANGE;
+	return server->getEqMount()->startNudge((nudgedir_t) dir);
+}
+
+static int bp_guide(EqMountServer *server, FrameReader &args, FrameWriter &reply)
+{
+	uint8_t dir;
+	uint16_t ms, delay = 0;
+	args.getU8(dir);
+	args.getU16(ms);
+	if (args.remaining() > 0)
+		args.getU16(delay);
+	if (!args.ok())
+		return ERR_WRONG_NUM_PARAM;
+	if (dir < GUIDE_EAST || dir > GUIDE_SOUTH || ms < 1
+			|| ms > cfg_max_guide_time.get())
+		return ERR_PARAM_OUT_OF_RANGE;
+	return server->getEqMount()->guide((guidedir_t) dir, ms, delay);
+}
+
+static int bp_subscribe(EqMountServer *server, FrameReader &args,
+		FrameWriter &reply)
+{
+	double rate;
+	if (!args.getF64(rate))
+		return ERR_WRONG_NUM_PARAM;
+	osStatus s = server->subscribe(rate, true);
+	if (s == osErrorParameter)
+		return ERR_PARAM_OUT_OF_RANGE;
+	else if (s != osOK)
+		return ERR_SERVER_BUSY;
+	return 0;
+}
+
+/// Binary commands, indexed by frame type
+static const BinaryCommand binary_commands[] =
+{
+{ 0, NULL, CMD_EXEC_INLINE },
+{ BP_OP_COMMAND, NULL, CMD_EXEC_INLINE }, /// Handled through the text command table
+{ BP_OP_READ, bp_read, CMD_EXEC_INLINE },
+{ BP_OP_GOTO, bp_goto, CMD_EXEC_QUEUED },
+{ BP_OP_STOP, bp_stop, CMD_EXEC_INLINE },
+{ BP_OP_ESTOP, bp_estop, CMD_EXEC_INLINE },
+{ BP_OP_TRACK, bp_track, CMD_EXEC_QUEUED },
+{ BP_OP_NUDGE, bp_nudge, CMD_EXEC_QUEUED },
+{ BP_OP_GUIDE, bp_guide, CMD_EXEC_QUEUED },
+{ BP_OP_SUBSCRIBE, bp_subscribe, CMD_EXEC_INLINE } };
+
+const BinaryCommand *EqMountServer::findBinaryCommand(uint8_t op)
+{
+	if (op >= sizeof(binary_commands) / sizeof(binary_commands[0])
+			|| binary_commands[op].fptr == NULL)
+		return NULL;
+	return &binary_commands[op];
+}
+
+CommandTable::CommandTable() :
+		count(0)
+{
+	memset(index, 0, sizeof(index));
+
+	/// Built-in commands
+	add(ServerCommand("stop", "Stop mount motion", eqmount_stop, CMD_EXEC_INLINE)); /// Stop
+	add(ServerCommand("estop", "Emergency stop", eqmount_estop, CMD_EXEC_INLINE)); /// Emergency Stop
+	add(ServerCommand("read", "Read current RA/DEC position", eqmount_read,
+			CMD_EXEC_INLINE)); /// Read Position
+	add(ServerCommand("time", "Get and set system time", eqmount_time,
+			CMD_EXEC_INLINE)); /// System time
+	add(ServerCommand("status", "Get the mount state", eqmount_state,
+			CMD_EXEC_INLINE)); /// System state
+	add(ServerCommand("help", "Print this help menu", eqmount_help,
+			CMD_EXEC_INLINE)); /// Help menu
+	add(ServerCommand("speed", "Set slew and tracking speed", eqmount_speed,
+			CMD_EXEC_INLINE)); /// Set speed
+	add(ServerCommand("align", "Star alignment", eqmount_align,
+			CMD_EXEC_INLINE)); /// Alignment
+	add(ServerCommand("goto",
+			"Perform go to operation to specified ra, dec coordinates",
+			eqmount_goto, CMD_EXEC_QUEUED)); /// Go to
+	add(ServerCommand("nudge", "Perform nudging on specified direction",
+			eqmount_nudge, CMD_EXEC_QUEUED)); /// Nudge
+	add(ServerCommand("track", "Start tracking in specified direction",
+			eqmount_track, CMD_EXEC_QUEUED)); /// Track
+	add(ServerCommand("guide", "Guide on specified direction", eqmount_guide,
+			CMD_EXEC_QUEUED)); /// Guide
+	add(ServerCommand("settime", "Set system time", eqmount_settime,
+			CMD_EXEC_QUEUED)); /// System time
+	add(ServerCommand("subscribe", "Push position telemetry at specified rate",
+			eqmount_subscribe, CMD_EXEC_INLINE)); /// Telemetry
+	add(ServerCommand("protocol", "Switch between text and binary protocol",
+			eqmount_protocol, CMD_EXEC_INLINE)); /// Protocol
+}
+
+bool CommandTable::add(const ServerCommand &cmd)
+{
+	if (count >= MAX_COMMAND)
 	{
 		debug("Error: max command reached.\n");
-		return;
+		return false;
+	}
+	uint32_t h = hash(cmd.cmd) & (COMMAND_HASH_SIZE - 1);
+	while (index[h] != 0)
+	{
+		if (strcmp(commands[index[h] - 1].cmd, cmd.cmd) == 0)
+		{
+			debug("Error: command %s already exists.\n", cmd.cmd);
+			return false;
+		}
+		h = (h + 1) & (COMMAND_HASH_SIZE - 1);
+	}
+	commands[count] = cmd;
+	index[h] = (uint8_t) ++count;
+	return true;
+}
+
+const ServerCommand *CommandTable::find(const char *name) const
+{
+	uint32_t h = hash(name) & (COMMAND_HASH_SIZE - 1);
+	while (index[h] != 0)
+	{
+		const ServerCommand *c = &commands[index[h] - 1];
+		if (strcmp(c->cmd, name) == 0)
+			return c;
+		h = (h + 1) & (COMMAND_HASH_SIZE - 1);
 	}
+	return NULL;
+}
 
-	commandlist[i] = cmd;
-	commandlist[++i] = ServerCommand("", "", NULL);
-}
-
-ServerCommand commandlist[MAX_COMMAND] =
-{ /// List of all commands
-		ServerCommand("stop", "Stop mount motion", eqmount_stop), 	/// Stop
-		ServerCommand("estop", "Emergency stop", eqmount_estop), /// Emergency Stop
-		ServerCommand("read", "Read current RA/DEC position", eqmount_read), /// Read Position
-		ServerCommand("time", "Get and set system time", eqmount_time), /// System time
-		ServerCommand("status", "Get the mount state", eqmount_state), /// System state
-		ServerCommand("help", "Print this help menu", eqmount_help), /// Help menu
-		ServerCommand("speed", "Set slew and tracking speed", eqmount_speed), /// Set speed
-		ServerCommand("align", "Star alignment", eqmount_align), /// Alignment
-		/// Above are allowed commands when another command is running
-
-				ServerCommand("goto",
-						"Perform go to operation to specified ra, dec coordinates",
-						eqmount_goto), 		/// Go to
-				ServerCommand("nudge", "Perform nudging on specified direction",
-						eqmount_nudge), 		/// Nudge
-				ServerCommand("track", "Start tracking in specified direction",
-						eqmount_track), 		/// Track
-				ServerCommand("guide", "Guide on specified direction",
-						eqmount_guide), /// Guide
-				ServerCommand("settime", "Set system time", eqmount_settime), /// System time
-				ServerCommand("", "", NULL) };
+static CommandTable &command_table()
+{
+	// Constructed on first use, so that commands can be added from static constructors in any file
+	static CommandTable table;
+	return table;
+}
 
+bool EqMountServer::addCommand(const ServerCommand &cmd)
+{
+	return command_table().add(cmd);
+}
+
+const ServerCommand *EqMountServer::findCommand(const char *name)
+{
+	return command_table().find(name);
+}
@@ -12,23 +12,128 @@ class EqMountServer;
 
 #include "MountServer.h"
 #include "EquatorialMount.h"
+#include "BinaryProtocol.h"
+
+/**
+ * How a command is executed by the server
+ */
+typedef enum
+{
+	CMD_EXEC_INLINE = 0, /// Run in the server thread. Must return quickly, can run while other commands are running
+	CMD_EXEC_QUEUED, /// Run in order on the dispatcher thread. Used by commands that move the mount
+	CMD_EXEC_LONG /// Long-running commands that do not move the mount, run on a separate background thread
+} command_exec_t;
 
 struct ServerCommand
 {
 	const char *cmd; /// Name of the command
 	const char *desc; /// Description of the command
 	int (*fptr)(EqMountServer *, const char *, int, char **); /// Function pointer to the command
+	command_exec_t exec; /// Execution class
 	ServerCommand(const char *n = "", const char *d = "",
-			int (*fp)(EqMountServer *, const char *, int, char **) = NULL) :
-			cmd(n), desc(d), fptr(fp)
+			int (*fp)(EqMountServer *, const char *, int, char **) = NULL,
+			command_exec_t e = CMD_EXEC_QUEUED) :
+			cmd(n), desc(d), fptr(fp), exec(e)
 	{
 	}
 };
 
+/**
+ * Command of the binary protocol, identified by the frame type
+ */
+struct BinaryCommand
+{
+	uint8_t op; /// Frame type of the request (bp_type_t)
+	/// Handler. Reads the arguments from args, and appends the data of the reply to reply
+	int (*fptr)(EqMountServer *, FrameReader &args, FrameWriter &reply);
+	command_exec_t exec; /// Execution class
+};
+
+/**
+ * Protocol spoken on the input stream
+ */
+typedef enum
+{
+	EMS_PROTOCOL_TEXT = 0, /// Command lines, replies as text lines
+	EMS_PROTOCOL_BINARY /// Frames as described in BinaryProtocol.h
+} ems_protocol_t;
+
 #define MAX_COMMAND 128
 
+/// Number of command lines that can be waiting or executing in the dispatchers at the same time
+#ifndef EMS_LINE_POOL_SIZE
+#define EMS_LINE_POOL_SIZE 8
+#endif
+/// Max length of a command line
+#define EMS_LINE_SIZE 256
+/// Stack of the server thread, which runs the inline commands. The alignment fit needs about 4KB
+#ifndef EMS_STACK_SIZE
+#define EMS_STACK_SIZE (2 * OS_STACK_SIZE)
+#endif
+/// Max number of arguments of a command
+#define EMS_MAX_ARGS 16
+
+/// Period of the telemetry producer in ms. Subscription rates are rounded to a multiple of it
+#define EMS_TELEMETRY_TICK_MS 50
+/// Max number of servers subscribed to telemetry at the same time
+#define EMS_MAX_SUBSCRIBERS 4
+
 #define ERR_WRONG_NUM_PARAM 1
 #define ERR_PARAM_OUT_OF_RANGE 2
+#define ERR_SERVER_BUSY 3
+#define ERR_UNKNOWN_COMMAND 4
+
+/**
+ * A received command line, parsed in place. Lines are taken from a fixed pool and handed to
+ * the dispatcher thread with queued commands, which returns them to the pool when done.
+ * A binary request uses the same slot: the payload is kept in buffer.
+ */
+struct CommandLine
+{
+	char buffer[EMS_LINE_SIZE]; /// Text of the line, split into tokens, or payload of a binary request
+	char *argv[EMS_MAX_ARGS]; /// Arguments, pointing into buffer
+	int argn;
+	ServerCommand cmd;
+	bool binary; /// Received as a binary frame, the reply is sent as a frame
+	uint16_t reqid; /// Request id of a binary frame
+	uint8_t op; /// Frame type of a binary request
+	const BinaryCommand *bcmd; /// Binary command, NULL if the request is a text command line
+	size_t length; /// Payload length of a binary command
+	uint32_t received; /// us_ticker_read() when the request was received
+};
+
+/**
+ * Output stream handed to the commands. Writes from a thread that is executing a binary request
+ * are sent as BP_MSG_TEXT frames with the id of that request, other writes go to the stream as is.
+ */
+class FramedStream: public FileHandle
+{
+public:
+	FramedStream(EqMountServer &server) :
+			server(server)
+	{
+	}
+
+	ssize_t read(void *buffer, size_t size)
+	{
+		return -1;
+	}
+
+	ssize_t write(const void *buffer, size_t size);
+
+	off_t seek(off_t offset, int whence = SEEK_SET)
+	{
+		return -1;
+	}
+
+	int close()
+	{
+		return 0;
+	}
+
+private:
+	EqMountServer &server;
+};
 
 class EqMountServer: public MountServer
 {
@@ -40,7 +145,41 @@ protected:
 
 	void task_thread();
 
-	void command_execute(ServerCommand &, int argn, char *argv[], char *buffer);
+	MemoryPool<CommandLine, EMS_LINE_POOL_SIZE> linePool;
+
+	ems_protocol_t protocol; /// Protocol of the input
+	volatile ems_protocol_t nextProtocol; /// Protocol after the current request
+	FrameDecoder decoder;
+	mutable FramedStream output;
+
+	/**
+	 * Request being executed by each of the server threads, indexed by execution class
+	 */
+	struct ExecContext
+	{
+		osThreadId thread;
+		const CommandLine *line;
+	} exec_ctx[3];
+
+	int telemetryDivider; /// Telemetry is sent every this many ticks, 0 if not subscribed
+	bool telemetryBinary; /// Telemetry is sent as BP_MSG_TELEMETRY frames
+	uint32_t telemetrySeq; /// Sequence number of the next telemetry frame
+
+	static EqMountServer *subscribers[EMS_MAX_SUBSCRIBERS];
+	static Mutex subscriber_mutex; /// Protects subscribers, not held while writing
+	static EqMountServer *volatile telemetry_writing; /// Server the telemetry is being written to
+	static Thread *telemetry_thread;
+	static void telemetry_task();
+
+	void command_execute(CommandLine *line);
+
+	int read_line(char *buffer);
+	int read_frame(CommandLine *line);
+	bool parse_line(CommandLine *line);
+	void execute(CommandLine *line, command_exec_t cls);
+	void send_status(const CommandLine *line, int ret);
+
+	friend class FramedStream;
 
 public:
 	EqMountServer(FileHandle &stream, bool echo = false);
@@ -56,12 +195,60 @@ public:
 		return eq_mount;
 	}
 
+	/**
+	 * @return stream to write the output of a command to
+	 */
 	FileHandle& getStream() const
 	{
-		return stream;
+		return output;
+	}
+
+	/**
+	 * Select the protocol of the input stream. Takes effect after the request being executed,
+	 * so the reply to a command that switches protocol is sent in the old one.
+	 */
+	void setProtocol(ems_protocol_t p)
+	{
+		nextProtocol = p;
+	}
+
+	ems_protocol_t getProtocol() const
+	{
+		return nextProtocol;
 	}
 
-	static void addCommand(const ServerCommand &cmd);
+	/**
+	 * Register a command. Can be called at any time, including from static constructors
+	 * @return false if the command table is full or a command with the same name exists
+	 */
+	static bool addCommand(const ServerCommand &cmd);
+
+	/**
+	 * Subscribe to position telemetry. The frames are pushed to the stream by a shared producer thread
+	 * @param rate frames per second, 0 to unsubscribe
+	 * @param binary send BP_MSG_TELEMETRY frames instead of text lines
+	 * @return osOK, osErrorParameter if the rate is out of range, or osErrorResource if there are too many subscribers
+	 */
+	osStatus subscribe(double rate, bool binary = false);
+
+	/** @return current telemetry rate in frames per second, 0 if not subscribed */
+	double getTelemetryRate() const
+	{
+		return telemetryDivider ?
+				1000.0 / (telemetryDivider * EMS_TELEMETRY_TICK_MS) : 0;
+	}
+
+	/**
+	 * Find a command by name
+	 * @return the command, or NULL if not found
+	 */
+	static const ServerCommand *findCommand(const char *name);
+
+	/**
+	 * Find a command of the binary protocol
+	 * @return the command, or NULL if op is not a request type
+	 */
+	static const BinaryCommand *findBinaryCommand(uint8_t op);
 };
 
 /**
@@ -3,15 +3,21 @@
 
 #define EM_DEBUG 1
 
+static ConfigHandle<bool> cfg_sync_slew("sync_slew");
+static ConfigHandle<int> cfg_track_mode("track_mode");
+static ConfigHandle<bool> cfg_track_pointing_model("track_pointing_model");
+static ConfigHandle<double> cfg_track_update_interval("track_update_interval");
+
 EquatorialMount::EquatorialMount(Axis& ra, Axis& dec, UTCClock& clk,
 		LocationCoordinates loc) :
-		ra(ra), dec(dec), clock(clk), location(loc), curr_pos(0, 0), curr_nudge_dir(
-				NUDGE_NONE), nudgeSpeed(0), pier_side(PIER_SIDE_EAST), num_alignment_stars(
-				0)
+		ra(ra), dec(dec), clock(clk), location(loc), config_version(0), curr_pos(0, 0), curr_nudge_dir(
+				NUDGE_NONE), nudgeSpeed(0), nudgeTarget(0), nudgeTargetTime(0), nudgeStart(0), pier_side(PIER_SIDE_EAST), num_alignment_stars(
+				0), pointing_terms(PM_TERMS_ALL), track_thread(NULL)
 {
 	south = loc.lat < 0.0;
 	// Get initial transformation
 	calibration.pa = AzimuthalCoordinates(loc.lat, 0);
+	model.update(calibration, location);
 	// Set RA and DEC positions to zero
 	ra.setAngleDeg(0);
 	dec.setAngleDeg(0);
@@ -27,30 +33,130 @@ osStatus EquatorialMount::goTo(double ra_dest, double dec_dest)
 	return goTo(EquatorialCoordinates(dec_dest, ra_dest));
 }
 
+static axisrotdir_t slew_direction(double from, double to)
+{
+	from = remainder(from, 360.0);
+	to = remainder(to, 360.0);
+	return (to > from) ? AXIS_ROTATE_POSITIVE :
+			(to < from) ? AXIS_ROTATE_NEGATIVE : AXIS_ROTATE_STOP;
+}
+
+/**
+ * Angle of a slew in the direction given by slew_direction
+ */
+static double slew_angle(double from, double to)
+{
+	return fabs(remainder(to, 360.0) - remainder(from, 360.0));
+}
+
+double EquatorialMount::planSlew(double ra_angle, double dec_angle,
+		double &ra_speed, double &dec_speed)
+{
+	ra_speed = dec_speed = 0;
+	double t_ra = ra.getSlewTime(ra_angle);
+	double t_dec = dec.getSlewTime(dec_angle);
+	if (cfg_sync_slew.get())
+	{
+		if (t_ra > t_dec)
+			dec_speed = dec.getSlewSpeedFor(dec_angle, t_ra);
+		else if (t_dec > t_ra)
+			ra_speed = ra.getSlewSpeedFor(ra_angle, t_dec);
+	}
+	return (t_ra > t_dec) ? t_ra : t_dec;
+}
+
 osStatus EquatorialMount::goTo(EquatorialCoordinates dest)
 {
 
 	debug_if(EM_DEBUG, "dest ra=%.2f, dec=%.2f\n", dest.ra, dest.dec);
 
+	mutex_execution.lock();
+	bool was_tracking = false;
+	if (status == MOUNT_TRACKING)
+	{
+		was_tracking = true;
+		stopSync();
+	}
+	else if (status != MOUNT_STOPPED)
+	{
+		debug("EM: goTo requested while mount is not stopped.\n");
+		mutex_execution.unlock();
+		return osErrorParameter;
+	}
+
 	updatePosition(); // Get the latest position information
 
 	if (EM_DEBUG)
 		printPosition();
 
-	for (int i = 0; i < 2; i++)
+	// Convert to Mount coordinates. Automatically determine the pier side, then apply offset
+	time_t now = clock.getTime();
+	MountCoordinates dest_now = model.toMount(dest, now);
+
+	// The target moves during the slew. Aim at where it will be when the slower axis gets there
+	double ra_speed, dec_speed;
+	double t = planSlew(slew_angle(curr_pos.ra_delta, dest_now.ra_delta),
+			slew_angle(curr_pos.dec_delta, dest_now.dec_delta), ra_speed,
+			dec_speed);
+	MountCoordinates dest_mount = model.toMount(dest,
+			now + (time_t) ceil(t), dest_now.side);
+	if (dest_mount.side != dest_now.side)
+	{
+		dest_mount = dest_now; // Crossing the meridian during the slew, stay on the side we started from
+	}
+	debug_if(EM_DEBUG, "EM: goTo, estimated %.1f s\n", t);
+	debug_if(EM_DEBUG, "dstmnt ra=%.2f, dec=%.2f\n", dest_mount.ra_delta,
+			dest_mount.dec_delta);
+
+	status = MOUNT_SLEWING;
+	if (was_tracking)
+	{
+		// RA intercepts the target and keeps tracking it. The axis follows the target from its current position
+		axisrotdir_t ra_dir = slew_direction(curr_pos.ra_delta,
+				dest_now.ra_delta);
+		ra.startSlewToTrack(
+				(ra_dir == AXIS_ROTATE_STOP) ? AXIS_ROTATE_POSITIVE : ra_dir,
+				dest_now.ra_delta, AXIS_ROTATE_POSITIVE, ra_speed);
+	}
+	else
 	{
-		// Convert to Mount coordinates. Automatically determine the pier side, then apply offset
-		MountCoordinates dest_mount = convertToMountCoordinates(dest);
+		ra.startSlewTo(slew_direction(curr_pos.ra_delta, dest_mount.ra_delta),
+				dest_mount.ra_delta, true, ra_speed);
+	}
+	dec.startSlewTo(slew_direction(curr_pos.dec_delta, dest_mount.dec_delta),
+			dest_mount.dec_delta, true, dec_speed);
 
-		osStatus s = goToMount(dest_mount, (i > 0)); // Use correction only for the second time
-		if (s != osOK)
-			return s;
+	int ret = (int) ra.waitForSlew();
+	ret |= (int) dec.waitForSlew();
+
+	debug_if(EM_DEBUG, "EM: slewing finished\n");
+
+	if (was_tracking && !ret)
+	{
+		// RA is tracking already
+		status = MOUNT_TRACKING;
+		dec.startTracking(AXIS_ROTATE_STOP);
+		updateTracking();
 	}
+	else
+	{
+		// Stopped during slew
+		stopSync();
+	}
+
+	mutex_execution.unlock();
+
+	if (was_tracking && ret && !(ret & (FINISH_ERROR | FINISH_EMERG_STOPPED)))
+	{
+		startTracking();
+	}
+
+	updatePosition(); // Update current position
 
 	if (EM_DEBUG)
 		printPosition();
 
-	return osOK;
+	return ret ? (osStatus) ret : osOK;
 }
 
 osStatus EquatorialMount::goToMount(MountCoordinates dest_mount,
@@ -73,26 +179,20 @@ bool withCorrection)
 	debug_if(EM_DEBUG, "dstmnt ra=%.2f, dec=%.2f\n", dest_mount.ra_delta,
 			dest_mount.dec_delta);
 
-	axisrotdir_t dec_dir, ra_dir;
-	ra_dir =
-			(remainder(dest_mount.ra_delta, 360.0)
-					> remainder(curr_pos.ra_delta, 360.0)) ?
-					AXIS_ROTATE_POSITIVE :
-			(remainder(dest_mount.ra_delta, 360.0)
-					< remainder(curr_pos.ra_delta, 360.0)) ?
-					AXIS_ROTATE_NEGATIVE : AXIS_ROTATE_STOP;
-	dec_dir =
-			(remainder(dest_mount.dec_delta, 360.0)
-					> remainder(curr_pos.dec_delta, 360.0)) ?
-					AXIS_ROTATE_POSITIVE :
-			(remainder(dest_mount.dec_delta, 360.0)
-					< remainder(curr_pos.dec_delta, 360.0)) ?
-					AXIS_ROTATE_NEGATIVE : AXIS_ROTATE_STOP;
-
-	debug_if(EM_DEBUG, "EM: start slewing\n");
+	axisrotdir_t ra_dir = slew_direction(curr_pos.ra_delta,
+			dest_mount.ra_delta);
+	axisrotdir_t dec_dir = slew_direction(curr_pos.dec_delta,
+			dest_mount.dec_delta);
+
+	double ra_speed, dec_speed;
+	double t = planSlew(slew_angle(curr_pos.ra_delta, dest_mount.ra_delta),
+			slew_angle(curr_pos.dec_delta, dest_mount.dec_delta), ra_speed,
+			dec_speed);
+
+	debug_if(EM_DEBUG, "EM: start slewing, estimated %.1f s\n", t);
 	status = MOUNT_SLEWING;
-	ra.startSlewTo(ra_dir, dest_mount.ra_delta, withCorrection);
-	dec.startSlewTo(dec_dir, dest_mount.dec_delta, withCorrection);
+	ra.startSlewTo(ra_dir, dest_mount.ra_delta, withCorrection, ra_speed);
+	dec.startSlewTo(dec_dir, dest_mount.dec_delta, withCorrection, dec_speed);
 
 	int ret = (int) ra.waitForSlew();
 	ret |= (int) dec.waitForSlew();
@@ -120,6 +220,11 @@ bool withCorrection)
 }
 
 osStatus EquatorialMount::startTracking()
+{
+	return beginTracking(false);
+}
+
+osStatus EquatorialMount::beginTracking(bool catchUp)
 {
 	if (status != MOUNT_STOPPED)
 	{
@@ -131,8 +236,11 @@ osStatus EquatorialMount::startTracking()
 	axisrotdir_t ra_dir = AXIS_ROTATE_POSITIVE; // Tracking is always going to positive hour angle direction, which is defined as positive.
 	status = MOUNT_TRACKING;
 	osStatus sr, sd;
-	sr = ra.startTracking(ra_dir);
+	sr = catchUp ?
+			ra.startTracking(ra_dir, nudgeTarget, nudgeTargetTime) :
+			ra.startTracking(ra_dir);
 	sd = dec.startTracking(AXIS_ROTATE_STOP);
+	updateTracking();
 	mutex_execution.unlock();
 	if (sr != osOK || sd != osOK)
 		return osErrorResource;
@@ -140,6 +248,97 @@ osStatus EquatorialMount::startTracking()
 		return osOK;
 }
 
+void EquatorialMount::updateTracking()
+{
+	int mode = cfg_track_mode.get();
+	if (mode != TRACK_MODE_CONSTANT && !track_thread)
+	{
+		track_thread = new Thread(osPriorityBelowNormal, OS_STACK_SIZE, NULL,
+				"EM tracking");
+		track_thread->start(callback(this, &EquatorialMount::track_task));
+	}
+
+	mutex_execution.lock();
+	if (status != MOUNT_TRACKING)
+	{
+		mutex_execution.unlock();
+		return;
+	}
+	double ra_offset = 0, dec_offset = 0;
+	if (mode != TRACK_MODE_CONSTANT)
+	{
+		updatePosition();
+		mutex_update.lock();
+		// Rates over the next update interval, from the positions at both ends.
+		// The offsets are taken relative to the motion of an ideal mount, which is what the tracking speed follows
+		time_t t0 = clock.getTime();
+		time_t t1 = t0 + (time_t) ceil(cfg_track_update_interval.get());
+		double dt = (double) (t1 - t0);
+		EqCalibration ideal_calib;
+		ideal_calib.pa = AzimuthalCoordinates(location.lat, 0);
+		MountModel ideal(ideal_calib, location);
+		MountCoordinates q0 = ideal.toMount(curr_pos_eq, t0, curr_pos.side);
+		MountCoordinates q1 = ideal.toMount(curr_pos_eq, t1, curr_pos.side);
+		double ra_base = remainder(q1.ra_delta - q0.ra_delta, 360.0) / dt;
+		double dec_base = remainder(q1.dec_delta - q0.dec_delta, 360.0) / dt;
+		if (mode == TRACK_MODE_KING)
+		{
+			ra_offset = ra_base
+					* (CelestialMath::kingRate(curr_pos_eq, location, t0)
+							/ sidereal_speed - 1);
+		}
+		else
+		{
+			const MountModel &m = cfg_track_pointing_model.get() ? model : ideal;
+			MountCoordinates p0 = m.toMount(
+					CelestialMath::applyRefraction(curr_pos_eq, t0, location),
+					t0, curr_pos.side);
+			MountCoordinates p1 = m.toMount(
+					CelestialMath::applyRefraction(curr_pos_eq, t1, location),
+					t1, curr_pos.side);
+			ra_offset = remainder(p1.ra_delta - p0.ra_delta, 360.0) / dt
+					- ra_base;
+			dec_offset = remainder(p1.dec_delta - p0.dec_delta, 360.0) / dt
+					- dec_base;
+		}
+		mutex_update.unlock();
+		debug_if(EM_DEBUG > 1, "EM: track offsets ra=%.3f dec=%.3f arcsec/s\n",
+				ra_offset * 3600, dec_offset * 3600);
+	}
+	if (ra_offset != ra.getTrackOffset())
+		ra.setTrackOffset(ra_offset);
+	if (dec_offset != dec.getTrackOffset())
+		dec.setTrackOffset(dec_offset);
+	mutex_execution.unlock();
+}
+
+void EquatorialMount::track_task()
+{
+	while (true)
+	{
+		Thread::wait((uint32_t) (cfg_track_update_interval.get() * 1000));
+		updateTracking();
+	}
+}
+
+void EquatorialMount::endRANudge(nudgedir_t dir)
+{
+	uint32_t now = osKernelGetTickCount();
+	double angle = nudgeSpeed * (uint32_t) (now - nudgeStart) * 0.001;
+	if (dir & NUDGE_WEST)
+		nudgeTarget += angle;
+	else if (dir & NUDGE_EAST)
+		nudgeTarget -= angle;
+	nudgeStart = now;
+}
+
+/*
+ * While tracking, RA nudges are relative to the tracked target. nudgeTarget is where the target was when the
+ * nudge started, moved by the nudge speed times the duration of each RA nudge, as a nudge without tracking
+ * would move. When its nudge ends, RA tracks again and pays back the tracking it missed while stopping and
+ * ramping, which the speeds of the nudge cannot make up for: the tracking speed is below the resolution of the
+ * speed ramps.
+ */
 osStatus EquatorialMount::startNudge(nudgedir_t newdir)
 { // Update new status
 	if (status != MOUNT_STOPPED && status != MOUNT_TRACKING
@@ -154,6 +353,8 @@ osStatus EquatorialMount::startNudge(nudgedir_t newdir)
 		if (status & MOUNT_NUDGING)
 		{
 			mountstatus_t oldstatus = status;
+			if (oldstatus == MOUNT_NUDGING_TRACKING)
+				endRANudge(curr_nudge_dir);
 			stopAsync(); // Stop the mount
 			if (oldstatus == MOUNT_NUDGING)
 			{
@@ -163,7 +364,7 @@ osStatus EquatorialMount::startNudge(nudgedir_t newdir)
 			{
 				// Get to tracking state
 				ra.setSlewSpeed(nudgeSpeed); // restore the slew rate of RA
-				startTracking();
+				beginTracking(true);
 			}
 		}
 	}
@@ -171,12 +372,17 @@ osStatus EquatorialMount::startNudge(nudgedir_t newdir)
 	{ // newdir is not NUDGE_NONE
 		updatePosition(); // Update current position, because we need to know the current pier side
 		bool ra_changed = false, dec_changed = false;
-		axisrotdir_t ra_dir, dec_dir;
+		axisrotdir_t ra_dir = AXIS_ROTATE_STOP, dec_dir = AXIS_ROTATE_STOP;
 		if ((status & MOUNT_NUDGING) == 0)
 		{
 			// Initial nudge
 			curr_nudge_dir = NUDGE_NONE; //Make sure the current nudging direction is cleared
 			nudgeSpeed = getSlewSpeed(); // Get nudge speed and use it for ALL following nudge operations, until the nudge finishes
+			if (status & MOUNT_TRACKING)
+			{
+				nudgeTarget = ra.getAngleDeg();
+				nudgeTargetTime = nudgeStart = osKernelGetTickCount();
+			}
 		}
 		// see what has changed in RA
 		if ((curr_nudge_dir & (NUDGE_WEST | NUDGE_EAST))
@@ -224,6 +430,7 @@ osStatus EquatorialMount::startNudge(nudgedir_t newdir)
 				dec_dir = AXIS_ROTATE_STOP;
 			}
 		}
+		nudgedir_t old_nudge_dir = curr_nudge_dir;
 		curr_nudge_dir = newdir;
 
 		// Request stop as necessary
@@ -275,9 +482,11 @@ osStatus EquatorialMount::startNudge(nudgedir_t newdir)
 		{
 			if (status & MOUNT_TRACKING)
 			{ // In tracking mode now
+				endRANudge(old_nudge_dir);
 				if (ra_dir == AXIS_ROTATE_STOP)
 				{ // resume tracking
-					s = ra.startTracking(AXIS_ROTATE_POSITIVE);
+					s = ra.startTracking(AXIS_ROTATE_POSITIVE, nudgeTarget,
+							nudgeTargetTime);
 				}
 				else
 				{
@@ -351,6 +560,16 @@ double EquatorialMount::getGuideSpeedSidereal()
 	return ra.getGuideSpeedSidereal();
 }
 
+double EquatorialMount::getTrackingRateSidereal()
+{
+	return ra.getTrackingRateSidereal();
+}
+
+double EquatorialMount::getTrackingDrift()
+{
+	return ra.getTrackingDrift();
+}
+
 osStatus EquatorialMount::stopTracking()
 {
 	if ((status & MOUNT_TRACKING) == 0)
@@ -375,14 +594,43 @@ void EquatorialMount::updatePosition()
 	// Lock the mutex to avoid race condition on the current position values
 	mutex_update.lock();
 	curr_pos = MountCoordinates(dec.getAngleDeg(), ra.getAngleDeg());
-	// Update location
-	location.lat = TelescopeConfiguration::getDouble("latitude");
-	location.lon = TelescopeConfiguration::getDouble("longitude");
+	// Update location, only if the configuration was changed
+	if (TelescopeConfiguration::changedSince(config_version))
+	{
+		LocationCoordinates loc(TelescopeConfiguration::getDouble("latitude"),
+				TelescopeConfiguration::getDouble("longitude"));
+		if (loc.lat != location.lat || loc.lon != location.lon)
+		{
+			location = loc;
+			model.update(calibration, location);
+		}
+	}
 	// Update Eq coordinates
 	curr_pos_eq = this->convertToEqCoordinates(curr_pos);
 	mutex_update.unlock();
 }
 
+static double signed_speed(const Axis &axis)
+{
+	return (axis.getCurrentDirection() == AXIS_ROTATE_NEGATIVE) ?
+			-axis.getCurrentSpeed() : axis.getCurrentSpeed();
+}
+
+void EquatorialMount::getState(MountState &state)
+{
+	mutex_update.lock();
+	updatePosition(); // Mutex is recursive
+	state.time = clock.getTime();
+	state.eq = curr_pos_eq;
+	state.mount = curr_pos;
+	state.status = status;
+	state.ra_speed = signed_speed(ra);
+	state.dec_speed = signed_speed(dec);
+	state.ra_slew = ra.getSlewState();
+	state.dec_slew = dec.getSlewState();
+	mutex_update.unlock();
+}
+
 void EquatorialMount::emergencyStop()
 {
 	ra.emergency_stop();
@@ -418,39 +666,53 @@ osStatus EquatorialMount::recalibrate()
 	{
 		return osOK;
 	}
-	EqCalibration newcalib = CelestialMath::align(num_alignment_stars,
-			alignment_stars, location, diverge);
+	EqCalibration newcalib;
+	if (num_alignment_stars >= 3)
+	{
+		// Keep the solution for adding more stars
+		newcalib = fit.fit(num_alignment_stars, alignment_stars, location,
+				pointing_terms, diverge);
+	}
+	else
+	{
+		fit.reset();
+		newcalib = CelestialMath::align(num_alignment_stars, alignment_stars,
+				location, diverge);
+	}
 	if (diverge)
 	{
+		fit.reset();
 		return osErrorParameter;
 	}
 
 	calibration = newcalib;
+	model.update(calibration, location);
 
 	return osOK;
 }
 
-osStatus EquatorialMount::guide(guidedir_t dir, int ms)
+osStatus EquatorialMount::guide(guidedir_t dir, int ms, uint32_t delay_ms)
 {
 	// Check we are in tracking mode
 	if (status != MOUNT_TRACKING)
 	{
 		return osErrorResource;
 	}
+	uint32_t start = osKernelGetTickCount() + delay_ms;
 	switch (dir)
 	{
 	case GUIDE_EAST:
-		return ra.guide(AXIS_ROTATE_NEGATIVE, ms);
+		return ra.guide(AXIS_ROTATE_NEGATIVE, ms, start);
 	case GUIDE_WEST:
-		return ra.guide(AXIS_ROTATE_POSITIVE, ms);
+		return ra.guide(AXIS_ROTATE_POSITIVE, ms, start);
 	case GUIDE_NORTH:
 		return dec.guide(
 				(curr_pos.side == PIER_SIDE_WEST) ?
-						AXIS_ROTATE_NEGATIVE : AXIS_ROTATE_POSITIVE, ms);
+						AXIS_ROTATE_NEGATIVE : AXIS_ROTATE_POSITIVE, ms, start);
 	case GUIDE_SOUTH:
 		return dec.guide(
 				(curr_pos.side == PIER_SIDE_WEST) ?
-						AXIS_ROTATE_POSITIVE : AXIS_ROTATE_NEGATIVE, ms);
+						AXIS_ROTATE_POSITIVE : AXIS_ROTATE_NEGATIVE, ms, start);
 	default:
 		return osErrorParameter;
 	}
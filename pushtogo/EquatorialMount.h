@@ -9,7 +9,9 @@ class EquatorialMount;
 #include "LocationProvider.h"
 #include "CelestialMath.h"
 
-#define MAX_AS_N 10 // Max number of alignment stars
+#ifndef MAX_AS_N
+#define MAX_AS_N 100 // Max number of alignment stars. The solver has no limit, this only sizes the storage
+#endif
 
 /**
  * Direction of nudge
@@ -36,6 +38,31 @@ typedef enum
 	GUIDE_EAST = 1, GUIDE_WEST = 2, GUIDE_NORTH = 3, GUIDE_SOUTH = 4,
 } guidedir_t;
 
+/**
+ * Tracking rate model, see the track_mode configuration
+ */
+typedef enum
+{
+	TRACK_MODE_CONSTANT = 0, /// Constant tracking speed on RA
+	TRACK_MODE_KING = 1, /// King rate on RA
+	TRACK_MODE_REFRACTION = 2, /// Apparent motion of the target with refraction, on both axes
+} trackmode_t;
+
+/**
+ * State of the mount at one instant
+ */
+struct MountState
+{
+	time_t time; /// UTC time of the snapshot
+	EquatorialCoordinates eq; /// Pointing direction in the sky
+	MountCoordinates mount; /// Position in mount coordinates, including the pier side
+	mountstatus_t status;
+	double ra_speed; /// Current speed of RA axis in deg/s, negative when rotating in the negative direction
+	double dec_speed; /// Current speed of DEC axis in deg/s
+	int ra_slew; /// Slew state of RA axis (axisslewstate_t)
+	int dec_slew; /// Slew state of DEC axis (axisslewstate_t)
+};
+
 /**
  * Object that represents an equatorial mount with two perpendicular axis called RA and Dec.
  */
@@ -52,16 +79,57 @@ protected:
 	Mutex mutex_execution; /// Mutex to lock motion related functions
 
 	LocationCoordinates location;   /// Current location (GPS coordinates)
+	uint32_t config_version; /// Configuration version location was last read from
 	bool south;	/// If we are in south semisphere
 	MountCoordinates curr_pos; /// Current Position in mount coordinates (offset from the index positions)
 	EquatorialCoordinates curr_pos_eq; /// Current Position in the equatorial coordinates (absolute pointing direction in the sky)
 	nudgedir_t curr_nudge_dir;
 	double nudgeSpeed;
+	double nudgeTarget; /// RA angle of the target at nudgeTargetTime, moved by the RA nudges, when nudging while tracking
+	uint32_t nudgeTargetTime; /// Kernel tick of nudgeTarget
+	uint32_t nudgeStart; /// Kernel tick at which the current RA nudge started
 
 	pierside_t pier_side;      /// Side of pier. 1: East
 	EqCalibration calibration;
+	MountModel model; /// Conversion model built from calibration and location
 	AlignmentStar alignment_stars[MAX_AS_N];
 	int num_alignment_stars;
+	PointingModelFit fit; /// Solution of the last full fit, for adding stars one by one
+	int pointing_terms; /// Optional terms of the pointing model to fit (pmterm_t)
+	Thread *track_thread; /// Thread updating the tracking rates, created when a tracking rate model is used
+
+	int fitTerms(int n) const
+	{
+		return (n >= PM_MIN_STARS_TERMS) ? pointing_terms : 0;
+	}
+
+	/**
+	 * Plan a slew of both axes. With coordinated slews, the axis with the shorter slew is slowed down so that
+	 * both axes arrive at the same time
+	 * @param ra_speed, dec_speed Max speed for each axis, 0 for the slew speed
+	 * @return estimated time of the slew in seconds
+	 */
+	double planSlew(double ra_angle, double dec_angle, double &ra_speed,
+			double &dec_speed);
+
+	/**
+	 * Compute the tracking rates of the target at the current position with the tracking rate model,
+	 * and push them to the axes as offsets from the tracking speed
+	 */
+	void updateTracking();
+	void track_task();
+
+	/**
+	 * Start tracking from the stopped state
+	 * @param catchUp RA catches up with nudgeTarget, after a nudge while tracking
+	 */
+	osStatus beginTracking(bool catchUp);
+
+	/**
+	 * Move nudgeTarget by the RA nudge that ends now, when nudging while tracking
+	 * @param dir Nudge direction until now
+	 */
+	void endRANudge(nudgedir_t dir);
 
 public:
 
@@ -101,8 +169,10 @@ public:
 
 	/**
 	 * Guide on specified direction for specified time
+	 * @param delay_ms Time in ms from now to the start of the pulse, so that a burst of pulses can be sent ahead
+	 * of time. Pulses that overlap are merged, see Axis::guide
 	 */
-	osStatus guide(guidedir_t dir, int ms);
+	osStatus guide(guidedir_t dir, int ms, uint32_t delay_ms = 0);
 
 	/*Calibration related functions*/
 	/**
@@ -111,8 +181,10 @@ public:
 	void clearCalibration()
 	{
 		num_alignment_stars = 0;
+		fit.reset();
 		calibration = EqCalibration();
 		calibration.pa.alt = location.lat;
+		model.update(calibration, location);
 	}
 
 	const EqCalibration &getCalibration() const
@@ -130,6 +202,16 @@ public:
 		if (num_alignment_stars < MAX_AS_N)
 		{
 			alignment_stars[num_alignment_stars++] = as;
+			if (fit.canAdd(fitTerms(num_alignment_stars)))
+			{
+				// Update the last solution with the new star instead of fitting all stars again
+				fit.add(as, location, calibration);
+				calibration.error = CelestialMath::alignmentError(
+						num_alignment_stars, alignment_stars, calibration,
+						location);
+				model.update(calibration, location);
+				return osOK;
+			}
 			return recalibrate();
 		}
 		else
@@ -147,6 +229,7 @@ public:
 			alignment_stars[index] = alignment_stars[index + 1];
 		}
 		num_alignment_stars--;
+		fit.reset();
 		return recalibrate();
 	}
 
@@ -166,36 +249,48 @@ public:
 			return osErrorParameter;
 		}
 		alignment_stars[index] = as;
+		fit.reset();
 		return recalibrate();
 	}
 
 	/*Utility functions to convert between coordinate systems*/
 	MountCoordinates convertToMountCoordinates(const EquatorialCoordinates &eq)
 	{
-		LocalEquatorialCoordinates leq =
-				CelestialMath::equatorialToLocalEquatorial(eq, clock.getTime(),
-						location);
-		// Apply PA misalignment
-		leq = CelestialMath::applyMisalignment(leq, calibration.pa, location);
-		// Apply Cone error
-		leq = CelestialMath::applyConeError(leq, calibration.cone);
-		// Convert to Mount coordinates. Automatically determine the pier side, then apply offset
-		return CelestialMath::localEquatorialToMount(leq, PIER_SIDE_AUTO)
-				+ calibration.offset;
+		// Apply PA misalignment, cone error and offset. Automatically determine the pier side
+		return model.toMount(eq, clock.getTime(), PIER_SIDE_AUTO);
 	}
 
 	EquatorialCoordinates convertToEqCoordinates(const MountCoordinates &mc)
 	{
-		LocalEquatorialCoordinates leq = CelestialMath::mountToLocalEquatorial(
-				mc - calibration.offset);
-		leq = CelestialMath::deapplyConeError(leq, calibration.cone);
-		leq = CelestialMath::deapplyMisalignment(leq, calibration.pa, location);
-		return CelestialMath::localEquatorialToEquatorial(leq, clock.getTime(),
-				location);
+		return model.toEquatorial(mc, clock.getTime());
 	}
 
+	const MountModel &getModel() const
+	{
+		return model;
+	}
+
+	/**
+	 * Fit the calibration to all alignment stars
+	 */
 	osStatus recalibrate();
 
+	/**
+	 * Select the optional terms of the pointing model and fit again
+	 * @param terms Mask of pmterm_t
+	 */
+	osStatus setPointingTerms(int terms)
+	{
+		pointing_terms = terms & PM_TERMS_ALL;
+		fit.reset();
+		return recalibrate();
+	}
+
+	int getPointingTerms() const
+	{
+		return pointing_terms;
+	}
+
 	/**
 	 * Call emergency stop of the Axis objects
 	 * @note This function can be called from any context (including ISR) to perform a hard stop of the mount
@@ -277,6 +372,16 @@ public:
 	void setGuideSpeedSidereal(double rate);
 	double getGuideSpeedSidereal();
 
+	/**
+	 * @return mean rate of the RA steps since tracking started, in sidereal rate
+	 */
+	double getTrackingRateSidereal();
+
+	/**
+	 * @return angle in deg by which RA tracking lags behind the tracking speed
+	 */
+	double getTrackingDrift();
+
 	/**
 	 * Print current position to STDOUT. Should call updatePosition to update the current position
 	 */
@@ -291,6 +396,12 @@ public:
 
 	void updatePosition();
 
+	/**
+	 * Take a consistent snapshot of the position, status and axis speeds
+	 * @param state filled with the current state
+	 */
+	void getState(MountState &state);
+
 	UTCClock& getClock() const
 	{
 		return clock;
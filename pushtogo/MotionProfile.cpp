@@ -0,0 +1,255 @@
+/*
+ * MotionProfile.cpp
+ */
+
+#include "MotionProfile.h"
+#include "mbed.h"
+
+#define MP_DEBUG 0
+
+MotionProfile *MotionProfile::cache[MOTION_PROFILE_CACHE_SIZE];
+static Mutex cache_mutex;
+
+MotionProfile::MotionProfile(double acceleration, int stepTime_ms,
+		double maxSpeed, int jerkTime_ms) :
+		acceleration(acceleration), requestedStepTime_ms(stepTime_ms), maxSpeed(
+				maxSpeed), jerkTime_ms(jerkTime_ms), stepTime_ms(stepTime_ms), jerkSteps(
+				0), steps(0), speed(NULL), rampAngle(NULL), refcount(0)
+{
+	// Stretch the step time if the table would become too long
+	int minStepTime_ms = (int) ceil(
+			maxSpeed / acceleration / MOTION_PROFILE_MAX_STEPS * 1000);
+	if (this->stepTime_ms < minStepTime_ms)
+	{
+		debug("MP: step time increased from %d to %d ms\n", this->stepTime_ms,
+				minStepTime_ms);
+		this->stepTime_ms = minStepTime_ms;
+	}
+
+	double dt = this->stepTime_ms / 1000.0;
+	double dv = acceleration * dt;
+
+	steps = (int) ceil(maxSpeed / dv - 1e-9);
+	if (steps < 1)
+		steps = 1;
+	if (steps > MOTION_PROFILE_MAX_STEPS)
+		steps = MOTION_PROFILE_MAX_STEPS;
+
+	jerkSteps = (jerkTime_ms + this->stepTime_ms / 2) / this->stepTime_ms;
+	if (jerkSteps > MOTION_PROFILE_MAX_JERK_STEPS)
+	{
+		debug("MP: jerk time limited to %d ms\n",
+				MOTION_PROFILE_MAX_JERK_STEPS * this->stepTime_ms);
+		jerkSteps = MOTION_PROFILE_MAX_JERK_STEPS;
+	}
+
+	speed = new mp_speed_t[steps];
+	rampAngle = new float[steps];
+	if (!speed || !rampAngle)
+	{
+		steps = 0;
+		return;
+	}
+
+	double cum = 0; // Sum of the speeds of the entries before i
+	for (int i = 0; i < steps; i++)
+	{
+		double v = (i == steps - 1) ? maxSpeed : dv * (i + 1);
+		speed[i] = toFixed(v);
+		rampAngle[i] = (float) ((2 * cum + toDouble(speed[i])) * dt);
+		cum += toDouble(speed[i]);
+	}
+
+	debug_if(MP_DEBUG, "MP: built acc=%f dt=%d vmax=%f jerk=%d, %d steps\n",
+			acceleration, this->stepTime_ms, maxSpeed, jerkSteps, steps);
+}
+
+MotionProfile::~MotionProfile()
+{
+	delete[] speed;
+	delete[] rampAngle;
+}
+
+const MotionProfile *MotionProfile::acquire(double acceleration,
+		int stepTime_ms, double maxSpeed, int jerkTime_ms)
+{
+	if (acceleration <= 0 || stepTime_ms <= 0 || maxSpeed <= 0
+			|| jerkTime_ms < 0)
+		return NULL;
+
+	cache_mutex.lock();
+	MotionProfile *p = NULL;
+	int i;
+	for (i = 0; i < MOTION_PROFILE_CACHE_SIZE; i++)
+	{
+		if (cache[i]
+				&& cache[i]->matches(acceleration, stepTime_ms, maxSpeed,
+						jerkTime_ms))
+		{
+			p = cache[i];
+			break;
+		}
+	}
+
+	if (!p)
+	{
+		p = new MotionProfile(acceleration, stepTime_ms, maxSpeed,
+				jerkTime_ms);
+		if (!p || p->steps == 0)
+		{
+			delete p;
+			cache_mutex.unlock();
+			return NULL;
+		}
+		// Replace an unused entry in the cache. If all entries are in use, the profile will be deleted on release
+		for (i = 0; i < MOTION_PROFILE_CACHE_SIZE; i++)
+		{
+			if (!cache[i] || cache[i]->refcount == 0)
+			{
+				delete cache[i];
+				cache[i] = p;
+				break;
+			}
+		}
+	}
+
+	p->refcount++;
+	cache_mutex.unlock();
+	return p;
+}
+
+void MotionProfile::release(const MotionProfile *profile)
+{
+	if (!profile)
+		return;
+	cache_mutex.lock();
+	MotionProfile *p = const_cast<MotionProfile *>(profile);
+	p->refcount--;
+	if (p->refcount == 0)
+	{
+		bool cached = false;
+		for (int i = 0; i < MOTION_PROFILE_CACHE_SIZE; i++)
+		{
+			if (cache[i] == p)
+				cached = true;
+		}
+		if (!cached)
+			delete p;
+	}
+	cache_mutex.unlock();
+}
+
+int MotionProfile::indexOf(mp_speed_t s) const
+{
+	int lo = -1, hi = steps - 1; // speed[lo] <= s < speed[hi + 1]
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) >> 1;
+		if (speed[mid] <= s)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+int MotionProfile::findPeak(double angle) const
+{
+	int lo = -1, hi = steps - 1;
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) >> 1;
+		if (rampAngle[mid] <= angle)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+void MotionRamp::reset(const MotionProfile *profile, double speed)
+{
+	this->profile = profile;
+	input = target = MotionProfile::toFixed(speed);
+	if (input > profile->getSpeedFixed(profile->getSteps() - 1))
+		input = target = profile->getSpeedFixed(profile->getSteps() - 1);
+	index = targetIndex = profile->indexOf(input);
+
+	window_len = profile->getJerkSteps() + 1;
+	for (int i = 0; i < window_len; i++)
+		window[i] = input;
+	wpos = 0;
+	sum = (int64_t) input * window_len;
+	settled = window_len;
+	scale = 1.0 / MP_ONE / window_len;
+}
+
+void MotionRamp::setTarget(double speed)
+{
+	mp_speed_t t = MotionProfile::toFixed(speed);
+	if (t < 0)
+		t = 0;
+	if (t > profile->getSpeedFixed(profile->getSteps() - 1))
+		t = profile->getSpeedFixed(profile->getSteps() - 1);
+	if (t != target)
+	{
+		target = t;
+		targetIndex = profile->indexOf(t);
+		settled = 0;
+	}
+}
+
+double MotionRamp::step()
+{
+	if (input < target)
+	{
+		int i = index + 1; // First entry above input
+		mp_speed_t next = profile->getSpeedFixed(i);
+		if (next < target)
+		{
+			input = next;
+			index = i;
+		}
+		else
+		{
+			input = target;
+			index = targetIndex;
+		}
+	}
+	else if (input > target)
+	{
+		int i = (index >= 0 && profile->getSpeedFixed(index) == input) ?
+				index - 1 : index; // Last entry below input
+		mp_speed_t next = (i >= 0) ? profile->getSpeedFixed(i) : 0;
+		if (next > target)
+		{
+			input = next;
+			index = i;
+		}
+		else
+		{
+			input = target;
+			index = targetIndex;
+		}
+	}
+
+	if (input == target)
+	{
+		if (settled < window_len)
+			settled++;
+	}
+	else
+	{
+		settled = 0;
+	}
+
+	if (window_len == 1)
+		return MotionProfile::toDouble(input);
+
+	// Moving average
+	sum += input - window[wpos];
+	window[wpos] = input;
+	if (++wpos == window_len)
+		wpos = 0;
+	return sum * scale;
+}
@@ -0,0 +1,200 @@
+/*
+ * MotionProfile.h
+ */
+
+#ifndef PUSHTOGO_MOTIONPROFILE_H_
+#define PUSHTOGO_MOTIONPROFILE_H_
+
+#include <stdint.h>
+
+/// Max number of entries in a speed table. The step time is stretched if a ramp needs more
+#define MOTION_PROFILE_MAX_STEPS 1024
+/// Max length of the jerk-limiting filter in steps
+#define MOTION_PROFILE_MAX_JERK_STEPS 63
+/// Number of profiles kept in the cache
+#define MOTION_PROFILE_CACHE_SIZE 2
+
+/// Speeds are stored in Q8.24 fixed point, in deg/s
+#define MP_FRAC_BITS 24
+#define MP_ONE ((int32_t) 1 << MP_FRAC_BITS)
+
+typedef int32_t mp_speed_t;
+
+/** Speed table of an acceleration ramp from 0 to the max speed
+ * The table is built once for each combination of acceleration, step time, max speed and jerk time,
+ * and shared by all axes using the same parameters. Entry i is the speed during the (i+1)-th step
+ * of a linear ramp. Jerk limiting (S-curve) is done by MotionRamp on top of the same table.
+ */
+class MotionProfile
+{
+public:
+
+	/**
+	 * Get a profile from the cache, building it if necessary. Must be released after use.
+	 * @param acceleration Acceleration in deg/s^2
+	 * @param stepTime_ms Time of each ramp step in milliseconds
+	 * @param maxSpeed Max speed in deg/s
+	 * @param jerkTime_ms Time to ramp up/down the acceleration in milliseconds. 0 for linear ramp
+	 * @return profile, or NULL if out of memory or the parameters are invalid
+	 */
+	static const MotionProfile *acquire(double acceleration, int stepTime_ms,
+			double maxSpeed, int jerkTime_ms);
+
+	/**
+	 * Release a profile obtained by acquire()
+	 */
+	static void release(const MotionProfile *profile);
+
+	/** @return number of entries in the table */
+	int getSteps() const
+	{
+		return steps;
+	}
+
+	/** @return speed of entry i in fixed point */
+	mp_speed_t getSpeedFixed(int i) const
+	{
+		return speed[i];
+	}
+
+	/** @return actual step time in milliseconds, can be larger than requested */
+	int getStepTime() const
+	{
+		return stepTime_ms;
+	}
+
+	/** @return length of the jerk-limiting filter in steps, 0 for linear ramp */
+	int getJerkSteps() const
+	{
+		return jerkSteps;
+	}
+
+	/** @return max speed in deg/s */
+	double getMaxSpeed() const
+	{
+		return maxSpeed;
+	}
+
+	/**
+	 * @return index of the last entry with a speed lower than or equal to the given speed, -1 if none
+	 */
+	int indexOf(mp_speed_t s) const;
+
+	/**
+	 * Find the highest entry that can be reached by a slew over the specified angle,
+	 * i.e. accelerating through entries 0..i, and decelerating through i-1..0
+	 * @return index of the highest entry, -1 if the angle is too small for even one step
+	 */
+	int findPeak(double angle) const;
+
+	/**
+	 * @return angle covered by accelerating to and decelerating from entry i in deg
+	 */
+	double getRampAngle(int i) const
+	{
+		return rampAngle[i];
+	}
+
+	static mp_speed_t toFixed(double speed)
+	{
+		return (mp_speed_t) (speed * MP_ONE + 0.5);
+	}
+
+	static double toDouble(mp_speed_t speed)
+	{
+		return speed * (1.0 / MP_ONE);
+	}
+
+private:
+	double acceleration;
+	int requestedStepTime_ms;
+	double maxSpeed;
+	int jerkTime_ms;
+
+	int stepTime_ms;
+	int jerkSteps;
+	int steps;
+	mp_speed_t *speed; /// Speed table
+	float *rampAngle; /// Angle covered by a full ramp up to and down from each entry
+
+	int refcount;
+
+	MotionProfile(double acceleration, int stepTime_ms, double maxSpeed,
+			int jerkTime_ms);
+	~MotionProfile();
+
+	bool matches(double acceleration, int stepTime_ms, double maxSpeed,
+			int jerkTime_ms) const
+	{
+		return this->acceleration == acceleration
+				&& this->requestedStepTime_ms == stepTime_ms
+				&& this->maxSpeed == maxSpeed
+				&& this->jerkTime_ms == jerkTime_ms;
+	}
+
+	static MotionProfile *cache[MOTION_PROFILE_CACHE_SIZE];
+};
+
+/** Generates the speed of each ramp step from a MotionProfile
+ * A ramp goes from the current speed to a target speed through the entries of the table.
+ * When the profile has a jerk time, the speeds are passed through a moving average over
+ * (jerk steps + 1) steps, which limits the jerk while preserving the angle covered.
+ * Stepping involves no division and no configuration lookup.
+ */
+class MotionRamp
+{
+public:
+	MotionRamp() :
+			profile(0), input(0), target(0), index(-1), targetIndex(-1), window_len(
+					1), wpos(0), sum(0), settled(0), scale(1.0 / MP_ONE)
+	{
+	}
+
+	/**
+	 * Start using a profile, from the specified speed
+	 * @param profile profile to use
+	 * @param speed initial speed in deg/s
+	 */
+	void reset(const MotionProfile *profile, double speed);
+
+	/**
+	 * Set the target speed. The speed is clamped to the max speed of the profile
+	 * @param speed target speed in deg/s
+	 */
+	void setTarget(double speed);
+
+	/**
+	 * Advance by one step
+	 * @return speed to use during this step in deg/s
+	 */
+	double step();
+
+	/**
+	 * @return true if the target speed has been reached (including the filter)
+	 */
+	bool done() const
+	{
+		return input == target && settled >= window_len;
+	}
+
+	/** @return current target speed in deg/s */
+	double getTarget() const
+	{
+		return MotionProfile::toDouble(target);
+	}
+
+private:
+	const MotionProfile *profile;
+	mp_speed_t input; /// Speed before filtering
+	mp_speed_t target;
+	int index; /// Index of the last entry <= input
+	int targetIndex; /// Index of the last entry <= target
+	mp_speed_t window[MOTION_PROFILE_MAX_JERK_STEPS + 1]; /// Moving average window
+	int window_len;
+	int wpos;
+	int64_t sum; /// Sum of the window
+	int settled; /// Consecutive steps with input == target
+	double scale; /// 1/(window length) in fixed point to double
+};
+
+#endif /* PUSHTOGO_MOTIONPROFILE_H_ */
@@ -0,0 +1,164 @@
+/*
+ * MotionTrace.cpp
+ */
+
+#include "MotionTrace.h"
+#include "EqMountServer.h"
+
+trace_event MotionTrace::buffer[TRACE_SIZE];
+volatile uint32_t MotionTrace::head = 0;
+volatile bool MotionTrace::enabled = true;
+char MotionTrace::sources[TRACE_MAX_SOURCES][TRACE_NAME_SIZE];
+int MotionTrace::numSources = 0;
+const char *MotionTrace::defaultFile = NULL;
+
+/*Register the command from a static constructor, the command table is built on first use*/
+static struct TraceCommandInit
+{
+	TraceCommandInit()
+	{
+		EqMountServer::addCommand(
+				ServerCommand("trace", "Motion trace recorder",
+						MotionTrace::eqmount_trace, CMD_EXEC_LONG));
+	}
+} trace_command_init;
+
+uint8_t MotionTrace::addSource(const char *name)
+{
+	core_util_critical_section_enter();
+	int id;
+	for (id = 0; id < numSources; id++)
+	{
+		if (strncmp(sources[id], name, TRACE_NAME_SIZE - 1) == 0)
+			break;
+	}
+	if (id == numSources)
+	{
+		if (numSources < TRACE_MAX_SOURCES)
+		{
+			strncpy(sources[id], name, TRACE_NAME_SIZE - 1);
+			sources[id][TRACE_NAME_SIZE - 1] = '\0';
+			numSources++;
+		}
+		else
+			id = TRACE_MAX_SOURCES - 1;
+	}
+	core_util_critical_section_exit();
+	return (uint8_t) id;
+}
+
+void MotionTrace::clear()
+{
+	bool wasEnabled = enabled;
+	enabled = false;
+	head = 0;
+	enabled = wasEnabled;
+}
+
+uint32_t MotionTrace::freeze(uint32_t &first)
+{
+	enabled = false;
+	uint32_t h = head;
+	uint32_t n = (h > TRACE_SIZE) ? TRACE_SIZE : h;
+	first = h - n;
+	return n;
+}
+
+int MotionTrace::save(const char *file)
+{
+	if (!file)
+		return -1;
+	FILE *fp = fopen(file, "wb");
+	if (!fp)
+	{
+		debug("Failed to write to file %s\n", file);
+		return -1;
+	}
+
+	bool wasEnabled = enabled;
+	uint32_t first;
+	trace_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	header.event_size = sizeof(trace_event);
+	header.count = freeze(first);
+	header.lost = getLost();
+	memcpy(header.sources, sources, sizeof(sources));
+
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	for (uint32_t i = 0; ok && i < header.count; i++)
+	{
+		ok = fwrite(&buffer[(first + i) & (TRACE_SIZE - 1)],
+				sizeof(trace_event), 1, fp) == 1;
+	}
+	enabled = wasEnabled;
+	fclose(fp);
+	return ok ? 0 : -1;
+}
+
+int MotionTrace::eqmount_trace(EqMountServer *server, const char *cmd,
+		int argn, char *argv[])
+{
+	if (argn == 0)
+	{
+		// State, events in the ring, events lost, size of the ring
+		stprintf(server->getStream(), "%s %s %u %u %u\r\n", cmd,
+				enabled ? "on" : "off", (unsigned int) getCount(),
+				(unsigned int) getLost(), (unsigned int) TRACE_SIZE);
+	}
+	else if (strcmp(argv[0], "on") == 0)
+	{
+		enabled = true;
+	}
+	else if (strcmp(argv[0], "off") == 0)
+	{
+		enabled = false;
+	}
+	else if (strcmp(argv[0], "clear") == 0)
+	{
+		clear();
+	}
+	else if (strcmp(argv[0], "save") == 0)
+	{
+		if (save(argn > 1 ? argv[1] : defaultFile) != 0)
+			return ERR_PARAM_OUT_OF_RANGE;
+	}
+	else if (strcmp(argv[0], "dump") == 0)
+	{
+		// Latest n events, or all of them
+		uint32_t n = TRACE_SIZE;
+		if (argn > 1)
+		{
+			char *tp;
+			n = strtoul(argv[1], &tp, 10);
+			if (tp == argv[1])
+				return ERR_PARAM_OUT_OF_RANGE;
+		}
+		bool wasEnabled = enabled;
+		uint32_t first;
+		uint32_t count = freeze(first);
+		if (n < count)
+		{
+			first += count - n;
+			count = n;
+		}
+		for (int i = 0; i < numSources; i++)
+		{
+			stprintf(server->getStream(), "%s source %d %s\r\n", cmd, i,
+					sources[i]);
+		}
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const trace_event &e = buffer[(first + i) & (TRACE_SIZE - 1)];
+			stprintf(server->getStream(), "%s %u %u %u %u %.9g %.9g\r\n", cmd,
+					(unsigned int) e.time, e.source, e.type, e.aux, e.a, e.b);
+		}
+		enabled = wasEnabled;
+	}
+	else
+	{
+		return ERR_PARAM_OUT_OF_RANGE;
+	}
+	return 0;
+}
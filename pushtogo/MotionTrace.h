@@ -0,0 +1,114 @@
+/*
+ * MotionTrace.h
+ *
+ * In-RAM recorder of timestamped motion events, for finding out what the axes did without changing
+ * their timing the way debug output does.
+ *
+ * Events go into a ring of TRACE_SIZE entries that always keeps the latest ones. Recording an event
+ * takes a slot with one atomic increment and fills it in, with no lock, so it can be done from any
+ * thread or interrupt handler. The ring is dumped by the trace command, as text over the server or as
+ * a binary file (see TraceFormat.h). Recording is paused during the dump. An event being written when
+ * the recording is paused can come out partly written.
+ */
+
+#ifndef PUSHTOGO_MOTIONTRACE_H_
+#define PUSHTOGO_MOTIONTRACE_H_
+
+class MotionTrace;
+class EqMountServer;
+
+#include "mbed.h"
+#include "TraceFormat.h"
+
+/// Number of events kept, must be a power of 2. Each takes 16 bytes
+#ifndef TRACE_SIZE
+#define TRACE_SIZE 1024
+#endif
+
+class MotionTrace
+{
+public:
+	/**
+	 * Register a source of events
+	 * @param name Name shown in the dump, truncated to TRACE_NAME_SIZE - 1 characters
+	 * @return id of the source. The same name gets the same id. The last id is shared when all are used
+	 */
+	static uint8_t addSource(const char *name);
+
+	/**
+	 * Record an event. Can be called from anywhere, including interrupt handlers
+	 */
+	static void record(trace_type_t type, uint8_t source, uint16_t aux = 0,
+			float a = 0, float b = 0)
+	{
+		if (!enabled)
+			return;
+		uint32_t i = core_util_atomic_incr_u32(&head, 1) - 1;
+		trace_event &e = buffer[i & (TRACE_SIZE - 1)];
+		e.time = us_ticker_read();
+		e.type = (uint8_t) type;
+		e.source = source;
+		e.aux = aux;
+		e.a = a;
+		e.b = b;
+	}
+
+	static void setEnabled(bool enable)
+	{
+		enabled = enable;
+	}
+
+	static bool isEnabled()
+	{
+		return enabled;
+	}
+
+	/** @return number of events in the ring */
+	static uint32_t getCount()
+	{
+		uint32_t h = head;
+		return (h > TRACE_SIZE) ? TRACE_SIZE : h;
+	}
+
+	/** @return number of events overwritten since the last clear */
+	static uint32_t getLost()
+	{
+		uint32_t h = head;
+		return (h > TRACE_SIZE) ? h - TRACE_SIZE : 0;
+	}
+
+	/** Drop all events */
+	static void clear();
+
+	/**
+	 * Write the events, oldest first, to a binary file
+	 * @return 0 on success
+	 */
+	static int save(const char *file);
+
+	/** Set the file written by "trace save" without a file name */
+	static void setFile(const char *file)
+	{
+		defaultFile = file;
+	}
+
+	static int eqmount_trace(EqMountServer *server, const char *cmd, int argn,
+			char *argv[]);
+
+protected:
+	static trace_event buffer[TRACE_SIZE];
+	static volatile uint32_t head; /// Number of events recorded since the last clear
+	static volatile bool enabled;
+	static char sources[TRACE_MAX_SOURCES][TRACE_NAME_SIZE];
+	static int numSources;
+	static const char *defaultFile;
+
+	/**
+	 * Pause the recording, to be resumed by the caller
+	 * @param first Index of the oldest event
+	 * @return number of events
+	 */
+	static uint32_t freeze(uint32_t &first);
+};
+
+#endif /* PUSHTOGO_MOTIONTRACE_H_ */
@@ -0,0 +1,349 @@
+/*
+ * PeriodicErrorCorrection.cpp
+ */
+
+#include "PeriodicErrorCorrection.h"
+#include "TelescopeConfiguration.h"
+
+static ConfigHandle<bool> cfg_pec_enable("pec_enable");
+static ConfigHandle<int> cfg_pec_harmonics("pec_harmonics");
+static ConfigHandle<int> cfg_pec_record_cycles("pec_record_cycles");
+
+PeriodicErrorCorrection *PeriodicErrorCorrection::instance = NULL;
+
+PeriodicErrorCorrection::PeriodicErrorCorrection(Axis &axis,
+		double stepsPerCycle, const char *file) :
+		axis(axis), stepsPerCycle(stepsPerCycle), file(file), valid(false), enabled(
+				false), recording(false), source(PEC_SOURCE_GUIDE), cycles(0), startPos(
+				0), lastPos(0)
+{
+	static bool commandAdded = false;
+	if (!commandAdded)
+	{
+		commandAdded = true;
+		EqMountServer::addCommand(
+				ServerCommand("pec", "Periodic error correction",
+						PeriodicErrorCorrection::eqmount_pec, CMD_EXEC_LONG));
+	}
+
+	if (stepsPerCycle <= 0)
+		error("PEC: steps per cycle must be > 0");
+
+	memset(table, 0, sizeof(table));
+	if (file && load() == 0)
+	{
+		enabled = cfg_pec_enable.get();
+	}
+	instance = this;
+	axis.setPEC(this);
+}
+
+PeriodicErrorCorrection::~PeriodicErrorCorrection()
+{
+	axis.setPEC(NULL);
+	if (instance == this)
+		instance = NULL;
+}
+
+void PeriodicErrorCorrection::update(double pos, double dt, double guided,
+		double slipped)
+{
+	if (!recording)
+		return;
+	mutex.lock();
+	if (recording)
+	{
+		// The correction is put in the bin the axis was in during the period
+		int bin = (int) (getPhase((pos + lastPos) / 2) * PEC_BINS);
+		if (bin >= PEC_BINS)
+			bin = PEC_BINS - 1;
+		sum[bin] += (source == PEC_SOURCE_GUIDE) ? guided : slipped;
+		dwell[bin] += dt;
+		lastPos = pos;
+		if (fabs(pos - startPos) >= cycles * stepsPerCycle)
+		{
+			finishRecording();
+		}
+	}
+	mutex.unlock();
+}
+
+double PeriodicErrorCorrection::getRate(double pos)
+{
+	if (!enabled || !valid)
+		return 0;
+	// Interpolate between the centers of the bins
+	double x = getPhase(pos) * PEC_BINS - 0.5;
+	int i0 = (int) floor(x);
+	double f = x - i0;
+	i0 = (i0 + PEC_BINS) % PEC_BINS;
+	int i1 = (i0 + 1) % PEC_BINS;
+	mutex.lock();
+	double rate = table[i0] * (1 - f) + table[i1] * f;
+	mutex.unlock();
+	return rate;
+}
+
+void PeriodicErrorCorrection::startRecording(int cycles,
+		pecsource_t source)
+{
+	mutex.lock();
+	memset(sum, 0, sizeof(sum));
+	memset(dwell, 0, sizeof(dwell));
+	this->cycles = (cycles > 0) ? cycles : 1;
+	this->source = source;
+	startPos = lastPos = axis.getMotorPosition();
+	recording = true;
+	mutex.unlock();
+}
+
+void PeriodicErrorCorrection::stopRecording()
+{
+	mutex.lock();
+	recording = false;
+	mutex.unlock();
+}
+
+double PeriodicErrorCorrection::getProgress() const
+{
+	if (!recording)
+		return 0;
+	return fabs(lastPos - startPos) / (cycles * stepsPerCycle);
+}
+
+/**
+ * Smooth the mean correction rate of each bin, and add it to the table. Called with the mutex held
+ */
+void PeriodicErrorCorrection::finishRecording()
+{
+	double rate[PEC_BINS];
+	for (int i = 0; i < PEC_BINS; i++)
+	{
+		rate[i] = (dwell[i] > 0) ? sum[i] / dwell[i] : 0;
+	}
+
+	// Keep harmonics 1 to pec_harmonics of the worm frequency
+	int harmonics = cfg_pec_harmonics.get();
+	if (harmonics > PEC_BINS / 2 - 1)
+		harmonics = PEC_BINS / 2 - 1;
+	double smooth[PEC_BINS];
+	memset(smooth, 0, sizeof(smooth));
+	for (int k = 1; k <= harmonics; k++)
+	{
+		double a = 0, b = 0;
+		for (int i = 0; i < PEC_BINS; i++)
+		{
+			double x = 2 * M_PI * k * (i + 0.5) / PEC_BINS;
+			a += rate[i] * cos(x);
+			b += rate[i] * sin(x);
+		}
+		a *= 2.0 / PEC_BINS;
+		b *= 2.0 / PEC_BINS;
+		for (int i = 0; i < PEC_BINS; i++)
+		{
+			double x = 2 * M_PI * k * (i + 0.5) / PEC_BINS;
+			smooth[i] += a * cos(x) + b * sin(x);
+		}
+	}
+
+	for (int i = 0; i < PEC_BINS; i++)
+	{
+		table[i] = (valid ? table[i] : 0) + smooth[i];
+	}
+	valid = true;
+	recording = false;
+	debug("%s: PEC recorded over %d cycles\n", axis.getAxisName(), cycles);
+}
+
+double PeriodicErrorCorrection::getAmplitude()
+{
+	if (!valid)
+		return 0;
+	// Time the axis spends in each bin while tracking
+	double dt = stepsPerCycle / axis.getStepsPerDeg()
+			/ (axis.getTrackSpeedSidereal() * sidereal_speed) / PEC_BINS;
+	double angle = 0, lo = 0, hi = 0;
+	mutex.lock();
+	for (int i = 0; i < PEC_BINS; i++)
+	{
+		angle += table[i] * dt;
+		if (angle < lo)
+			lo = angle;
+		if (angle > hi)
+			hi = angle;
+	}
+	mutex.unlock();
+	return hi - lo;
+}
+
+void PeriodicErrorCorrection::clear()
+{
+	mutex.lock();
+	valid = false;
+	enabled = false;
+	memset(table, 0, sizeof(table));
+	mutex.unlock();
+}
+
+int PeriodicErrorCorrection::save()
+{
+	if (!file || !valid)
+		return -1;
+	FILE *fp = fopen(file, "w");
+	if (!fp)
+	{
+		debug("Failed to write to file %s\n", file);
+		return -1;
+	}
+	mutex.lock();
+	fprintf(fp, "# PushToGo periodic error correction table\n");
+	fprintf(fp, "# Rate corrections in arcsec/s over one worm cycle\n");
+	fprintf(fp, "steps_per_cycle %.6f\n", stepsPerCycle);
+	fprintf(fp, "bins %d\n", PEC_BINS);
+	for (int i = 0; i < PEC_BINS; i++)
+	{
+		fprintf(fp, "%.9f\n", table[i] * 3600);
+	}
+	mutex.unlock();
+	fclose(fp);
+	return 0;
+}
+
+int PeriodicErrorCorrection::load()
+{
+	if (!file)
+		return -1;
+	FILE *fp = fopen(file, "r");
+	if (!fp)
+		return -1;
+
+	char line[128];
+	double steps = 0;
+	int bins = 0, n = 0;
+	double t[PEC_BINS];
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+			continue;
+		if (sscanf(line, "steps_per_cycle %lf", &steps) == 1
+				|| sscanf(line, "bins %d", &bins) == 1)
+			continue;
+		if (n >= PEC_BINS || sscanf(line, "%lf", &t[n]) != 1)
+		{
+			n = -1;
+			break;
+		}
+		n++;
+	}
+	fclose(fp);
+
+	if (n != PEC_BINS || bins != PEC_BINS
+			|| fabs(steps - stepsPerCycle) > 1e-6 * stepsPerCycle)
+	{
+		debug("PEC: table in %s does not match the mount\n", file);
+		return -1;
+	}
+	mutex.lock();
+	for (int i = 0; i < PEC_BINS; i++)
+	{
+		table[i] = t[i] / 3600;
+	}
+	valid = true;
+	mutex.unlock();
+	return 0;
+}
+
+int PeriodicErrorCorrection::eqmount_pec(EqMountServer *server,
+		const char *cmd, int argn, char *argv[])
+{
+	PeriodicErrorCorrection *pec = instance;
+	if (!pec)
+	{
+		stprintf(server->getStream(), "%s Error: no PEC on this mount\r\n",
+				cmd);
+		return ERR_PARAM_OUT_OF_RANGE;
+	}
+	if (argn == 0)
+	{
+		// State, peak-to-peak error in arcsec, worm phase, recording progress in percent
+		stprintf(server->getStream(), "%s %s %s %.3f %.4f %.1f\r\n", cmd,
+				pec->isEnabled() ? "on" : "off",
+				pec->isRecording() ? "recording" : "idle",
+				pec->getAmplitude() * 3600,
+				pec->getPhase(pec->axis.getMotorPosition()),
+				pec->getProgress() * 100);
+		return 0;
+	}
+
+	if (strcmp(argv[0], "on") == 0)
+	{
+		if (!pec->isValid())
+		{
+			stprintf(server->getStream(), "%s Error: no table recorded\r\n",
+					cmd);
+			return ERR_PARAM_OUT_OF_RANGE;
+		}
+		pec->setEnabled(true);
+	}
+	else if (strcmp(argv[0], "off") == 0)
+	{
+		pec->setEnabled(false);
+	}
+	else if (strcmp(argv[0], "record") == 0)
+	{
+		int cycles = cfg_pec_record_cycles.get();
+		pecsource_t source = PEC_SOURCE_GUIDE;
+		for (int i = 1; i < argn; i++)
+		{
+			char *tp;
+			if (strcmp(argv[i], "guide") == 0)
+				source = PEC_SOURCE_GUIDE;
+			else if (strcmp(argv[i], "encoder") == 0)
+				source = PEC_SOURCE_ENCODER;
+			else if ((cycles = strtol(argv[i], &tp, 10)) <= 0
+					|| tp == argv[i])
+				return ERR_PARAM_OUT_OF_RANGE;
+		}
+		if (source == PEC_SOURCE_ENCODER && !pec->axis.getObserver())
+		{
+			stprintf(server->getStream(), "%s Error: the axis has no encoder\r\n",
+					cmd);
+			return ERR_PARAM_OUT_OF_RANGE;
+		}
+		pec->startRecording(cycles, source);
+	}
+	else if (strcmp(argv[0], "stop") == 0)
+	{
+		pec->stopRecording();
+	}
+	else if (strcmp(argv[0], "clear") == 0)
+	{
+		pec->clear();
+	}
+	else if (strcmp(argv[0], "save") == 0)
+	{
+		if (pec->save() != 0)
+			return ERR_PARAM_OUT_OF_RANGE;
+	}
+	else if (strcmp(argv[0], "load") == 0)
+	{
+		if (pec->load() != 0)
+			return ERR_PARAM_OUT_OF_RANGE;
+	}
+	else if (strcmp(argv[0], "table") == 0)
+	{
+		// Rate corrections in arcsec/s
+		for (int i = 0; i < PEC_BINS; i++)
+		{
+			pec->mutex.lock();
+			double r = pec->table[i];
+			pec->mutex.unlock();
+			stprintf(server->getStream(), "%s %d %.6f\r\n", cmd, i, r * 3600);
+		}
+	}
+	else
+	{
+		return ERR_PARAM_OUT_OF_RANGE;
+	}
+	return 0;
+}
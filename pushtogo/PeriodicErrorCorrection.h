@@ -0,0 +1,150 @@
+/*
+ * PeriodicErrorCorrection.h
+ *
+ * Periodic error correction (PEC) of a worm-driven axis.
+ *
+ * The worm gear makes the axis run a little fast and a little slow over each turn of the worm. The error
+ * repeats with the worm, so it can be recorded once and played back as a modulation of the tracking rate.
+ * The worm phase is derived from the motor position: the worm turns once every motor_steps * gear_reduction
+ * full steps. The motor position is counted from power-up and is not changed when the axis angle is set,
+ * so a saved table stays in phase as long as the mount is powered up at the same position, e.g. parked.
+ *
+ * While recording, the corrections applied to the axis are summed per phase bin over several worm cycles:
+ * either the guide pulses (the autoguider sees the error), or the slips paid back from the encoder. The mean
+ * correction rate of each bin is smoothed by keeping the first pec_harmonics harmonics of the worm frequency,
+ * without the constant term (a drift, e.g. from polar misalignment, is not periodic). The result is added to
+ * the table being played, so a recording with PEC on refines the table.
+ */
+
+#ifndef PUSHTOGO_PERIODICERRORCORRECTION_H_
+#define PUSHTOGO_PERIODICERRORCORRECTION_H_
+
+class PeriodicErrorCorrection;
+
+#include "mbed.h"
+#include "Axis.h"
+#include "EqMountServer.h"
+
+/// Number of phase bins per worm cycle
+#define PEC_BINS 128
+
+/**
+ * What the recording learns from
+ */
+typedef enum
+{
+	PEC_SOURCE_GUIDE = 0, /// Guide pulses
+	PEC_SOURCE_ENCODER /// Slips detected by the encoder of the axis
+} pecsource_t;
+
+class PeriodicErrorCorrection
+{
+public:
+	/**
+	 * Attach PEC to an axis
+	 * @param axis Axis driven by the worm, usually RA
+	 * @param stepsPerCycle Motor full steps per turn of the worm
+	 * @param file Path of the table, loaded now if it exists. NULL if the table can't be stored
+	 */
+	PeriodicErrorCorrection(Axis &axis, double stepsPerCycle, const char *file =
+	NULL);
+	~PeriodicErrorCorrection();
+
+	/**
+	 * Account a tracking period. Called by the axis while it tracks
+	 * @param pos Motor position in full steps at the end of the period
+	 * @param dt Length of the period in s
+	 * @param guided Angle in deg moved by guiding during the period
+	 * @param slipped Angle in deg the axis fell behind the step count during the period, as seen by the encoder
+	 */
+	void update(double pos, double dt, double guided, double slipped);
+
+	/**
+	 * @param pos Motor position in full steps
+	 * @return Rate in deg/s to add to the tracking rate, 0 if PEC is off
+	 */
+	double getRate(double pos);
+
+	/** @return worm phase of a motor position, between 0 and 1 */
+	double getPhase(double pos) const
+	{
+		double p = fmod(pos / stepsPerCycle, 1.0);
+		return (p < 0) ? p + 1 : p;
+	}
+
+	/**
+	 * Start recording. The table is updated when the cycles are done
+	 * @param cycles Number of worm cycles to average
+	 * @param source What to learn from
+	 */
+	void startRecording(int cycles, pecsource_t source);
+
+	/** Stop recording and drop what was recorded */
+	void stopRecording();
+
+	bool isRecording() const
+	{
+		return recording;
+	}
+
+	/** @return fraction of the recording done */
+	double getProgress() const;
+
+	void setEnabled(bool enabled)
+	{
+		this->enabled = enabled;
+	}
+
+	bool isEnabled() const
+	{
+		return enabled;
+	}
+
+	/** @return true if there is a table to play */
+	bool isValid() const
+	{
+		return valid;
+	}
+
+	/** @return peak-to-peak periodic error of the table in deg, i.e. the error PEC takes out */
+	double getAmplitude();
+
+	/** Drop the table */
+	void clear();
+
+	/** Write the table to the file. @return 0 on success */
+	int save();
+
+	/** Read the table from the file. @return 0 on success */
+	int load();
+
+	static int eqmount_pec(EqMountServer *server, const char *cmd, int argn,
+			char *argv[]);
+
+protected:
+	Axis &axis;
+	double stepsPerCycle;
+	const char *file;
+	Mutex mutex; /// Protects the table and the recording
+	double table[PEC_BINS]; /// Rate correction in deg/s at the center of each bin
+	bool valid;
+	volatile bool enabled;
+
+	volatile bool recording;
+	pecsource_t source;
+	int cycles;
+	double startPos; /// Motor position when the recording started
+	double lastPos; /// Motor position at the last update
+	double sum[PEC_BINS]; /// Correction in deg recorded in each bin
+	double dwell[PEC_BINS]; /// Time in s recorded in each bin
+
+	void finishRecording();
+
+	static PeriodicErrorCorrection *instance; /// Used by the pec command
+
+private:
+	PeriodicErrorCorrection(const PeriodicErrorCorrection &);
+	PeriodicErrorCorrection &operator=(const PeriodicErrorCorrection &);
+};
+
+#endif /* PUSHTOGO_PERIODICERRORCORRECTION_H_ */
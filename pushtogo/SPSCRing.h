@@ -0,0 +1,331 @@
+/*
+ * SPSCRing.h
+ *
+ * Lock-free single-producer/single-consumer ring buffer.
+ *
+ * The producer only writes tail and the consumer only writes head, so neither side needs a
+ * critical section or a mutex, and one of them can be an interrupt handler. The indices are
+ * free-running and wrap at 2^32, which lets the ring use all N slots.
+ * If several threads produce (or consume), they must be serialized by the caller, e.g. with a Mutex.
+ */
+
+#ifndef PUSHTOGO_SPSCRING_H_
+#define PUSHTOGO_SPSCRING_H_
+
+#include "mbed.h"
+
+/// Thread flag used by BlockingSPSCRing to wake a waiting thread. Kept out of the range used by the axes
+#define SPSC_SIGNAL 0x40000000
+
+/// Orders the copy of the data with the update of the index seen by the other side
+#if defined(__CORTEX_M)
+#define SPSC_BARRIER() __DMB()
+#else
+#define SPSC_BARRIER() __sync_synchronize()
+#endif
+
+template<typename T, unsigned int N>
+class SPSCRing
+{
+public:
+	SPSCRing() :
+			head(0), tail(0)
+	{
+		MBED_STATIC_ASSERT((N & (N - 1)) == 0, "N must be a power of 2");
+	}
+
+	/** @return number of elements in the ring. Exact on the consumer side, a lower bound elsewhere */
+	unsigned int count() const
+	{
+		return tail - head;
+	}
+
+	/** @return free space. Exact on the producer side, a lower bound elsewhere */
+	unsigned int space() const
+	{
+		return N - (tail - head);
+	}
+
+	bool empty() const
+	{
+		return tail == head;
+	}
+
+	bool full() const
+	{
+		return tail - head == N;
+	}
+
+	/**
+	 * Put an element. Producer side only.
+	 * @return false if the ring is full
+	 */
+	bool push(const T &data)
+	{
+		unsigned int t = tail;
+		if (t - head == N)
+			return false;
+		buf[t & (N - 1)] = data;
+		SPSC_BARRIER();
+		tail = t + 1;
+		return true;
+	}
+
+	/**
+	 * Get an element. Consumer side only.
+	 * @return false if the ring is empty
+	 */
+	bool pop(T &data)
+	{
+		unsigned int h = head;
+		if (tail == h)
+			return false;
+		SPSC_BARRIER();
+		data = buf[h & (N - 1)];
+		SPSC_BARRIER();
+		head = h + 1;
+		return true;
+	}
+
+	/**
+	 * Put up to n elements, as many as fit. Producer side only. T must be copyable with memcpy.
+	 * @return number of elements put
+	 */
+	unsigned int push_n(const T *data, unsigned int n)
+	{
+		unsigned int t = tail;
+		unsigned int len = N - (t - head);
+		if (len > n)
+			len = n;
+		unsigned int pos = t & (N - 1);
+		unsigned int first = N - pos;
+		if (len <= first)
+		{
+			memcpy(buf + pos, data, len * sizeof(T));
+		}
+		else
+		{
+			memcpy(buf + pos, data, first * sizeof(T));
+			memcpy(buf, data + first, (len - first) * sizeof(T));
+		}
+		SPSC_BARRIER();
+		tail = t + len;
+		return len;
+	}
+
+	/**
+	 * Get up to n elements, as many as available. Consumer side only. T must be copyable with memcpy.
+	 * @return number of elements retrieved
+	 */
+	unsigned int pop_n(T *data, unsigned int n)
+	{
+		unsigned int h = head;
+		unsigned int len = tail - h;
+		if (len > n)
+			len = n;
+		SPSC_BARRIER();
+		unsigned int pos = h & (N - 1);
+		unsigned int first = N - pos;
+		if (len <= first)
+		{
+			memcpy(data, buf + pos, len * sizeof(T));
+		}
+		else
+		{
+			memcpy(data, buf + pos, first * sizeof(T));
+			memcpy(data + first, buf, (len - first) * sizeof(T));
+		}
+		SPSC_BARRIER();
+		head = h + len;
+		return len;
+	}
+
+	/**
+	 * Drop everything in the ring. Consumer side only.
+	 */
+	void clear()
+	{
+		head = tail;
+	}
+
+protected:
+	T buf[N];
+	volatile unsigned int head; /// Next element to read, written by the consumer
+	volatile unsigned int tail; /// Next slot to write, written by the producer
+
+private:
+	SPSCRing(const SPSCRing &);
+	SPSCRing &operator=(const SPSCRing &);
+};
+
+/**
+ * One thread waiting on a ring, woken with a thread flag. Only the side that can block uses it.
+ * The waiter registers itself before checking the ring a last time, so a wake-up between the check
+ * and the wait is not lost: the flag stays set until the wait.
+ */
+class SPSCWaiter
+{
+public:
+	SPSCWaiter() :
+			thread(NULL)
+	{
+	}
+
+	/** Register the calling thread. Must be followed by a check of the ring, then wait() */
+	void prepare()
+	{
+		osThreadFlagsClear(SPSC_SIGNAL);
+		thread = osThreadGetId();
+		SPSC_BARRIER();
+	}
+
+	/** @return false if timed out */
+	bool wait(uint32_t timeout)
+	{
+		uint32_t flags = osThreadFlagsWait(SPSC_SIGNAL, osFlagsWaitAny,
+				timeout);
+		thread = NULL;
+		return (flags & osFlagsError) == 0;
+	}
+
+	void cancel()
+	{
+		thread = NULL;
+	}
+
+	/** Wake the waiting thread, if any. Can be called from ISR */
+	void wake()
+	{
+		SPSC_BARRIER();
+		osThreadId_t t = thread;
+		if (t)
+			osThreadFlagsSet(t, SPSC_SIGNAL);
+	}
+
+private:
+	osThreadId_t volatile thread;
+};
+
+/**
+ * SPSC ring where the producer can block for space and the consumer can block for data.
+ * The non-blocking functions can be called from ISR. Subclasses can override pushed() and popped()
+ * to be told when data or space becomes available, e.g. to start a transfer.
+ */
+template<typename T, unsigned int N>
+class BlockingSPSCRing: public SPSCRing<T, N>
+{
+public:
+	typedef SPSCRing<T, N> Ring;
+
+	virtual ~BlockingSPSCRing()
+	{
+	}
+
+	bool push(const T &data)
+	{
+		if (!Ring::push(data))
+			return false;
+		readers.wake();
+		pushed();
+		return true;
+	}
+
+	bool pop(T &data)
+	{
+		if (!Ring::pop(data))
+			return false;
+		writers.wake();
+		popped();
+		return true;
+	}
+
+	unsigned int push_n(const T *data, unsigned int n)
+	{
+		unsigned int len = Ring::push_n(data, n);
+		if (len > 0)
+		{
+			readers.wake();
+			pushed();
+		}
+		return len;
+	}
+
+	unsigned int pop_n(T *data, unsigned int n)
+	{
+		unsigned int len = Ring::pop_n(data, n);
+		if (len > 0)
+		{
+			writers.wake();
+			popped();
+		}
+		return len;
+	}
+
+	/**
+	 * Put n elements, waiting for space
+	 * @return number of elements put, less than n if timed out
+	 */
+	unsigned int put_n(const T *data, unsigned int n, uint32_t wait =
+			osWaitForever)
+	{
+		unsigned int done = 0;
+		while (done < n)
+		{
+			unsigned int len = push_n(data + done, n - done);
+			done += len;
+			if (len > 0 || done == n)
+				continue;
+			// Full
+			writers.prepare();
+			if (!this->full())
+			{
+				writers.cancel();
+				continue;
+			}
+			if (!writers.wait(wait))
+				break;
+		}
+		return done;
+	}
+
+	/**
+	 * Wait for data and get up to n elements
+	 * @return number of elements retrieved, 0 if timed out
+	 */
+	unsigned int get_n(T *data, unsigned int n, uint32_t wait = osWaitForever)
+	{
+		if (n == 0)
+			return 0;
+		while (true)
+		{
+			unsigned int len = pop_n(data, n);
+			if (len > 0)
+				return len;
+			readers.prepare();
+			if (!this->empty())
+			{
+				readers.cancel();
+				continue;
+			}
+			if (!readers.wait(wait))
+				return 0;
+		}
+	}
+
+protected:
+	/** Called by the producer after data was put */
+	virtual void pushed()
+	{
+	}
+
+	/** Called by the consumer after data was taken */
+	virtual void popped()
+	{
+	}
+
+private:
+	SPSCWaiter readers; /// Consumer waiting for data
+	SPSCWaiter writers; /// Producer waiting for space
+};
+
+#endif /* PUSHTOGO_SPSCRING_H_ */
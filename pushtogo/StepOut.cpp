@@ -9,12 +9,217 @@
 #include "mbed.h"
 #include <StepOut.h>
 
+#define STEPOUT_DEBUG 0
+
+#if STEPOUT_HW
+
+/*
+ * Timers that can count the pulses of each output timer. The slave runs in external clock mode 1,
+ * clocked by the OCxREF of the master through the internal trigger ITRx (RM0090, TIMx internal
+ * trigger connection). TIM5 is used by the us_ticker and must not be used here.
+ */
+static const struct
+{
+	uint32_t master;
+	uint32_t slave;
+	uint32_t ts; /// ITRx of the slave connected to the TRGO of the master
+	IRQn_Type irq;
+} counter_table[] =
+{
+{ TIM4_BASE, TIM2_BASE, 3, TIM2_IRQn },
+{ TIM3_BASE, TIM9_BASE, 1, TIM1_BRK_TIM9_IRQn },
+{ TIM8_BASE, TIM2_BASE, 1, TIM2_IRQn },
+{ TIM1_BASE, TIM2_BASE, 0, TIM2_IRQn } };
+
+#define COUNTER_TABLE_SIZE ((int) (sizeof(counter_table) / sizeof(counter_table[0])))
+
+static StepOut *counter_owner[COUNTER_TABLE_SIZE];
+
+static void timer_clock_enable(uint32_t base)
+{
+	switch (base)
+	{
+	case TIM2_BASE:
+		__HAL_RCC_TIM2_CLK_ENABLE();
+		break;
+	case TIM9_BASE:
+		__HAL_RCC_TIM9_CLK_ENABLE();
+		break;
+	}
+}
+
+/**
+ * Counter clock of a timer with PSC=0. Timers on an APB bus with a prescaler run at twice the bus clock.
+ */
+static uint32_t timer_clock(TIM_TypeDef *tim)
+{
+	if ((uint32_t) tim >= APB2PERIPH_BASE)
+	{
+		uint32_t pclk = HAL_RCC_GetPCLK2Freq();
+		return ((RCC->CFGR & RCC_CFGR_PPRE2) == RCC_CFGR_PPRE2_DIV1) ?
+				pclk : 2 * pclk;
+	}
+	else
+	{
+		uint32_t pclk = HAL_RCC_GetPCLK1Freq();
+		return ((RCC->CFGR & RCC_CFGR_PPRE1) == RCC_CFGR_PPRE1_DIV1) ?
+				pclk : 2 * pclk;
+	}
+}
+
+#endif
+
+StepOut::StepOut(PinName pin) :
+		PwmOut(pin), stepCount(0), freq(1), status(IDLE)
+{
+	// Stop the output
+	this->period(1);
+	this->write(0);
+	tim.start();
+#if STEPOUT_HW
+	if (hwInit())
+		setFrequency(freq);
+#endif
+}
+
+StepOut::~StepOut()
+{
+#if STEPOUT_HW
+	if (master)
+	{
+		master->CR1 &= ~(TIM_CR1_CEN | TIM_CR1_OPM);
+		core_util_critical_section_enter();
+		slave->DIER = 0;
+		slave->CR1 = 0;
+		counter_owner[slot] = NULL;
+		core_util_critical_section_exit();
+	}
+#endif
+	// Stop the PWM Output
+	this->write(0);
+}
+
+#if STEPOUT_HW
+
+bool StepOut::hwInit()
+{
+	master = (TIM_TypeDef *) _pwm.pwm;
+	slave = NULL;
+	int ch = _pwm.channel;
+	core_util_critical_section_enter();
+	for (slot = 0; slot < COUNTER_TABLE_SIZE; slot++)
+	{
+		if (counter_table[slot].master != (uint32_t) master)
+			continue;
+		bool used = false;
+		for (int i = 0; i < COUNTER_TABLE_SIZE; i++)
+		{
+			if (counter_owner[i]
+					&& ((uint32_t) counter_owner[i]->slave
+							== counter_table[slot].slave
+							|| counter_owner[i]->master == master))
+				used = true;
+		}
+		if (!used)
+			break;
+	}
+	if (slot == COUNTER_TABLE_SIZE || ch < 1 || ch > 4)
+	{
+		core_util_critical_section_exit();
+		debug_if(STEPOUT_DEBUG,
+				"StepOut: no pulse counter for timer 0x%08x, using PwmOut\n",
+				(unsigned int) master);
+		master = NULL;
+		return false;
+	}
+	counter_owner[slot] = this;
+	slave = (TIM_TypeDef *) counter_table[slot].slave;
+	core_util_critical_section_exit();
+
+	clock = timer_clock(master);
+	slaveHigh = 0;
+
+	// Slave: count the rising edges of the master TRGO
+	timer_clock_enable((uint32_t) slave);
+	slave->CR1 = TIM_CR1_URS; // Only overflows set the update flag
+	slave->CR2 = 0;
+	slave->SMCR = (counter_table[slot].ts << TIM_SMCR_TS_Pos) | TIM_SMCR_SMS; // External clock mode 1
+	slave->PSC = 0;
+	slave->ARR = IS_TIM_32B_COUNTER_INSTANCE(slave) ? 0xFFFFFFFFU : 0xFFFFU;
+	slaveRange = (int64_t) slave->ARR + 1;
+	slave->CNT = 0;
+	slave->EGR = TIM_EGR_UG;
+	slave->SR = 0;
+	slave->DIER = TIM_DIER_UIE;
+	NVIC_SetVector(counter_table[slot].irq, (uint32_t) &StepOut::slaveIrq);
+	NVIC_EnableIRQ(counter_table[slot].irq);
+	slave->CR1 |= TIM_CR1_CEN;
+
+	// Master: PWM mode 2 (low for the first half of each period) with preloaded period and compare,
+	// so that the counter stops with the output low and period changes apply at the next update
+	master->CR1 &= ~(TIM_CR1_CEN | TIM_CR1_OPM);
+	volatile uint32_t *ccmr = (ch <= 2) ? &master->CCMR1 : &master->CCMR2;
+	int shift = ((ch - 1) & 1) * 8;
+	*ccmr = (*ccmr & ~(0xFFU << shift))
+			| ((TIM_CCMR1_OC1M | TIM_CCMR1_OC1PE) << shift);
+	ccr = &master->CCR1 + (ch - 1);
+	master->CR2 = (master->CR2 & ~TIM_CR2_MMS)
+			| ((4U + ch - 1) << TIM_CR2_MMS_Pos); // TRGO = OCxREF
+	master->CR1 |= TIM_CR1_ARPE;
+	master->CNT = 0;
+
+	debug_if(STEPOUT_DEBUG, "StepOut: timer 0x%08x ch%d, counter 0x%08x, %u Hz\n",
+			(unsigned int) master, ch, (unsigned int) slave, clock);
+	return true;
+}
+
+void StepOut::slaveIrq()
+{
+	for (int i = 0; i < COUNTER_TABLE_SIZE; i++)
+	{
+		StepOut *s = counter_owner[i];
+		if (s && (s->slave->SR & TIM_SR_UIF))
+		{
+			s->slave->SR = ~TIM_SR_UIF;
+			s->slaveHigh += s->slaveRange;
+		}
+	}
+}
+
+int64_t StepOut::hwCount()
+{
+	core_util_critical_section_enter();
+	int64_t high = slaveHigh;
+	uint32_t cnt = slave->CNT;
+	if ((slave->SR & TIM_SR_UIF) && cnt < slaveRange / 2)
+		high += slaveRange; // Overflow not handled yet
+	core_util_critical_section_exit();
+	return high + cnt;
+}
+
+#endif
+
 void StepOut::start()
 {
 	if (status == IDLE && freq > 0) // Start only when idle and frequency is not zero
 	{
 		core_util_critical_section_enter();
 		status = STEPPING;
+#if STEPOUT_HW
+		if (master)
+		{
+			// If the last pulse is still being finished, just keep the counter running
+			master->CR1 &= ~TIM_CR1_OPM;
+			if (!(master->CR1 & TIM_CR1_CEN))
+			{
+				master->CNT = 0;
+				master->EGR = TIM_EGR_UG; // Load the period, also sets UIF
+				master->CR1 |= TIM_CR1_CEN;
+			}
+			core_util_critical_section_exit();
+			return;
+		}
+#endif
 		this->write(0.5f);
 		tim.reset();
 		core_util_critical_section_exit();
@@ -27,6 +232,21 @@ void StepOut::stop()
 	{
 		core_util_critical_section_enter();
 		status = IDLE;
+#if STEPOUT_HW
+		if (master)
+		{
+			master->CR1 &= ~TIM_CR1_CEN;
+			// UIF is cleared when new values are written, and set when they are loaded
+			uint32_t active = (master->SR & TIM_SR_UIF) ? compare : lastCompare;
+			if (master->CNT >= active)
+			{
+				// The pulse is high and already counted. Let it finish and stop at the end of the period
+				master->CR1 |= TIM_CR1_OPM | TIM_CR1_CEN;
+			}
+			core_util_critical_section_exit();
+			return;
+		}
+#endif
 		this->write(0);
 		stepCount += (int64_t) (freq * tim.read_high_resolution_us() / 1.0E6);
 		core_util_critical_section_exit();
@@ -35,6 +255,38 @@ void StepOut::stop()
 
 double StepOut::setFrequency(double frequency)
 {
+#if STEPOUT_HW
+	if (master && frequency > 0)
+	{
+		double ticks = clock / frequency;
+		if (ticks < 2)
+			ticks = 2;
+		uint32_t psc = (uint32_t) (ticks / 65536.0);
+		if (psc > 0xFFFF)
+			psc = 0xFFFF;
+		double p = ceil(ticks / (psc + 1) - 1e-9); /*Ceil to the next timer tick*/
+		uint32_t period = (p > 65536) ? 65536 : (uint32_t) p;
+
+		core_util_critical_section_enter();
+		// Block update events so that the registers are loaded together at the next period boundary
+		master->CR1 |= TIM_CR1_UDIS;
+		if (master->SR & TIM_SR_UIF)
+			lastCompare = compare;
+		compare = period / 2;
+		master->PSC = psc;
+		master->ARR = period - 1;
+		*ccr = compare;
+		if (status == STEPPING || (master->CR1 & TIM_CR1_CEN))
+			master->SR = ~TIM_SR_UIF;
+		else
+			lastCompare = compare; // Loaded by start()
+		master->CR1 &= ~TIM_CR1_UDIS;
+		core_util_critical_section_exit();
+
+		freq = (double) clock / ((double) (psc + 1) * period);
+		return freq;
+	}
+#endif
 	if (frequency > 0)
 	{
 		int64_t us_period = ceil(1.0E6 / frequency); /*Ceil to the next microsecond*/
@@ -45,7 +297,7 @@ double StepOut::setFrequency(double frequency)
 		}
 		if (status == IDLE)
 			this->period_us(us_period);
-		else
+		else if (1.0E6 / us_period != freq) /*Restarting loses part of a period, only do it if the period changes*/
 		{
 			core_util_critical_section_enter();
 			stop(); /*Stop to correctly update the stepCount*/
@@ -70,6 +322,14 @@ double StepOut::setFrequency(double frequency)
 void StepOut::resetCount()
 {
 	core_util_critical_section_enter();
+#if STEPOUT_HW
+	if (master)
+	{
+		stepCount = hwCount(); // Count is taken relative to the slave counter
+		core_util_critical_section_exit();
+		return;
+	}
+#endif
 	stepCount = 0;
 	if (status == STEPPING)
 		tim.reset();
@@ -78,6 +338,10 @@ void StepOut::resetCount()
 
 int64_t StepOut::getCount()
 {
+#if STEPOUT_HW
+	if (master)
+		return hwCount() - stepCount; // Exact, whether stepping or not
+#endif
 	if (status == IDLE)
 		return stepCount;
 	else
@@ -87,4 +351,3 @@ int64_t StepOut::getCount()
 				+ (int64_t) (freq * tim.read_high_resolution_us() / 1.0E6); /*Calculate count at now*/
 	}
 }
-
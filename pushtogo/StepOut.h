@@ -10,23 +10,25 @@
 
 #include "mbed.h"
 
+/*
+ * On STM32F4, the step pulses are generated by programming the timer behind the PwmOut directly.
+ * The period is changed through the preload registers, so that a new frequency takes effect at the
+ * next period boundary without stopping the output, and the pulses are counted exactly by a second
+ * timer clocked from the trigger output of the first one. Pins whose timer has no usable counter
+ * fall back to the PwmOut implementation, where the count is estimated from the elapsed time.
+ */
+#if defined(TARGET_STM32F4)
+#define STEPOUT_HW 1
+#else
+#define STEPOUT_HW 0
+#endif
+
 class StepOut: protected PwmOut
 {
 public:
 
-	StepOut(PinName pin) :
-			PwmOut(pin), stepCount(0), freq(1), status(IDLE)
-	{
-		// Stop the output
-		this->period(1);
-		this->write(0);
-		tim.start();
-	}
-	virtual ~StepOut()
-	{
-		// Stop the PWM Output
-		this->write(0);
-	}
+	StepOut(PinName pin);
+	virtual ~StepOut();
 
 	void start();
 	void stop();
@@ -46,7 +48,21 @@ private:
 	stepstatus_t status;
 	Timer tim;
 
+#if STEPOUT_HW
+	TIM_TypeDef *master; /// Timer generating the pulses, NULL if using the PwmOut fallback
+	TIM_TypeDef *slave; /// Timer counting the pulses
+	volatile uint32_t *ccr; /// Compare register of the output channel
+	uint32_t compare; /// Last value written to the compare register
+	uint32_t lastCompare; /// Compare value in use until the next update event
+	uint32_t clock; /// Counter clock of the master timer in Hz
+	int64_t slaveRange; /// Pulses per overflow of the slave counter
+	volatile int64_t slaveHigh; /// Pulses counted by the slave before its last overflow
+	int slot; /// Index in the counter table
+
+	bool hwInit();
+	int64_t hwCount();
+	static void slaveIrq();
+#endif
 };
 
 #endif /* TELESCOPE_STEPOUT_H_ */
-
@@ -78,7 +78,8 @@ public:
 	/**
 	 * Set microsteps
 	 * @param microstep Microstep setting to use
-	 * @note to be overriden by application if available
+	 * @note to be overriden by application if available. Can be called while stepping, in which case the step
+	 * count must be kept and the frequency set again by the caller
 	 */
 	virtual void setMicroStep(int microstep)
 	{
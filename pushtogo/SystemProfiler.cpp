@@ -0,0 +1,212 @@
+/*
+ * SystemProfiler.cpp
+ */
+
+#include "SystemProfiler.h"
+#include "EqMountServer.h"
+
+LatencyHistogram SystemProfiler::wakeupLatency("wakeup");
+LatencyHistogram SystemProfiler::commandLatency("command");
+profiler_thread_t SystemProfiler::threads[PROFILER_MAX_THREADS];
+int SystemProfiler::numThreads = 0;
+int SystemProfiler::current = -1;
+uint32_t SystemProfiler::lastSwitch = 0;
+uint64_t SystemProfiler::total = 0;
+uint64_t SystemProfiler::lastTotal = 0;
+uint64_t SystemProfiler::recentTotal = 0;
+uint32_t SystemProfiler::switches = 0;
+
+void LatencyHistogram::reset()
+{
+	core_util_critical_section_enter();
+	for (int i = 0; i < PROFILER_HIST_BINS; i++)
+		bins[i] = 0;
+	count = 0;
+	sum = 0;
+	max = 0;
+	core_util_critical_section_exit();
+}
+
+uint32_t LatencyHistogram::getPercentile(double p) const
+{
+	uint32_t n = count;
+	if (n == 0)
+		return 0;
+	uint32_t target = (uint32_t) ceil(p * n);
+	uint32_t acc = 0;
+	for (int i = 0; i < PROFILER_HIST_BINS - 1; i++)
+	{
+		acc += bins[i];
+		if (acc >= target)
+		{
+			uint32_t edge = 2u << i;
+			return (edge < max) ? edge : max;
+		}
+	}
+	return max;
+}
+
+void SystemProfiler::init()
+{
+	static bool inited = false;
+	if (inited)
+		return;
+	inited = true;
+	EqMountServer::addCommand(
+			ServerCommand("prof", "CPU time of the threads and latencies",
+					SystemProfiler::eqmount_prof, CMD_EXEC_INLINE));
+
+	core_util_critical_section_enter();
+	profiler_init();
+	lastSwitch = profiler_read_cycles();
+	core_util_critical_section_exit();
+	// The thread running now is not switched in by the hook
+	osThreadId_t tid = osThreadGetId();
+	threadSwitched(tid, osThreadGetName(tid), osThreadGetPriority(tid));
+}
+
+void SystemProfiler::account()
+{
+	uint32_t now = profiler_read_cycles();
+	uint32_t delta = now - lastSwitch;
+	lastSwitch = now;
+	if (current >= 0)
+		threads[current].cycles += delta;
+	total += delta;
+}
+
+void SystemProfiler::threadSwitched(void *thread, const char *name,
+		int priority)
+{
+	core_util_critical_section_enter();
+	account();
+	int i;
+	for (i = 0; i < numThreads; i++)
+	{
+		if (threads[i].thread == thread)
+			break;
+	}
+	if (i == numThreads)
+	{
+		if (numThreads < PROFILER_MAX_THREADS)
+		{
+			profiler_thread_t &t = threads[numThreads++];
+			memset(&t, 0, sizeof(t));
+			t.thread = thread;
+			t.name = name;
+			t.priority = priority;
+		}
+		else
+			i = PROFILER_MAX_THREADS - 1;
+	}
+	threads[i].switches++;
+	current = i;
+	switches++;
+	core_util_critical_section_exit();
+}
+
+void SystemProfiler::update()
+{
+	core_util_critical_section_enter();
+	account();
+	for (int i = 0; i < numThreads; i++)
+	{
+		threads[i].recentCycles = threads[i].cycles - threads[i].lastCycles;
+		threads[i].lastCycles = threads[i].cycles;
+	}
+	recentTotal = total - lastTotal;
+	lastTotal = total;
+	core_util_critical_section_exit();
+}
+
+float SystemProfiler::getCPUUsage()
+{
+	core_util_critical_section_enter();
+	uint64_t idle = 0;
+	for (int i = 0; i < numThreads; i++)
+	{
+		if (threads[i].priority == osPriorityIdle)
+			idle += threads[i].recentCycles;
+	}
+	float usage = recentTotal ? 1.0f - (float) idle / recentTotal : 0;
+	core_util_critical_section_exit();
+	return usage;
+}
+
+void SystemProfiler::reset()
+{
+	core_util_critical_section_enter();
+	account();
+	for (int i = 0; i < numThreads; i++)
+	{
+		threads[i].cycles = threads[i].lastCycles = threads[i].recentCycles =
+				0;
+		threads[i].switches = 0;
+	}
+	total = lastTotal = recentTotal = 0;
+	core_util_critical_section_exit();
+	wakeupLatency.reset();
+	commandLatency.reset();
+}
+
+static void print_histogram(EqMountServer *server, const char *cmd,
+		const LatencyHistogram &h)
+{
+	// Samples, mean, max, median, 90th and 99th percentiles in us
+	stprintf(server->getStream(), "%s hist %s %u %.1f %u %u %u %u\r\n", cmd,
+			h.getName(), (unsigned int) h.getCount(), h.getMean(),
+			(unsigned int) h.getMax(), (unsigned int) h.getPercentile(0.5),
+			(unsigned int) h.getPercentile(0.9),
+			(unsigned int) h.getPercentile(0.99));
+	// Counts of the bins
+	char buf[PROFILER_HIST_BINS * 11 + 1];
+	int len = 0;
+	for (int i = 0; i < PROFILER_HIST_BINS; i++)
+	{
+		len += sprintf(buf + len, " %u", (unsigned int) h.getBin(i));
+	}
+	stprintf(server->getStream(), "%s bins %s%s\r\n", cmd, h.getName(), buf);
+}
+
+int SystemProfiler::eqmount_prof(EqMountServer *server, const char *cmd,
+		int argn, char *argv[])
+{
+	if (argn == 1 && strcmp(argv[0], "reset") == 0)
+	{
+		reset();
+		return 0;
+	}
+	else if (argn != 0)
+	{
+		return ERR_WRONG_NUM_PARAM;
+	}
+
+	// Copy the table, so that the output is not done with interrupts disabled
+	profiler_thread_t t[PROFILER_MAX_THREADS];
+	core_util_critical_section_enter();
+	account();
+	int n = numThreads;
+	memcpy(t, threads, sizeof(t));
+	uint64_t tot = total, recent = recentTotal;
+	core_util_critical_section_exit();
+
+	double freq = profiler_cycle_frequency();
+	// Time accounted in ms, cycle frequency in Hz, whether threads are switched through the hook
+	stprintf(server->getStream(), "%s total %.3f %.0f %d\r\n", cmd,
+			tot / freq * 1000, freq, hasSwitchHook() ? 1 : 0);
+	for (int i = 0; i < n; i++)
+	{
+		// Priority, times switched in, CPU time in ms, share of the total and of the last window in percent, name
+		stprintf(server->getStream(), "%s thread %d %u %.3f %.2f %.2f %s\r\n",
+				cmd, t[i].priority, (unsigned int) t[i].switches,
+				t[i].cycles / freq * 1000,
+				tot ? 100.0 * t[i].cycles / tot : 0.0,
+				recent ? 100.0 * t[i].recentCycles / recent : 0.0,
+				t[i].name ? t[i].name : "?");
+	}
+	stprintf(server->getStream(), "%s load %.2f\r\n", cmd,
+			getCPUUsage() * 100);
+	print_histogram(server, cmd, wakeupLatency);
+	print_histogram(server, cmd, commandLatency);
+	return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * SystemProfiler.h
+ *
+ * Accounts the CPU time of each thread, and keeps histograms of the latencies that matter to the mount:
+ * how late the axis threads wake up, and how long a command takes from its arrival to its reply.
+ *
+ * CPU time is measured in cycles of a free-running counter read on every thread switch, and charged to
+ * the thread that was running. Time spent in interrupt handlers is charged to the interrupted thread.
+ * The counter and the switch hook are provided by the platform (telescope_hardware.cpp on the mount,
+ * where they are the DWT cycle counter and the RTX thread switch event).
+ */
+
+#ifndef PUSHTOGO_SYSTEMPROFILER_H_
+#define PUSHTOGO_SYSTEMPROFILER_H_
+
+class SystemProfiler;
+class EqMountServer;
+
+#include "mbed.h"
+
+/// Max number of threads accounted. Threads beyond are charged to the last entry
+#define PROFILER_MAX_THREADS 16
+/// Number of bins of a latency histogram. Bin 0 is below 2us, bin i is [2^i, 2^(i+1)) us, the last bin is open
+#define PROFILER_HIST_BINS 24
+
+/*Provided by the platform*/
+
+/** @return value of a free-running 32-bit cycle counter */
+uint32_t profiler_read_cycles();
+/** @return frequency of the cycle counter in Hz */
+uint32_t profiler_cycle_frequency();
+/** Start the cycle counter and the thread switch hook, which calls SystemProfiler::threadSwitched() */
+void profiler_init();
+
+/**
+ * Histogram of a latency in microseconds, on a log2 scale
+ */
+class LatencyHistogram
+{
+public:
+	LatencyHistogram(const char *name) :
+			name(name)
+	{
+		reset();
+	}
+
+	/** Add a sample. Can be called from any thread */
+	void add(uint32_t us)
+	{
+		int bin = 0;
+		for (uint32_t v = us >> 1; v && bin < PROFILER_HIST_BINS - 1; v >>= 1)
+			bin++;
+		core_util_critical_section_enter();
+		bins[bin]++;
+		count++;
+		sum += us;
+		if (us > max)
+			max = us;
+		core_util_critical_section_exit();
+	}
+
+	void reset();
+
+	const char *getName() const
+	{
+		return name;
+	}
+
+	uint32_t getCount() const
+	{
+		return count;
+	}
+
+	uint32_t getMax() const
+	{
+		return max;
+	}
+
+	/** @return mean latency in us */
+	double getMean() const
+	{
+		return count ? (double) sum / count : 0;
+	}
+
+	uint32_t getBin(int i) const
+	{
+		return bins[i];
+	}
+
+	/**
+	 * @param p Fraction of the samples, e.g. 0.99
+	 * @return upper edge in us of the bin holding the p quantile, max if in the last bin
+	 */
+	uint32_t getPercentile(double p) const;
+
+protected:
+	const char *name;
+	volatile uint32_t bins[PROFILER_HIST_BINS];
+	volatile uint32_t count;
+	volatile uint64_t sum;
+	volatile uint32_t max;
+};
+
+/**
+ * CPU time of a thread
+ */
+struct profiler_thread_t
+{
+	void *thread; /// Thread id
+	const char *name;
+	int priority;
+	uint64_t cycles; /// Cycles run since the last reset
+	uint64_t lastCycles; /// cycles at the last update()
+	uint64_t recentCycles; /// Cycles run between the last two update()
+	uint32_t switches; /// Times switched in
+};
+
+class SystemProfiler
+{
+public:
+	/** Start the profiler. Called once by the hardware setup */
+	static void init();
+
+	/**
+	 * Charge the cycles since the last switch to the outgoing thread. Called by the switch hook of the
+	 * platform with the incoming thread, from the kernel
+	 */
+	static void threadSwitched(void *thread, const char *name, int priority);
+
+	/**
+	 * Close the current measurement window, used by getCPUUsage() and the recent figures. Called periodically,
+	 * e.g. every second by the LCD console
+	 */
+	static void update();
+
+	/** @return CPU load over the last window, i.e. the share of the cycles not spent in the idle thread */
+	static float getCPUUsage();
+
+	/** Clear the accounting and the histograms */
+	static void reset();
+
+	/** @return false if no thread switch has been seen, i.e. the platform has no switch hook */
+	static bool hasSwitchHook()
+	{
+		return switches > 1;
+	}
+
+	static int eqmount_prof(EqMountServer *server, const char *cmd, int argn,
+			char *argv[]);
+
+	/// Lateness of the timed wakeups of the axis threads
+	static LatencyHistogram wakeupLatency;
+	/// Time from the arrival of a command to its reply
+	static LatencyHistogram commandLatency;
+
+protected:
+	static profiler_thread_t threads[PROFILER_MAX_THREADS];
+	static int numThreads;
+	static int current; /// Entry of the running thread, -1 if unknown
+	static uint32_t lastSwitch; /// Cycle counter at the last switch
+	static uint64_t total; /// Cycles since the last reset
+	static uint64_t lastTotal; /// total at the last update()
+	static uint64_t recentTotal; /// Cycles between the last two update()
+	static uint32_t switches;
+
+	/** Charge the cycles up to now to the running thread. Called with interrupts disabled */
+	static void account();
+};
+
+#endif /* PUSHTOGO_SYSTEMPROFILER_H_ */
@@ -14,6 +14,8 @@
 
 #define TC_DEBUG 1
 
+volatile uint32_t TelescopeConfiguration::version = 1;
+
 TelescopeConfiguration TelescopeConfiguration::instance =
 		TelescopeConfiguration();
 
@@ -167,6 +169,109 @@ static const ConfigItem default_config[] =
 						{ .idata = 5 }, .min =
 						{ .idata = 1 }, .max =
 						{ .idata = 1000 } },
+				{ .config = "jerk_time", .name = "Jerk Time",
+						.help =
+								"Time in milliseconds for the acceleration to build up at the start and end of each speed change. 0 gives a linear speed ramp.",
+						.type = DATATYPE_INT, .value =
+						{ .idata = 0 }, .min =
+						{ .idata = 0 }, .max =
+						{ .idata = 1000 } },
+				{ .config = "sync_slew", .name = "Coordinated Slews",
+						.help =
+								"Slow down the axis with the shorter slew so that both axes arrive at the same time.",
+						.type = DATATYPE_BOOL, .value =
+						{ .bdata = true } },
+				{ .config = "track_mode", .name = "Tracking Rate Model",
+						.help =
+								"0: constant tracking speed. 1: King rate on RA. 2: apparent motion of the target with refraction, on both axes.",
+						.type = DATATYPE_INT, .value =
+						{ .idata = 0 }, .min =
+						{ .idata = 0 }, .max =
+						{ .idata = 2 } },
+				{ .config = "track_pointing_model",
+						.name = "Track Pointing Model",
+						.help =
+								"Include the pointing model in the tracking rates of track_mode 2.",
+						.type = DATATYPE_BOOL, .value =
+						{ .bdata = false } },
+				{ .config = "track_update_interval",
+						.name = "Tracking Update Interval",
+						.help =
+								"Interval in seconds between updates of the tracking rates when track_mode is not 0.",
+						.type = DATATYPE_DOUBLE, .value =
+						{ .ddata = 10 }, .min =
+						{ .ddata = 1 }, .max =
+						{ .ddata = 600 } },
+				{ .config = "encoder_sample_rate", .name = "Encoder Sample Rate",
+						.help =
+								"Rate in Hz at which the axis encoders are read, if there are any.",
+						.type = DATATYPE_DOUBLE, .value =
+						{ .ddata = 50 }, .min =
+						{ .ddata = 1 }, .max =
+						{ .ddata = 1000 } },
+				{ .config = "encoder_slip_threshold",
+						.name = "Encoder Slip Threshold",
+						.help =
+								"Difference in deg between the encoder and the step count that is taken as lost steps or backlash, instead of noise.",
+						.type = DATATYPE_DOUBLE, .value =
+						{ .ddata = 0.02 }, .min =
+						{ .ddata = 0 }, .max =
+						{ .ddata = 10 } },
+				{ .config = "ra_backlash", .name = "RA Backlash",
+						.help =
+								"Backlash of the RA gear in deg, taken up when the axis reverses. 0 to disable.",
+						.type = DATATYPE_DOUBLE, .value =
+						{ .ddata = 0 }, .min =
+						{ .ddata = 0 }, .max =
+						{ .ddata = 5 } },
+				{ .config = "dec_backlash", .name = "DEC Backlash",
+						.help =
+								"Backlash of the DEC gear in deg, taken up when the axis reverses. 0 to disable.",
+						.type = DATATYPE_DOUBLE, .value =
+						{ .ddata = 0 }, .min =
+						{ .ddata = 0 }, .max =
+						{ .ddata = 5 } },
+				{ .config = "ra_approach", .name = "RA Approach Direction",
+						.help =
+								"Direction of the final approach of RA slews when there is backlash. 1: positive, -1: negative, 0: either.",
+						.type = DATATYPE_INT, .value =
+						{ .idata = 1 }, .min =
+						{ .idata = -1 }, .max =
+						{ .idata = 1 } },
+				{ .config = "dec_approach", .name = "DEC Approach Direction",
+						.help =
+								"Direction of the final approach of DEC slews when there is backlash. 1: positive, -1: negative, 0: either.",
+						.type = DATATYPE_INT, .value =
+						{ .idata = 0 }, .min =
+						{ .idata = -1 }, .max =
+						{ .idata = 1 } },
+				{ .config = "backlash_speed_sidereal",
+						.name = "Backlash Takeup Speed",
+						.help =
+								"Speed of the backlash takeup in multiple of sidereal rate. The motor starts at this speed without acceleration.",
+						.type = DATATYPE_DOUBLE, .value =
+						{ .ddata = 64 }, .min =
+						{ .ddata = 1 }, .max =
+						{ .ddata = 1000 } },
+				{ .config = "pec_enable", .name = "Periodic Error Correction",
+						.help =
+								"Play back the PEC table on the SD card when the mount starts.",
+						.type = DATATYPE_BOOL, .value =
+						{ .bdata = false } },
+				{ .config = "pec_record_cycles", .name = "PEC Recording Cycles",
+						.help =
+								"Number of worm cycles averaged by a PEC recording.",
+						.type = DATATYPE_INT, .value =
+						{ .idata = 3 }, .min =
+						{ .idata = 1 }, .max =
+						{ .idata = 100 } },
+				{ .config = "pec_harmonics", .name = "PEC Harmonics",
+						.help =
+								"Number of harmonics of the worm period kept in the PEC table. Higher harmonics are taken as noise.",
+						.type = DATATYPE_INT, .value =
+						{ .idata = 4 }, .min =
+						{ .idata = 1 }, .max =
+						{ .idata = 63 } },
 				{ .config = "" } };
 
 int TelescopeConfiguration::eqmount_config(EqMountServer *server,
@@ -318,22 +423,63 @@ int TelescopeConfiguration::eqmount_config(EqMountServer *server,
 	return 0;
 }
 
+/*FNV-1a, with a seed mixed into the offset basis*/
+uint32_t TelescopeConfiguration::hash(const char *name, uint32_t seed)
+{
+	uint32_t h = 2166136261u ^ (seed * 0x9E3779B9u);
+	while (*name)
+	{
+		h ^= (uint8_t) *name++;
+		h *= 16777619u;
+	}
+	return h ^ (h >> 15);
+}
+
 TelescopeConfiguration::TelescopeConfiguration()
 {
-	ConfigNode *q = NULL, *r;
-	for (const ConfigItem *p = default_config; *(p->config) != '\0'; p++)
+	int n = 0;
+	while (*(default_config[n].config) != '\0')
+		n++;
+	if (n * 4 > TC_BUILTIN_SLOTS || n > 255)
+		error("Too many built-in configs");
+
+	builtin = new ConfigItem[n];
+	ConfigNode *q = NULL, *r = NULL;
+	for (int i = 0; i < n; i++)
 	{
 		r = new ConfigNode;
 		r->next = q;
-		r->config = new ConfigItem(*p);
-		r->default_config = p;
+		r->config = &builtin[i];
+		*r->config = default_config[i];
+		r->default_config = &default_config[i];
 		q = r;
 	}
 	head = r;
 
+	// Find a seed that maps every built-in config to its own slot. With n configs in m slots a seed
+	// succeeds with a probability of about exp(-n^2 / 2m), hence the table at most a quarter full
+	for (seed = 0;; seed++)
+	{
+		if (seed == TC_MAX_SEED_TRIES)
+			error("No collision-free hash of the built-in configs");
+		memset(builtin_index, 0, sizeof(builtin_index));
+		int i;
+		for (i = 0; i < n; i++)
+		{
+			uint8_t &slot = builtin_index[hash(default_config[i].config, seed)
+					& (TC_BUILTIN_SLOTS - 1)];
+			if (slot)
+				break;
+			slot = i + 1;
+		}
+		if (i == n)
+			break;
+	}
+	memset(extra_table, 0, sizeof(extra_table));
+
 	EqMountServer::addCommand(
 			ServerCommand("config", "Configuration subsystem",
-					TelescopeConfiguration::eqmount_config));
+					TelescopeConfiguration::eqmount_config, CMD_EXEC_INLINE));
 }
 
 int TelescopeConfiguration::getIntFromConfig(ConfigItem *config)
@@ -384,6 +530,7 @@ bool TelescopeConfiguration::setIntToConfig(ConfigItem *config, int value)
 		config->value.idata = value;
 	else
 		config->value.ddata = value;
+	changed();
 	return false;
 }
 
@@ -401,6 +548,7 @@ bool TelescopeConfiguration::setDoubleToConfig(ConfigItem *config, double value)
 		return true;
 	}
 	config->value.ddata = value;
+	changed();
 	return false;
 }
 
@@ -418,6 +566,7 @@ bool TelescopeConfiguration::setBoolToConfig(ConfigItem *config, bool value)
 		return true;
 	}
 	config->value.bdata = value;
+	changed();
 	return false;
 }
 
@@ -435,6 +584,7 @@ bool TelescopeConfiguration::setStringToConfig(ConfigItem *config, char* value)
 		return true;
 	}
 	strncpy(config->value.strdata, value, sizeof(config->value.strdata));
+	changed();
 	return false;
 }
 
@@ -489,6 +639,7 @@ void TelescopeConfiguration::setConfig(const char* name, char *value)
 		config->help = "";
 		config->name = config->config;
 		config->extra = true;
+		instance.addExtra(config);
 		ConfigNode *n = new ConfigNode;
 		n->config = config;
 		n->default_config = NULL;
@@ -544,17 +695,39 @@ void TelescopeConfiguration::setConfig(const char* name, char *value)
 		strncpy(config->value.strdata, value, sizeof(config->value.strdata));
 		break;
 	}
+	changed();
 }
 
 ConfigItem* TelescopeConfiguration::getConfigItem(const char* name)
 {
-	ConfigNode *p;
-	for (p = head; p && (strcmp(p->config->config, name) != 0); p = p->next)
-		;
-	if (!p)
-		return NULL;
-	else
-		return p->config;
+	uint8_t i = builtin_index[hash(name, seed) & (TC_BUILTIN_SLOTS - 1)];
+	if (i && strcmp(builtin[i - 1].config, name) == 0)
+		return &builtin[i - 1];
+	// Not a built-in config, probe the extra table
+	for (uint32_t h = hash(name, 0), k = 0; k < TC_EXTRA_SLOTS; h++, k++)
+	{
+		ConfigItem *config = extra_table[h & (TC_EXTRA_SLOTS - 1)];
+		if (!config)
+			break;
+		if (strcmp(config->config, name) == 0)
+			return config;
+	}
+	return NULL;
+}
+
+void TelescopeConfiguration::addExtra(ConfigItem *config)
+{
+	for (uint32_t h = hash(config->config, 0), k = 0; k < TC_EXTRA_SLOTS;
+			h++, k++)
+	{
+		ConfigItem *&slot = extra_table[h & (TC_EXTRA_SLOTS - 1)];
+		if (!slot)
+		{
+			slot = config;
+			return;
+		}
+	}
+	error("Too many extra configs");
 }
 
 TelescopeConfiguration::~TelescopeConfiguration()
@@ -562,10 +735,12 @@ TelescopeConfiguration::~TelescopeConfiguration()
 	for (ConfigNode *q = head; q;)
 	{
 		ConfigNode *p = q->next;
-		delete q->config;
+		if (!q->default_config)
+			delete q->config;
 		delete q;
 		q = p;
 	}
+	delete[] builtin;
 }
 
 void TelescopeConfiguration::readFromFile(FILE* fp)
@@ -10,6 +10,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 class TelescopeConfiguration;
 
@@ -39,6 +40,13 @@ struct ConfigItem
 	DataValue max;bool extra;
 };
 
+/// Number of slots of the index of built-in configs, power of 2 of at least 4 times the number of built-in configs
+#define TC_BUILTIN_SLOTS 256
+/// Max number of seeds tried for the index of built-in configs. 35 configs in 256 slots need about 14 tries
+#define TC_MAX_SEED_TRIES 10000
+/// Number of slots of the table of extra configs (those read from file that have no built-in default), power of 2
+#define TC_EXTRA_SLOTS 64
+
 class TelescopeConfiguration
 {
 public:
@@ -63,7 +71,31 @@ public:
 				len);
 	}
 
+	/**
+	 * @return Version of the configuration, incremented every time a value is changed. Never 0.
+	 */
+	static uint32_t getVersion()
+	{
+		return version;
+	}
+
+	/**
+	 * Check if the configuration changed since the version seen by the caller, and update it.
+	 * Used by consumers that cache values derived from the configuration.
+	 * @param seen Version seen by the caller, initialized to 0
+	 */
+	static bool changedSince(uint32_t &seen)
+	{
+		uint32_t v = version;
+		if (seen == v)
+			return false;
+		seen = v;
+		return true;
+	}
+
 private:
+	template<typename T> friend class ConfigHandle;
+
 	TelescopeConfiguration();
 	~TelescopeConfiguration();
 
@@ -74,7 +106,14 @@ private:
 		ConfigItem *config;
 		const ConfigItem *default_config;
 		ConfigNode *next;
-	}*head;
+	}*head; /// All configs, in the order they are listed and saved
+
+	static volatile uint32_t version;
+
+	uint32_t seed; /// Hash seed that gives no collision in builtin_index
+	uint8_t builtin_index[TC_BUILTIN_SLOTS]; /// Perfect-hash index of the built-in configs, 1 + index into builtin
+	ConfigItem *builtin; /// Built-in configs, same order as the default table
+	ConfigItem *extra_table[TC_EXTRA_SLOTS]; /// Open-addressing table of the extra configs
 
 	static TelescopeConfiguration &getInstance()
 	{
@@ -83,6 +122,14 @@ private:
 
 	ConfigItem *getConfigItem(const char *name);
 	ConfigItem *getConfigItemCheck(const char *name);
+	void addExtra(ConfigItem *config);
+
+	static uint32_t hash(const char *name, uint32_t seed);
+	static void changed()
+	{
+		if (++version == 0)
+			version = 1;
+	}
 
 	void setConfig(const char *name, char *value);
 
@@ -96,8 +143,64 @@ private:
 	static bool setBoolToConfig(ConfigItem *, bool value);
 	static bool setStringToConfig(ConfigItem *, char *value);
 
+	static void getFromConfig(ConfigItem *config, int &value)
+	{
+		value = getIntFromConfig(config);
+	}
+	static void getFromConfig(ConfigItem *config, double &value)
+	{
+		value = getDoubleFromConfig(config);
+	}
+	static void getFromConfig(ConfigItem *config, bool &value)
+	{
+		value = getBoolFromConfig(config);
+	}
+
 	static int eqmount_config(EqMountServer *server, const char *cmd, int argn,
 			char *argv[]);
 };
 
+/**
+ * Typed handle to a config, for code that reads it often. The name is resolved the first time the
+ * value is read and the value is cached until the configuration changes, so get() is a comparison
+ * of the version in the common case. T can be int, double or bool.
+ * Handles can be static: the constructor does not touch the configuration.
+ */
+template<typename T>
+class ConfigHandle
+{
+public:
+	explicit ConfigHandle(const char *name) :
+			name(name), item(NULL), seen(0), value()
+	{
+	}
+
+	T get()
+	{
+		uint32_t v = TelescopeConfiguration::version;
+		if (seen != v)
+		{
+			if (!item)
+				item = TelescopeConfiguration::getInstance().getConfigItemCheck(
+						name);
+			T val;
+			TelescopeConfiguration::getFromConfig(item, val);
+			value = val;
+			seen = v; // Published after the value, so a concurrent reader never sees a stale value as current
+		}
+		return value;
+	}
+
+	operator T()
+	{
+		return get();
+	}
+
+private:
+	const char *name;
+	ConfigItem *item;
+	volatile uint32_t seen;
+	T value;
+};
+
 #endif /* PUSHTOGO_TELESCOPECONFIGURATION_H_ */
@@ -0,0 +1,69 @@
+/*
+ * TraceFormat.h
+ *
+ * Format of the motion trace recorded by MotionTrace. This file has no dependency on mbed, so the same
+ * definitions are used by the firmware and by the host-side decoder.
+ *
+ * A trace file is a trace_header followed by count trace_event records, all little-endian.
+ * The text dump of the trace command has one line per event:
+ *
+ *   trace <time> <source> <type> <aux> <a> <b>
+ *
+ * with the same fields as trace_event, after a line "trace source <id> <name>" for each source.
+ */
+
+#ifndef PUSHTOGO_TRACEFORMAT_H_
+#define PUSHTOGO_TRACEFORMAT_H_
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x54474750 /// "PGGT"
+#define TRACE_VERSION 1
+/// Max number of event sources, e.g. axes
+#define TRACE_MAX_SOURCES 8
+/// Max length of a source name, including the terminating 0
+#define TRACE_NAME_SIZE 16
+
+/**
+ * Event types. a and b are in the units given here
+ */
+typedef enum
+{
+	TRACE_NONE = 0,
+	TRACE_FREQUENCY = 1, /// Step frequency set. a: requested, b: actual frequency in full steps/s
+	TRACE_START = 2, /// Motor started. aux: 1 forward, 2 backward. b: step count
+	TRACE_STOP = 3, /// Motor stopped. b: step count
+	TRACE_SLEW_STATE = 4, /// Slew state changed. aux: axisslewstate_t
+	TRACE_STATUS = 5, /// Axis status changed. aux: axisstatus_t
+	TRACE_GUIDE = 6, /// Guide pulse queued. aux: 1 positive, 2 negative. a: duration in ms
+	TRACE_CORRECTION = 7, /// Correction move. a: angle to go in deg, b: duration in ms
+	TRACE_WAKEUP = 8, /// Axis thread woken up. aux: thread flags >> 16 (the axis signals), 0 if timed out
+	TRACE_TAKEUP = 9, /// Backlash taken up. b: steps
+	TRACE_MESSAGE = 10, /// Command received by the axis thread. aux: message type. a: angle in deg
+	TRACE_USER = 11 /// Free for debugging
+} trace_type_t;
+
+/**
+ * One event. 16 bytes, so that the buffer can hold many
+ */
+struct trace_event
+{
+	uint32_t time; /// Microseconds, wraps around after 71 minutes
+	uint8_t type; /// trace_type_t
+	uint8_t source; /// Source id
+	uint16_t aux;
+	float a;
+	float b;
+};
+
+struct trace_header
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t event_size; /// sizeof(trace_event)
+	uint32_t count; /// Number of events following the header
+	uint32_t lost; /// Events overwritten before the dump
+	char sources[TRACE_MAX_SOURCES][TRACE_NAME_SIZE]; /// Names of the sources by id, empty if not used
+};
+
+#endif /* PUSHTOGO_TRACEFORMAT_H_ */
@@ -0,0 +1,178 @@
+/*
+ * SimBench.cpp
+ */
+
+#include "SimBench.h"
+#include "sim_hardware.h"
+#include <time.h>
+
+/// Interval at which .settle checks the axes, in us
+#define SIM_SETTLE_POLL_US 10000
+
+/**
+ * Position of the shafts and of the step counts of both axes
+ */
+struct bench_axes_t
+{
+	double ra_shaft, dec_shaft;
+	double ra_count, dec_count;
+
+	void read()
+	{
+		ra_shaft = sim_ra_stepper->getShaftPosition();
+		dec_shaft = sim_dec_stepper->getShaftPosition();
+		ra_count = sim_ra_stepper->getStepCount();
+		dec_count = sim_dec_stepper->getStepCount();
+	}
+};
+
+static struct
+{
+	char name[64];
+	bool started;
+	uint64_t t0; /// Start of the scenario in us
+	double cpu0; /// Host CPU time at the start in s
+	uint64_t switches0;
+	bench_axes_t start;
+	uint64_t tmark; /// Start of the rate window
+	bench_axes_t mark;
+	double slew; /// Time spent slewing in s
+	bool hasTarget;
+	EquatorialCoordinates target;
+} bench;
+
+static double cpu_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool slewing()
+{
+	return sim_ra_axis->getStatus() == AXIS_SLEWING
+			|| sim_dec_axis->getStatus() == AXIS_SLEWING;
+}
+
+/**
+ * @return angle between two positions in deg
+ */
+static double distance(const EquatorialCoordinates &a,
+		const EquatorialCoordinates &b)
+{
+	double d2r = M_PI / 180;
+	double sd = sin((a.dec - b.dec) * d2r / 2);
+	double sr = sin((a.ra - b.ra) * d2r / 2);
+	double h = sd * sd + cos(a.dec * d2r) * cos(b.dec * d2r) * sr * sr;
+	return 2 * asin(sqrt(h < 1 ? h : 1)) / d2r;
+}
+
+static void result()
+{
+	SimKernel &k = SimKernel::instance();
+	bench_axes_t now;
+	now.read();
+	double ra_spd = sim_ra_axis->getStepsPerDeg();
+	double dec_spd = sim_dec_axis->getStepsPerDeg();
+
+	// Steps lost or gained since the start
+	double ra_drift = (now.ra_shaft - now.ra_count)
+			- (bench.start.ra_shaft - bench.start.ra_count);
+	double dec_drift = (now.dec_shaft - now.dec_count)
+			- (bench.start.dec_shaft - bench.start.dec_count);
+
+	double window = (k.now() - bench.tmark) * 1e-6;
+	double ra_rate = 0, dec_rate = 0;
+	if (window > 0)
+	{
+		ra_rate = (now.ra_shaft - bench.mark.ra_shaft) / ra_spd / window
+				/ sidereal_speed;
+		dec_rate = (now.dec_shaft - bench.mark.dec_shaft) / dec_spd / window
+				/ sidereal_speed;
+	}
+
+	printf("bench %s sim_s=%.3f slew_s=%.3f", bench.name,
+			(k.now() - bench.t0) * 1e-6, bench.slew);
+	if (bench.hasTarget)
+	{
+		// Where the shafts point: the angles of the axes, off by the lost steps
+		MountCoordinates mc(
+				remainder((now.dec_count + dec_drift) / dec_spd, 360),
+				remainder((now.ra_count + ra_drift) / ra_spd, 360));
+		EquatorialCoordinates eq = sim_eq_mount->convertToEqCoordinates(mc);
+		printf(" err_arcsec=%.3f", distance(eq, bench.target) * 3600);
+	}
+	printf(" ra_rate=%.6f dec_rate=%.6f ra_drift=%.4f dec_drift=%.4f"
+			" switches=%llu cpu_ms=%.1f\n", ra_rate, dec_rate, ra_drift,
+			dec_drift,
+			(unsigned long long) (k.getSwitchCount() - bench.switches0),
+			(cpu_time() - bench.cpu0) * 1000);
+}
+
+bool SimBench::directive(const char *cmd, char *saveptr, int lineno)
+{
+	SimKernel &k = SimKernel::instance();
+	char *arg = strtok_r(NULL, " \t", &saveptr);
+	if (strcmp(cmd, ".bench") == 0)
+	{
+		snprintf(bench.name, sizeof(bench.name), "%s", arg ? arg : "unnamed");
+		bench.started = true;
+		bench.t0 = bench.tmark = k.now();
+		bench.cpu0 = cpu_time();
+		bench.switches0 = k.getSwitchCount();
+		bench.start.read();
+		bench.mark = bench.start;
+		bench.slew = 0;
+		bench.hasTarget = false;
+	}
+	else if (!bench.started)
+	{
+		if (strcmp(cmd, ".target") == 0 || strcmp(cmd, ".settle") == 0
+				|| strcmp(cmd, ".mark") == 0 || strcmp(cmd, ".result") == 0)
+		{
+			fprintf(stderr, "sim: line %d: %s before .bench\n", lineno, cmd);
+			return true;
+		}
+		return false;
+	}
+	else if (strcmp(cmd, ".target") == 0)
+	{
+		char *dec = strtok_r(NULL, " \t", &saveptr);
+		if (!arg || !dec)
+		{
+			fprintf(stderr, "sim: line %d: usage: .target <ra> <dec>\n",
+					lineno);
+			return true;
+		}
+		bench.target = EquatorialCoordinates(strtod(dec, NULL),
+				strtod(arg, NULL));
+		bench.hasTarget = true;
+	}
+	else if (strcmp(cmd, ".settle") == 0)
+	{
+		double timeout = arg ? strtod(arg, NULL) : 600;
+		uint64_t t0 = k.now();
+		do
+		{
+			k.sleep(SIM_SETTLE_POLL_US);
+		} while (slewing() && k.now() - t0 < timeout * 1e6);
+		if (slewing())
+			fprintf(stderr, "sim: line %d: still slewing after %.0f s\n",
+					lineno, timeout);
+		bench.slew += (k.now() - t0) * 1e-6;
+	}
+	else if (strcmp(cmd, ".mark") == 0)
+	{
+		bench.tmark = k.now();
+		bench.mark.read();
+	}
+	else if (strcmp(cmd, ".result") == 0)
+	{
+		result();
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
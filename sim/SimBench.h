@@ -0,0 +1,38 @@
+/*
+ * SimBench.h
+ *
+ * Measurements of the motion quality for the benchmark scenarios in bench/. A scenario is an ordinary
+ * simulation script that uses these directives:
+ *  .bench <name>			start a scenario
+ *  .target <ra> <dec>		position the mount should end up at, in deg
+ *  .settle [seconds]		let the virtual time run until no axis is slewing (default timeout 600 s).
+ *  					The time is added to the slew time of the scenario
+ *  .mark				start the window over which the rates are measured, default the start of the scenario
+ *  .result				print the results of the scenario
+ *
+ * The result is one line of key=value pairs:
+ *
+ *   bench <name> sim_s=.. slew_s=.. err_arcsec=.. ra_rate=.. dec_rate=.. ra_drift=.. dec_drift=.. switches=.. cpu_ms=..
+ *
+ * err_arcsec is the distance between the target and where the shafts point, which includes the lost steps.
+ * The rates are the mean speeds of the shafts over the window in sidereal units. The drifts are the steps
+ * the shafts lost or gained against the step counts. All but cpu_ms are deterministic.
+ */
+
+#ifndef SIM_SIMBENCH_H_
+#define SIM_SIMBENCH_H_
+
+class SimBench
+{
+public:
+	/**
+	 * Execute a benchmark directive
+	 * @param cmd Directive
+	 * @param saveptr State of strtok_r() after the directive, for the arguments
+	 * @param lineno Line of the script
+	 * @return false if cmd is not a benchmark directive
+	 */
+	static bool directive(const char *cmd, char *saveptr, int lineno);
+};
+
+#endif /* SIM_SIMBENCH_H_ */
@@ -0,0 +1,37 @@
+/*
+ * SimClock.h
+ *
+ * UTCClock running on virtual time
+ */
+
+#ifndef SIM_SIMCLOCK_H_
+#define SIM_SIMCLOCK_H_
+
+#include "mbed.h"
+#include "UTCClock.h"
+
+class SimClock: public UTCClock
+{
+protected:
+	time_t epoch; /// UTC time at virtual time 0
+public:
+	SimClock(time_t epoch = 0) :
+			epoch(epoch)
+	{
+	}
+	~SimClock()
+	{
+	}
+
+	time_t getTime()
+	{
+		return epoch + (time_t) (SimKernel::instance().now() / 1000000);
+	}
+
+	void setTime(time_t newtime)
+	{
+		epoch = newtime - (time_t) (SimKernel::instance().now() / 1000000);
+	}
+};
+
+#endif /* SIM_SIMCLOCK_H_ */
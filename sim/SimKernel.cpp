@@ -0,0 +1,344 @@
+/*
+ * SimKernel.cpp
+ */
+
+#include "SimKernel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+/// Host code needs much more stack than the target, so never go below this
+#define SIM_MIN_STACK_SIZE	(256 * 1024)
+
+/// Time a busy-yielding thread advances the clock by when nothing else can run (one RTOS tick)
+#define SIM_YIELD_TICK_US	1000
+
+SimWaitQueue::~SimWaitQueue()
+{
+	// Threads still blocked here will only ever return by timing out
+	for (std::deque<SimThread*>::iterator it = waiters.begin();
+			it != waiters.end(); ++it)
+		(*it)->blocked_on = NULL;
+}
+
+bool SimWaitQueue::wait(uint64_t timeout_us)
+{
+	return SimKernel::instance().block(this, timeout_us);
+}
+
+bool SimWaitQueue::notify_one()
+{
+	if (waiters.empty())
+		return false;
+	SimThread *th = waiters.front();
+	SimKernel::instance().wake(th);
+	return true;
+}
+
+void SimWaitQueue::notify_all()
+{
+	while (!waiters.empty())
+		SimKernel::instance().wake(waiters.front());
+}
+
+void SimWaitQueue::remove(SimThread *th)
+{
+	std::deque<SimThread*>::iterator it = std::find(waiters.begin(),
+			waiters.end(), th);
+	if (it != waiters.end())
+		waiters.erase(it);
+}
+
+SimThread::SimThread(int priority, size_t stack_size, const char *name) :
+		flags(0), wait_flags(0), wait_options(0), stack(NULL), stack_size(
+				stack_size), priority(priority), name(name), state(INACTIVE), deadline(
+		SIM_WAIT_FOREVER), timed_out(false), ready_seq(0), blocked_on(NULL)
+{
+	SimKernel &k = SimKernel::instance();
+	k.all.push_back(this);
+}
+
+SimThread::~SimThread()
+{
+	SimKernel &k = SimKernel::instance();
+	if (state != TERMINATED && state != INACTIVE)
+	{
+		if (k.running == this)
+		{
+			fprintf(stderr, "sim: thread %s deleted while running\n",
+					name ? name : "?");
+			abort();
+		}
+		k.terminate(this);
+	}
+	k.remove(this);
+	delete[] stack;
+}
+
+void SimThread::trampoline(unsigned int hi, unsigned int lo)
+{
+	SimThread *th = (SimThread*) (((uintptr_t) hi << 32) | (uintptr_t) lo);
+	th->entry();
+	SimKernel::instance().terminate(th);
+}
+
+SimKernel &SimKernel::instance()
+{
+	// Never destroyed, so that static destructors can still use it
+	static SimKernel *kernel = new SimKernel();
+	return *kernel;
+}
+
+SimKernel::SimKernel() :
+		now_us(0), seq(0), switches(0), running(NULL), main_thread(NULL), switch_hook(
+		NULL)
+{
+}
+
+SimThread *SimKernel::current()
+{
+	if (!running)
+	{
+		// Adopt the host thread as the main thread
+		main_thread = new SimThread(24, 0, "main");
+		main_thread->state = SimThread::RUNNING;
+		running = main_thread;
+	}
+	return running;
+}
+
+void SimKernel::remove(SimThread *th)
+{
+	std::vector<SimThread*>::iterator it = std::find(all.begin(), all.end(),
+			th);
+	if (it != all.end())
+		all.erase(it);
+}
+
+void SimKernel::makeReady(SimThread *th, bool front)
+{
+	th->state = SimThread::READY;
+	th->ready_seq = front ? 0 : ++seq;
+}
+
+SimThread *SimKernel::pickNext()
+{
+	SimThread *next = NULL;
+	for (std::vector<SimThread*>::iterator it = all.begin(); it != all.end();
+			++it)
+	{
+		SimThread *th = *it;
+		if (th->state != SimThread::READY)
+			continue;
+		if (!next || th->priority > next->priority
+				|| (th->priority == next->priority
+						&& th->ready_seq < next->ready_seq))
+			next = th;
+	}
+	return next;
+}
+
+uint64_t SimKernel::nextDeadline(SimThread *exclude)
+{
+	uint64_t t = SIM_WAIT_FOREVER;
+	for (std::vector<SimThread*>::iterator it = all.begin(); it != all.end();
+			++it)
+	{
+		SimThread *th = *it;
+		if (th != exclude && th->state == SimThread::BLOCKED
+				&& th->deadline < t)
+			t = th->deadline;
+	}
+	return t;
+}
+
+/**
+ * Advance virtual time and make all threads whose timeout expired ready
+ */
+void SimKernel::advanceTo(uint64_t t)
+{
+	if (t > now_us)
+		now_us = t;
+	for (std::vector<SimThread*>::iterator it = all.begin(); it != all.end();
+			++it)
+	{
+		SimThread *th = *it;
+		if (th->state == SimThread::BLOCKED && th->deadline <= now_us)
+		{
+			if (th->blocked_on)
+			{
+				th->blocked_on->remove(th);
+				th->blocked_on = NULL;
+			}
+			th->timed_out = true;
+			th->deadline = SIM_WAIT_FOREVER;
+			makeReady(th, false);
+		}
+	}
+}
+
+void SimKernel::schedule()
+{
+	SimThread *prev = running;
+	SimThread *next;
+	while ((next = pickNext()) == NULL)
+	{
+		// Nothing to run, jump to the next timed event
+		uint64_t t = nextDeadline(NULL);
+		if (t == SIM_WAIT_FOREVER)
+		{
+			fprintf(stderr, "sim: deadlock at t=%.6f s, all threads blocked:\n",
+					now_us / 1.0E6);
+			for (std::vector<SimThread*>::iterator it = all.begin();
+					it != all.end(); ++it)
+				fprintf(stderr, "sim:   %s (state %d, prio %d)\n",
+						(*it)->name ? (*it)->name : "?", (int) (*it)->state,
+						(*it)->priority);
+			exit(3);
+		}
+		advanceTo(t);
+	}
+
+	next->state = SimThread::RUNNING;
+	if (next == prev)
+		return;
+
+	running = next;
+	switches++;
+	if (switch_hook)
+		switch_hook(prev, next);
+	swapcontext(&prev->ctx, &next->ctx);
+	// Resumed. running has been set back to prev by whoever switched to us
+}
+
+void SimKernel::start(SimThread *th, const std::function<void()> &fn)
+{
+	SimThread *cur = current();
+	if (th->state != SimThread::INACTIVE)
+		return;
+
+	th->entry = fn;
+	size_t size = th->stack_size;
+	if (size < SIM_MIN_STACK_SIZE)
+		size = SIM_MIN_STACK_SIZE;
+	th->stack = new char[size];
+	th->stack_size = size;
+
+	getcontext(&th->ctx);
+	th->ctx.uc_stack.ss_sp = th->stack;
+	th->ctx.uc_stack.ss_size = size;
+	th->ctx.uc_link = NULL;
+	uintptr_t p = (uintptr_t) th;
+	makecontext(&th->ctx, (void (*)()) &SimThread::trampoline, 2,
+			(unsigned int) (p >> 32), (unsigned int) (p & 0xFFFFFFFF));
+
+	makeReady(th, false);
+	if (th->priority > cur->priority)
+	{
+		makeReady(cur, false);
+		schedule();
+	}
+}
+
+void SimKernel::terminate(SimThread *th)
+{
+	if (th->state == SimThread::TERMINATED || th->state == SimThread::INACTIVE)
+		return;
+	if (th->blocked_on)
+	{
+		th->blocked_on->remove(th);
+		th->blocked_on = NULL;
+	}
+	th->state = SimThread::TERMINATED;
+	th->join_queue.notify_all();
+	if (th == running)
+	{
+		schedule();
+		abort(); // Never reached
+	}
+}
+
+void SimKernel::join(SimThread *th)
+{
+	while (th->state != SimThread::TERMINATED
+			&& th->state != SimThread::INACTIVE)
+		th->join_queue.wait();
+}
+
+void SimKernel::sleep(uint64_t us)
+{
+	SimThread *th = current();
+	th->wait_flags = 0;
+	block(NULL, us);
+}
+
+void SimKernel::yield()
+{
+	SimThread *th = current();
+	for (std::vector<SimThread*>::iterator it = all.begin(); it != all.end();
+			++it)
+	{
+		if (*it != th && (*it)->state == SimThread::READY
+				&& (*it)->priority >= th->priority)
+		{
+			makeReady(th, false);
+			schedule();
+			return;
+		}
+	}
+	// Busy loop: lower-priority threads are still starved, but time goes on
+	uint64_t t = nextDeadline(th);
+	if (t > now_us + SIM_YIELD_TICK_US)
+		t = now_us + SIM_YIELD_TICK_US;
+	advanceTo(t);
+	if (pickNext() && pickNext()->priority >= th->priority)
+	{
+		makeReady(th, false);
+		schedule();
+	}
+}
+
+bool SimKernel::block(SimWaitQueue *wq, uint64_t timeout_us)
+{
+	SimThread *th = current();
+	if (timeout_us == 0)
+		return false;
+	th->state = SimThread::BLOCKED;
+	th->timed_out = false;
+	th->deadline =
+			(timeout_us == SIM_WAIT_FOREVER) ?
+					SIM_WAIT_FOREVER : now_us + timeout_us;
+	th->blocked_on = wq;
+	if (wq)
+	{
+		// Waiters are ordered by priority, FIFO among equal priorities
+		std::deque<SimThread*>::iterator it = wq->waiters.begin();
+		while (it != wq->waiters.end() && (*it)->priority >= th->priority)
+			++it;
+		wq->waiters.insert(it, th);
+	}
+	schedule();
+	return !th->timed_out;
+}
+
+void SimKernel::wake(SimThread *th)
+{
+	if (th->state != SimThread::BLOCKED)
+		return;
+	if (th->blocked_on)
+	{
+		th->blocked_on->remove(th);
+		th->blocked_on = NULL;
+	}
+	th->deadline = SIM_WAIT_FOREVER;
+	th->wait_flags = 0;
+	makeReady(th, false);
+
+	SimThread *cur = current();
+	if (cur->state == SimThread::RUNNING && th->priority > cur->priority)
+	{
+		// Preempt
+		makeReady(cur, false);
+		schedule();
+	}
+}
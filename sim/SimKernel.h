@@ -0,0 +1,217 @@
+/*
+ * SimKernel.h
+ *
+ * Deterministic, virtual-time cooperative scheduler used by the host
+ * simulation build. Every simulated RTOS thread runs on its own ucontext
+ * stack inside a single host thread, so a run is fully reproducible.
+ * Virtual time only advances when no thread is ready to run, which lets the
+ * simulation skip over idle periods (e.g. an hour of tracking) instantly.
+ */
+
+#ifndef SIM_SIMKERNEL_H_
+#define SIM_SIMKERNEL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <ucontext.h>
+#include <deque>
+#include <vector>
+#include <functional>
+
+#define SIM_WAIT_FOREVER 0xFFFFFFFFFFFFFFFFULL
+
+class SimThread;
+
+/**
+ * Hook called on every context switch, with the outgoing and incoming thread
+ */
+typedef void (*sim_switch_hook_t)(SimThread *from, SimThread *to);
+
+/**
+ * A list of threads blocked on some object (semaphore, mutex, queue, ...)
+ */
+class SimWaitQueue
+{
+public:
+	SimWaitQueue()
+	{
+	}
+	~SimWaitQueue();
+
+	/**
+	 * Block the current thread until woken up or timed out
+	 * @param timeout_us timeout in microseconds, or SIM_WAIT_FOREVER
+	 * @return true if woken up, false if timed out
+	 */
+	bool wait(uint64_t timeout_us = SIM_WAIT_FOREVER);
+
+	/**
+	 * Wake up the highest priority waiting thread
+	 * @return true if a thread was woken up
+	 */
+	bool notify_one();
+
+	/**
+	 * Wake up all waiting threads
+	 */
+	void notify_all();
+
+	bool empty() const
+	{
+		return waiters.empty();
+	}
+
+private:
+	friend class SimKernel;
+	std::deque<SimThread *> waiters;
+	void remove(SimThread *th);
+};
+
+class SimThread
+{
+public:
+	typedef enum
+	{
+		READY = 0, RUNNING, BLOCKED, TERMINATED, INACTIVE
+	} state_t;
+
+	SimThread(int priority, size_t stack_size, const char *name);
+	~SimThread();
+
+	const char *getName() const
+	{
+		return name;
+	}
+
+	int getPriority() const
+	{
+		return priority;
+	}
+
+	state_t getState() const
+	{
+		return state;
+	}
+
+	/** Thread flags, used to implement the CMSIS-RTOS2 thread flags API */
+	uint32_t flags;
+	uint32_t wait_flags;
+	uint32_t wait_options;
+
+private:
+	friend class SimKernel;
+	friend class SimWaitQueue;
+
+	ucontext_t ctx;
+	char *stack;
+	size_t stack_size;
+	int priority;
+	const char *name;
+	state_t state;
+	uint64_t deadline; /// Wake-up time for timed waits
+	bool timed_out;
+	uint64_t ready_seq; /// FIFO order among threads of equal priority
+	SimWaitQueue *blocked_on;
+	SimWaitQueue join_queue;
+	std::function<void()> entry;
+
+	static void trampoline(unsigned int hi, unsigned int lo);
+};
+
+/**
+ * The virtual-time kernel. There is only one instance.
+ */
+class SimKernel
+{
+public:
+	static SimKernel &instance();
+
+	/** @return current virtual time in microseconds */
+	uint64_t now() const
+	{
+		return now_us;
+	}
+
+	/** @return currently running thread */
+	SimThread *current();
+
+	/**
+	 * Start a thread that has been created but not yet started
+	 */
+	void start(SimThread *th, const std::function<void()> &fn);
+
+	/**
+	 * Terminate a thread. If the thread is the current one, this does not return.
+	 */
+	void terminate(SimThread *th);
+
+	/**
+	 * Block the current thread until the thread specified terminates
+	 */
+	void join(SimThread *th);
+
+	/**
+	 * Block the current thread for the specified time
+	 */
+	void sleep(uint64_t us);
+
+	/**
+	 * Give up the CPU. If no thread of equal or higher priority is ready, virtual time
+	 * advances to the next scheduled event, as it would in a busy-waiting loop on hardware.
+	 */
+	void yield();
+
+	/**
+	 * Block the current thread on a wait queue (or on nothing if wq is NULL)
+	 * @return true if woken up, false if timed out
+	 */
+	bool block(SimWaitQueue *wq, uint64_t timeout_us);
+
+	/**
+	 * Make a blocked thread ready. Preempts the current thread if the woken thread has a higher priority.
+	 */
+	void wake(SimThread *th);
+
+	/** @return list of all threads that have been created */
+	const std::vector<SimThread *> &threads() const
+	{
+		return all;
+	}
+
+	/**
+	 * Install a context-switch hook (used for per-thread CPU accounting)
+	 */
+	void setSwitchHook(sim_switch_hook_t hook)
+	{
+		switch_hook = hook;
+	}
+
+	/**
+	 * Total number of context switches performed so far
+	 */
+	uint64_t getSwitchCount() const
+	{
+		return switches;
+	}
+
+private:
+	friend class SimThread;
+	SimKernel();
+
+	uint64_t now_us;
+	uint64_t seq;
+	uint64_t switches;
+	SimThread *running;
+	SimThread *main_thread;
+	std::vector<SimThread *> all;
+	sim_switch_hook_t switch_hook;
+
+	void remove(SimThread *th);
+	SimThread *pickNext();
+	void schedule();
+	void makeReady(SimThread *th, bool front);
+	void advanceTo(uint64_t t);
+	uint64_t nextDeadline(SimThread *exclude);
+};
+
+#endif /* SIM_SIMKERNEL_H_ */
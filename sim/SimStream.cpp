@@ -0,0 +1,118 @@
+/*
+ * SimStream.cpp
+ */
+
+#include "SimStream.h"
+#include "CelestialMath.h"
+
+SimStream::SimStream(FILE *out) :
+		out(out), rpos(0), eof(false)
+{
+}
+
+SimStream::~SimStream()
+{
+}
+
+ssize_t SimStream::read(void *buffer, size_t size)
+{
+	while (pending() == 0)
+	{
+		if (eof)
+			return 0;
+		readers.wait();
+	}
+	size_t n = pending();
+	if (n > size)
+		n = size;
+	memcpy(buffer, input.data() + rpos, n);
+	rpos += n;
+	if (rpos == input.size())
+	{
+		input.clear();
+		rpos = 0;
+	}
+	return n;
+}
+
+ssize_t SimStream::write(const void *buffer, size_t size)
+{
+	if (out)
+	{
+		const uint8_t *p = (const uint8_t *) buffer;
+		for (size_t i = 0; i < size; i++)
+		{
+			if (decoder.idle() && p[i] != BP_SYNC0)
+			{
+				fputc(p[i], out); // Text
+				continue;
+			}
+			FrameDecoder::result_t r = decoder.feed(p[i]);
+			if (r == FrameDecoder::DECODE_FRAME)
+				printFrame(out, decoder);
+			else if (r == FrameDecoder::DECODE_ERROR)
+				fprintf(out, "frame error %d\n", decoder.error());
+		}
+		fflush(out);
+	}
+	return size;
+}
+
+void SimStream::feed(const char *data, size_t size)
+{
+	input.append(data, size);
+	readers.notify_all();
+}
+
+static void print_state(FILE *out, FrameReader &r)
+{
+	bp_state s;
+	if (r.getState(s))
+		fprintf(out, " %u %.8f %.8f %.8f %.8f %.6f %.6f %c %d %d %d",
+				(unsigned) s.time, s.ra, s.dec, s.ra_delta, s.dec_delta,
+				s.ra_speed, s.dec_speed, s.side == PIER_SIDE_WEST ? 'W' : 'E',
+				s.status, s.ra_slew, s.dec_slew);
+}
+
+void SimStream::printFrame(FILE *out, const FrameDecoder &frame)
+{
+	FrameReader r(frame.payload(), frame.payloadSize());
+	uint8_t type = frame.type();
+	if (type == BP_MSG_TEXT)
+	{
+		size_t n = r.remaining();
+		while (n > 0 && (r.current()[n - 1] == '\n' || r.current()[n - 1] == '\r'))
+			n--;
+		fprintf(out, "frame %u text %.*s\n", frame.id(), (int) n,
+				(const char *) r.current());
+		return;
+	}
+	else if (type == BP_MSG_TELEMETRY)
+	{
+		uint32_t seq;
+		r.getU32(seq);
+		fprintf(out, "frame %u telemetry %u", frame.id(), (unsigned) seq);
+		print_state(out, r);
+	}
+	else if (type & BP_REPLY)
+	{
+		int32_t status;
+		r.getI32(status);
+		fprintf(out, "frame %u reply 0x%02x %d", frame.id(), type & ~BP_REPLY,
+				(int) status);
+		if ((type & ~BP_REPLY) == BP_OP_READ)
+			print_state(out, r);
+	}
+	else
+	{
+		fprintf(out, "frame %u type 0x%02x, %u bytes", frame.id(), type,
+				(unsigned) frame.payloadSize());
+	}
+	fprintf(out, "\n");
+}
+
+void SimStream::closeInput()
+{
+	eof = true;
+	readers.notify_all();
+}
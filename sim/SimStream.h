@@ -0,0 +1,66 @@
+/*
+ * SimStream.h
+ *
+ * In-memory FileHandle connecting the simulation driver to an EqMountServer.
+ * Input is fed by the driver, output is written to a host FILE. Binary protocol frames in the
+ * output are decoded and printed as one text line each.
+ */
+
+#ifndef SIM_SIMSTREAM_H_
+#define SIM_SIMSTREAM_H_
+
+#include "mbed.h"
+#include "BinaryProtocol.h"
+#include <string>
+
+class SimStream: public FileHandle
+{
+public:
+	SimStream(FILE *out = stdout);
+	virtual ~SimStream();
+
+	/**
+	 * Read from input. Blocks until data is available or the input is closed
+	 */
+	ssize_t read(void *buffer, size_t size);
+
+	/**
+	 * Write to output
+	 */
+	ssize_t write(const void *buffer, size_t size);
+
+	/**
+	 * Feed data to the input side
+	 */
+	void feed(const char *data, size_t size);
+	void feed(const char *str)
+	{
+		feed(str, strlen(str));
+	}
+
+	/**
+	 * Signal end of file on the input side
+	 */
+	void closeInput();
+
+	/**
+	 * Print a decoded frame
+	 */
+	static void printFrame(FILE *out, const FrameDecoder &frame);
+
+	/** @return number of bytes still waiting to be read */
+	size_t pending() const
+	{
+		return input.size() - rpos;
+	}
+
+private:
+	FILE *out;
+	FrameDecoder decoder;
+	std::string input;
+	size_t rpos;
+	bool eof;
+	SimWaitQueue readers;
+};
+
+#endif /* SIM_SIMSTREAM_H_ */
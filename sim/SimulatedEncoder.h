@@ -0,0 +1,40 @@
+/*
+ * SimulatedEncoder.h
+ *
+ * Absolute encoder on the axis of a SimulatedStepper. It reads the position of the shaft, so it sees
+ * the steps lost with SimulatedStepper::slip(). The reading is Gray coded like a real encoder.
+ */
+
+#ifndef SIM_SIMULATEDENCODER_H_
+#define SIM_SIMULATEDENCODER_H_
+
+#include "GrayAbsEncoder.h"
+#include "SimulatedStepper.h"
+
+template<uint8_t N>
+class SimulatedEncoder: public GrayAbsEncoder<N>
+{
+public:
+	/**
+	 * @param stepper Motor turning the axis
+	 * @param stepsPerRev Full steps per revolution of the axis
+	 */
+	SimulatedEncoder(SimulatedStepper &stepper, double stepsPerRev) :
+			stepper(stepper), stepsPerRev(stepsPerRev)
+	{
+	}
+
+	uint32_t readPosGray()
+	{
+		double rev = stepper.getShaftPosition() / stepsPerRev;
+		uint32_t pos = (uint32_t) (int64_t) floor((rev - floor(rev)) * (1 << N))
+				& ((1 << N) - 1);
+		return pos ^ (pos >> 1);
+	}
+
+private:
+	SimulatedStepper &stepper;
+	double stepsPerRev;
+};
+
+#endif /* SIM_SIMULATEDENCODER_H_ */
@@ -0,0 +1,181 @@
+/*
+ * SimulatedStepper.cpp
+ */
+
+#include "SimulatedStepper.h"
+
+SimulatedStepper::SimulatedStepper(bool invert, const char *name) :
+		StepperMotor(invert), name(name), pulseCount(0), pulseFreq(1), phase(0), stepping(
+				false), running(false), stepCount(0), shaftOffset(0), backlash(0), gap(0), runStart(0), peAmplitude(0), pePeriod(1), inc(1), microstep(32), current(0), powered(
+				true), totalPulses(0), starts(0), freqChanges(0)
+{
+	tim.start();
+}
+
+SimulatedStepper::~SimulatedStepper()
+{
+}
+
+void SimulatedStepper::pulseStart()
+{
+	if (!stepping && pulseFreq > 0)
+	{
+		stepping = true;
+		phase = 0;
+		tim.reset();
+	}
+}
+
+double SimulatedStepper::pulsePhase()
+{
+	return phase + pulseFreq * tim.read_high_resolution_us() / 1.0E6;
+}
+
+void SimulatedStepper::pulseStop()
+{
+	if (stepping)
+	{
+		stepping = false;
+		// The rising edge is in the middle of each period. A pulse that has started is finished and counted
+		int64_t n = (int64_t) floor(pulsePhase() + 0.5);
+		pulseCount += n;
+		totalPulses += n;
+	}
+}
+
+int64_t SimulatedStepper::pulseGetCount()
+{
+	if (!stepping)
+		return pulseCount;
+	return pulseCount + (int64_t) floor(pulsePhase() + 0.5);
+}
+
+void SimulatedStepper::start(stepdir_t dir)
+{
+	if (!running)
+	{
+		inc = (dir == STEP_FORWARD) ? 1 : -1;
+		runStart = stepCount;
+		pulseStart();
+		pulseCount = 0;
+		running = true;
+		starts++;
+	}
+}
+
+void SimulatedStepper::stop()
+{
+	if (running)
+	{
+		running = false;
+		pulseStop();
+		stepCount += ((double) pulseCount) * inc / microstep;
+		gap = gapAt(stepCount);
+	}
+}
+
+/**
+ * @return backlash gap at a step count reached in the current run. The motor goes one way during a run,
+ * so the gap only depends on the distance moved
+ */
+double SimulatedStepper::gapAt(double count)
+{
+	double g = gap - (count - runStart);
+	return (g < 0) ? 0 : (g > backlash) ? backlash : g;
+}
+
+double SimulatedStepper::getStepCount()
+{
+	if (!running)
+		return stepCount;
+	return stepCount + ((double) pulseGetCount()) * inc / microstep;
+}
+
+void SimulatedStepper::setStepCount(double count)
+{
+	shaftOffset += stepCount - count;
+	runStart += count - stepCount;
+	stepCount = count;
+}
+
+double SimulatedStepper::getShaftPosition()
+{
+	double count = getStepCount();
+	double motor = count + shaftOffset;
+	return motor + (running ? gapAt(count) : gap)
+			+ peAmplitude * sin(2 * M_PI * motor / pePeriod);
+}
+
+double SimulatedStepper::setFrequency(double frequency)
+{
+	freqChanges++;
+	frequency *= microstep;
+	if (frequency > 0)
+	{
+		// Same prescaler/period selection as StepOut
+		double ticks = SIM_STEPOUT_CLOCK / frequency;
+		if (ticks < 2)
+			ticks = 2;
+		uint32_t psc = (uint32_t) (ticks / 65536.0);
+		if (psc > 0xFFFF)
+			psc = 0xFFFF;
+		double p = ceil(ticks / (psc + 1) - 1e-9);
+		uint32_t period = (p > 65536) ? 65536 : (uint32_t) p;
+		if (stepping)
+		{
+			// The new period takes effect without a restart
+			phase = pulsePhase();
+			tim.reset();
+		}
+		pulseFreq = (double) SIM_STEPOUT_CLOCK / ((double) (psc + 1) * period);
+	}
+	else
+	{
+		pulseFreq = 0;
+		if (stepping)
+		{
+			pulseStop();
+		}
+	}
+	return pulseFreq / microstep;
+}
+
+void SimulatedStepper::poweroff()
+{
+	powered = false;
+}
+
+void SimulatedStepper::poweron()
+{
+	powered = true;
+}
+
+void SimulatedStepper::setMicroStep(int microstep)
+{
+	if (microstep <= 0 || microstep > 128 || (microstep & (microstep - 1)))
+	{
+		debug("Error: microsteps must be a power of 2\n");
+		return;
+	}
+	// Keep the step count if the resolution changes while stepping
+	if (running)
+	{
+		double d = ((double) pulseGetCount()) * inc
+				* (1.0 / this->microstep - 1.0 / microstep);
+		stepCount += d;
+		runStart += d;
+	}
+	this->microstep = microstep;
+}
+
+void SimulatedStepper::setCurrent(double current)
+{
+	this->current = current;
+}
+
+uint64_t SimulatedStepper::getPulseCount()
+{
+	if (!stepping)
+		return totalPulses;
+	return totalPulses + (uint64_t) floor(pulsePhase() + 0.5);
+}
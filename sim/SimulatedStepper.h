@@ -0,0 +1,157 @@
+/*
+ * SimulatedStepper.h
+ *
+ * StepperMotor that generates no pulses but counts them in software, on virtual time.
+ * The step generator reproduces the behavior of StepOut + AMIS30543StepperDriver
+ * with the timer backend: the step period is quantized to ticks of the timer clock,
+ * frequency changes keep the phase of the pulse train, and every pulse is counted,
+ * so that the motion code sees the same frequencies and positions it would see on the hardware.
+ */
+
+#ifndef SIM_SIMULATEDSTEPPER_H_
+#define SIM_SIMULATEDSTEPPER_H_
+
+#include "mbed.h"
+#include "StepperMotor.h"
+
+/// Counter clock of the step timers (APB1 timers with the core at 180MHz)
+#define SIM_STEPOUT_CLOCK 90000000
+
+class SimulatedStepper: public StepperMotor
+{
+public:
+	SimulatedStepper(bool invert = false, const char *name = "Stepper");
+	virtual ~SimulatedStepper();
+
+	void start(stepdir_t dir);
+	void stop();
+	double getStepCount();
+	void setStepCount(double count);
+	double setFrequency(double frequency);
+	void poweroff();
+	void poweron();
+	void setMicroStep(int microstep);
+	void setCurrent(double current);
+
+	/** @return total number of microstep pulses emitted so far, in either direction */
+	uint64_t getPulseCount();
+
+	/** @return position of the shaft in full steps. Unlike the step count, it is not changed by setStepCount()
+	 * and it includes the slips and the backlash */
+	double getShaftPosition();
+
+	/**
+	 * Put backlash between the motor and the shaft: when the motor reverses, it turns through this many
+	 * steps before the shaft moves. The gear starts as driven in the forward direction
+	 * @param steps Backlash in full steps
+	 */
+	void setBacklash(double steps)
+	{
+		backlash = (steps > 0) ? steps : 0;
+		gap = 0;
+	}
+
+	double getBacklash() const
+	{
+		return backlash;
+	}
+
+	/**
+	 * Make the shaft run ahead and behind the motor periodically, like a worm gear with periodic error
+	 * @param amplitude Amplitude in full steps
+	 * @param period Motor full steps per period
+	 */
+	void setPeriodicError(double amplitude, double period)
+	{
+		peAmplitude = amplitude;
+		pePeriod = period;
+	}
+
+	/**
+	 * Lose steps: the shaft falls behind the step count, as if the motor had slipped
+	 * @param steps Number of full steps lost, in the positive direction
+	 */
+	void slip(double steps)
+	{
+		shaftOffset -= steps;
+	}
+
+	/** @return number of times the motor has been started */
+	uint32_t getStartCount() const
+	{
+		return starts;
+	}
+
+	/** @return number of calls to setFrequency() */
+	uint32_t getFrequencyChangeCount() const
+	{
+		return freqChanges;
+	}
+
+	/** @return current step frequency in full steps per second, 0 if not stepping */
+	double getFrequency() const
+	{
+		return stepping ? pulseFreq / microstep : 0;
+	}
+
+	bool isStepping() const
+	{
+		return stepping;
+	}
+
+	bool isPowered() const
+	{
+		return powered;
+	}
+
+	int getMicroStep() const
+	{
+		return microstep;
+	}
+
+	double getCurrent() const
+	{
+		return current;
+	}
+
+	const char *getName() const
+	{
+		return name;
+	}
+
+private:
+	const char *name;
+
+	/* Pulse generator, same behavior as StepOut */
+	int64_t pulseCount; /// Pulses counted before the current stepping period
+	double pulseFreq; /// Pulse frequency in Hz, quantized to integer timer periods
+	double phase; /// Periods elapsed in the current stepping period until the last frequency change
+	bool stepping;
+	Timer tim;
+
+	/* Driver */
+	bool running; /// Driver state, the pulse generator can still be idle if the frequency is 0
+	double stepCount; /// Full step count when the driver was last started
+	double shaftOffset; /// Shaft position - step count, without the backlash
+	double backlash; /// Backlash in full steps
+	double gap; /// Steps the motor can go backward without moving the shaft, between 0 and backlash
+	double runStart; /// Step count when the driver was started
+	double peAmplitude; /// Amplitude of the periodic error in full steps
+	double pePeriod; /// Period of the periodic error in full steps
+	int inc; /// +1 or -1
+	int microstep;
+	double current;
+	bool powered;
+
+	uint64_t totalPulses;
+	uint32_t starts;
+	uint32_t freqChanges;
+
+	void pulseStart();
+	void pulseStop();
+	int64_t pulseGetCount();
+	double pulsePhase();
+	double gapAt(double count);
+};
+
+#endif /* SIM_SIMULATEDSTEPPER_H_ */
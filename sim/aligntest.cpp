@@ -0,0 +1,290 @@
+/*
+ * aligntest.cpp
+ *
+ * Host test of the damped least-squares solver (pushtogo/AlignmentSolver.cpp) and of the N-star alignment
+ * built on it (CelestialMath::alignNStars and align). The solver is run on a small problem with a known
+ * minimum. The alignment is run on stars generated from a known calibration with MountModel, without noise,
+ * where it must find the calibration back, and with noise, where it must find it to the noise level. A
+ * degenerate geometry, with all the stars in the same place, must report divergence.
+ *
+ *   make test
+ *
+ * Prints the failed checks and exits with 1 if any failed.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include "AlignmentSolver.h"
+#include "CelestialMath.h"
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(bool ok, const char *what, int line)
+{
+	checks++;
+	if (!ok)
+	{
+		failures++;
+		fprintf(stderr, "aligntest.cpp:%d: check failed: %s\n", line, what);
+	}
+}
+
+static const double DEGREE = M_PI / 180.0;
+
+/// Tolerance of the noise-free fits, in degrees
+#define ALIGNTEST_EXACT 1e-6
+/// Noise of the measurements, in degrees (10 arcsec)
+#define ALIGNTEST_NOISE (10.0 / 3600)
+
+/**
+ * Rosenbrock function as a least-squares problem: r = (10 (y - x^2), 1 - x), minimum 0 at (1, 1).
+ * Each measurement is a copy of the same residuals.
+ */
+class RosenbrockProblem: public AlignmentProblem
+{
+public:
+	RosenbrockProblem(int n) :
+			n(n)
+	{
+	}
+
+	virtual int size() const
+	{
+		return n;
+	}
+
+	virtual void prepare(int slot, const double p[])
+	{
+		x[slot] = p[0];
+		y[slot] = p[1];
+	}
+
+	virtual void residual(int slot, int i, double r[2])
+	{
+		r[0] = 10 * (y[slot] - x[slot] * x[slot]);
+		r[1] = 1 - x[slot];
+	}
+
+private:
+	int n;
+	double x[AS_MAX_PARAM + 1];
+	double y[AS_MAX_PARAM + 1];
+};
+
+/**
+ * Problem with fewer independent residuals than parameters: r = (a + b - 1, a + b - 1)
+ */
+class UnderdeterminedProblem: public AlignmentProblem
+{
+public:
+	virtual int size() const
+	{
+		return 3;
+	}
+
+	virtual void prepare(int slot, const double p[])
+	{
+		s[slot] = p[0] + p[1];
+	}
+
+	virtual void residual(int slot, int i, double r[2])
+	{
+		r[0] = r[1] = s[slot] - 1;
+	}
+
+private:
+	double s[AS_MAX_PARAM + 1];
+};
+
+static void test_solver()
+{
+	RosenbrockProblem rosenbrock(3);
+	AlignmentSolver solver(rosenbrock, 2);
+	double p[2] =
+	{ -1.2, 1 };
+	CHECK(solver.solve(p));
+	CHECK(fabs(p[0] - 1) < 1e-5 && fabs(p[1] - 1) < 1e-5);
+	CHECK(solver.getResidue() < 1e-5);
+	CHECK(solver.getIterations() > 1);
+
+	double cov[2][2];
+	CHECK(solver.covariance(p, &cov[0][0], 2));
+	CHECK(cov[0][0] > 0 && cov[1][1] > 0);
+	CHECK(fabs(cov[0][1] - cov[1][0]) < 1e-9 * fabs(cov[0][1]) + 1e-12);
+
+	UnderdeterminedProblem under;
+	AlignmentSolver usolver(under, 2);
+	double q[2] =
+	{ 3, 0 };
+	CHECK(!usolver.solve(q));
+}
+
+/**
+ * Deterministic uniform random numbers in [0, 1)
+ */
+static double uniform(uint32_t &seed)
+{
+	seed = seed * 1664525u + 1013904223u;
+	return (seed >> 8) * (1.0 / (1 << 24));
+}
+
+/**
+ * Deterministic normal random numbers (Box-Muller)
+ */
+static double normal(uint32_t &seed)
+{
+	double u = uniform(seed);
+	double v = uniform(seed);
+	return sqrt(-2 * log(1 - u)) * cos(2 * M_PI * v);
+}
+
+static const LocationCoordinates loc(31.2, 121.5);
+static const time_t t0 = 1540000000;
+
+/**
+ * Generate stars measured by a mount with the calibration calib, spread over the sky above 20 degrees
+ * of altitude, on both sides of the pier, one every 5 minutes
+ * @param noise Standard deviation of the noise added to the measurements, in degrees
+ */
+static void make_stars(int n, const EqCalibration &calib, double noise,
+		AlignmentStar stars[], uint32_t seed)
+{
+	MountModel model(calib, loc);
+	for (int i = 0; i < n;)
+	{
+		time_t t = t0 + 300 * i;
+		EquatorialCoordinates eq(asin(2 * uniform(seed) - 1) / DEGREE,
+				360 * uniform(seed) - 180);
+		LocalEquatorialCoordinates leq =
+				CelestialMath::equatorialToLocalEquatorial(eq, t, loc);
+		if (CelestialMath::localEquatorialToAzimuthal(leq, loc).alt < 20)
+			continue;
+		MountCoordinates mc = model.toMount(eq, t);
+		mc.dec_delta += noise * normal(seed);
+		mc.ra_delta += noise * normal(seed) / cos(eq.dec * DEGREE);
+		stars[i++] = AlignmentStar(eq, mc, t);
+	}
+}
+
+static bool close(const EqCalibration &a, const EqCalibration &b, double tol)
+{
+	return fabs(a.pa.alt - b.pa.alt) < tol && fabs(a.pa.azi - b.pa.azi) < tol
+			&& fabs(a.offset.dec_off - b.offset.dec_off) < tol
+			&& fabs(a.offset.ra_off - b.offset.ra_off) < tol
+			&& fabs(a.cone - b.cone) < tol && fabs(a.np - b.np) < tol
+			&& fabs(a.tf - b.tf) < tol && fabs(a.daf - b.daf) < tol
+			&& fabs(a.fo - b.fo) < tol;
+}
+
+/**
+ * Calibration of a badly set up mount: PA off by half a degree, index offsets and cone error
+ */
+static EqCalibration known_calibration()
+{
+	return EqCalibration(IndexOffset(0.8, -1.3),
+			AzimuthalCoordinates(loc.lat + 0.4, -0.3), 0.25, 0);
+}
+
+static void test_align_exact()
+{
+	const int N = 8;
+	AlignmentStar stars[N];
+	EqCalibration truth = known_calibration();
+	make_stars(N, truth, 0, stars, 1);
+
+	// Basic model, from the starting point the mount uses
+	EqCalibration calib;
+	calib.pa.alt = loc.lat;
+	bool diverge = true;
+	CelestialMath::alignNStars(N, stars, loc, calib, 0, diverge);
+	CHECK(!diverge);
+	CHECK(close(calib, truth, ALIGNTEST_EXACT));
+
+	// Same with the local equatorial and mount coordinate arrays
+	LocalEquatorialCoordinates ref[N];
+	MountCoordinates meas[N];
+	for (int i = 0; i < N; i++)
+	{
+		ref[i] = stars[i].star_ref_local(loc);
+		meas[i] = stars[i].star_meas;
+	}
+	AzimuthalCoordinates pa(loc.lat, 0);
+	IndexOffset offset;
+	double cone = 0;
+	diverge = true;
+	CelestialMath::alignNStars(N, ref, meas, loc, pa, offset, cone, diverge);
+	CHECK(!diverge);
+	CHECK(fabs(pa.alt - truth.pa.alt) < ALIGNTEST_EXACT);
+	CHECK(fabs(pa.azi - truth.pa.azi) < ALIGNTEST_EXACT);
+	CHECK(fabs(offset.dec_off - truth.offset.dec_off) < ALIGNTEST_EXACT);
+	CHECK(fabs(offset.ra_off - truth.offset.ra_off) < ALIGNTEST_EXACT);
+	CHECK(fabs(cone - truth.cone) < ALIGNTEST_EXACT);
+
+	// Through the adaptor of the mount, which starts from the two-star solution
+	calib = CelestialMath::align(N, stars, loc, diverge);
+	CHECK(!diverge);
+	CHECK(close(calib, truth, ALIGNTEST_EXACT));
+	CHECK(calib.error < ALIGNTEST_EXACT);
+
+	// Model with the optional terms
+	const int M = 12;
+	AlignmentStar more[M];
+	truth.np = 0.05;
+	truth.tf = -0.03;
+	truth.daf = 0.02;
+	truth.fo = 0.04;
+	make_stars(M, truth, 0, more, 2);
+	calib = CelestialMath::align(M, more, loc, diverge, PM_TERMS_ALL);
+	CHECK(!diverge);
+	CHECK(close(calib, truth, ALIGNTEST_EXACT));
+}
+
+static void test_align_noise()
+{
+	const int N = 30;
+	AlignmentStar stars[N];
+	EqCalibration truth = known_calibration();
+	make_stars(N, truth, ALIGNTEST_NOISE, stars, 3);
+
+	bool diverge = true;
+	EqCalibration calib = CelestialMath::align(N, stars, loc, diverge);
+	CHECK(!diverge);
+	// The parameters are found to a few times the noise of one star, as PA and the offsets are correlated
+	CHECK(close(calib, truth, 10 * ALIGNTEST_NOISE));
+	// The residue is that of the noise, 2N residuals of about the noise level
+	double rms = calib.error / sqrt(2.0 * N);
+	CHECK(rms > 0.5 * ALIGNTEST_NOISE && rms < 1.5 * ALIGNTEST_NOISE);
+	// The true calibration does not fit better than the solution
+	CHECK(CelestialMath::alignmentError(N, stars, truth, loc) >= calib.error);
+}
+
+static void test_align_degenerate()
+{
+	// All the stars measured at the same place: the PA and the cone error can't be told from the offsets
+	const int N = 5;
+	AlignmentStar stars[N];
+	EqCalibration truth = known_calibration();
+	make_stars(1, truth, 0, stars, 4);
+	for (int i = 1; i < N; i++)
+		stars[i] = stars[0];
+
+	EqCalibration calib;
+	calib.pa.alt = loc.lat;
+	bool diverge = false;
+	CelestialMath::alignNStars(N, stars, loc, calib, 0, diverge);
+	CHECK(diverge);
+}
+
+int main()
+{
+	test_solver();
+	test_align_exact();
+	test_align_noise();
+	test_align_degenerate();
+	printf("aligntest: %d checks, %d failed\n", checks, failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Run the benchmark scenarios on the simulator and print one result line per scenario
+# (see SimBench.h for the fields).
+#
+#   bench/run.sh                      run all scenarios
+#   bench/run.sh -b bench/baseline.txt   run and compare with a baseline, exit 1 if a result changed
+#   bench/run.sh -- -E -B 2           pass options to the simulator, e.g. encoders and backlash
+#
+# Run from the sim directory after make. cpu_ms is not compared, it depends on the host.
+
+cd "$(dirname "$0")/.." || exit 1
+
+baseline=
+while [ $# -gt 0 ]; do
+	case "$1" in
+	-b) baseline="$2"; shift 2 ;;
+	--) shift; break ;;
+	*) echo "Usage: $0 [-b baseline] [-- simulator options]" >&2; exit 1 ;;
+	esac
+done
+
+out=$(mktemp)
+trap 'rm -f "$out"' EXIT
+
+for script in bench/*.txt; do
+	case "$script" in
+	*/baseline*.txt) continue ;;
+	esac
+	./pushtogo-sim -q -c ../telescope.cfg "$@" "$script" | grep '^bench ' >> "$out"
+done
+cat "$out"
+
+[ -n "$baseline" ] || exit 0
+
+# Compare field by field. Times and rates have a small tolerance for the floating point differences between hosts
+awk '
+function tol(key) {
+	if (key == "err_arcsec") return 0.01
+	if (key ~ /_rate$/) return 1e-6
+	if (key ~ /_drift$/) return 1e-3
+	if (key == "switches") return 0
+	return 0.002
+}
+FNR == NR {
+	for (i = 3; i <= NF; i++) { split($i, kv, "="); base[$2, kv[1]] = kv[2] }
+	names[$2] = 1
+	next
+}
+{
+	seen[$2] = 1
+	if (!($2 in names)) { printf "%s: not in the baseline\n", $2; changed = 1; next }
+	for (i = 3; i <= NF; i++) {
+		split($i, kv, "=")
+		if (kv[1] == "cpu_ms" || !(($2, kv[1]) in base)) continue
+		d = kv[2] - base[$2, kv[1]]
+		if (d > tol(kv[1]) || -d > tol(kv[1])) {
+			printf "%s: %s %s -> %s\n", $2, kv[1], base[$2, kv[1]], kv[2]
+			changed = 1
+		}
+	}
+}
+END {
+	for (n in names) if (!(n in seen)) { printf "%s: missing\n", n; changed = 1 }
+	if (changed) exit 1
+	print "All results match the baseline"
+}' "$baseline" "$out"
@@ -0,0 +1,545 @@
+/*
+ * bptest.cpp
+ *
+ * Host test of the binary protocol codec (pushtogo/BinaryProtocol.cpp). Every request and reply
+ * type is encoded with FrameWriter, decoded with FrameDecoder and FrameReader, and compared with the
+ * values it was built from. The decoder is also fed frames split across reads, frames back to back,
+ * garbage, and frames with a bad CRC or length.
+ *
+ *   make test
+ *
+ * Prints the failed checks and exits with 1 if any failed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "BinaryProtocol.h"
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(bool ok, const char *what, int line)
+{
+	checks++;
+	if (!ok)
+	{
+		failures++;
+		fprintf(stderr, "bptest.cpp:%d: check failed: %s\n", line, what);
+	}
+}
+
+/**
+ * Decoded frame, copied out of the decoder
+ */
+struct frame_t
+{
+	uint16_t id;
+	uint8_t type;
+	uint8_t payload[BP_MAX_PAYLOAD];
+	size_t size;
+};
+
+/**
+ * Feed data in chunks of at most chunk bytes, as a stream would deliver it
+ * @param frames Decoded frames
+ * @param errors Errors returned by the decoder, in order
+ * @return number of frames decoded
+ */
+static int decode(const uint8_t *data, size_t len, size_t chunk,
+		frame_t *frames, int maxframes, bp_error_t *errors, int &nerrors)
+{
+	FrameDecoder dec;
+	int n = 0;
+	nerrors = 0;
+	for (size_t off = 0; off < len; off += chunk)
+	{
+		size_t avail = (len - off < chunk) ? len - off : chunk;
+		const uint8_t *p = data + off;
+		while (avail > 0)
+		{
+			size_t consumed;
+			FrameDecoder::result_t r = dec.feed(p, avail, consumed);
+			p += consumed;
+			avail -= consumed;
+			if (r == FrameDecoder::DECODE_FRAME && n < maxframes)
+			{
+				frames[n].id = dec.id();
+				frames[n].type = dec.type();
+				frames[n].size = dec.payloadSize();
+				memcpy(frames[n].payload, dec.payload(), dec.payloadSize());
+				n++;
+			}
+			else if (r == FrameDecoder::DECODE_ERROR)
+			{
+				errors[nerrors++] = dec.error();
+			}
+		}
+	}
+	return n;
+}
+
+/**
+ * Decode a single frame fed in one chunk
+ */
+static bool decode_one(const uint8_t *data, size_t len, frame_t &f)
+{
+	bp_error_t errors[4];
+	int nerrors;
+	return decode(data, len, len, &f, 1, errors, nerrors) == 1 && nerrors == 0;
+}
+
+static bp_state make_state(int k)
+{
+	bp_state s;
+	s.time = 1520000000u + k;
+	s.ra = -80.37733743 + k;
+	s.dec = 38.78005859 - k;
+	s.ra_delta = 0.125 * k;
+	s.dec_delta = -0.0625 * k;
+	s.ra_speed = 1.0027379 * k;
+	s.dec_speed = -2.5;
+	s.side = 1;
+	s.status = 2 + k;
+	s.ra_slew = 3;
+	s.dec_slew = 4;
+	return s;
+}
+
+static bool same_state(const bp_state &a, const bp_state &b)
+{
+	return a.time == b.time && a.ra == b.ra && a.dec == b.dec
+			&& a.ra_delta == b.ra_delta && a.dec_delta == b.dec_delta
+			&& a.ra_speed == b.ra_speed && a.dec_speed == b.dec_speed
+			&& a.side == b.side && a.status == b.status
+			&& a.ra_slew == b.ra_slew && a.dec_slew == b.dec_slew;
+}
+
+static void test_crc()
+{
+	CHECK(bp_crc16((const uint8_t *) "123456789", 9) == 0x29B1);
+	// Split computation gives the same result
+	uint16_t c = bp_crc16((const uint8_t *) "1234", 4);
+	CHECK(bp_crc16((const uint8_t *) "56789", 5, c) == 0x29B1);
+}
+
+static void test_layout()
+{
+	// Stop tracking, id 0x1234
+	static const uint8_t expected[] =
+	{ 0xA5, 0x5A, 0x04, 0x00, 0x34, 0x12, 0x04, 0x01, 0x4F, 0x1F };
+	uint8_t buf[BP_MAX_FRAME];
+	FrameWriter w(buf, sizeof(buf), 0x1234, BP_OP_STOP);
+	w.putU8(1);
+	size_t len = w.finish();
+	CHECK(len == sizeof(expected));
+	CHECK(memcmp(buf, expected, sizeof(expected)) == 0);
+}
+
+static void test_requests()
+{
+	uint8_t buf[BP_MAX_FRAME];
+	frame_t f;
+	size_t len;
+
+	// Command line
+	{
+		const char *line = "goto 10.5 20.25";
+		FrameWriter w(buf, sizeof(buf), 1, BP_OP_COMMAND);
+		w.putBytes(line, strlen(line));
+		len = w.finish();
+		CHECK(len == BP_HEADER_SIZE + BP_BODY_HEADER_SIZE + strlen(line) + BP_TRAILER_SIZE);
+		CHECK(decode_one(buf, len, f));
+		CHECK(f.id == 1 && f.type == BP_OP_COMMAND);
+		CHECK(f.size == strlen(line) && memcmp(f.payload, line, f.size) == 0);
+	}
+
+	// Requests without payload
+	static const uint8_t empty[] =
+	{ BP_OP_READ, BP_OP_ESTOP, BP_OP_TRACK };
+	for (unsigned int i = 0; i < sizeof(empty); i++)
+	{
+		FrameWriter w(buf, sizeof(buf), 100 + i, empty[i]);
+		len = w.finish();
+		CHECK(len == BP_HEADER_SIZE + BP_BODY_HEADER_SIZE + BP_TRAILER_SIZE);
+		CHECK(decode_one(buf, len, f));
+		CHECK(f.id == 100 + i && f.type == empty[i] && f.size == 0);
+	}
+
+	// Go to
+	{
+		FrameWriter w(buf, sizeof(buf), 0xFFFF, BP_OP_GOTO);
+		w.putU8(BP_COORD_MOUNT).putF64(-179.999).putF64(45.5);
+		len = w.finish();
+		CHECK(decode_one(buf, len, f));
+		CHECK(f.id == 0xFFFF && f.type == BP_OP_GOTO);
+		FrameReader r(f.payload, f.size);
+		uint8_t coord;
+		double ra, dec;
+		r.getU8(coord);
+		r.getF64(ra);
+		r.getF64(dec);
+		CHECK(r.ok() && r.remaining() == 0);
+		CHECK(coord == BP_COORD_MOUNT && ra == -179.999 && dec == 45.5);
+	}
+
+	// Stop, nudge: one byte
+	{
+		FrameWriter w(buf, sizeof(buf), 7, BP_OP_STOP);
+		w.putU8(1);
+		len = w.finish();
+		CHECK(decode_one(buf, len, f));
+		uint8_t what = 0;
+		FrameReader r(f.payload, f.size);
+		CHECK(f.id == 7 && f.type == BP_OP_STOP && r.getU8(what) && what == 1);
+	}
+	{
+		FrameWriter w(buf, sizeof(buf), 8, BP_OP_NUDGE);
+		w.putU8(0x05);
+		len = w.finish();
+		CHECK(decode_one(buf, len, f));
+		uint8_t dir = 0;
+		FrameReader r(f.payload, f.size);
+		CHECK(f.id == 8 && f.type == BP_OP_NUDGE && r.getU8(dir) && dir == 0x05);
+	}
+
+	// Guide
+	{
+		FrameWriter w(buf, sizeof(buf), 9, BP_OP_GUIDE);
+		w.putU8(3).putU16(1500);
+		len = w.finish();
+		CHECK(decode_one(buf, len, f));
+		CHECK(f.id == 9 && f.type == BP_OP_GUIDE);
+		FrameReader r(f.payload, f.size);
+		uint8_t dir;
+		uint16_t ms;
+		r.getU8(dir);
+		r.getU16(ms);
+		CHECK(r.ok() && r.remaining() == 0 && dir == 3 && ms == 1500);
+
+		// With the optional delay
+		FrameWriter wd(buf, sizeof(buf), 9, BP_OP_GUIDE);
+		wd.putU8(1).putU16(200).putU16(750);
+		len = wd.finish();
+		CHECK(decode_one(buf, len, f));
+		FrameReader rd(f.payload, f.size);
+		uint16_t delay;
+		rd.getU8(dir);
+		rd.getU16(ms);
+		CHECK(rd.remaining() == 2 && rd.getU16(delay));
+		CHECK(rd.ok() && dir == 1 && ms == 200 && delay == 750);
+	}
+
+	// Subscribe
+	{
+		FrameWriter w(buf, sizeof(buf), 10, BP_OP_SUBSCRIBE);
+		w.putF64(12.5);
+		len = w.finish();
+		CHECK(decode_one(buf, len, f));
+		FrameReader r(f.payload, f.size);
+		double rate;
+		CHECK(f.id == 10 && f.type == BP_OP_SUBSCRIBE && r.getF64(rate) && rate == 12.5);
+	}
+}
+
+static void test_replies()
+{
+	uint8_t buf[BP_MAX_FRAME];
+	frame_t f;
+	size_t len;
+
+	// Status replies to all requests
+	static const uint8_t ops[] =
+	{ BP_OP_COMMAND, BP_OP_READ, BP_OP_GOTO, BP_OP_STOP, BP_OP_ESTOP,
+			BP_OP_TRACK, BP_OP_NUDGE, BP_OP_GUIDE, BP_OP_SUBSCRIBE };
+	for (unsigned int i = 0; i < sizeof(ops); i++)
+	{
+		int32_t status = -(int32_t) i;
+		FrameWriter w(buf, sizeof(buf), 200 + i, ops[i] | BP_REPLY);
+		w.putI32(status);
+		len = w.finish();
+		CHECK(decode_one(buf, len, f));
+		CHECK(f.id == 200 + i && f.type == (ops[i] | BP_REPLY));
+		FrameReader r(f.payload, f.size);
+		int32_t s;
+		CHECK(r.getI32(s) && s == status && r.remaining() == 0);
+	}
+
+	// Read reply, with the status filled in after the data as the server does
+	{
+		bp_state s = make_state(1), d;
+		FrameWriter w(buf, sizeof(buf), 300, BP_OP_READ | BP_REPLY);
+		w.putI32(0).putState(s);
+		w.setI32(0, -4);
+		len = w.finish();
+		CHECK(decode_one(buf, len, f));
+		CHECK(f.id == 300 && f.type == (BP_OP_READ | BP_REPLY));
+		FrameReader r(f.payload, f.size);
+		int32_t status;
+		CHECK(r.getI32(status) && status == -4);
+		CHECK(r.getState(d) && r.remaining() == 0 && same_state(s, d));
+	}
+
+	// Text output
+	{
+		const char *text = "time 1520000062\r\n";
+		FrameWriter w(buf, sizeof(buf), 301, BP_MSG_TEXT);
+		w.putBytes(text, strlen(text));
+		len = w.finish();
+		CHECK(decode_one(buf, len, f));
+		CHECK(f.id == 301 && f.type == BP_MSG_TEXT);
+		CHECK(f.size == strlen(text) && memcmp(f.payload, text, f.size) == 0);
+	}
+
+	// Telemetry
+	{
+		bp_state s = make_state(2), d;
+		uint32_t seq = 0x12345;
+		FrameWriter w(buf, sizeof(buf), (uint16_t) seq, BP_MSG_TELEMETRY);
+		w.putU32(seq).putState(s);
+		len = w.finish();
+		CHECK(decode_one(buf, len, f));
+		CHECK(f.id == 0x2345 && f.type == BP_MSG_TELEMETRY);
+		FrameReader r(f.payload, f.size);
+		uint32_t dseq;
+		CHECK(r.getU32(dseq) && dseq == seq);
+		CHECK(r.getState(d) && r.remaining() == 0 && same_state(s, d));
+	}
+
+	// Error
+	{
+		FrameWriter w(buf, sizeof(buf), 0, BP_MSG_ERROR);
+		w.putU8(BP_ERR_CRC);
+		len = w.finish();
+		CHECK(decode_one(buf, len, f));
+		FrameReader r(f.payload, f.size);
+		uint8_t e;
+		CHECK(f.type == BP_MSG_ERROR && r.getU8(e) && e == BP_ERR_CRC);
+	}
+}
+
+static void test_writer_reader_limits()
+{
+	uint8_t buf[BP_MAX_FRAME];
+	// Payload that does not fit
+	{
+		FrameWriter w(buf, sizeof(buf), 1, BP_MSG_TEXT);
+		uint8_t big[BP_MAX_PAYLOAD + 1];
+		memset(big, 'x', sizeof(big));
+		w.putBytes(big, sizeof(big));
+		CHECK(w.finish() == 0);
+	}
+	// Largest payload
+	{
+		FrameWriter w(buf, sizeof(buf), 1, BP_MSG_TEXT);
+		uint8_t big[BP_MAX_PAYLOAD];
+		memset(big, 'y', sizeof(big));
+		w.putBytes(big, sizeof(big));
+		size_t len = w.finish();
+		CHECK(len == BP_MAX_FRAME);
+		frame_t f;
+		CHECK(decode_one(buf, len, f) && f.size == BP_MAX_PAYLOAD);
+	}
+	// Read past the end
+	{
+		uint8_t data[3] =
+		{ 1, 2, 3 };
+		FrameReader r(data, sizeof(data));
+		uint32_t v;
+		uint8_t b;
+		CHECK(!r.getU32(v) && !r.ok());
+		CHECK(!r.getU8(b)); // Stays in error state
+	}
+}
+
+/**
+ * Build the frames used by the stream tests: a goto, a read reply and a telemetry frame
+ * @return total length
+ */
+static size_t build_stream(uint8_t *buf, size_t size, size_t *ends)
+{
+	size_t len = 0;
+	{
+		FrameWriter w(buf, size, 11, BP_OP_GOTO);
+		w.putU8(BP_COORD_EQ).putF64(10.5).putF64(-20.25);
+		len += w.finish();
+		ends[0] = len;
+	}
+	{
+		FrameWriter w(buf + len, size - len, 12, BP_OP_READ | BP_REPLY);
+		w.putI32(0).putState(make_state(3));
+		len += w.finish();
+		ends[1] = len;
+	}
+	{
+		FrameWriter w(buf + len, size - len, 13, BP_MSG_TELEMETRY);
+		w.putU32(13).putState(make_state(4));
+		len += w.finish();
+		ends[2] = len;
+	}
+	return len;
+}
+
+static void check_stream_frames(const frame_t *f)
+{
+	CHECK(f[0].id == 11 && f[0].type == BP_OP_GOTO && f[0].size == 17);
+	FrameReader r0(f[0].payload, f[0].size);
+	uint8_t coord;
+	double ra, dec;
+	r0.getU8(coord);
+	r0.getF64(ra);
+	r0.getF64(dec);
+	CHECK(r0.ok() && coord == BP_COORD_EQ && ra == 10.5 && dec == -20.25);
+
+	CHECK(f[1].id == 12 && f[1].type == (BP_OP_READ | BP_REPLY));
+	FrameReader r1(f[1].payload, f[1].size);
+	int32_t status;
+	bp_state s;
+	CHECK(r1.getI32(status) && status == 0 && r1.getState(s)
+			&& same_state(s, make_state(3)));
+
+	CHECK(f[2].id == 13 && f[2].type == BP_MSG_TELEMETRY);
+	FrameReader r2(f[2].payload, f[2].size);
+	uint32_t seq;
+	CHECK(r2.getU32(seq) && seq == 13 && r2.getState(s)
+			&& same_state(s, make_state(4)));
+}
+
+static void test_stream()
+{
+	uint8_t buf[3 * BP_MAX_FRAME];
+	size_t ends[3];
+	size_t len = build_stream(buf, sizeof(buf), ends);
+	frame_t f[4];
+	bp_error_t errors[8];
+	int nerrors;
+
+	// Back to back in one read, and split across reads of every size
+	for (size_t chunk = 1; chunk <= len; chunk++)
+	{
+		int n = decode(buf, len, chunk, f, 4, errors, nerrors);
+		CHECK(n == 3 && nerrors == 0);
+		if (n == 3)
+			check_stream_frames(f);
+	}
+
+	// Reads bounded by need(), as the blocking reader of the server does, must stop at each frame end
+	{
+		FrameDecoder dec;
+		size_t off = 0;
+		int n = 0;
+		while (off < len)
+		{
+			size_t k = dec.need();
+			CHECK(k > 0 && off + k <= len);
+			if (k == 0 || off + k > len)
+				break;
+			size_t consumed;
+			FrameDecoder::result_t r = dec.feed(buf + off, k, consumed);
+			CHECK(consumed == k);
+			off += consumed;
+			if (r == FrameDecoder::DECODE_FRAME)
+			{
+				CHECK(n < 3 && off == ends[n]);
+				n++;
+			}
+		}
+		CHECK(n == 3);
+	}
+
+	// Garbage before and between the frames, including a lone first sync byte
+	{
+		uint8_t noisy[sizeof(buf) + 16];
+		size_t m = 0;
+		static const uint8_t junk[] =
+		{ 0x00, BP_SYNC0, 0x13, 0xFF, BP_SYNC0 };
+		memcpy(noisy + m, junk, sizeof(junk));
+		m += sizeof(junk);
+		memcpy(noisy + m, buf, ends[0]);
+		m += ends[0];
+		noisy[m++] = 0x42;
+		memcpy(noisy + m, buf + ends[0], len - ends[0]);
+		m += len - ends[0];
+		int n = decode(noisy, m, 7, f, 4, errors, nerrors);
+		CHECK(n == 3 && nerrors == 0);
+		if (n == 3)
+			check_stream_frames(f);
+	}
+}
+
+static void test_corrupted()
+{
+	uint8_t buf[3 * BP_MAX_FRAME];
+	size_t ends[3];
+	size_t len = build_stream(buf, sizeof(buf), ends);
+	frame_t f[4];
+	bp_error_t errors[8];
+	int nerrors;
+
+	// Bad CRC on the second frame: it is dropped, the others get through
+	for (size_t chunk = 1; chunk <= len; chunk += 13)
+	{
+		uint8_t bad[sizeof(buf)];
+		memcpy(bad, buf, len);
+		bad[ends[0] + BP_HEADER_SIZE + 5] ^= 0x10; // Inside the payload
+		int n = decode(bad, len, chunk, f, 4, errors, nerrors);
+		CHECK(n == 2 && nerrors == 1 && errors[0] == BP_ERR_CRC);
+		CHECK(f[0].id == 11 && f[1].id == 13);
+	}
+
+	// Bad CRC field
+	{
+		uint8_t bad[sizeof(buf)];
+		memcpy(bad, buf, len);
+		bad[ends[0] - 1] ^= 0x01;
+		int n = decode(bad, len, len, f, 4, errors, nerrors);
+		CHECK(n == 2 && nerrors == 1 && errors[0] == BP_ERR_CRC);
+		CHECK(f[0].id == 12 && f[1].id == 13);
+	}
+
+	// Length too large: the frame is dropped and the decoder resyncs on the next one
+	{
+		uint8_t bad[sizeof(buf)];
+		memcpy(bad, buf, len);
+		bad[2] = (BP_MAX_BODY + 1) & 0xFF;
+		bad[3] = (BP_MAX_BODY + 1) >> 8;
+		int n = decode(bad, len, 5, f, 4, errors, nerrors);
+		CHECK(nerrors == 1 && errors[0] == BP_ERR_LENGTH);
+		CHECK(n == 2 && f[0].id == 12 && f[1].id == 13);
+	}
+
+	// Length too small
+	{
+		uint8_t bad[sizeof(buf)];
+		memcpy(bad, buf, len);
+		bad[2] = BP_BODY_HEADER_SIZE - 1;
+		bad[3] = 0;
+		int n = decode(bad, len, len, f, 4, errors, nerrors);
+		CHECK(nerrors == 1 && errors[0] == BP_ERR_LENGTH);
+		CHECK(n == 2 && f[0].id == 12 && f[1].id == 13);
+	}
+
+	// Length shorter than the frame but in range: the CRC cannot match
+	{
+		uint8_t bad[sizeof(buf)];
+		memcpy(bad, buf, len);
+		bad[2] -= 4;
+		int n = decode(bad, ends[0], ends[0], f, 4, errors, nerrors);
+		CHECK(n == 0 && nerrors == 1 && errors[0] == BP_ERR_CRC);
+	}
+}
+
+int main()
+{
+	test_crc();
+	test_layout();
+	test_requests();
+	test_replies();
+	test_writer_reader_limits();
+	test_stream();
+	test_corrupted();
+
+	printf("bptest: %d checks, %d failed\n", checks, failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,297 @@
+/**
+ * Simulation driver.
+ *
+ * Runs the pushtogo stack on the host against simulated steppers and a virtual clock.
+ * Commands are read from a script (or stdin), one per line, and sent to the EqMountServer.
+ * Lines starting with '.' are directives to the simulator itself:
+ *  .wait <seconds>		let the virtual time run for the specified time
+ *  .motors				print the state of the simulated motors
+ *  .time				print the virtual time
+ *  .slip <RA|DEC> <steps>	make a motor lose steps, the shaft falls behind the step count
+ *  .frame <id> <type> [args]	send a binary protocol request (the server must be in binary mode,
+ *  					see the protocol command). type is one of command, read, goto,
+ *  					stop, estop, track, nudge, guide, subscribe
+ *  .quit				end the simulation
+ *  .bench, .target, .settle, .mark, .result	measure a benchmark scenario, see SimBench.h
+ * Everything after a '#' is a comment.
+ */
+
+#include "mbed.h"
+#include "sim_hardware.h"
+#include "SimBench.h"
+#include <sys/time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <ctype.h>
+
+/// Virtual time to let the server process each command line
+#define SIM_COMMAND_DELAY_US 1000
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-c config] [-e epoch] [-E] [-B steps] [-W steps] [-P file] [-q] [script]\n"
+			"  -c config   read telescope configuration from file\n"
+			"  -e epoch    UTC timestamp at the start of the simulation\n"
+			"  -E          attach absolute encoders to the axes\n"
+			"  -B steps    backlash of the simulated gears in full steps\n"
+			"  -W steps    amplitude of the periodic error of the RA worm in full steps\n"
+			"  -P file     file of the PEC table\n"
+			"  -q          suppress debug output\n"
+			"  script      command script, stdin if not specified\n", prog);
+}
+
+static double host_time()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1.0E6;
+}
+
+static void print_motor(SimulatedStepper *s)
+{
+	printf("%s: steps=%.4f freq=%.4f %s microstep=%d current=%.3f %s\n",
+			s->getName(), s->getStepCount(), s->getFrequency(),
+			s->isStepping() ? "stepping" : "stopped", s->getMicroStep(),
+			s->getCurrent(), s->isPowered() ? "on" : "off");
+	if (sim_encoders || s->getBacklash() > 0 || sim_periodic_error != 0)
+		printf("%s: shaft=%.4f\n", s->getName(), s->getShaftPosition());
+}
+
+/**
+ * Encode a binary request from the arguments of a .frame directive
+ * @return size of the frame, 0 if the arguments are invalid
+ */
+static size_t encode_frame(uint8_t *buf, size_t size, char *saveptr)
+{
+	char *arg = strtok_r(NULL, " \t", &saveptr);
+	char *type = strtok_r(NULL, " \t", &saveptr);
+	if (!arg || !type)
+		return 0;
+	uint16_t id = (uint16_t) strtol(arg, NULL, 0);
+
+	if (strcmp(type, "command") == 0)
+	{
+		// Rest of the line is the command
+		char *cmd = saveptr;
+		while (isspace(*cmd))
+			cmd++;
+		FrameWriter w(buf, size, id, BP_OP_COMMAND);
+		w.putBytes(cmd, strlen(cmd));
+		return w.finish();
+	}
+
+	double v[3] =
+	{ 0, 0, 0 };
+	int n = 0;
+	bool mount = false;
+	while (n < 3 && (arg = strtok_r(NULL, " \t", &saveptr)) != NULL)
+	{
+		if (strcmp(arg, "mount") == 0)
+			mount = true;
+		else if (strcmp(arg, "eq") != 0)
+			v[n++] = strtod(arg, NULL);
+	}
+
+	if (strcmp(type, "read") == 0)
+	{
+		FrameWriter w(buf, size, id, BP_OP_READ);
+		return w.finish();
+	}
+	else if (strcmp(type, "goto") == 0 && n == 2)
+	{
+		FrameWriter w(buf, size, id, BP_OP_GOTO);
+		w.putU8(mount ? BP_COORD_MOUNT : BP_COORD_EQ).putF64(v[0]).putF64(v[1]);
+		return w.finish();
+	}
+	else if (strcmp(type, "stop") == 0)
+	{
+		FrameWriter w(buf, size, id, BP_OP_STOP);
+		w.putU8((uint8_t) v[0]);
+		return w.finish();
+	}
+	else if (strcmp(type, "estop") == 0)
+	{
+		FrameWriter w(buf, size, id, BP_OP_ESTOP);
+		return w.finish();
+	}
+	else if (strcmp(type, "track") == 0)
+	{
+		FrameWriter w(buf, size, id, BP_OP_TRACK);
+		return w.finish();
+	}
+	else if (strcmp(type, "nudge") == 0 && n == 1)
+	{
+		FrameWriter w(buf, size, id, BP_OP_NUDGE);
+		w.putU8((uint8_t) v[0]);
+		return w.finish();
+	}
+	else if (strcmp(type, "guide") == 0 && n == 2)
+	{
+		FrameWriter w(buf, size, id, BP_OP_GUIDE);
+		w.putU8((uint8_t) v[0]).putU16((uint16_t) v[1]);
+		return w.finish();
+	}
+	else if (strcmp(type, "subscribe") == 0 && n == 1)
+	{
+		FrameWriter w(buf, size, id, BP_OP_SUBSCRIBE);
+		w.putF64(v[0]);
+		return w.finish();
+	}
+	return 0;
+}
+
+/**
+ * Execute a simulator directive
+ * @return false if the simulation should end
+ */
+static bool directive(char *line, int lineno)
+{
+	char *saveptr;
+	char *cmd = strtok_r(line, " \t", &saveptr);
+	if (strcmp(cmd, ".frame") == 0)
+	{
+		uint8_t frame[BP_MAX_FRAME];
+		size_t size = encode_frame(frame, sizeof(frame), saveptr);
+		if (size == 0)
+			fprintf(stderr, "sim: line %d: invalid frame\n", lineno);
+		else
+			sim_console.feed((const char *) frame, size);
+		SimKernel::instance().sleep(SIM_COMMAND_DELAY_US);
+		return true;
+	}
+	if (SimBench::directive(cmd, saveptr, lineno))
+		return true;
+	char *arg = strtok_r(NULL, " \t", &saveptr);
+	if (strcmp(cmd, ".wait") == 0)
+	{
+		double sec = arg ? strtod(arg, NULL) : 0;
+		if (sec > 0)
+			SimKernel::instance().sleep((uint64_t) (sec * 1.0E6));
+	}
+	else if (strcmp(cmd, ".motors") == 0)
+	{
+		print_motor(sim_ra_stepper);
+		print_motor(sim_dec_stepper);
+	}
+	else if (strcmp(cmd, ".slip") == 0)
+	{
+		char *steps = strtok_r(NULL, " \t", &saveptr);
+		SimulatedStepper *s =
+				(arg && strcasecmp(arg, "ra") == 0) ? sim_ra_stepper :
+				(arg && strcasecmp(arg, "dec") == 0) ? sim_dec_stepper : NULL;
+		if (!s || !steps)
+			fprintf(stderr, "sim: line %d: usage: .slip <RA|DEC> <steps>\n",
+					lineno);
+		else
+			s->slip(strtod(steps, NULL));
+	}
+	else if (strcmp(cmd, ".time") == 0)
+	{
+		printf("time %.6f\n", SimKernel::instance().now() / 1.0E6);
+	}
+	else if (strcmp(cmd, ".quit") == 0)
+	{
+		return false;
+	}
+	else
+	{
+		fprintf(stderr, "sim: line %d: unknown directive %s\n", lineno, cmd);
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	bool quiet = false;
+	time_t epoch = 1520000000; // Fixed default, so that every run is reproducible
+	int opt;
+	while ((opt = getopt(argc, argv, "c:e:EB:W:P:qh")) != -1)
+	{
+		switch (opt)
+		{
+		case 'c':
+			sim_config_file = optarg;
+			break;
+		case 'e':
+			epoch = (time_t) strtoll(optarg, NULL, 10);
+			break;
+		case 'E':
+			sim_encoders = true;
+			break;
+		case 'B':
+			sim_backlash = strtod(optarg, NULL);
+			break;
+		case 'W':
+			sim_periodic_error = strtod(optarg, NULL);
+			break;
+		case 'P':
+			sim_pec_file = optarg;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	FILE *script = stdin;
+	if (optind < argc)
+	{
+		script = fopen(argv[optind], "r");
+		if (!script)
+		{
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	sim_set_debug(!quiet);
+	sim_clock.setTime(epoch);
+
+	double t0 = host_time();
+
+	telescopeHardwareInit();
+	telescopeServerInit();
+
+	char line[256];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), script))
+	{
+		lineno++;
+		char *p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+		p = line + strlen(line);
+		while (p > line && isspace(p[-1]))
+			*--p = '\0';
+		p = line;
+		while (isspace(*p))
+			p++;
+		if (*p == '\0')
+			continue;
+
+		if (*p == '.')
+		{
+			if (!directive(p, lineno))
+				break;
+			continue;
+		}
+
+		sim_console.feed(p);
+		sim_console.feed("\n");
+		SimKernel::instance().sleep(SIM_COMMAND_DELAY_US);
+	}
+
+	if (!quiet)
+	{
+		fprintf(stderr, "sim: simulated %.3f s in %.3f s, %llu context switches\n",
+				SimKernel::instance().now() / 1.0E6, host_time() - t0,
+				(unsigned long long) SimKernel::instance().getSwitchCount());
+	}
+	fflush(stdout);
+	// Threads are never joined, so leave without running static destructors
+	_exit(0);
+}
@@ -0,0 +1,539 @@
+/*
+ * mbed.h
+ *
+ * Minimal replacement of the mbed OS API for the host simulation build.
+ * Only the subset used by the pushtogo sources is provided. All RTOS
+ * primitives are implemented on top of SimKernel and run on virtual time.
+ */
+
+#ifndef SIM_MBED_H_
+#define SIM_MBED_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <functional>
+#include <utility>
+#include "SimKernel.h"
+
+/*
+ * CMSIS-RTOS2 compatible definitions
+ */
+typedef int32_t osStatus;
+
+enum
+{
+	osOK = 0,
+	osError = -1,
+	osErrorTimeout = -2,
+	osErrorResource = -3,
+	osErrorParameter = -4,
+	osErrorNoMemory = -5,
+	osErrorISR = -6
+};
+
+#define osEventSignal			(0x08)
+#define osEventMessage			(0x10)
+#define osEventMail				(0x20)
+#define osEventTimeout			(0x40)
+
+#define osFlagsWaitAny			0x00000000U
+#define osFlagsWaitAll			0x00000001U
+#define osFlagsNoClear			0x00000002U
+
+#define osFlagsError			0x80000000U
+#define osFlagsErrorUnknown		0xFFFFFFFFU
+#define osFlagsErrorTimeout		0xFFFFFFFEU
+#define osFlagsErrorResource	0xFFFFFFFDU
+#define osFlagsErrorParameter	0xFFFFFFFCU
+
+#define osWaitForever			0xFFFFFFFFU
+
+typedef enum
+{
+	osPriorityNone = 0,
+	osPriorityIdle = 1,
+	osPriorityLow = 8,
+	osPriorityBelowNormal = 16,
+	osPriorityNormal = 24,
+	osPriorityAboveNormal = 32,
+	osPriorityHigh = 40,
+	osPriorityRealtime = 48,
+	osPriorityISR = 56,
+	osPriorityError = -1
+} osPriority_t;
+
+typedef osPriority_t osPriority;
+
+typedef void *osThreadId;
+typedef void *osThreadId_t;
+
+typedef struct
+{
+	osStatus status;
+	union
+	{
+		uint32_t v;
+		void *p;
+		int32_t signals;
+	} value;
+} osEvent;
+
+#define OS_STACK_SIZE			4096
+#define MBED_CONF_APP_MAIN_STACK_SIZE OS_STACK_SIZE
+
+uint32_t osThreadFlagsSet(osThreadId_t thread_id, uint32_t flags);
+uint32_t osThreadFlagsClear(uint32_t flags);
+uint32_t osThreadFlagsGet(void);
+uint32_t osThreadFlagsWait(uint32_t flags, uint32_t options, uint32_t timeout);
+osThreadId_t osThreadGetId(void);
+osPriority_t osThreadGetPriority(osThreadId_t thread_id);
+const char *osThreadGetName(osThreadId_t thread_id);
+osStatus osDelay(uint32_t ticks);
+uint32_t osKernelGetTickCount(void);
+
+/*
+ * Platform
+ */
+void debug(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void debug_if(int condition, const char *format, ...)
+		__attribute__((format(printf, 2, 3)));
+void error(const char *format, ...) __attribute__((noreturn));
+
+/**
+ * Enable or disable debug output of the simulation (default on)
+ */
+void sim_set_debug(bool enable);
+
+inline void core_util_critical_section_enter()
+{
+	// All simulated threads run on one host thread and are never interrupted
+}
+
+inline void core_util_critical_section_exit()
+{
+}
+
+inline uint32_t core_util_atomic_incr_u32(volatile uint32_t *valuePtr,
+		uint32_t delta)
+{
+	return *valuePtr += delta;
+}
+
+/** Microsecond ticker, in simulated time */
+inline uint32_t us_ticker_read()
+{
+	return (uint32_t) SimKernel::instance().now();
+}
+
+#define MBED_STATIC_ASSERT(expr, msg) static_assert(expr, msg)
+
+void wait_us(int us);
+void wait_ms(int ms);
+void wait(float s);
+
+namespace mbed
+{
+
+class NonCopyable
+{
+protected:
+	NonCopyable()
+	{
+	}
+	~NonCopyable()
+	{
+	}
+private:
+	NonCopyable(const NonCopyable &);
+	NonCopyable &operator=(const NonCopyable &);
+};
+
+/**
+ * Callback with the same call syntax as mbed::Callback
+ */
+template<typename F> class Callback;
+
+template<typename R, typename ... A>
+class Callback<R(A...)>
+{
+public:
+	Callback()
+	{
+	}
+
+	Callback(R (*f)(A...)) :
+			fn(f)
+	{
+	}
+
+	template<typename T, typename M>
+	Callback(T *obj, M method) :
+			fn([obj, method](A... args) -> R
+			{	return (obj->*method)(std::forward<A>(args)...);})
+	{
+	}
+
+	R operator()(A... args) const
+	{
+		return fn(std::forward<A>(args)...);
+	}
+
+	R call(A... args) const
+	{
+		return fn(std::forward<A>(args)...);
+	}
+
+	operator bool() const
+	{
+		return (bool) fn;
+	}
+
+private:
+	std::function<R(A...)> fn;
+};
+
+template<typename R, typename ... A>
+Callback<R(A...)> callback(R (*f)(A...))
+{
+	return Callback<R(A...)>(f);
+}
+
+template<typename T, typename U, typename R, typename ... A>
+Callback<R(A...)> callback(U *obj, R (T::*method)(A...))
+{
+	return Callback<R(A...)>(static_cast<T*>(obj), method);
+}
+
+template<typename T, typename U, typename R, typename ... A>
+Callback<R(A...)> callback(const U *obj, R (T::*method)(A...) const)
+{
+	return Callback<R(A...)>(static_cast<const T*>(obj), method);
+}
+
+/**
+ * File handle interface
+ */
+class FileHandle
+{
+public:
+	virtual ~FileHandle()
+	{
+	}
+	virtual ssize_t read(void *buffer, size_t size) = 0;
+	virtual ssize_t write(const void *buffer, size_t size) = 0;
+	virtual off_t seek(off_t offset, int whence = SEEK_SET)
+	{
+		return -1;
+	}
+	virtual int close()
+	{
+		return 0;
+	}
+	virtual int sync()
+	{
+		return 0;
+	}
+	virtual int isatty()
+	{
+		return 0;
+	}
+};
+
+typedef FileHandle FileLike;
+
+/**
+ * Timer running on virtual time
+ */
+class Timer
+{
+public:
+	Timer() :
+			running(false), start_time(0), accum(0)
+	{
+	}
+
+	void start()
+	{
+		if (!running)
+		{
+			start_time = SimKernel::instance().now();
+			running = true;
+		}
+	}
+
+	void stop()
+	{
+		accum = slicetime();
+		running = false;
+	}
+
+	void reset()
+	{
+		start_time = SimKernel::instance().now();
+		accum = 0;
+	}
+
+	float read()
+	{
+		return (float) slicetime() / 1.0E6f;
+	}
+
+	int read_ms()
+	{
+		return (int) (slicetime() / 1000);
+	}
+
+	int read_us()
+	{
+		return (int) slicetime();
+	}
+
+	uint64_t read_high_resolution_us()
+	{
+		return slicetime();
+	}
+
+	operator float()
+	{
+		return read();
+	}
+
+private:
+	bool running;
+	uint64_t start_time;
+	uint64_t accum;
+
+	uint64_t slicetime()
+	{
+		uint64_t t = accum;
+		if (running)
+			t += SimKernel::instance().now() - start_time;
+		return t;
+	}
+};
+
+} // namespace mbed
+
+namespace rtos
+{
+
+class Thread: private mbed::NonCopyable
+{
+public:
+	typedef enum
+	{
+		Inactive, Ready, Running, WaitingDelay, WaitingJoin, WaitingThreadFlag,
+		WaitingEventFlag, WaitingMutex, WaitingSemaphore, WaitingMemoryPool,
+		WaitingMessageGet, WaitingMessagePut, WaitingInterval, WaitingOr,
+		WaitingAnd, WaitingMailbox, Deleted
+	} State;
+
+	Thread(osPriority priority = osPriorityNormal, uint32_t stack_size =
+	OS_STACK_SIZE, unsigned char *stack_mem = NULL, const char *name = NULL);
+	virtual ~Thread();
+
+	osStatus start(mbed::Callback<void()> task);
+	osStatus join();
+	osStatus terminate();
+	osStatus set_priority(osPriority priority);
+	osPriority get_priority();
+	int32_t signal_set(int32_t signals);
+	State get_state();
+	const char *get_name();
+	osThreadId get_id()
+	{
+		return (osThreadId) sim_thread;
+	}
+
+	static int32_t signal_clr(int32_t signals);
+	static osEvent signal_wait(int32_t signals,
+			uint32_t millisec = osWaitForever);
+	static osStatus wait(uint32_t millisec);
+	static osStatus yield();
+	static osThreadId gettid();
+
+private:
+	SimThread *sim_thread;
+	bool started;
+};
+
+class Mutex: private mbed::NonCopyable
+{
+public:
+	Mutex(const char *name = NULL);
+	~Mutex();
+	osStatus lock(uint32_t millisec = osWaitForever);
+	bool trylock();
+	osStatus unlock();
+	osThreadId get_owner()
+	{
+		return (osThreadId) owner;
+	}
+private:
+	SimThread *owner;
+	uint32_t count;
+	SimWaitQueue waiters;
+};
+
+class Semaphore: private mbed::NonCopyable
+{
+public:
+	Semaphore(int32_t count = 0, uint16_t max_count = 0xFFFF);
+	~Semaphore();
+	int32_t wait(uint32_t millisec = osWaitForever);
+	osStatus release();
+private:
+	int32_t count;
+	int32_t max_count;
+	SimWaitQueue waiters;
+};
+
+/**
+ * Message queue of pointers
+ */
+template<typename T, uint32_t queue_sz>
+class Queue: private mbed::NonCopyable
+{
+public:
+	Queue() :
+			head(0), count(0)
+	{
+	}
+
+	bool empty() const
+	{
+		return count == 0;
+	}
+
+	bool full() const
+	{
+		return count == queue_sz;
+	}
+
+	uint32_t count_messages() const
+	{
+		return count;
+	}
+
+	osStatus put(T *data, uint32_t millisec = 0, uint8_t prio = 0)
+	{
+		uint64_t deadline = sim_deadline(millisec);
+		while (full())
+		{
+			if (millisec == 0
+					|| !putters.wait(sim_remaining(deadline, millisec)))
+				return millisec == 0 ? osErrorResource : osErrorTimeout;
+		}
+		buf[(head + count) % queue_sz] = data;
+		count++;
+		getters.notify_one();
+		return osOK;
+	}
+
+	osEvent get(uint32_t millisec = osWaitForever)
+	{
+		osEvent evt;
+		evt.value.p = NULL;
+		uint64_t deadline = sim_deadline(millisec);
+		while (empty())
+		{
+			if (millisec == 0
+					|| !getters.wait(sim_remaining(deadline, millisec)))
+			{
+				evt.status = (millisec == 0) ? osOK : osEventTimeout;
+				return evt;
+			}
+		}
+		evt.value.p = (void*) buf[head];
+		head = (head + 1) % queue_sz;
+		count--;
+		evt.status = osEventMessage;
+		putters.notify_one();
+		return evt;
+	}
+
+private:
+	T *buf[queue_sz];
+	uint32_t head;
+	uint32_t count;
+	SimWaitQueue getters;
+	SimWaitQueue putters;
+
+	static uint64_t sim_deadline(uint32_t millisec)
+	{
+		if (millisec == osWaitForever)
+			return SIM_WAIT_FOREVER;
+		return SimKernel::instance().now() + (uint64_t) millisec * 1000;
+	}
+
+	static uint64_t sim_remaining(uint64_t deadline, uint32_t millisec)
+	{
+		if (millisec == osWaitForever)
+			return SIM_WAIT_FOREVER;
+		uint64_t now = SimKernel::instance().now();
+		return (deadline > now) ? deadline - now : 0;
+	}
+};
+
+/**
+ * Fixed size memory pool
+ */
+template<typename T, uint32_t pool_sz>
+class MemoryPool: private mbed::NonCopyable
+{
+public:
+	MemoryPool()
+	{
+		memset(used, 0, sizeof(used));
+	}
+
+	T *alloc()
+	{
+		for (uint32_t i = 0; i < pool_sz; i++)
+		{
+			if (!used[i])
+			{
+				used[i] = true;
+				return (T*) &data[i * sizeof(T)];
+			}
+		}
+		return NULL;
+	}
+
+	T *calloc()
+	{
+		T *p = alloc();
+		if (p)
+			memset(p, 0, sizeof(T));
+		return p;
+	}
+
+	osStatus free(T *block)
+	{
+		uintptr_t off = (uintptr_t) block - (uintptr_t) data;
+		if ((char*) block < data || off % sizeof(T) != 0
+				|| off / sizeof(T) >= pool_sz)
+			return osErrorParameter;
+		used[off / sizeof(T)] = false;
+		return osOK;
+	}
+
+private:
+	char data[pool_sz * sizeof(T)] __attribute__((aligned(16)));
+	bool used[pool_sz];
+};
+
+} // namespace rtos
+
+using namespace mbed;
+using namespace rtos;
+
+#endif /* SIM_MBED_H_ */
@@ -0,0 +1,109 @@
+/*
+ * mbed_events.h
+ *
+ * EventQueue replacement for the host simulation build
+ */
+
+#ifndef SIM_MBED_EVENTS_H_
+#define SIM_MBED_EVENTS_H_
+
+#include "mbed.h"
+#include <deque>
+
+#define EVENTS_EVENT_SIZE 64
+
+namespace events
+{
+
+/**
+ * Bounded queue of deferred calls, dispatched by whichever thread calls dispatch()
+ */
+class EventQueue: private mbed::NonCopyable
+{
+public:
+	EventQueue(unsigned size = 32 * EVENTS_EVENT_SIZE, unsigned char *buffer =
+	NULL) :
+			capacity(size / EVENTS_EVENT_SIZE), next_id(1), breaking(false)
+	{
+		if (capacity == 0)
+			capacity = 1;
+	}
+
+	~EventQueue()
+	{
+	}
+
+	/**
+	 * Post a call
+	 * @return a non-zero id, or 0 if the queue is full
+	 */
+	template<typename F, typename ... A>
+	int call(F f, A ... args)
+	{
+		if (events.size() >= capacity)
+			return 0;
+		events.push_back(std::bind(f, args...));
+		notify.notify_one();
+		return next_id++;
+	}
+
+	template<typename T, typename R, typename ... P, typename ... A>
+	int call(T *obj, R (T::*method)(P...), A ... args)
+	{
+		return call(mbed::callback(obj, method), args...);
+	}
+
+	/**
+	 * Dispatch events
+	 * @param ms time to dispatch for, negative to dispatch forever
+	 */
+	void dispatch(int ms = -1)
+	{
+		uint64_t deadline =
+				(ms < 0) ?
+						SIM_WAIT_FOREVER :
+						SimKernel::instance().now() + (uint64_t) ms * 1000;
+		breaking = false;
+		while (!breaking)
+		{
+			if (events.empty())
+			{
+				uint64_t now = SimKernel::instance().now();
+				if (deadline != SIM_WAIT_FOREVER && now >= deadline)
+					break;
+				if (!notify.wait(
+						(deadline == SIM_WAIT_FOREVER) ?
+								SIM_WAIT_FOREVER : deadline - now))
+					break;
+				continue;
+			}
+			std::function<void()> f = events.front();
+			events.pop_front();
+			f();
+		}
+	}
+
+	void dispatch_forever()
+	{
+		dispatch(-1);
+	}
+
+	void break_dispatch()
+	{
+		breaking = true;
+		notify.notify_all();
+	}
+
+private:
+	std::deque<std::function<void()> > events;
+	unsigned capacity;
+	int next_id;
+	bool breaking;
+	SimWaitQueue notify;
+};
+
+} // namespace events
+
+using namespace events;
+
+#endif /* SIM_MBED_EVENTS_H_ */
@@ -0,0 +1,381 @@
+/*
+ * mbed_sim.cpp
+ *
+ * Implementation of the simulated mbed OS API
+ */
+
+#include "mbed.h"
+
+static bool sim_debug_enabled = true;
+
+void sim_set_debug(bool enable)
+{
+	sim_debug_enabled = enable;
+}
+
+static void sim_vdebug(const char *format, va_list args)
+{
+	if (!sim_debug_enabled)
+		return;
+	fprintf(stderr, "[%12.6f] ", SimKernel::instance().now() / 1.0E6);
+	vfprintf(stderr, format, args);
+}
+
+void debug(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	sim_vdebug(format, args);
+	va_end(args);
+}
+
+void debug_if(int condition, const char *format, ...)
+{
+	if (!condition)
+		return;
+	va_list args;
+	va_start(args, format);
+	sim_vdebug(format, args);
+	va_end(args);
+}
+
+void error(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	fprintf(stderr, "[%12.6f] error: ", SimKernel::instance().now() / 1.0E6);
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+	exit(1);
+}
+
+void wait_us(int us)
+{
+	if (us > 0)
+		SimKernel::instance().sleep(us);
+}
+
+void wait_ms(int ms)
+{
+	wait_us(ms * 1000);
+}
+
+void wait(float s)
+{
+	wait_us((int) (s * 1.0E6f));
+}
+
+/*
+ * CMSIS-RTOS2 thread flags
+ */
+uint32_t osThreadFlagsSet(osThreadId_t thread_id, uint32_t flags)
+{
+	SimThread *th = (SimThread*) thread_id;
+	if (!th || (flags & osFlagsError))
+		return osFlagsErrorParameter;
+	th->flags |= flags;
+	uint32_t ret = th->flags;
+	if (th->getState() == SimThread::BLOCKED && th->wait_flags)
+	{
+		bool satisfied =
+				(th->wait_options & osFlagsWaitAll) ?
+						((th->flags & th->wait_flags) == th->wait_flags) :
+						((th->flags & th->wait_flags) != 0);
+		if (satisfied)
+			SimKernel::instance().wake(th);
+	}
+	return ret;
+}
+
+uint32_t osThreadFlagsClear(uint32_t flags)
+{
+	SimThread *th = SimKernel::instance().current();
+	uint32_t old = th->flags;
+	th->flags &= ~flags;
+	return old;
+}
+
+uint32_t osThreadFlagsGet(void)
+{
+	return SimKernel::instance().current()->flags;
+}
+
+uint32_t osThreadFlagsWait(uint32_t flags, uint32_t options, uint32_t timeout)
+{
+	SimKernel &k = SimKernel::instance();
+	SimThread *th = k.current();
+	uint64_t deadline =
+			(timeout == osWaitForever) ?
+					SIM_WAIT_FOREVER : k.now() + (uint64_t) timeout * 1000;
+	while (true)
+	{
+		uint32_t cur = th->flags;
+		bool satisfied =
+				(options & osFlagsWaitAll) ?
+						((cur & flags) == flags) : ((cur & flags) != 0);
+		if (satisfied)
+		{
+			if (!(options & osFlagsNoClear))
+				th->flags &= ~flags;
+			return cur;
+		}
+		if (timeout == 0)
+			return osFlagsErrorResource;
+		if (deadline != SIM_WAIT_FOREVER && k.now() >= deadline)
+			return osFlagsErrorTimeout;
+		th->wait_flags = flags;
+		th->wait_options = options;
+		bool woken = k.block(NULL,
+				(deadline == SIM_WAIT_FOREVER) ?
+						SIM_WAIT_FOREVER : deadline - k.now());
+		th->wait_flags = 0;
+		if (!woken)
+			return osFlagsErrorTimeout;
+	}
+}
+
+osThreadId_t osThreadGetId(void)
+{
+	return (osThreadId_t) SimKernel::instance().current();
+}
+
+osPriority_t osThreadGetPriority(osThreadId_t thread_id)
+{
+	SimThread *th = (SimThread*) thread_id;
+	if (!th)
+		return osPriorityError;
+	return (osPriority_t) th->getPriority();
+}
+
+const char *osThreadGetName(osThreadId_t thread_id)
+{
+	SimThread *th = (SimThread*) thread_id;
+	return th ? th->getName() : NULL;
+}
+
+osStatus osDelay(uint32_t ticks)
+{
+	SimKernel::instance().sleep((uint64_t) ticks * 1000);
+	return osOK;
+}
+
+uint32_t osKernelGetTickCount(void)
+{
+	return (uint32_t) (SimKernel::instance().now() / 1000);
+}
+
+namespace rtos
+{
+
+/*
+ * Thread
+ */
+Thread::Thread(osPriority priority, uint32_t stack_size,
+		unsigned char *stack_mem, const char *name) :
+		sim_thread(new SimThread((int) priority, stack_size, name)), started(
+				false)
+{
+}
+
+Thread::~Thread()
+{
+	terminate();
+	delete sim_thread;
+}
+
+osStatus Thread::start(mbed::Callback<void()> task)
+{
+	if (started)
+		return osErrorParameter;
+	started = true;
+	SimKernel::instance().start(sim_thread, [task]()
+	{	task();});
+	return osOK;
+}
+
+osStatus Thread::join()
+{
+	SimKernel::instance().join(sim_thread);
+	return osOK;
+}
+
+osStatus Thread::terminate()
+{
+	SimKernel::instance().terminate(sim_thread);
+	return osOK;
+}
+
+osStatus Thread::set_priority(osPriority priority)
+{
+	return osErrorResource; // Not supported by the simulator
+}
+
+osPriority Thread::get_priority()
+{
+	return (osPriority) sim_thread->getPriority();
+}
+
+int32_t Thread::signal_set(int32_t signals)
+{
+	return (int32_t) osThreadFlagsSet((osThreadId_t) sim_thread,
+			(uint32_t) signals);
+}
+
+Thread::State Thread::get_state()
+{
+	switch (sim_thread->getState())
+	{
+	case SimThread::READY:
+		return Ready;
+	case SimThread::RUNNING:
+		return Running;
+	case SimThread::BLOCKED:
+		return WaitingThreadFlag;
+	case SimThread::TERMINATED:
+		return Deleted;
+	default:
+		return Inactive;
+	}
+}
+
+const char *Thread::get_name()
+{
+	return sim_thread->getName();
+}
+
+int32_t Thread::signal_clr(int32_t signals)
+{
+	return (int32_t) osThreadFlagsClear((uint32_t) signals);
+}
+
+osEvent Thread::signal_wait(int32_t signals, uint32_t millisec)
+{
+	osEvent evt;
+	uint32_t options = (signals == 0) ? osFlagsWaitAny : osFlagsWaitAll;
+	uint32_t flags = osThreadFlagsWait(
+			(signals == 0) ? 0x7FFFFFFFU : (uint32_t) signals, options,
+			millisec);
+	if (flags == osFlagsErrorTimeout)
+		evt.status = osEventTimeout;
+	else if (flags == osFlagsErrorResource)
+		evt.status = osOK;
+	else if (flags & osFlagsError)
+		evt.status = osErrorParameter;
+	else
+		evt.status = osEventSignal;
+	evt.value.signals = (int32_t) flags;
+	return evt;
+}
+
+osStatus Thread::wait(uint32_t millisec)
+{
+	SimKernel::instance().sleep((uint64_t) millisec * 1000);
+	return osOK;
+}
+
+osStatus Thread::yield()
+{
+	SimKernel::instance().yield();
+	return osOK;
+}
+
+osThreadId Thread::gettid()
+{
+	return (osThreadId) SimKernel::instance().current();
+}
+
+/*
+ * Mutex (recursive, like in mbed OS)
+ */
+Mutex::Mutex(const char *name) :
+		owner(NULL), count(0)
+{
+}
+
+Mutex::~Mutex()
+{
+}
+
+osStatus Mutex::lock(uint32_t millisec)
+{
+	SimKernel &k = SimKernel::instance();
+	SimThread *th = k.current();
+	uint64_t deadline =
+			(millisec == osWaitForever) ?
+					SIM_WAIT_FOREVER : k.now() + (uint64_t) millisec * 1000;
+	while (owner != NULL && owner != th)
+	{
+		if (millisec == 0)
+			return osErrorResource;
+		uint64_t timeout =
+				(deadline == SIM_WAIT_FOREVER) ?
+						SIM_WAIT_FOREVER :
+						(deadline > k.now() ? deadline - k.now() : 0);
+		if (!waiters.wait(timeout))
+			return osErrorTimeout;
+	}
+	owner = th;
+	count++;
+	return osOK;
+}
+
+bool Mutex::trylock()
+{
+	return lock(0) == osOK;
+}
+
+osStatus Mutex::unlock()
+{
+	if (owner != SimKernel::instance().current())
+		return osErrorResource;
+	if (--count == 0)
+	{
+		owner = NULL;
+		waiters.notify_one();
+	}
+	return osOK;
+}
+
+/*
+ * Semaphore
+ */
+Semaphore::Semaphore(int32_t count, uint16_t max_count) :
+		count(count), max_count(max_count)
+{
+}
+
+Semaphore::~Semaphore()
+{
+}
+
+int32_t Semaphore::wait(uint32_t millisec)
+{
+	SimKernel &k = SimKernel::instance();
+	uint64_t deadline =
+			(millisec == osWaitForever) ?
+					SIM_WAIT_FOREVER : k.now() + (uint64_t) millisec * 1000;
+	while (count == 0)
+	{
+		if (millisec == 0)
+			return 0;
+		uint64_t timeout =
+				(deadline == SIM_WAIT_FOREVER) ?
+						SIM_WAIT_FOREVER :
+						(deadline > k.now() ? deadline - k.now() : 0);
+		if (!waiters.wait(timeout))
+			return 0;
+	}
+	return count--;
+}
+
+osStatus Semaphore::release()
+{
+	if (count >= max_count)
+		return osErrorResource;
+	count++;
+	waiters.notify_one();
+	return osOK;
+}
+
+} // namespace rtos
@@ -0,0 +1,51 @@
+/*
+ * sim_hardware.h
+ *
+ * Objects of the simulated telescope hardware, for use by the simulation driver
+ */
+
+#ifndef SIM_SIM_HARDWARE_H_
+#define SIM_SIM_HARDWARE_H_
+
+#include "telescope_hardware.h"
+#include "SimulatedStepper.h"
+#include "SimClock.h"
+#include "SimStream.h"
+#include "EqMountServer.h"
+#include "AdaptiveAxis.h"
+
+extern SimulatedStepper *sim_ra_stepper;
+extern SimulatedStepper *sim_dec_stepper;
+extern AdaptiveAxis *sim_ra_axis;
+extern AdaptiveAxis *sim_dec_axis;
+extern EquatorialMount *sim_eq_mount;
+extern SimClock sim_clock;
+extern SimStream sim_console;
+extern EqMountServer *sim_server;
+
+/**
+ * Configuration file to read during telescopeHardwareInit(), NULL to use the defaults
+ */
+extern const char *sim_config_file;
+
+/**
+ * Attach simulated absolute encoders to the axes during telescopeHardwareInit()
+ */
+extern bool sim_encoders;
+
+/**
+ * Backlash of the simulated gears in full steps, set during telescopeHardwareInit()
+ */
+extern double sim_backlash;
+
+/**
+ * Amplitude in full steps of the periodic error of the simulated RA worm, set during telescopeHardwareInit()
+ */
+extern double sim_periodic_error;
+
+/**
+ * File of the PEC table, NULL if the table can't be stored
+ */
+extern const char *sim_pec_file;
+
+#endif /* SIM_SIM_HARDWARE_H_ */
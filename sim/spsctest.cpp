@@ -0,0 +1,227 @@
+/*
+ * spsctest.cpp
+ *
+ * Host stress test and benchmark of SPSCRing (pushtogo/SPSCRing.h) with one producer and one consumer
+ * running as real threads. The producer writes a running sequence number and the consumer checks that it
+ * reads every number once and in order, with single and bulk transfers of varying sizes. The indices are
+ * also started off the start of the buffer, since on a single core the threads tend to fill and drain the
+ * whole ring in turns, and just below 2^32 so that they wrap around during the run.
+ *
+ *   make test         run the stress test, exits with 1 on a lost, duplicated or reordered element
+ *   make ringbench    print the throughput of single and bulk transfers
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "SPSCRing.h"
+
+/// Ring size of the test. Small, so that the ring is often full or empty
+#define SPSCTEST_RING_SIZE 64
+/// Largest bulk transfer, larger than the ring
+#define SPSCTEST_MAX_BULK 100
+
+template<unsigned int N>
+class TestRing: public SPSCRing<uint32_t, N>
+{
+public:
+	/** @param start Initial value of the free-running indices */
+	TestRing(unsigned int start)
+	{
+		this->head = this->tail = start;
+	}
+};
+
+/**
+ * Pseudo-random transfer sizes, the same on every run
+ */
+static unsigned int next_size(uint32_t &seed)
+{
+	seed = seed * 1664525u + 1013904223u;
+	return 1 + (seed >> 16) % SPSCTEST_MAX_BULK;
+}
+
+/**
+ * Flags of a run, so that neither side waits forever for the other when elements are lost
+ */
+struct run_state
+{
+	std::atomic<bool> produced; /// The producer has put all the elements
+	std::atomic<bool> consumed; /// The consumer has stopped reading
+};
+
+template<unsigned int N>
+static void produce(TestRing<N> *ring, uint32_t count, bool bulk,
+		run_state *rs)
+{
+	uint32_t buf[SPSCTEST_MAX_BULK];
+	uint32_t seed = 1;
+	uint32_t seq = 0;
+	while (seq < count)
+	{
+		if (!bulk)
+		{
+			if (ring->push(seq))
+				seq++;
+			else if (rs->consumed)
+				break;
+			else
+				std::this_thread::yield(); // Let the consumer run on a single core
+			continue;
+		}
+		unsigned int n = next_size(seed);
+		if (n > count - seq)
+			n = count - seq;
+		for (unsigned int i = 0; i < n; i++)
+			buf[i] = seq + i;
+		unsigned int done = 0;
+		while (done < n)
+		{
+			unsigned int len = ring->push_n(buf + done, n - done);
+			if (len == 0)
+			{
+				if (rs->consumed)
+					return;
+				std::this_thread::yield();
+			}
+			done += len;
+		}
+		seq += n;
+	}
+	rs->produced = true;
+}
+
+/**
+ * @return number of elements that were not the expected one, or 1 if elements are missing at the end
+ */
+template<unsigned int N>
+static uint32_t consume(TestRing<N> *ring, uint32_t count, bool bulk,
+		run_state *rs)
+{
+	uint32_t buf[SPSCTEST_MAX_BULK];
+	uint32_t seed = 2;
+	uint32_t expected = 0;
+	uint32_t errors = 0;
+	while (expected < count)
+	{
+		unsigned int n;
+		if (bulk)
+		{
+			n = ring->pop_n(buf, next_size(seed));
+		}
+		else
+		{
+			n = ring->pop(buf[0]) ? 1 : 0;
+		}
+		if (n == 0)
+		{
+			// Read produced before checking the ring, so that nothing pushed last is missed
+			if (rs->produced && ring->empty())
+			{
+				fprintf(stderr, "spsctest: got %u of %u elements\n",
+						(unsigned int) expected, (unsigned int) count);
+				errors++;
+				break;
+			}
+			std::this_thread::yield();
+		}
+		for (unsigned int i = 0; i < n; i++)
+		{
+			if (buf[i] != expected)
+			{
+				if (errors < 10)
+					fprintf(stderr, "spsctest: expected %u, got %u\n",
+							(unsigned int) expected, (unsigned int) buf[i]);
+				errors++;
+				expected = buf[i]; // Resync, to count each fault once
+			}
+			expected++;
+		}
+	}
+	rs->consumed = true;
+	return errors;
+}
+
+/**
+ * Run one producer and one consumer over count elements
+ * @param errors Elements out of sequence
+ * @return run time in s
+ */
+template<unsigned int N>
+static double run(unsigned int start, uint32_t count, bool bulk,
+		uint32_t &errors)
+{
+	TestRing<N> *ring = new TestRing<N>(start);
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	run_state rs;
+	rs.produced = false;
+	rs.consumed = false;
+	std::thread producer(produce<N>, ring, count, bulk, &rs);
+	errors = consume<N>(ring, count, bulk, &rs);
+	producer.join();
+	double t = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - t0).count();
+	if (!ring->empty())
+	{
+		fprintf(stderr, "spsctest: %u elements left in the ring\n",
+				ring->count());
+		errors++;
+	}
+	delete ring;
+	return t;
+}
+
+static int stress()
+{
+	static const unsigned int starts[] =
+	{ 0, 37, 0xFFFFFFFFu - 1000 };
+	uint32_t count = 5000000;
+	int failed = 0;
+	for (int b = 0; b < 2; b++)
+	{
+		for (unsigned int s = 0; s < sizeof(starts) / sizeof(starts[0]); s++)
+		{
+			uint32_t errors;
+			run<SPSCTEST_RING_SIZE>(starts[s], count, b != 0, errors);
+			printf("spsctest: %s start=0x%08x %u elements, %u errors\n",
+					b ? "bulk" : "single", starts[s], (unsigned int) count,
+					(unsigned int) errors);
+			if (errors)
+				failed = 1;
+		}
+	}
+	return failed;
+}
+
+template<unsigned int N>
+static void bench(const char *name, bool bulk, uint32_t count)
+{
+	uint32_t errors;
+	double t = run<N>(0, count, bulk, errors);
+	printf("ringbench %s ring=%u elements=%u time_s=%.3f melem_s=%.2f%s\n",
+			name, N, (unsigned int) count, t, count / t * 1e-6,
+			errors ? " ERRORS" : "");
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "-b") == 0)
+	{
+		// Sizes of the rings in the firmware: guide queue, USB queues, LCD console
+		bench<16>("single", false, 20000000);
+		bench<256>("single", false, 20000000);
+		bench<1024>("single", false, 20000000);
+		bench<256>("bulk", true, 100000000);
+		bench<1024>("bulk", true, 100000000);
+		return 0;
+	}
+	else if (argc > 1)
+	{
+		fprintf(stderr, "Usage: %s [-b]\n"
+				"  -b   benchmark instead of stress test\n", argv[0]);
+		return 1;
+	}
+	return stress();
+}
@@ -0,0 +1,175 @@
+/**
+ * Hardware setup of the simulated telescope
+ */
+
+#include "sim_hardware.h"
+#include "AdaptiveAxis.h"
+#include "EquatorialMount.h"
+#include "TelescopeConfiguration.h"
+#include "EncoderObserver.h"
+#include "SimulatedEncoder.h"
+#include "PeriodicErrorCorrection.h"
+#include "SystemProfiler.h"
+#include <time.h>
+
+/// Resolution of the simulated encoders in bits
+#define SIM_ENCODER_BITS 16
+
+SimulatedStepper *sim_ra_stepper = NULL;
+SimulatedStepper *sim_dec_stepper = NULL;
+SimClock sim_clock;
+SimStream sim_console;
+EqMountServer *sim_server = NULL;
+
+const char *sim_config_file = NULL;
+bool sim_encoders = false;
+double sim_backlash = 0;
+double sim_periodic_error = 0;
+const char *sim_pec_file = NULL;
+
+AdaptiveAxis *sim_ra_axis = NULL;
+AdaptiveAxis *sim_dec_axis = NULL;
+EquatorialMount *sim_eq_mount = NULL;
+static SimulatedEncoder<SIM_ENCODER_BITS> *ra_encoder = NULL;
+static SimulatedEncoder<SIM_ENCODER_BITS> *dec_encoder = NULL;
+static EncoderObserver *ra_observer = NULL;
+static EncoderObserver *dec_observer = NULL;
+static PeriodicErrorCorrection *ra_pec = NULL;
+
+/**
+ * Convert an approach direction of the configuration (1, -1 or 0) to a rotation direction
+ */
+static axisrotdir_t approach_direction(int dir)
+{
+	return (dir > 0) ? AXIS_ROTATE_POSITIVE :
+			(dir < 0) ? AXIS_ROTATE_NEGATIVE : AXIS_ROTATE_STOP;
+}
+
+/*
+ * The profiler counts host CPU time in ns. Simulated time does not pass while a thread runs,
+ * so the latency histograms only show the time threads spend blocked on each other. There is
+ * no idle thread, so the load is not meaningful
+ */
+uint32_t profiler_read_cycles()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint32_t) ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+uint32_t profiler_cycle_frequency()
+{
+	return 1000000000;
+}
+
+static void sim_thread_switched(SimThread *from, SimThread *to)
+{
+	SystemProfiler::threadSwitched(to, to->getName(), to->getPriority());
+}
+
+void profiler_init()
+{
+	SimKernel::instance().setSwitchHook(sim_thread_switched);
+}
+
+EquatorialMount &telescopeHardwareInit()
+{
+	SystemProfiler::init();
+
+	if (sim_config_file)
+	{
+		FILE *fp = fopen(sim_config_file, "r");
+		if (fp == NULL)
+		{
+			debug("Error: config file %s not found.\n", sim_config_file);
+		}
+		else
+		{
+			TelescopeConfiguration::readFromFile(fp);
+			fclose(fp);
+		}
+	}
+
+	// Object re-initialization
+	delete ra_pec;
+	delete ra_observer;
+	delete dec_observer;
+	delete ra_encoder;
+	delete dec_encoder;
+	ra_observer = dec_observer = NULL;
+	ra_encoder = dec_encoder = NULL;
+	if (sim_ra_axis != NULL)
+	{
+		delete sim_ra_axis;
+	}
+	if (sim_dec_axis != NULL)
+	{
+		delete sim_dec_axis;
+	}
+	if (sim_eq_mount != NULL)
+	{
+		delete sim_eq_mount;
+	}
+	if (sim_ra_stepper != NULL)
+	{
+		delete sim_ra_stepper;
+	}
+	if (sim_dec_stepper != NULL)
+	{
+		delete sim_dec_stepper;
+	}
+
+	double stepsPerDeg = TelescopeConfiguration::getDouble("motor_steps")
+			* TelescopeConfiguration::getDouble("gear_reduction")
+			* TelescopeConfiguration::getDouble("worm_teeth") / 360.0;
+
+	sim_ra_stepper = new SimulatedStepper(
+			TelescopeConfiguration::getBool("ra_invert"), "RA");
+	sim_dec_stepper = new SimulatedStepper(
+			TelescopeConfiguration::getBool("dec_invert"), "DEC");
+	sim_ra_stepper->setBacklash(sim_backlash);
+	sim_dec_stepper->setBacklash(sim_backlash);
+	double stepsPerWorm = TelescopeConfiguration::getDouble("motor_steps")
+			* TelescopeConfiguration::getDouble("gear_reduction");
+	sim_ra_stepper->setPeriodicError(sim_periodic_error, stepsPerWorm);
+	sim_ra_axis = new AdaptiveAxis(stepsPerDeg, sim_ra_stepper, "RA_Axis");
+	sim_dec_axis = new AdaptiveAxis(stepsPerDeg, sim_dec_stepper, "DEC_Axis");
+	sim_ra_axis->setBacklash(TelescopeConfiguration::getDouble("ra_backlash"),
+			approach_direction(TelescopeConfiguration::getInt("ra_approach")));
+	sim_dec_axis->setBacklash(TelescopeConfiguration::getDouble("dec_backlash"),
+			approach_direction(TelescopeConfiguration::getInt("dec_approach")));
+	if (sim_encoders)
+	{
+		ra_encoder = new SimulatedEncoder<SIM_ENCODER_BITS>(*sim_ra_stepper,
+				stepsPerDeg * 360);
+		dec_encoder = new SimulatedEncoder<SIM_ENCODER_BITS>(*sim_dec_stepper,
+				stepsPerDeg * 360);
+		ra_observer = new EncoderObserver(*sim_ra_axis, *ra_encoder);
+		dec_observer = new EncoderObserver(*sim_dec_axis, *dec_encoder);
+	}
+	ra_pec = new PeriodicErrorCorrection(*sim_ra_axis, stepsPerWorm, sim_pec_file);
+	sim_eq_mount = new EquatorialMount(*sim_ra_axis, *sim_dec_axis, sim_clock,
+			LocationCoordinates(TelescopeConfiguration::getDouble("latitude"),
+					TelescopeConfiguration::getDouble("longitude")));
+
+	return (*sim_eq_mount);
+}
+
+osStatus telescopeServerInit()
+{
+	if (sim_eq_mount == NULL)
+		return osErrorResource;
+
+	if (!sim_server)
+	{
+		sim_server = new EqMountServer(sim_console, false);
+	}
+	sim_server->bind(*sim_eq_mount);
+
+	return osOK;
+}
+
+osStatus telescopeConfigurationWriteback()
+{
+	return osOK;
+}
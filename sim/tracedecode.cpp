@@ -0,0 +1,205 @@
+/*
+ * tracedecode.cpp
+ *
+ * Host-side decoder of the motion trace (see pushtogo/TraceFormat.h). Reads a binary file written by
+ * "trace save" or the text output of "trace dump", and prints a CSV timeline with one row per event:
+ *
+ *   time_s,source,event,aux,a,b,speed,position
+ *
+ * speed is the signed step frequency of the source after the event, in full steps/s. position is the
+ * step count, taken from the start and stop events and integrated from the speed in between.
+ *
+ *   ./tracedecode trace.bin > trace.csv
+ *   ./pushtogo-sim script.txt | ./tracedecode > trace.csv
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include "TraceFormat.h"
+
+static const char *event_names[] =
+{ "none", "frequency", "start", "stop", "slew_state", "status", "guide",
+		"correction", "wakeup", "takeup", "message", "user" };
+
+struct source_state
+{
+	std::string name;
+	int dir; /// 1 forward, -1 backward, 0 stopped
+	double freq; /// Actual step frequency
+	double pos; /// Step count at lastTime
+	double lastTime;
+	bool known; /// pos has been anchored by a start or stop event
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [file]\n"
+			"  file   binary trace or text dump, stdin if not specified\n", prog);
+}
+
+static bool read_binary(const std::string &data,
+		std::vector<trace_event> &events, std::vector<std::string> &names)
+{
+	trace_header header;
+	if (data.size() < sizeof(header))
+		return false;
+	memcpy(&header, data.data(), sizeof(header));
+	if (header.magic != TRACE_MAGIC)
+		return false;
+	if (header.version != TRACE_VERSION
+			|| header.event_size != sizeof(trace_event))
+	{
+		fprintf(stderr, "Unsupported trace version %d\n", header.version);
+		exit(1);
+	}
+	for (int i = 0; i < TRACE_MAX_SOURCES; i++)
+	{
+		header.sources[i][TRACE_NAME_SIZE - 1] = '\0';
+		names.push_back(header.sources[i]);
+	}
+	trace_event e;
+	for (size_t off = sizeof(header);
+			events.size() < header.count && off + sizeof(e) <= data.size();
+			off += sizeof(e))
+	{
+		memcpy(&e, data.data() + off, sizeof(e));
+		events.push_back(e);
+	}
+	if (header.lost)
+		fprintf(stderr, "%u events lost before the trace was saved\n",
+				(unsigned int) header.lost);
+	return true;
+}
+
+static void read_text(const std::string &data,
+		std::vector<trace_event> &events, std::vector<std::string> &names)
+{
+	names.assign(TRACE_MAX_SOURCES, std::string());
+	size_t start = 0;
+	while (start < data.size())
+	{
+		size_t end = data.find('\n', start);
+		if (end == std::string::npos)
+			end = data.size();
+		std::string text = data.substr(start, end - start);
+		start = end + 1;
+		const char *line = text.c_str();
+		int id;
+		char name[TRACE_NAME_SIZE];
+		unsigned int time, source, type, aux;
+		float a, b;
+		if (sscanf(line, "trace source %d %15s", &id, name) == 2)
+		{
+			if (id >= 0 && id < TRACE_MAX_SOURCES)
+				names[id] = name;
+		}
+		else if (sscanf(line, "trace %u %u %u %u %f %f", &time, &source, &type,
+				&aux, &a, &b) == 6)
+		{
+			trace_event e;
+			e.time = time;
+			e.source = source;
+			e.type = type;
+			e.aux = aux;
+			e.a = a;
+			e.b = b;
+			events.push_back(e);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 2 || (argc == 2 && argv[1][0] == '-' && argv[1][1] != '\0'))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	FILE *fp = stdin;
+	if (argc == 2 && strcmp(argv[1], "-") != 0)
+	{
+		fp = fopen(argv[1], "rb");
+		if (!fp)
+		{
+			perror(argv[1]);
+			return 1;
+		}
+	}
+
+	// Read it all, the input can be a pipe
+	std::string data;
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		data.append(buf, n);
+	if (fp != stdin)
+		fclose(fp);
+
+	std::vector<trace_event> events;
+	std::vector<std::string> names;
+	if (!read_binary(data, events, names))
+		read_text(data, events, names);
+
+	std::vector<source_state> sources(TRACE_MAX_SOURCES);
+	for (int i = 0; i < TRACE_MAX_SOURCES; i++)
+	{
+		source_state &s = sources[i];
+		s.name = names[i].empty() ? "source" + std::to_string(i) : names[i];
+		s.dir = 0;
+		s.freq = s.pos = s.lastTime = 0;
+		s.known = false;
+	}
+
+	printf("time_s,source,event,aux,a,b,speed,position\n");
+	// Times are 32-bit microseconds and wrap around, count the wraps
+	double base = 0;
+	uint32_t last = events.empty() ? 0 : events[0].time;
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		const trace_event &e = events[i];
+		if (e.time < last && last - e.time > 0x80000000u)
+			base += 4294967296.0;
+		last = e.time;
+		double t = (base + e.time) * 1e-6;
+		if (e.source >= TRACE_MAX_SOURCES)
+			continue;
+		source_state &s = sources[e.source];
+
+		// Integrate up to this event
+		if (s.known)
+			s.pos += s.dir * s.freq * (t - s.lastTime);
+		s.lastTime = t;
+
+		switch (e.type)
+		{
+		case TRACE_FREQUENCY:
+			s.freq = e.b;
+			break;
+		case TRACE_START:
+			s.dir = (e.aux == 1) ? 1 : -1;
+			s.pos = e.b;
+			s.known = true;
+			break;
+		case TRACE_STOP:
+			s.dir = 0;
+			s.pos = e.b;
+			s.known = true;
+			break;
+		default:
+			break;
+		}
+
+		const char *ev = (e.type < sizeof(event_names) / sizeof(event_names[0])) ?
+				event_names[e.type] : "unknown";
+		printf("%.6f,%s,%s,%u,%.9g,%.9g,%.6f,", t, s.name.c_str(), ev,
+				(unsigned int) e.aux, e.a, e.b, s.dir * s.freq);
+		if (s.known)
+			printf("%.4f\n", s.pos);
+		else
+			printf("\n");
+	}
+	return 0;
+}
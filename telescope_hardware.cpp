@@ -11,8 +11,11 @@
 #include "FATFileSystem.h"
 #include "TelescopeConfiguration.h"
 #include "EqMountServer.h"
-#include "MCULoadMeasurement.h"
+#include "SystemProfiler.h"
+#include "mbed_rtos_storage.h"
 #include "USBSerial.h"
+#include "PeriodicErrorCorrection.h"
+#include "MotionTrace.h"
 
 /**
  * Right-Ascenstion Axis
@@ -39,14 +42,56 @@ FATFileSystem fs("sdcard");
 
 const char *config_file_path = "/sdcard/telescope.cfg";
 const char *config_saved_file_path = "/sdcard/telescope_saved.cfg";
+const char *pec_file_path = "/sdcard/pec.dat";
+const char *trace_file_path = "/sdcard/trace.bin";
 AdaptiveAxis *ra_axis = NULL;
 AdaptiveAxis *dec_axis = NULL;
 EquatorialMount *eq_mount = NULL;
+PeriodicErrorCorrection *ra_pec = NULL;
 
 static void add_sys_commands();
 
+/**
+ * Convert an approach direction of the configuration (1, -1 or 0) to a rotation direction
+ */
+static axisrotdir_t approach_direction(int dir)
+{
+	return (dir > 0) ? AXIS_ROTATE_POSITIVE :
+			(dir < 0) ? AXIS_ROTATE_NEGATIVE : AXIS_ROTATE_STOP;
+}
+
+uint32_t profiler_read_cycles()
+{
+	return DWT->CYCCNT;
+}
+
+uint32_t profiler_cycle_frequency()
+{
+	return SystemCoreClock;
+}
+
+void profiler_init()
+{
+	// Enable the DWT cycle counter. It stops when the core sleeps, so the idle hook must not sleep
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+/**
+ * Thread switch event of RTX, called by the kernel with the incoming thread. RTX only calls it
+ * when its event hooks are compiled in (EVR_RTX_DISABLE not defined)
+ */
+extern "C" void EvrRtxThreadSwitched(osThreadId_t thread_id)
+{
+	mbed_rtos_storage_thread_t *th = (mbed_rtos_storage_thread_t *) thread_id;
+	SystemProfiler::threadSwitched(thread_id, th->name, th->priority);
+}
+
 EquatorialMount &telescopeHardwareInit()
 {
+	SystemProfiler::init();
+
 	// Read configuration
 	printf("Mounting SD card...\n");
 	if (fs.mount(&sd) != 0)
@@ -79,6 +124,10 @@ EquatorialMount &telescopeHardwareInit()
 	}
 
 	// Object re-initialization
+	if (ra_pec != NULL)
+	{
+		delete ra_pec;
+	}
 	if (ra_axis != NULL)
 	{
 		delete ra_axis;
@@ -110,6 +159,15 @@ EquatorialMount &telescopeHardwareInit()
 			TelescopeConfiguration::getBool("dec_invert"));
 	ra_axis = new AdaptiveAxis(stepsPerDeg, ra_stepper, "RA_Axis");
 	dec_axis = new AdaptiveAxis(stepsPerDeg, dec_stepper, "DEC_Axis");
+	ra_axis->setBacklash(TelescopeConfiguration::getDouble("ra_backlash"),
+			approach_direction(TelescopeConfiguration::getInt("ra_approach")));
+	dec_axis->setBacklash(TelescopeConfiguration::getDouble("dec_backlash"),
+			approach_direction(TelescopeConfiguration::getInt("dec_approach")));
+	ra_pec = new PeriodicErrorCorrection(*ra_axis,
+			TelescopeConfiguration::getDouble("motor_steps")
+					* TelescopeConfiguration::getDouble("gear_reduction"),
+			pec_file_path);
+	MotionTrace::setFile(trace_file_path);
 	eq_mount = new EquatorialMount(*ra_axis, *dec_axis, clk,
 			LocationCoordinates(TelescopeConfiguration::getDouble("latitude"),
 					TelescopeConfiguration::getDouble("longitude")));
@@ -211,7 +269,7 @@ static int eqmount_sys(EqMountServer *server, const char *cmd, int argn,
 	}
 
 	stprintf(server->getStream(), "\r\nRecent CPU usage: %.1f%%\r\n",
-			MCULoadMeasurement::getInstance().getCPUUsage() * 100);
+			SystemProfiler::getCPUUsage() * 100);
 	return 0;
 }
 
@@ -265,11 +323,15 @@ static int eqmount_save(EqMountServer *server, const char *cmd, int argn,
 static void add_sys_commands()
 {
 	EqMountServer::addCommand(
-			ServerCommand("sys", "Print system information", eqmount_sys));
+			ServerCommand("sys", "Print system information", eqmount_sys,
+					CMD_EXEC_INLINE));
 	EqMountServer::addCommand(
-			ServerCommand("systime", "Print system time", eqmount_systime));
+			ServerCommand("systime", "Print system time", eqmount_systime,
+					CMD_EXEC_INLINE));
 	EqMountServer::addCommand(
-			ServerCommand("reboot", "Reboot the system", eqmount_reboot));
+			ServerCommand("reboot", "Reboot the system", eqmount_reboot,
+					CMD_EXEC_QUEUED));
 	EqMountServer::addCommand(
-			ServerCommand("save", "Save configuration file", eqmount_save));
+			ServerCommand("save", "Save configuration file", eqmount_save,
+					CMD_EXEC_LONG));
 }
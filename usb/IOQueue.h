@@ -9,212 +9,64 @@
 #define IOQUEUE_H_
 
 #include "mbed.h"
+#include "SPSCRing.h"
 
-#define SIGNAL_QUEUE 0x00000010
-#define MAX_THREAD_QUEUE 16
-
-struct ThreadQueue
-{
-	osThreadId_t threads[MAX_THREAD_QUEUE];
-	osThreadId_t *head, *tail;
-
-	ThreadQueue()
-	{
-		head = tail = threads;
-	}
-
-	bool empty()
-	{
-		return head == tail;
-	}
-
-	bool full()
-	{
-		return ((tail - head + 1) % MAX_THREAD_QUEUE) == 0;
-	}
-
-	osThreadId_t get()
-	{
-		if (empty())
-			return NULL;
-		osThreadId_t th = *head;
-		if (++head == threads + MAX_THREAD_QUEUE)
-			head = threads;
-		return th;
-	}
-
-	int put(osThreadId_t th)
-	{
-		if (full())
-		{
-			return -1;
-		}
-		*tail = th;
-		if (++tail == threads + MAX_THREAD_QUEUE)
-			tail = threads;
-		return 0;
-	}
-
-	/*
-	 * Wait on the current thread until awaken by other operations in the queue
-	 */
-	osStatus qwait(uint32_t wait)
-	{
-		if (wait == 0)
-		{
-			return osErrorTimeout;
-		}
-		core_util_critical_section_exit();
-
-		Thread::signal_clr(0x7FFFFFFF); // Clear all signals before adding to queue. Important!
-		if (put(Thread::gettid()) != 0)
-		{
-			// Queue full
-			printf("Queue full");
-			core_util_critical_section_enter();
-			return osErrorTimeout;
-		}
-		Thread::signal_wait(SIGNAL_QUEUE, wait);
-		core_util_critical_section_enter();
-		return osOK;
-	}
-};
-
+/**
+ * Queue from threads to an interrupt handler. Writers block for space, the handler takes
+ * data without blocking. The notify callback is called after data is put, to start a transfer.
+ * Writing threads must be serialized by the caller, reads must not run concurrently either.
+ */
 template<typename T, unsigned int N>
-class OutputQueue: private mbed::NonCopyable<OutputQueue<T, N> >
+class OutputQueue: public BlockingSPSCRing<T, N>
 {
 public:
 
 	typedef void (*notify_cb)(OutputQueue<T, N> *);
 
-	/** Create and initialize a message Queue.
-	 *
-	 * @note You cannot call this function from ISR context.
-	 */
-	OutputQueue()
+	OutputQueue() :
+			ntf(NULL)
 	{
-		memset(buf, 0, sizeof(buf));
-		ntf = NULL;
-		head = buf;
-		tail = buf;
-	}
-	/** Queue destructor
-	 *
-	 * @note You cannot call this function from ISR context.
-	 */
-	virtual ~OutputQueue()
-	{
-	}
-
-	/** Check if the queue is empty
-	 *
-	 * @return True if the queue is empty, false if not
-	 *
-	 * @note You may call this function from ISR context.
-	 */
-	bool empty() const
-	{
-		return head == tail;
 	}
 
-	/** Check if the queue is full
-	 *
-	 * @return True if the queue is full, false if not
-	 *
-	 * @note You may call this function from ISR context.
-	 */
-	bool full() const
-	{
-		return (tail - head == -1) || (tail - head == N - 1);
-	}
-
-	/** Check if the queue is full
-	 *
-	 * @return number of empty space
+	/** @return number of empty space
 	 *
 	 * @note You may call this function from ISR context.
 	 */
 	int capacity() const
 	{
-		return N - (tail - head + N) % N - 1;
-	}
-	/** Check if the queue is full
-	 *
-	 * @return number of empty space
-	 *
-	 * @note You may call this function from ISR context.
-	 */
-	int count() const
-	{
-		return (tail - head + N) % N;
+		return this->space();
 	}
 
-	/** Put a message in a Queue.
-	 @param   data      message pointer.
-	 @param   millisec  timeout value or 0 in case of no time-out. (default: osWaitForever)
-	 @return  status code that indicates the execution status of the function:
-	 @a osOK the message has been put into the queue.
-	 @a osErrorTimeout the message could not be put into the queue in the given time.
+	/** Put a message in the queue.
+	 @param   data      message.
+	 @param   wait      timeout value or 0 in case of no time-out. (default: osWaitForever)
+	 @return  osOK, or osErrorTimeout if the message could not be put in the given time.
 
-	 @note You may call this function from ISR context if the millisec parameter is set to 0.
+	 @note You may call this function from ISR context if the wait parameter is set to 0.
 	 */
 	osStatus put(const T &data, uint32_t wait = osWaitForever)
 	{
-		core_util_critical_section_enter();
-
-		// Wait for signal
-		while (full())
-		{
-			if (thq.qwait(wait) == osErrorTimeout)
-			{
-				core_util_critical_section_exit();
-				return osErrorTimeout;
-			}
-		}
-
-		*tail = data;
-		if (++tail == buf + N)
-			tail = buf;
-
-		if (ntf)
-		{
-			ntf(this);
-		}
-		core_util_critical_section_exit();
-
-		return osOK;
+		return (this->put_n(&data, 1, wait) == 1) ? osOK : osErrorTimeout;
 	}
 
-	/** Get a message or Wait for a message from a Queue. Messages are retrieved in a descending priority order or
-	 first in first out when the priorities are the same.
-	 @param   pdata     pointer for return value
-	 @param   millisec  timeout value or 0 in case of no time-out. (default: osWaitForever).
-	 @return  status code that indicates the execution status of the function:
-	 @a osOK data retrieved in pdata
-	 @a osEventTimeout no message has arrived during the given timeout period.
+	/** Get a message without waiting.
+	 @return  osOK, or osErrorResource if the queue is empty
 
-	 @note You may call this function from ISR context if the millisec parameter is set to 0.
+	 @note You may call this function from ISR context.
 	 */
 	osStatus get(T *pdata)
 	{
-		if (empty())
-			return osErrorResource;
-
-		core_util_critical_section_enter();
-
-		*pdata = *head;
-		if (++head == buf + N)
-			head = buf;
-		if (!thq.empty())
-		{
-			osThreadId_t th = thq.get();
-			if (th)
-				osThreadFlagsSet(th, SIGNAL_QUEUE);
-		}
+		return this->pop(*pdata) ? osOK : osErrorResource;
+	}
 
-		core_util_critical_section_exit();
+	/** Get up to n messages from the queue without waiting. get_n() waits for data.
+	 @return  number of messages retrieved.
 
-		return osOK;
+	 @note You may call this function from ISR context.
+	 */
+	unsigned int try_get_n(T *pdata, unsigned int n)
+	{
+		return this->pop_n(pdata, n);
 	}
 
 	void notify(notify_cb cb)
@@ -224,147 +76,67 @@ public:
 
 protected:
 	notify_cb ntf;
-	T buf[N];
-	T* head;
-	T* tail;
-	ThreadQueue thq;
 
+	void pushed()
+	{
+		if (ntf)
+			ntf(this);
+	}
 };
 
+/**
+ * Queue from an interrupt handler to threads. The handler puts data without blocking, readers
+ * block for data. The notify callback is called after data is taken, to restart a transfer that
+ * was waiting for space.
+ */
 template<typename T, unsigned int N>
-class InputQueue: private mbed::NonCopyable<InputQueue<T, N> >
+class InputQueue: public BlockingSPSCRing<T, N>
 {
 public:
 
 	typedef void (*notify_cb)(InputQueue<T, N> *);
 
-	/** Create and initialize a message Queue.
-	 *
-	 * @note You cannot call this function from ISR context.
-	 */
-	InputQueue()
-	{
-		memset(buf, 0, sizeof(buf));
-		ntf = NULL;
-		head = buf;
-		tail = buf;
-	}
-	/** Queue destructor
-	 *
-	 * @note You cannot call this function from ISR context.
-	 */
-	virtual ~InputQueue()
+	InputQueue() :
+			ntf(NULL)
 	{
 	}
 
-	/** Check if the queue is empty
-	 *
-	 * @return True if the queue is empty, false if not
+	/** @return number of empty space
 	 *
 	 * @note You may call this function from ISR context.
 	 */
-	bool empty() const
+	int capacity() const
 	{
-		return head == tail;
+		return this->space();
 	}
 
-	/** Check if the queue is full
-	 *
-	 * @return True if the queue is full, false if not
-	 *
-	 * @note You may call this function from ISR context.
-	 */
-	bool full() const
-	{
-		return (tail - head == -1) || (tail - head == N - 1);
-	}
+	/** Put a message without waiting.
+	 @return  osOK, or osErrorResource if the queue is full
 
-	/** Check if the queue is full
-	 *
-	 * @return number of empty space
-	 *
-	 * @note You may call this function from ISR context.
-	 */
-	int capacity() const
-	{
-		return N - (tail - head + N) % N - 1;
-	}
-	/** Check if the queue is full
-	 *
-	 * @return number of empty space
-	 *
-	 * @note You may call this function from ISR context.
+	 @note You may call this function from ISR context.
 	 */
-	int count() const
+	osStatus put(const T &data)
 	{
-		return (tail - head + N) % N;
+		return this->push(data) ? osOK : osErrorResource;
 	}
 
-	/** Put a message in a Queue.
-	 @param   data      message pointer.
-	 @param   millisec  timeout value or 0 in case of no time-out. (default: osWaitForever)
-	 @return  status code that indicates the execution status of the function:
-	 @a osOK the message has been put into the queue.
-	 @a osErrorTimeout the message could not be put into the queue in the given time.
+	/** Put up to n messages in the queue without waiting. put_n() waits for space.
+	 @return  number of messages put, less than n if the queue is full.
 
-	 @note You may call this function from ISR context if the millisec parameter is set to 0.
+	 @note You may call this function from ISR context.
 	 */
-	osStatus put(const T &data)
+	unsigned int try_put_n(const T *data, unsigned int n)
 	{
-		core_util_critical_section_enter();
-
-		*tail = data;
-		if (++tail == buf + N)
-			tail = buf;
-
-		if (!thq.empty())
-		{
-			osThreadId_t th = thq.get();
-			if (th)
-				osThreadFlagsSet(th, SIGNAL_QUEUE);
-		}
-
-		core_util_critical_section_exit();
-
-		return osOK;
+		return this->push_n(data, n);
 	}
 
-	/** Get a message or Wait for a message from a Queue. Messages are retrieved in a descending priority order or
-	 first in first out when the priorities are the same.
-	 @param   pdata     pointer for return value
-	 @param   millisec  timeout value or 0 in case of no time-out. (default: osWaitForever).
-	 @return  status code that indicates the execution status of the function:
-	 @a osOK data retrieved in pdata
-	 @a osEventTimeout no message has arrived during the given timeout period.
-
-	 @note You may call this function from ISR context if the millisec parameter is set to 0.
+	/** Get a message or wait for a message from the queue.
+	 @param   wait      timeout value or 0 in case of no time-out. (default: osWaitForever).
+	 @return  osOK, or osErrorTimeout if no message arrived in the given time.
 	 */
 	osStatus get(T *pdata, uint32_t wait = osWaitForever)
 	{
-		core_util_critical_section_enter();
-
-		// Wait for non-empty
-		while (empty())
-		{
-			if (thq.qwait(wait) == osErrorTimeout)
-			{
-				core_util_critical_section_exit();
-				return osErrorTimeout;
-			}
-		}
-
-		*pdata = *head;
-		if (++head == buf + N)
-			head = buf;
-
-		if (ntf)
-		{
-			ntf(this);
-		}
-
-		core_util_critical_section_exit();
-
-		return osOK;
+		return (this->get_n(pdata, 1, wait) == 1) ? osOK : osErrorTimeout;
 	}
 
 	void notify(notify_cb cb)
@@ -374,11 +146,12 @@ public:
 
 protected:
 	notify_cb ntf;
-	T buf[N];
-	T* head;
-	T* tail;
-	ThreadQueue thq;
 
+	void popped()
+	{
+		if (ntf)
+			ntf(this);
+	}
 };
 /** @}*/
 /** @}*/
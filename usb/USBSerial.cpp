@@ -11,9 +11,14 @@
 InputQueue<char, USBSERIAL_QUEUE_SIZE> USBSerial::rxq;
 OutputQueue<char, USBSERIAL_QUEUE_SIZE> USBSerial::txq;
 USBD_HandleTypeDef USBSerial::hUSBDDevice;
+Mutex USBSerial::write_mutex;
 
-static unsigned char rxbuf[USBSERIAL_QUEUE_SIZE];
-static unsigned char txbuf[USBSERIAL_QUEUE_SIZE];
+static unsigned char rxbuf[CDC_DATA_FS_MAX_PACKET_SIZE];
+static unsigned char txbuf[2][CDC_DATA_FS_MAX_PACKET_SIZE]; // One packet being sent, the next one filled meanwhile
+static unsigned int txlen[2];
+static int txnext = 0; // Buffer of the next packet
+static bool txready = false; // The next packet is filled and waits for the current one to finish
+static bool txfull = false; // Last packet filled was a full one, a zero-length packet must end the transfer
 
 USBSerial USBSerial::instance;
 
@@ -99,24 +104,37 @@ int8_t USBSerial::CDC_Control(uint8_t cmd, uint8_t* pbuf, uint16_t length)
 	return (0);
 }
 
+/**
+ * Fill the next packet from the output queue, if it is not filled yet. Called in a critical section
+ */
+static void fill_packet(OutputQueue<char, USBSERIAL_QUEUE_SIZE>* txq)
+{
+	if (txready || (txq->count() == 0 && !txfull))
+		return;
+	unsigned int len = txq->try_get_n((char*) txbuf[txnext],
+			CDC_DATA_FS_MAX_PACKET_SIZE);
+	txlen[txnext] = len;
+	txfull = (len == CDC_DATA_FS_MAX_PACKET_SIZE);
+	txready = true;
+}
+
 void USBSerial::onotify(OutputQueue<char, USBSERIAL_QUEUE_SIZE>* txq)
 {
-	// Data available in output queue
+	// Data available in output queue, or the last packet has been sent
 	core_util_critical_section_enter();
 	USBD_CDC_HandleTypeDef *hcdc =
 			(USBD_CDC_HandleTypeDef*) hUSBDDevice.pClassData;
-	unsigned int len = txq->count();
 
-	if (hcdc->TxState == 0 && len > 0)
+	fill_packet(txq);
+	if (hcdc->TxState == 0 && txready)
 	{
-		// No ongoing transmission
-		unsigned int i;
-		for (i = 0; i < len; i++)
-		{
-			txq->get((char*) &txbuf[i]);
-		}
-		USBD_CDC_SetTxBuffer(&hUSBDDevice, txbuf, i);
+		// No ongoing transmission, send the next packet
+		USBD_CDC_SetTxBuffer(&hUSBDDevice, txbuf[txnext], txlen[txnext]);
 		USBD_CDC_TransmitPacket(&hUSBDDevice);
+		txready = false;
+		txnext ^= 1;
+		// Fill the other buffer while this one is being sent
+		fill_packet(txq);
 	}
 	core_util_critical_section_exit();
 }
@@ -139,13 +157,7 @@ void USBSerial::inotify(InputQueue<char, USBSERIAL_QUEUE_SIZE>* rxq)
 
 int8_t USBSerial::CDC_Received(uint8_t* pbuf, uint32_t* Len)
 {
-	int len = *Len;
-	if (len > rxq.capacity())
-		len = rxq.capacity();
-	for (int i = 0; i < len; i++)
-	{
-		rxq.put(pbuf[i]);
-	}
+	rxq.try_put_n((char*) pbuf, *Len);
 	// Prepare for next receive
 	inotify(&rxq);
 	return 0;
@@ -160,21 +172,16 @@ int8_t USBSerial::CDC_Transmitted(uint8_t* pbuf, uint32_t* Len)
 
 ssize_t USBSerial::read(void* buffer, size_t size)
 {
-	char *p = (char*) buffer;
-	for (unsigned int i = 0; i < size; i++)
-	{
-		rxq.get(&p[i]);
-	}
-	return size;
+	// Return as soon as some data is available
+	return rxq.get_n((char*) buffer, size);
 }
 
 ssize_t USBSerial::write(const void* buffer, size_t size)
 {
-	char *p = (char*) buffer;
-	for (unsigned int i = 0; i < size; i++)
-	{
-		txq.put(p[i]);
-	}
+	// Keep the data from one write together when several threads are writing
+	write_mutex.lock();
+	size = txq.put_n((const char*) buffer, size);
+	write_mutex.unlock();
 	return size;
 }
 
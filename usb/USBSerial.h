@@ -14,7 +14,7 @@
 #include "usbd_cdc.h"
 #include "IOQueue.h"
 
-#define USBSERIAL_QUEUE_SIZE (2 * CDC_DATA_FS_MAX_PACKET_SIZE)
+#define USBSERIAL_QUEUE_SIZE (4 * CDC_DATA_FS_MAX_PACKET_SIZE)
 
 class USBSerial: public mbed::FileHandle
 {
@@ -32,6 +32,7 @@ private:
 
 	static InputQueue<char, USBSERIAL_QUEUE_SIZE> rxq;
 	static OutputQueue<char, USBSERIAL_QUEUE_SIZE> txq;
+	static Mutex write_mutex;
 
 	USBSerial()
 	{